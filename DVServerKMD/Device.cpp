@@ -22,6 +22,7 @@ Environment:
 
 #ifdef ALLOC_PRAGMA
 #pragma alloc_text (PAGE, DVServerKMDCreateDevice)
+#pragma alloc_text (PAGE, DVServerKMDEvtFileCleanup)
 #endif
 
 NTSTATUS
@@ -47,12 +48,23 @@ Return Value:
 --*/
 {
 	WDF_OBJECT_ATTRIBUTES deviceAttributes;
+	WDF_FILEOBJECT_CONFIG fileConfig;
 	PDEVICE_CONTEXT pDeviceContext;
 	WDFDEVICE device;
 	NTSTATUS status;
 
 	PAGED_CODE();
 	TRACING();
+
+	//
+	// Frame pools registered through a handle are dropped when it is closed
+	//
+	WDF_FILEOBJECT_CONFIG_INIT(&fileConfig,
+		WDF_NO_EVENT_CALLBACK,
+		WDF_NO_EVENT_CALLBACK,
+		DVServerKMDEvtFileCleanup);
+	WdfDeviceInitSetFileObjectConfig(DeviceInit, &fileConfig, WDF_NO_OBJECT_ATTRIBUTES);
+
 	WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&deviceAttributes, DEVICE_CONTEXT);
 
 	status = WdfDeviceCreate(&DeviceInit, &deviceAttributes, &device);
@@ -235,6 +247,43 @@ NTSTATUS DVServerKMDEvtReleaseHardware(
 	return status;
 }
 
+VOID DVServerKMDEvtFileCleanup(
+	_In_ WDFFILEOBJECT FileObject)
+	/*++
+
+	Routine Description:
+
+		Called when the last handle to a file object is closed. Drops the
+		presents still queued, the buffer its presents left locked and the
+		frame pools registered through it, which unpins the staging buffers
+		of the process that owns them.
+
+	Arguments:
+
+		FileObject - A handle to the WDFFILEOBJECT
+
+	Return Value:
+
+		VOID
+
+	--*/
+{
+	PDEVICE_CONTEXT pDeviceContext;
+	VioGpuAdapterLite* pVioGpuAdapterLite;
+
+	PAGED_CODE();
+	TRACING();
+
+	pDeviceContext = DeviceGetContext(WdfFileObjectGetDevice(FileObject));
+	pVioGpuAdapterLite = (VioGpuAdapterLite*)pDeviceContext->pvDeviceExtension;
+
+	if (pVioGpuAdapterLite) {
+		pVioGpuAdapterLite->CancelPresents(FileObject);
+		pVioGpuAdapterLite->ReleaseFrameSegments(FileObject);
+		pVioGpuAdapterLite->ReleaseFramePools(FileObject);
+	}
+}
+
 NTSTATUS DVServerKMDEvtD0Entry(
 	_In_ WDFDEVICE Device,
 	_In_ WDF_POWER_DEVICE_STATE PreviousState)
@@ -361,7 +410,7 @@ BOOLEAN DVServerKMDEvtInterruptISR(
 {
 	PDEVICE_CONTEXT pDeviceContext;
 	VioGpuAdapterLite* pVioGpuAdapterLite;
-	TRACING();
+	TRACING_HOT();
 	pDeviceContext = DeviceGetContext(WdfInterruptGetDevice(Interrupt));
 
 	//
@@ -402,7 +451,7 @@ void DVServerKMDEvtInterruptDPC(
 {
 	PDEVICE_CONTEXT pDeviceContext;
 	VioGpuAdapterLite* pVioGpuAdapterLite;
-	TRACING();
+	TRACING_HOT();
 	UNREFERENCED_PARAMETER(AssociatedObject);
 
 	pDeviceContext = DeviceGetContext(WdfInterruptGetDevice(Interrupt));
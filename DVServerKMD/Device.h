@@ -58,4 +58,5 @@ EVT_WDF_DEVICE_D0_EXIT_PRE_INTERRUPTS_DISABLED DVServerKMDEvtDeviceD0ExitPreInte
 EVT_WDF_DEVICE_D0_ENTRY_POST_INTERRUPTS_ENABLED DVServerKMDEvtDeviceD0EntryPostInterruptsEnabled;
 EVT_WDF_INTERRUPT_ENABLE DVServerKMDEvtInterruptEnable;
 EVT_WDF_INTERRUPT_DISABLE DVServerKMDEvtInterruptDisable;
+EVT_WDF_FILE_CLEANUP DVServerKMDEvtFileCleanup;
 EXTERN_C_END
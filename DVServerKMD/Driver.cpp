@@ -105,6 +105,7 @@ Return Value:
 		return status;
 	}
 
+	ReadTraceParameters();
 	return status;
 }
 
@@ -34,6 +34,16 @@ DEFINE_GUID(GUID_DEVINTERFACE_DVServerKMD,
 #define IOCTL_DVSERVER_GET_TOTAL_SCREENS	CTL_CODE(FILE_DEVICE_UNKNOWN, 0x813, METHOD_BUFFERED, FILE_ANY_ACCESS)
 #define IOCTL_DVSERVER_HP_EVENT				CTL_CODE(FILE_DEVICE_UNKNOWN, 0x814, METHOD_BUFFERED, FILE_ANY_ACCESS)
 #define IOCTL_DVSERVER_CURSOR_POS			CTL_CODE(FILE_DEVICE_UNKNOWN, 0x815, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define IOCTL_DVSERVER_WAIT_FENCE			CTL_CODE(FILE_DEVICE_UNKNOWN, 0x816, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define IOCTL_DVSERVER_FRAME_DAMAGE			CTL_CODE(FILE_DEVICE_UNKNOWN, 0x817, METHOD_NEITHER, FILE_ANY_ACCESS)
+#define IOCTL_DVSERVER_REGISTER_FRAME_POOL	CTL_CODE(FILE_DEVICE_UNKNOWN, 0x818, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define IOCTL_DVSERVER_PRESENT_POOL			CTL_CODE(FILE_DEVICE_UNKNOWN, 0x819, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define IOCTL_DVSERVER_GET_DIAG				CTL_CODE(FILE_DEVICE_UNKNOWN, 0x81A, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define IOCTL_DVSERVER_GET_STATS			CTL_CODE(FILE_DEVICE_UNKNOWN, 0x81B, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define IOCTL_DVSERVER_GET_QUEUE_STATS		CTL_CODE(FILE_DEVICE_UNKNOWN, 0x81C, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define MAX_FENCE_TIMEOUT_MS       1000
+#define MAX_DAMAGE_RECTS           16
+#define MAX_FRAME_POOL_SLOTS       4
 
 typedef struct FrameMetaData
 {
@@ -49,6 +59,44 @@ typedef struct FrameMetaData
 
 }FrameMetaData;
 
+struct damage_rect
+{
+	LONG left;
+	LONG top;
+	LONG right;
+	LONG bottom;
+};
+
+// FRAME_DAMAGE input: a regular frame plus the rects that changed since the
+// previous present. num_rects == 0 means the whole frame changed.
+typedef struct FrameDamageData
+{
+	struct FrameMetaData frame;
+	unsigned int num_rects;
+	struct damage_rect rects[MAX_DAMAGE_RECTS];
+}FrameDamageData;
+
+// REGISTER_FRAME_POOL input: the geometry shared by all slots (frame.addr
+// is unused) and the address of each staging buffer. num_slots == 0 drops
+// the pool of frame.screen_num.
+struct frame_pool_info
+{
+	struct FrameMetaData frame;
+	unsigned int num_slots;
+	void* slot_addr[MAX_FRAME_POOL_SLOTS];
+};
+
+// PRESENT_POOL input, answered with a present_response. num_rects == 0
+// means the whole slot changed.
+struct pool_present
+{
+	unsigned int screen_num;
+	unsigned int pool_id;
+	unsigned int slot;
+	unsigned int num_rects;
+	struct damage_rect rects[MAX_DAMAGE_RECTS];
+};
+
 typedef struct CursorData
 {
 	UINT32	screen_num;
@@ -97,4 +145,123 @@ struct KMDF_IOCTL_Response
 	UINT16 retval;
 };
 
+struct present_response
+{
+	struct KMDF_IOCTL_Response resp;
+	UINT64 fence_id;
+};
+
+struct frame_pool_response
+{
+	struct KMDF_IOCTL_Response resp;
+	unsigned int pool_id;
+};
+
+struct fence_info
+{
+	unsigned int screen_num;
+	unsigned int timeout_ms;
+	UINT64 fence_id;
+	UINT64 last_retired;
+	bool signaled;
+};
+
+// diag_info.fb_alloc, how the KMD backed the framebuffer segment of a screen
+#define DIAG_FB_ALLOC_NONE			0
+#define DIAG_FB_ALLOC_CONTIGUOUS	1
+#define DIAG_FB_ALLOC_CHUNKS		2
+#define DIAG_FB_ALLOC_POOL			3
+#define DIAG_FB_ALLOC_MAPPED		4
+#define DIAG_FB_ALLOC_USER			5
+
+// GET_DIAG input and output, the caller fills in screen_num only.
+// fb_entries < fb_pages means the host maps the framebuffer with fewer
+// scatter-gather entries than it has pages.
+struct diag_info
+{
+	unsigned int screen_num;
+	unsigned int fb_alloc;
+	unsigned int fb_pages;
+	unsigned int fb_entries;
+	unsigned int framebuffer_count;
+	unsigned int frames_presented;
+	unsigned int frames_dropped;
+	UINT64 sg_pages_sent;
+	UINT64 sg_entries_sent;
+	// Display info and EDID responses served from preallocated buffers
+	UINT64 resp_pool_hits;
+	UINT64 resp_pool_misses;
+	// Presents that a newer one replaced while they waited for the worker
+	// or for a flush to retire; they never count as dropped
+	unsigned int frames_replaced;
+	// Control queue waits satisfied while spinning and waits that slept,
+	// and the spin budget the driver settled on
+	unsigned int wait_spin_budget_us;
+	UINT64 wait_spin_hits;
+	UINT64 wait_sleeps;
+};
+
+// stats_info histograms, how long each stage of a present took
+#define STATS_STAGE_QUEUE			0	// IOCTL entry until the present worker ran it
+#define STATS_STAGE_LOCK			1	// probe and lock of the UMD buffer
+#define STATS_STAGE_CREATE			2	// creating a resource and attaching its backing
+#define STATS_STAGE_SCANOUT			3	// pointing the scanout at the resource
+#define STATS_STAGE_SUBMIT			4	// IOCTL entry until the flush was queued
+#define STATS_STAGE_COMPLETE		5	// flush queued until DpcRoutine saw it complete
+#define STATS_STAGE_COUNT			6
+
+// Bucket 0 counts samples under a microsecond, bucket n those of
+// [2^(n-1), 2^n) microseconds and the last one everything longer
+#define STATS_BUCKETS				32
+
+// GET_STATS input and output, the caller fills in screen_num and reset.
+// A non-zero reset clears the histograms of the screen once copied out.
+// Stages a present skips, like LOCK for an already locked buffer, record
+// nothing for it.
+struct stats_info
+{
+	unsigned int screen_num;
+	unsigned int reset;
+	UINT64 sum_us[STATS_STAGE_COUNT];
+	UINT64 buckets[STATS_STAGE_COUNT][STATS_BUCKETS];
+};
+
+// queue_stats_info queues
+#define QSTATS_QUEUE_CTRL			0
+#define QSTATS_QUEUE_CURSOR			1
+
+// Commands are counted by the low byte of their type, so control commands
+// (0x01xx) and cursor commands (0x03xx) both start at 0. Types past the
+// table are counted in its last entry.
+#define QSTATS_CMD_TYPES			16
+
+// Bucket 0 counts commands added to an empty ring, bucket n those added
+// with [2^(n-1), 2^n) commands in flight and the last one everything more
+#define QSTATS_OCC_BUCKETS			12
+
+// GET_QUEUE_STATS input and output, the caller fills in queue and reset.
+// A non-zero reset clears the counters of the queue once copied out,
+// in_flight and ring_size are not cleared. Latencies go from adding a
+// command to the ring until DpcRoutine took it back, into the buckets of
+// stats_info. Commands per second come from comparing two reads.
+struct queue_stats_info
+{
+	unsigned int queue;
+	unsigned int reset;
+	unsigned int ring_size;
+	unsigned int in_flight;
+	unsigned int max_in_flight;
+	// Commands the ring had no room for
+	UINT64 add_failures;
+	// Times the device was notified after adding commands, and times it
+	// asked not to be
+	UINT64 notifies;
+	UINT64 notifies_suppressed;
+	UINT64 occupancy[QSTATS_OCC_BUCKETS];
+	UINT64 submitted[QSTATS_CMD_TYPES];
+	UINT64 completed[QSTATS_CMD_TYPES];
+	UINT64 sum_us[QSTATS_CMD_TYPES];
+	UINT64 buckets[QSTATS_CMD_TYPES][STATS_BUCKETS];
+};
+
 #endif // __PUBLIC_H__
@@ -131,7 +131,7 @@ Return Value:
 	WDFDEVICE Device = WdfIoQueueGetDevice(Queue);
 	PDEVICE_CONTEXT pDeviceContext = DeviceGetContext(Device);
 	size_t bytesReturned = 0;
-	TRACING();
+	TRACING_SAMPLED(TRACE_SAMPLE_RATE);
 
 
 	UNREFERENCED_PARAMETER(Queue);
@@ -149,12 +149,18 @@ Return Value:
 		// Get the input buffer from the UMD which is passed to "IoctlRequestPresentFb" API and We use "WdfRequestRetrieveInputBuffer" 
 		// method retrieves an I/O request's input buffer.
 		// https://docs.microsoft.com/en-us/windows-hardware/drivers/ddi/wdfrequest/nf-wdfrequest-wdfrequestretrieveinputbuffer
-		status = IoctlRequestPresentFb(pDeviceContext, InputBufferLength, OutputBufferLength, Request, &bytesReturned);
+		status = IoctlRequestPresentFb(pDeviceContext, InputBufferLength, OutputBufferLength, Request, IoControlCode, &bytesReturned);
 		if (status != STATUS_SUCCESS) {
 			return;
 		}
 		break;
 
+	case IOCTL_DVSERVER_FRAME_DAMAGE:
+		status = IoctlRequestPresentFb(pDeviceContext, InputBufferLength, OutputBufferLength, Request, IoControlCode, &bytesReturned);
+		if (status != STATUS_SUCCESS)
+			return;
+		break;
+
 
 	case IOCTL_DVSERVER_CURSOR_DATA:
 
@@ -216,7 +222,7 @@ Return Value:
 		break;
 
 	case IOCTL_DVSERVER_TEST_IMAGE:
-		status = IoctlRequestPresentFb(pDeviceContext, InputBufferLength, OutputBufferLength, Request, &bytesReturned);
+		status = IoctlRequestPresentFb(pDeviceContext, InputBufferLength, OutputBufferLength, Request, IoControlCode, &bytesReturned);
 		if (status != STATUS_SUCCESS)
 			return;
 		break;
@@ -230,6 +236,36 @@ Return Value:
 		if (status != STATUS_SUCCESS)
 			return;
 		break;
+	case IOCTL_DVSERVER_WAIT_FENCE:
+		status = IoctlRequestWaitFence(pDeviceContext, InputBufferLength, OutputBufferLength, Request, &bytesReturned);
+		if (status != STATUS_SUCCESS)
+			return;
+		break;
+	case IOCTL_DVSERVER_REGISTER_FRAME_POOL:
+		status = IoctlRequestRegisterFramePool(pDeviceContext, InputBufferLength, OutputBufferLength, Request, &bytesReturned);
+		if (status != STATUS_SUCCESS)
+			return;
+		break;
+	case IOCTL_DVSERVER_PRESENT_POOL:
+		status = IoctlRequestPresentPool(pDeviceContext, InputBufferLength, OutputBufferLength, Request, &bytesReturned);
+		if (status != STATUS_SUCCESS)
+			return;
+		break;
+	case IOCTL_DVSERVER_GET_DIAG:
+		status = IoctlRequestDiag(pDeviceContext, InputBufferLength, OutputBufferLength, Request, &bytesReturned);
+		if (status != STATUS_SUCCESS)
+			return;
+		break;
+	case IOCTL_DVSERVER_GET_STATS:
+		status = IoctlRequestStats(pDeviceContext, InputBufferLength, OutputBufferLength, Request, &bytesReturned);
+		if (status != STATUS_SUCCESS)
+			return;
+		break;
+	case IOCTL_DVSERVER_GET_QUEUE_STATS:
+		status = IoctlRequestQueueStats(pDeviceContext, InputBufferLength, OutputBufferLength, Request, &bytesReturned);
+		if (status != STATUS_SUCCESS)
+			return;
+		break;
 	}
 
 	WdfRequestComplete(Request, STATUS_SUCCESS);
@@ -362,7 +398,17 @@ static NTSTATUS IoctlRequestSetMode(
 	tempCurrentMode.FrameBuffer.Ptr = (BYTE*)ptr->addr;
 	tempCurrentMode.Stride = ptr->stride;
 
-	status = pAdapter->SetCurrentModeExt(&tempCurrentMode);
+	// Whatever was queued for the old mode is stale
+	pAdapter->CancelPresent(ptr->screen_num, NULL);
+	// A mode set means the UMD has (re)created its staging texture, so the
+	// resource cached for this screen and the pages locked for it can no
+	// longer be trusted even if the new texture happens to land on the same
+	// user address
+	pAdapter->UnpinFrameSegments(ptr->screen_num);
+	// Same for the pool registered for the old mode
+	pAdapter->UnregisterFramePool(ptr->screen_num);
+
+	status = pAdapter->SetCurrentModeExt(&tempCurrentMode, NULL);
 	if (status != STATUS_SUCCESS) {
 		ERR("SetCurrentModeExt failed with status = %d\n", status);
 		WdfRequestComplete(Request, STATUS_UNSUCCESSFUL);
@@ -380,8 +426,13 @@ static NTSTATUS IoctlRequestSetMode(
 
 	pAdapter->BlackOutScreen(&CurrentMode);
 
+	// Give the blackout flush a chance to retire, otherwise the first frame
+	// presented in the new mode would be skipped as a pending flush
+	pAdapter->WaitForFence(ptr->screen_num, pAdapter->GetLastSubmittedFence(ptr->screen_num),
+		SET_MODE_FENCE_TIMEOUT_MS, NULL);
+
 	if (tempCurrentMode.FrameBuffer.Ptr) {
-		pAdapter->Close(ptr->screen_num);
+		pAdapter->UnpinFrameSegments(ptr->screen_num);
 	}
 
 	return STATUS_SUCCESS;
@@ -392,14 +443,23 @@ static NTSTATUS IoctlRequestPresentFb(
 	const size_t          InputBufferLength,
 	const size_t          OutputBufferLength,
 	const WDFREQUEST      Request,
+	const ULONG           IoControlCode,
 	size_t* BytesReturned)
 {
 	UNREFERENCED_PARAMETER(BytesReturned);
-	TRACING();
+	TRACING_SAMPLED(TRACE_SAMPLE_RATE);
 
+	ULONGLONG entry_us = VioGpuStats::NowUs();
 	NTSTATUS status = STATUS_UNSUCCESSFUL;
 	FrameMetaData* ptr = NULL;
 	KMDF_IOCTL_Response* output = NULL;
+	ULONGLONG fence_id = 0;
+	size_t respSize = sizeof(struct KMDF_IOCTL_Response);
+	size_t inSize = (IoControlCode == IOCTL_DVSERVER_FRAME_DAMAGE) ?
+		sizeof(struct FrameDamageData) : sizeof(struct FrameMetaData);
+	RECT rects[MAX_DAMAGE_RECTS];
+	ULONG num_rects = 0;
+	PRESENT_WORK work;
 
 	PIRP irp = WdfRequestWdmGetIrp(Request);
 	if (!irp) {
@@ -426,8 +486,8 @@ static NTSTATUS IoctlRequestPresentFb(
 		return STATUS_INSUFFICIENT_RESOURCES;
 	}
 
-	if (InputBufferLength < sizeof(struct FrameMetaData)) {
-		ERR("Input Buffer is too small: provided = %Iu, expected >= %Iu\n", InputBufferLength, sizeof(struct FrameMetaData));
+	if (InputBufferLength < inSize) {
+		ERR("Input Buffer is too small: provided = %Iu, expected >= %Iu\n", InputBufferLength, inSize);
 		WdfRequestComplete(Request, STATUS_BUFFER_TOO_SMALL);
 		return STATUS_BUFFER_TOO_SMALL;
 	}
@@ -447,7 +507,7 @@ static NTSTATUS IoctlRequestPresentFb(
 	}
 
 	__try {
-		ProbeForRead(inputBuffer, sizeof(FrameMetaData), __alignof(FrameMetaData));
+		ProbeForRead(inputBuffer, inSize, __alignof(FrameMetaData));
 		ptr = (FrameMetaData*)inputBuffer;
 		if (ptr == NULL) {
 			ERR("Input buffer is NULL\n");
@@ -467,6 +527,18 @@ static NTSTATUS IoctlRequestPresentFb(
 		}
 
 		ProbeForRead(ptr->addr, size, sizeof(BYTE));
+
+		// Copy the rects out of user memory before they are looked at
+		if (IoControlCode == IOCTL_DVSERVER_FRAME_DAMAGE) {
+			struct FrameDamageData* dptr = (struct FrameDamageData*)inputBuffer;
+			num_rects = min(dptr->num_rects, (ULONG)MAX_DAMAGE_RECTS);
+			for (ULONG i = 0; i < num_rects; i++) {
+				rects[i].left = dptr->rects[i].left;
+				rects[i].top = dptr->rects[i].top;
+				rects[i].right = dptr->rects[i].right;
+				rects[i].bottom = dptr->rects[i].bottom;
+			}
+		}
 	}
 	__except (EXCEPTION_EXECUTE_HANDLER) {
 		ERR("Invalid user-mode buffer access\n");
@@ -488,17 +560,25 @@ static NTSTATUS IoctlRequestPresentFb(
 		return STATUS_INVALID_PARAMETER;
 	}
 
-	status = pAdapter->ExecutePresentDisplayZeroCopy(
-		(BYTE*)ptr->addr,
-		ptr->bitrate,
-		ptr->pitch,
-		ptr->width,
-		ptr->height,
-		ptr->screen_num,
-		ptr->stride);
+	// The worker of the screen does the present, this thread only queues it
+	RtlZeroMemory(&work, sizeof(work));
+	work.Kind = PresentKind::Buffer;
+	work.Owner = WdfRequestGetFileObject(Request);
+	work.EntryUs = entry_us;
+	work.Addr = ptr->addr;
+	work.BytesPerPixel = ptr->bitrate;
+	work.Pitch = ptr->pitch;
+	work.Width = ptr->width;
+	work.Height = ptr->height;
+	work.Stride = ptr->stride;
+	// No rects means the whole frame changed
+	work.NumRects = min(num_rects, (ULONG)MAX_DAMAGE_REGION_RECTS);
+	RtlCopyMemory(work.Rects, rects, work.NumRects * sizeof(RECT));
+
+	status = pAdapter->QueuePresent(ptr->screen_num, &work, &fence_id);
 
 	if (status != STATUS_SUCCESS) {
-		ERR("ExecutePresentDisplayZeroCopy failed with status = %d\n", status);
+		ERR("QueuePresent failed with status = %d\n", status);
 		WdfRequestComplete(Request, STATUS_UNSUCCESSFUL);
 		return STATUS_UNSUCCESSFUL;
 	}
@@ -515,14 +595,23 @@ static NTSTATUS IoctlRequestPresentFb(
 		return STATUS_INVALID_PARAMETER;
 	}
 
+	// Callers that pass a present_response get the fence reserved for the
+	// flush of this frame, older callers keep receiving the bare
+	// KMDF_IOCTL_Response
+	if (OutputBufferLength >= sizeof(struct present_response))
+		respSize = sizeof(struct present_response);
+
 	__try {
-		ProbeForWrite(outBuffer, sizeof(KMDF_IOCTL_Response), __alignof(KMDF_IOCTL_Response));
+		ProbeForWrite(outBuffer, respSize, __alignof(KMDF_IOCTL_Response));
 		output = (KMDF_IOCTL_Response*)outBuffer;
 		if (output == NULL) {
 			ERR("Output buffer is NULL\n");
 			WdfRequestComplete(Request, STATUS_INVALID_PARAMETER);
 			return STATUS_INVALID_PARAMETER;
 		}
+		output->retval = DVSERVERKMD_SUCCESS;
+		if (respSize == sizeof(struct present_response))
+			((struct present_response*)outBuffer)->fence_id = fence_id;
 	}
 	__except (EXCEPTION_EXECUTE_HANDLER) {
 		status = GetExceptionCode();
@@ -530,8 +619,7 @@ static NTSTATUS IoctlRequestPresentFb(
 		WdfRequestComplete(Request, status);
 		return status;
 	}
-	output->retval = DVSERVERKMD_SUCCESS;
-	WdfRequestSetInformation(Request, sizeof(struct KMDF_IOCTL_Response));
+	WdfRequestSetInformation(Request, respSize);
 	return STATUS_SUCCESS;
 }
 
@@ -595,14 +683,7 @@ static NTSTATUS IoctlRequestEdid(
 		return STATUS_INSUFFICIENT_RESOURCES;
 	}
 	//Return value from the KMDF DVServer
-	if (pAdapter->GetModeListSize(edata->screen_num) != 0) {
-		edata->mode_size = pAdapter->GetModeListSize(edata->screen_num);
-	}
-	else {
-		edata->mode_size = QEMU_MODELIST_SIZE;
-	}
-	RtlCopyMemory(edata->edid_data, pAdapter->GetEdidData(edata->screen_num), EDID_V1_BLOCK_SIZE);
-	pAdapter->CopyResolution(edata->screen_num, edata);
+	pAdapter->FillEdidInfo(edata->screen_num, edata);
 	WdfRequestSetInformation(Request, sizeof(struct edid_info));
 	return STATUS_SUCCESS;
 }
@@ -649,6 +730,415 @@ static NTSTATUS IoctlRequestTotalScreens(
 	return STATUS_SUCCESS;
 }
 
+static NTSTATUS IoctlRequestWaitFence(
+	const PDEVICE_CONTEXT DeviceContext,
+	const size_t          InputBufferLength,
+	const size_t          OutputBufferLength,
+	const WDFREQUEST      Request,
+	size_t* BytesReturned)
+{
+	TRACING_SAMPLED(TRACE_SAMPLE_RATE);
+	UNREFERENCED_PARAMETER(BytesReturned);
+
+	NTSTATUS status = STATUS_UNSUCCESSFUL;
+	struct fence_info* fdata = NULL;
+	ULONGLONG last_retired = 0;
+	size_t bufSize;
+
+	VioGpuAdapterLite* pAdapter =
+		(VioGpuAdapterLite*)(DeviceContext ? DeviceContext->pvDeviceExtension : 0);
+
+	if (!pAdapter) {
+		ERR("Couldn't find adapter\n");
+		WdfRequestComplete(Request, STATUS_INSUFFICIENT_RESOURCES);
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	if (InputBufferLength < sizeof(struct fence_info) || OutputBufferLength < sizeof(struct fence_info)) {
+		ERR("Buffer is too small: input = %Iu, output = %Iu, expected >= %Iu\n",
+			InputBufferLength, OutputBufferLength, sizeof(struct fence_info));
+		WdfRequestComplete(Request, STATUS_BUFFER_TOO_SMALL);
+		return STATUS_BUFFER_TOO_SMALL;
+	}
+
+	status = WdfRequestRetrieveInputBuffer(Request, sizeof(struct fence_info), (PVOID*)&fdata, &bufSize);
+	if (!NT_SUCCESS(status)) {
+		ERR("Couldn't retrieve Input buffer\n");
+		WdfRequestComplete(Request, STATUS_INVALID_USER_BUFFER);
+		return STATUS_INVALID_USER_BUFFER;
+	}
+
+	if (fdata->screen_num >= MAX_SCAN_OUT) {
+		ERR("Screen number provided by UMD: %d is greater than or equal to the maximum supported: %d by the KMD\n",
+			fdata->screen_num, MAX_SCAN_OUT);
+		WdfRequestComplete(Request, STATUS_INVALID_PARAMETER);
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	if (fdata->timeout_ms > MAX_FENCE_TIMEOUT_MS) {
+		fdata->timeout_ms = MAX_FENCE_TIMEOUT_MS;
+	}
+
+	status = pAdapter->WaitForFence(fdata->screen_num, fdata->fence_id, fdata->timeout_ms, &last_retired);
+	if (status != STATUS_SUCCESS && status != STATUS_TIMEOUT) {
+		ERR("WaitForFence failed with status = 0x%x\n", status);
+		WdfRequestComplete(Request, status);
+		return status;
+	}
+
+	// METHOD_BUFFERED shares the system buffer between input and output
+	fdata->signaled = (status == STATUS_SUCCESS);
+	fdata->last_retired = last_retired;
+	WdfRequestSetInformation(Request, sizeof(struct fence_info));
+
+	return STATUS_SUCCESS;
+}
+
+static NTSTATUS IoctlRequestDiag(
+	const PDEVICE_CONTEXT DeviceContext,
+	const size_t          InputBufferLength,
+	const size_t          OutputBufferLength,
+	const WDFREQUEST      Request,
+	size_t* BytesReturned)
+{
+	TRACING();
+	UNREFERENCED_PARAMETER(BytesReturned);
+
+	NTSTATUS status = STATUS_UNSUCCESSFUL;
+	struct diag_info* info = NULL;
+	size_t bufSize;
+
+	VioGpuAdapterLite* pAdapter =
+		(VioGpuAdapterLite*)(DeviceContext ? DeviceContext->pvDeviceExtension : 0);
+
+	if (!pAdapter) {
+		ERR("Couldn't find adapter\n");
+		WdfRequestComplete(Request, STATUS_INSUFFICIENT_RESOURCES);
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	if (InputBufferLength < sizeof(struct diag_info) || OutputBufferLength < sizeof(struct diag_info)) {
+		ERR("Buffer is too small: input = %Iu, output = %Iu, expected >= %Iu\n",
+			InputBufferLength, OutputBufferLength, sizeof(struct diag_info));
+		WdfRequestComplete(Request, STATUS_BUFFER_TOO_SMALL);
+		return STATUS_BUFFER_TOO_SMALL;
+	}
+
+	status = WdfRequestRetrieveInputBuffer(Request, sizeof(struct diag_info), (PVOID*)&info, &bufSize);
+	if (!NT_SUCCESS(status)) {
+		ERR("Couldn't retrieve Input buffer\n");
+		WdfRequestComplete(Request, STATUS_INVALID_USER_BUFFER);
+		return STATUS_INVALID_USER_BUFFER;
+	}
+
+	// METHOD_BUFFERED shares the system buffer between input and output
+	status = pAdapter->FillDiagInfo(info);
+	if (status != STATUS_SUCCESS) {
+		WdfRequestComplete(Request, status);
+		return status;
+	}
+
+	WdfRequestSetInformation(Request, sizeof(struct diag_info));
+	return STATUS_SUCCESS;
+}
+
+static NTSTATUS IoctlRequestStats(
+	const PDEVICE_CONTEXT DeviceContext,
+	const size_t          InputBufferLength,
+	const size_t          OutputBufferLength,
+	const WDFREQUEST      Request,
+	size_t* BytesReturned)
+{
+	TRACING();
+	UNREFERENCED_PARAMETER(BytesReturned);
+
+	NTSTATUS status = STATUS_UNSUCCESSFUL;
+	struct stats_info* info = NULL;
+	size_t bufSize;
+
+	VioGpuAdapterLite* pAdapter =
+		(VioGpuAdapterLite*)(DeviceContext ? DeviceContext->pvDeviceExtension : 0);
+
+	if (!pAdapter) {
+		ERR("Couldn't find adapter\n");
+		WdfRequestComplete(Request, STATUS_INSUFFICIENT_RESOURCES);
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	if (InputBufferLength < sizeof(struct stats_info) || OutputBufferLength < sizeof(struct stats_info)) {
+		ERR("Buffer is too small: input = %Iu, output = %Iu, expected >= %Iu\n",
+			InputBufferLength, OutputBufferLength, sizeof(struct stats_info));
+		WdfRequestComplete(Request, STATUS_BUFFER_TOO_SMALL);
+		return STATUS_BUFFER_TOO_SMALL;
+	}
+
+	status = WdfRequestRetrieveInputBuffer(Request, sizeof(struct stats_info), (PVOID*)&info, &bufSize);
+	if (!NT_SUCCESS(status)) {
+		ERR("Couldn't retrieve Input buffer\n");
+		WdfRequestComplete(Request, STATUS_INVALID_USER_BUFFER);
+		return STATUS_INVALID_USER_BUFFER;
+	}
+
+	// METHOD_BUFFERED shares the system buffer between input and output
+	status = pAdapter->FillStatsInfo(info);
+	if (status != STATUS_SUCCESS) {
+		WdfRequestComplete(Request, status);
+		return status;
+	}
+
+	WdfRequestSetInformation(Request, sizeof(struct stats_info));
+	return STATUS_SUCCESS;
+}
+
+static NTSTATUS IoctlRequestQueueStats(
+	const PDEVICE_CONTEXT DeviceContext,
+	const size_t          InputBufferLength,
+	const size_t          OutputBufferLength,
+	const WDFREQUEST      Request,
+	size_t* BytesReturned)
+{
+	TRACING();
+	UNREFERENCED_PARAMETER(BytesReturned);
+
+	NTSTATUS status = STATUS_UNSUCCESSFUL;
+	struct queue_stats_info* info = NULL;
+	size_t bufSize;
+
+	VioGpuAdapterLite* pAdapter =
+		(VioGpuAdapterLite*)(DeviceContext ? DeviceContext->pvDeviceExtension : 0);
+
+	if (!pAdapter) {
+		ERR("Couldn't find adapter\n");
+		WdfRequestComplete(Request, STATUS_INSUFFICIENT_RESOURCES);
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	if (InputBufferLength < sizeof(struct queue_stats_info) || OutputBufferLength < sizeof(struct queue_stats_info)) {
+		ERR("Buffer is too small: input = %Iu, output = %Iu, expected >= %Iu\n",
+			InputBufferLength, OutputBufferLength, sizeof(struct queue_stats_info));
+		WdfRequestComplete(Request, STATUS_BUFFER_TOO_SMALL);
+		return STATUS_BUFFER_TOO_SMALL;
+	}
+
+	status = WdfRequestRetrieveInputBuffer(Request, sizeof(struct queue_stats_info), (PVOID*)&info, &bufSize);
+	if (!NT_SUCCESS(status)) {
+		ERR("Couldn't retrieve Input buffer\n");
+		WdfRequestComplete(Request, STATUS_INVALID_USER_BUFFER);
+		return STATUS_INVALID_USER_BUFFER;
+	}
+
+	// METHOD_BUFFERED shares the system buffer between input and output
+	status = pAdapter->FillQueueStatsInfo(info);
+	if (status != STATUS_SUCCESS) {
+		WdfRequestComplete(Request, status);
+		return status;
+	}
+
+	WdfRequestSetInformation(Request, sizeof(struct queue_stats_info));
+	return STATUS_SUCCESS;
+}
+
+static NTSTATUS IoctlRequestRegisterFramePool(
+	const PDEVICE_CONTEXT DeviceContext,
+	const size_t          InputBufferLength,
+	const size_t          OutputBufferLength,
+	const WDFREQUEST      Request,
+	size_t* BytesReturned)
+{
+	TRACING();
+	UNREFERENCED_PARAMETER(BytesReturned);
+
+	NTSTATUS status = STATUS_UNSUCCESSFUL;
+	struct frame_pool_info* pdata = NULL;
+	struct frame_pool_response* resp = NULL;
+	struct FrameMetaData frame;
+	PVOID slot_addr[MAX_FRAME_POOL_SLOTS];
+	unsigned int num_slots;
+	ULONG pool_id = 0;
+	size_t bufSize;
+
+	VioGpuAdapterLite* pAdapter =
+		(VioGpuAdapterLite*)(DeviceContext ? DeviceContext->pvDeviceExtension : 0);
+
+	if (!pAdapter) {
+		ERR("Couldn't find adapter\n");
+		WdfRequestComplete(Request, STATUS_INSUFFICIENT_RESOURCES);
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	if (InputBufferLength < sizeof(struct frame_pool_info) || OutputBufferLength < sizeof(struct frame_pool_response)) {
+		ERR("Buffer is too small: input = %Iu, output = %Iu, expected >= %Iu, %Iu\n",
+			InputBufferLength, OutputBufferLength, sizeof(struct frame_pool_info), sizeof(struct frame_pool_response));
+		WdfRequestComplete(Request, STATUS_BUFFER_TOO_SMALL);
+		return STATUS_BUFFER_TOO_SMALL;
+	}
+
+	status = WdfRequestRetrieveInputBuffer(Request, sizeof(struct frame_pool_info), (PVOID*)&pdata, &bufSize);
+	if (!NT_SUCCESS(status)) {
+		ERR("Couldn't retrieve Input buffer\n");
+		WdfRequestComplete(Request, STATUS_INVALID_USER_BUFFER);
+		return STATUS_INVALID_USER_BUFFER;
+	}
+
+	// METHOD_BUFFERED shares the system buffer with the response, so take
+	// everything out of it first
+	frame = pdata->frame;
+	num_slots = pdata->num_slots;
+	for (UINT i = 0; i < MAX_FRAME_POOL_SLOTS; i++) {
+		slot_addr[i] = pdata->slot_addr[i];
+	}
+
+	if (frame.screen_num >= MAX_SCAN_OUT || num_slots > MAX_FRAME_POOL_SLOTS) {
+		ERR("Invalid pool: screen = %d, slots = %d\n", frame.screen_num, num_slots);
+		WdfRequestComplete(Request, STATUS_INVALID_PARAMETER);
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	if (num_slots != 0) {
+		if (frame.width == 0 || frame.height == 0 ||
+			frame.width > MAX_WIDTH_SIZE || frame.height > MAX_HEIGHT_SIZE ||
+			frame.pitch < frame.width * (VGPU_BPP / BITS_PER_BYTE) || frame.pitch > MAXULONG / frame.height) {
+			ERR("Invalid pool geometry: width=%u, height=%u, pitch=%u\n", frame.width, frame.height, frame.pitch);
+			WdfRequestComplete(Request, STATUS_INVALID_PARAMETER);
+			return STATUS_INVALID_PARAMETER;
+		}
+
+		if (KeGetCurrentIrql() != PASSIVE_LEVEL) {
+			ERR("Cannot access user-mode buffer at IRQL > PASSIVE_LEVEL\n");
+			WdfRequestComplete(Request, STATUS_INVALID_DEVICE_REQUEST);
+			return STATUS_INVALID_DEVICE_REQUEST;
+		}
+
+		// The slots get locked as kernel memory, make sure they are the
+		// caller's before that
+		__try {
+			for (UINT i = 0; i < num_slots; i++) {
+				ProbeForRead(slot_addr[i], (SIZE_T)frame.pitch * frame.height, sizeof(BYTE));
+			}
+		}
+		__except (EXCEPTION_EXECUTE_HANDLER) {
+			ERR("Invalid user-mode buffer access\n");
+			status = GetExceptionCode();
+			WdfRequestComplete(Request, status);
+			return status;
+		}
+	}
+
+	status = pAdapter->RegisterFramePool(frame.screen_num, WdfRequestGetFileObject(Request), num_slots, slot_addr,
+		frame.width, frame.height, frame.pitch, frame.stride, &pool_id);
+	if (!NT_SUCCESS(status)) {
+		ERR("RegisterFramePool failed with status = 0x%x\n", status);
+		WdfRequestComplete(Request, status);
+		return status;
+	}
+
+	status = WdfRequestRetrieveOutputBuffer(Request, sizeof(struct frame_pool_response), (PVOID*)&resp, &bufSize);
+	if (!NT_SUCCESS(status)) {
+		ERR("Couldn't retrieve Output buffer\n");
+		WdfRequestComplete(Request, STATUS_INSUFFICIENT_RESOURCES);
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	resp->resp.retval = DVSERVERKMD_SUCCESS;
+	resp->pool_id = pool_id;
+	WdfRequestSetInformation(Request, sizeof(struct frame_pool_response));
+
+	return STATUS_SUCCESS;
+}
+
+static NTSTATUS IoctlRequestPresentPool(
+	const PDEVICE_CONTEXT DeviceContext,
+	const size_t          InputBufferLength,
+	const size_t          OutputBufferLength,
+	const WDFREQUEST      Request,
+	size_t* BytesReturned)
+{
+	TRACING_SAMPLED(TRACE_SAMPLE_RATE);
+	UNREFERENCED_PARAMETER(BytesReturned);
+
+	ULONGLONG entry_us = VioGpuStats::NowUs();
+	NTSTATUS status = STATUS_UNSUCCESSFUL;
+	struct pool_present* pdata = NULL;
+	struct present_response* resp = NULL;
+	unsigned int screen_num, pool_id, slot;
+	RECT rects[MAX_DAMAGE_RECTS];
+	ULONG num_rects;
+	ULONGLONG fence_id = 0;
+	size_t bufSize;
+	PRESENT_WORK work;
+
+	VioGpuAdapterLite* pAdapter =
+		(VioGpuAdapterLite*)(DeviceContext ? DeviceContext->pvDeviceExtension : 0);
+
+	if (!pAdapter) {
+		ERR("Couldn't find adapter\n");
+		WdfRequestComplete(Request, STATUS_INSUFFICIENT_RESOURCES);
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	if (InputBufferLength < sizeof(struct pool_present) || OutputBufferLength < sizeof(struct present_response)) {
+		ERR("Buffer is too small: input = %Iu, output = %Iu, expected >= %Iu, %Iu\n",
+			InputBufferLength, OutputBufferLength, sizeof(struct pool_present), sizeof(struct present_response));
+		WdfRequestComplete(Request, STATUS_BUFFER_TOO_SMALL);
+		return STATUS_BUFFER_TOO_SMALL;
+	}
+
+	status = WdfRequestRetrieveInputBuffer(Request, sizeof(struct pool_present), (PVOID*)&pdata, &bufSize);
+	if (!NT_SUCCESS(status)) {
+		ERR("Couldn't retrieve Input buffer\n");
+		WdfRequestComplete(Request, STATUS_INVALID_USER_BUFFER);
+		return STATUS_INVALID_USER_BUFFER;
+	}
+
+	// The response overwrites the same system buffer
+	screen_num = pdata->screen_num;
+	pool_id = pdata->pool_id;
+	slot = pdata->slot;
+	num_rects = min(pdata->num_rects, (ULONG)MAX_DAMAGE_RECTS);
+	for (ULONG i = 0; i < num_rects; i++) {
+		rects[i].left = pdata->rects[i].left;
+		rects[i].top = pdata->rects[i].top;
+		rects[i].right = pdata->rects[i].right;
+		rects[i].bottom = pdata->rects[i].bottom;
+	}
+
+	if (screen_num >= MAX_SCAN_OUT) {
+		ERR("Screen number provided by UMD: %d is greater than or equal to the maximum supported: %d by the KMD\n",
+			screen_num, MAX_SCAN_OUT);
+		WdfRequestComplete(Request, STATUS_INVALID_PARAMETER);
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	RtlZeroMemory(&work, sizeof(work));
+	work.Kind = PresentKind::Pool;
+	work.Owner = WdfRequestGetFileObject(Request);
+	work.EntryUs = entry_us;
+	work.PoolId = pool_id;
+	work.Slot = slot;
+	work.NumRects = min(num_rects, (ULONG)MAX_DAMAGE_REGION_RECTS);
+	RtlCopyMemory(work.Rects, rects, work.NumRects * sizeof(RECT));
+
+	status = pAdapter->QueuePresent(screen_num, &work, &fence_id);
+	if (!NT_SUCCESS(status)) {
+		ERR("QueuePresent failed with status = 0x%x\n", status);
+		WdfRequestComplete(Request, status);
+		return status;
+	}
+
+	status = WdfRequestRetrieveOutputBuffer(Request, sizeof(struct present_response), (PVOID*)&resp, &bufSize);
+	if (!NT_SUCCESS(status)) {
+		ERR("Couldn't retrieve Output buffer\n");
+		WdfRequestComplete(Request, STATUS_INSUFFICIENT_RESOURCES);
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	resp->resp.retval = DVSERVERKMD_SUCCESS;
+	resp->fence_id = fence_id;
+	WdfRequestSetInformation(Request, sizeof(struct present_response));
+
+	return STATUS_SUCCESS;
+}
+
 static NTSTATUS IoctlRequestHPEventInfo(
 	const PDEVICE_CONTEXT DeviceContext,
 	const size_t          InputBufferLength,
@@ -712,7 +1202,7 @@ static NTSTATUS IoctlSetPointerShape(
 	const size_t          OutputBufferLength,
 	const WDFREQUEST      Request)
 {
-	TRACING();
+	TRACING_SAMPLED(TRACE_SAMPLE_RATE);
 	POINTER_SHAPE pointerShape;
 	struct CursorData* cptr = NULL;
 	NTSTATUS status = STATUS_UNSUCCESSFUL;
@@ -865,7 +1355,7 @@ static NTSTATUS IoctlSetPointerPosition(
 	size_t bufSize;
 	NTSTATUS status = STATUS_UNSUCCESSFUL;
 
-	TRACING();
+	TRACING_SAMPLED(TRACE_SAMPLE_RATE);
 
 	VioGpuAdapterLite* pAdapter =
 		(VioGpuAdapterLite*)(DeviceContext ? DeviceContext->pvDeviceExtension : 0);
@@ -45,6 +45,7 @@ static NTSTATUS IoctlRequestPresentFb(
 	const size_t          InputBufferLength,
 	const size_t          OutputBufferLength,
 	const WDFREQUEST      Request,
+	const ULONG           IoControlCode,
 	size_t* BytesReturned);
 
 static NTSTATUS IoctlRequestEdid(
@@ -68,6 +69,48 @@ static NTSTATUS IoctlRequestHPEventInfo(
 	const WDFREQUEST      Request,
 	size_t* BytesReturned);
 
+static NTSTATUS IoctlRequestWaitFence(
+	const PDEVICE_CONTEXT DeviceContext,
+	const size_t          InputBufferLength,
+	const size_t          OutputBufferLength,
+	const WDFREQUEST      Request,
+	size_t* BytesReturned);
+
+static NTSTATUS IoctlRequestDiag(
+	const PDEVICE_CONTEXT DeviceContext,
+	const size_t          InputBufferLength,
+	const size_t          OutputBufferLength,
+	const WDFREQUEST      Request,
+	size_t* BytesReturned);
+
+static NTSTATUS IoctlRequestStats(
+	const PDEVICE_CONTEXT DeviceContext,
+	const size_t          InputBufferLength,
+	const size_t          OutputBufferLength,
+	const WDFREQUEST      Request,
+	size_t* BytesReturned);
+
+static NTSTATUS IoctlRequestQueueStats(
+	const PDEVICE_CONTEXT DeviceContext,
+	const size_t          InputBufferLength,
+	const size_t          OutputBufferLength,
+	const WDFREQUEST      Request,
+	size_t* BytesReturned);
+
+static NTSTATUS IoctlRequestRegisterFramePool(
+	const PDEVICE_CONTEXT DeviceContext,
+	const size_t          InputBufferLength,
+	const size_t          OutputBufferLength,
+	const WDFREQUEST      Request,
+	size_t* BytesReturned);
+
+static NTSTATUS IoctlRequestPresentPool(
+	const PDEVICE_CONTEXT DeviceContext,
+	const size_t          InputBufferLength,
+	const size_t          OutputBufferLength,
+	const WDFREQUEST      Request,
+	size_t* BytesReturned);
+
 static NTSTATUS IoctlSetPointerShape(
 	const PDEVICE_CONTEXT DeviceContext,
 	const size_t          InputBufferLength,
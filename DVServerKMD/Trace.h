@@ -21,14 +21,73 @@
            (WPP_LEVEL_ENABLED(flags) && WPP_CONTROL(WPP_BIT_ ## flags).Level >= lvl)
 
 
+// Function entry and exit tracing, the FuncTraceLevel driver parameter
+// picks how much of it is emitted. A level includes the ones below it.
+#define FUNC_TRACE_OFF             0
+#define FUNC_TRACE_COLD            1	// TRACING(), setup, teardown and rare IOCTLs
+#define FUNC_TRACE_SAMPLED         2	// TRACING_SAMPLED(), every n-th call of a site
+#define FUNC_TRACE_HOT             3	// TRACING_HOT(), every call, checked builds only
+
+#if DBG
+#define FUNC_TRACE_DEFAULT         FUNC_TRACE_HOT
+#else
+#define FUNC_TRACE_DEFAULT         FUNC_TRACE_COLD
+#endif
+
+#define REG_FUNC_TRACE_LEVEL       L"FuncTraceLevel"
+
+// Calls of a per frame site between two traced ones, once a second at 60Hz
+#define TRACE_SAMPLE_RATE          60
+
+extern ULONG g_FuncTraceLevel;
+
+VOID ReadTraceParameters(VOID);
+
+// A site that is not traced costs the compare in the constructor and the
+// one in the destructor, both inline
 class tracer {
 private:
-	char* m_func_name;
+	const char* m_func_name;
+	void Enter(const char* func_name);
+	void Exit(void);
 public:
-	tracer(const char* func_name);
-	~tracer();
+	tracer(const char* func_name, ULONG level)
+	{
+		m_func_name = NULL;
+		if (g_FuncTraceLevel >= level) {
+			Enter(func_name);
+		}
+	}
+	// The call count is not interlocked, a lost increment only moves the
+	// next sample
+	tracer(const char* func_name, ULONG level, ULONG* calls, ULONG every)
+	{
+		m_func_name = NULL;
+		if (g_FuncTraceLevel >= level && (++(*calls) % every) == 0) {
+			Enter(func_name);
+		}
+	}
+	~tracer()
+	{
+		if (m_func_name) {
+			Exit();
+		}
+	}
 };
-#define TRACING() tracer trace(__FUNCTION__)
+
+#define TRACING() tracer trace(__FUNCTION__, FUNC_TRACE_COLD)
+
+#define TRACING_SAMPLED(every) \
+	static ULONG trace_calls; \
+	tracer trace(__FUNCTION__, FUNC_TRACE_SAMPLED, &trace_calls, (every))
+
+// Per command, per row and interrupt paths, nothing is left of them in a
+// free build
+#if DBG
+#define TRACING_HOT() tracer trace(__FUNCTION__, FUNC_TRACE_HOT)
+#else
+#define TRACING_HOT() ((void)0)
+#endif
 
 //
 // This comment block is scanned by the trace preprocessor to define our
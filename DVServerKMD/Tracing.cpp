@@ -20,35 +20,70 @@ Environment:
 #include "Trace.h"
 #include "tracing.tmh"
 
+ULONG g_FuncTraceLevel = FUNC_TRACE_DEFAULT;
 
 /*******************************************************************************
 *
 * Description
 *
-* tracer is a constructor member function of the class tracer called to mark the entry of the function.
+* Enter is called by the constructor of the class tracer to mark the entry of the function.
 *
 * Parameters
 *   func_name - Function name.
 *
 *
 ******************************************************************************/
-tracer::tracer(const char* func_name)
+void tracer::Enter(const char* func_name)
 {
 	FuncTrace(">>> %s\n", func_name);
-	m_func_name = (char*)func_name;
+	m_func_name = func_name;
 }
 /*******************************************************************************
 *
 * Description
 *
-* tracer is a destructor member function of the class tracer called to mark exit of the function.
+* Exit is called by the destructor of the class tracer to mark exit of the function.
 *
 * Parameters
-*   func_name - Function name.
+*   None
 *
 *
 ******************************************************************************/
-tracer::~tracer()
+void tracer::Exit(void)
 {
 	FuncTrace("<<< %s\n", m_func_name);
+}
+/*******************************************************************************
+*
+* Description
+*
+* ReadTraceParameters reads the FuncTraceLevel driver parameter, the build
+* default stays when it is missing or out of range.
+*
+* Parameters
+*   None
+*
+*
+******************************************************************************/
+VOID ReadTraceParameters(VOID)
+{
+	PAGED_CODE();
+
+	NTSTATUS status;
+	WDFKEY hKey = NULL;
+	UNICODE_STRING valueName;
+	ULONG value;
+
+	status = WdfDriverOpenParametersRegistryKey(WdfGetDriver(), KEY_READ, WDF_NO_OBJECT_ATTRIBUTES, &hKey);
+	if (!NT_SUCCESS(status)) {
+		return;
+	}
+
+	RtlInitUnicodeString(&valueName, REG_FUNC_TRACE_LEVEL);
+	status = WdfRegistryQueryULong(hKey, &valueName, &value);
+	WdfRegistryClose(hKey);
+
+	if (NT_SUCCESS(status) && value <= FUNC_TRACE_HOT) {
+		g_FuncTraceLevel = value;
+	}
 }
\ No newline at end of file
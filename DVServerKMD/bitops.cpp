@@ -1,11 +1,18 @@
 #include "bitops.h"
 #include "Trace.h"
 #include <bitops.tmh>
-
+#include "bitops_rows.h"
 
 #pragma code_seg(push)
 #pragma code_seg()
 
+// The only conversion the driver asks for, the cursor comes in ARGB and
+// the host takes ABGR
+static BOOLEAN NeedsRedBlueSwap(CONST BLT_INFO* pDst, CONST BLT_INFO* pSrc)
+{
+	return (pDst->PixelFmt == D3DDDIFMT_A8B8G8R8 && pSrc->PixelFmt == D3DDDIFMT_A8R8G8B8);
+}
+
 VOID
 GetPitches(
 	_In_ CONST BLT_INFO* pBltInfo,
@@ -13,7 +20,7 @@ GetPitches(
 	_Out_ LONG* pRowPitch
 )
 {
-	TRACING();
+	TRACING_HOT();
 	switch (pBltInfo->Rotation) {
 	case D3DKMDT_VPPR_IDENTITY:
 		*pPixelPitch = (pBltInfo->BitsPerPel / BITS_PER_BYTE);
@@ -42,7 +49,7 @@ GetPitches(
 
 BYTE* GetRowStart(_In_ CONST BLT_INFO* pBltInfo, CONST RECT* pRect)
 {
-	TRACING();
+	TRACING_HOT();
 	BYTE* pRet = NULL;
 	LONG OffLeft = pRect->left + pBltInfo->Offset.x;
 	LONG OffTop = pRect->top + pBltInfo->Offset.y;
@@ -84,7 +91,7 @@ VOID CopyBitsGeneric(
 	UINT  NumRects,
 	_In_reads_(NumRects) CONST RECT* pRects)
 {
-	TRACING();
+	TRACING_HOT();
 	LONG DstPixelPitch = 0;
 	LONG DstRowPitch = 0;
 	LONG SrcPixelPitch = 0;
@@ -92,9 +99,16 @@ VOID CopyBitsGeneric(
 
 	DBGPRINT("NumRects = %d Dst = %p Src = %p\n", NumRects, pDst->pBits, pSrc->pBits);
 
+	if (pDst->BitsPerPel != 32 || pSrc->BitsPerPel != 32) {
+		VioGpuDbgBreak();
+		return;
+	}
+
 	GetPitches(pDst, &DstPixelPitch, &DstRowPitch);
 	GetPitches(pSrc, &SrcPixelPitch, &SrcRowPitch);
 
+	BOOLEAN bSwap = NeedsRedBlueSwap(pDst, pSrc);
+
 	for (UINT iRect = 0; iRect < NumRects; iRect++) {
 		CONST RECT* pRect = &pRects[iRect];
 
@@ -107,25 +121,22 @@ VOID CopyBitsGeneric(
 		BYTE* pDstRow = GetRowStart(pDst, pRect);
 		CONST BYTE* pSrcRow = GetRowStart(pSrc, pRect);
 
-		for (UINT y = 0; y < NumRows; y++) {
-			BYTE* pDstPixel = pDstRow;
-			CONST BYTE* pSrcPixel = pSrcRow;
-
-			for (UINT x = 0; x < NumPixels; x++) {
-				if (pDst->BitsPerPel == 32 && pSrc->BitsPerPel == 32) {
-					UINT32* pDstPixelAs32 = (UINT32*)pDstPixel;
-					UINT32* pSrcPixelAs32 = (UINT32*)pSrcPixel;
-					*pDstPixelAs32 = *pSrcPixelAs32;
+		if (SrcPixelPitch == 4 && (DstPixelPitch == 4 || DstPixelPitch == -4)) {
+			// Rows stay rows, only their direction may flip
+			for (UINT y = 0; y < NumRows; y++) {
+				if (DstPixelPitch == 4) {
+					CopyRow32((UINT32*)pDstRow, (CONST UINT32*)pSrcRow, NumPixels, bSwap);
 				}
 				else {
-					VioGpuDbgBreak();
+					CopyRowReversed32((UINT32*)pDstRow, (CONST UINT32*)pSrcRow, NumPixels, bSwap);
 				}
-				pDstPixel += DstPixelPitch;
-				pSrcPixel += SrcPixelPitch;
+				pDstRow += DstRowPitch;
+				pSrcRow += SrcRowPitch;
 			}
-
-			pDstRow += DstRowPitch;
-			pSrcRow += SrcRowPitch;
+		}
+		else {
+			CopyRectTiled32(pDstRow, DstPixelPitch, DstRowPitch, pSrcRow, SrcPixelPitch, SrcRowPitch,
+				NumPixels, NumRows, bSwap);
 		}
 	}
 }
@@ -142,7 +153,9 @@ VOID CopyBits32_32(
 	VIOGPU_ASSERT((pDst->Rotation == D3DKMDT_VPPR_IDENTITY) &&
 		(pSrc->Rotation == D3DKMDT_VPPR_IDENTITY));
 
-	TRACING();
+	TRACING_HOT();
+
+	BOOLEAN bSwap = NeedsRedBlueSwap(pDst, pSrc);
 
 	for (UINT iRect = 0; iRect < NumRects; iRect++) {
 		CONST RECT* pRect = &pRects[iRect];
@@ -152,7 +165,6 @@ VOID CopyBits32_32(
 
 		UINT NumPixels = pRect->right - pRect->left;
 		UINT NumRows = pRect->bottom - pRect->top;
-		UINT BytesToCopy = NumPixels * 4;
 		BYTE* pStartDst = ((BYTE*)pDst->pBits +
 			(pRect->top + pDst->Offset.y) * pDst->Pitch +
 			(pRect->left + pDst->Offset.x) * 4);
@@ -161,14 +173,7 @@ VOID CopyBits32_32(
 			(pRect->left + pSrc->Offset.x) * 4);
 
 		for (UINT i = 0; i < NumRows; ++i) {
-			RtlCopyMemory(pStartDst, pStartSrc, BytesToCopy);
-			for (UINT j = 0; j < NumPixels; j++) {
-				RtlCopyMemory(&pStartDst[j * 4], &pStartSrc[j * 4], 4);
-				if (pDst->PixelFmt == D3DDDIFMT_A8B8G8R8 && pSrc->PixelFmt == D3DDDIFMT_A8R8G8B8) {
-					pStartDst[j * 4] = pStartSrc[j * 4 + 2];
-					pStartDst[j * 4 + 2] = pStartSrc[j * 4];
-				}
-			}
+			CopyRow32((UINT32*)pStartDst, (CONST UINT32*)pStartSrc, NumPixels, bSwap);
 			pStartDst += pDst->Pitch;
 			pStartSrc += pSrc->Pitch;
 		}
@@ -182,7 +187,7 @@ VOID BltBits(
 	UINT  NumRects,
 	_In_reads_(NumRects) CONST RECT* pRects)
 {
-	TRACING();
+	TRACING_HOT();
 	__try {
 		if (pDst->Rotation == D3DKMDT_VPPR_IDENTITY &&
 			pSrc->Rotation == D3DKMDT_VPPR_IDENTITY) {
@@ -201,7 +206,7 @@ VOID BltBits(
 
 UINT BPPFromPixelFormat(D3DDDIFORMAT Format)
 {
-	TRACING();
+	TRACING_HOT();
 	switch (Format)
 	{
 	case D3DDDIFMT_UNKNOWN: return 0;
@@ -0,0 +1,101 @@
+/*
+ * Copyright (C) 2021 Intel Corporation
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#pragma once
+#include <emmintrin.h>
+
+// Row and tile kernels of CopyBitsGeneric and CopyBits32_32. They use no
+// more than the Windows base types, so the host tests in tests\ build them
+// without the WDK.
+
+// Pixels per side of the blocks rotated blits are done in, a block of
+// source rows and the destination rows it lands in both stay in the L1
+#define BLT_TILE_SIZE 16
+
+static __forceinline UINT32 SwapRedBlue(UINT32 Pixel)
+{
+	return (Pixel & 0xFF00FF00) | ((Pixel >> 16) & 0xFF) | ((Pixel & 0xFF) << 16);
+}
+
+// x64 kernel code may use the XMM registers without saving them and SSE2
+// is part of the architecture, so nothing is detected or saved
+static __forceinline __m128i SwapRedBlue4(__m128i Pixels)
+{
+	CONST __m128i LowByte = _mm_set1_epi32(0xFF);
+	__m128i Kept = _mm_and_si128(Pixels, _mm_set1_epi32((int)0xFF00FF00));
+	__m128i Red = _mm_and_si128(_mm_srli_epi32(Pixels, 16), LowByte);
+	__m128i Blue = _mm_slli_epi32(_mm_and_si128(Pixels, LowByte), 16);
+
+	return _mm_or_si128(Kept, _mm_or_si128(Red, Blue));
+}
+
+static VOID CopyRow32(UINT32* pDst, CONST UINT32* pSrc, UINT NumPixels, BOOLEAN bSwap)
+{
+	UINT x = 0;
+
+	if (!bSwap) {
+		RtlCopyMemory(pDst, pSrc, NumPixels * 4);
+		return;
+	}
+
+	for (; x + 4 <= NumPixels; x += 4) {
+		__m128i Pixels = _mm_loadu_si128((CONST __m128i*)&pSrc[x]);
+		_mm_storeu_si128((__m128i*)&pDst[x], SwapRedBlue4(Pixels));
+	}
+	for (; x < NumPixels; x++) {
+		pDst[x] = SwapRedBlue(pSrc[x]);
+	}
+}
+
+// pDst is where the first source pixel goes, the others land before it
+static VOID CopyRowReversed32(UINT32* pDst, CONST UINT32* pSrc, UINT NumPixels, BOOLEAN bSwap)
+{
+	UINT x = 0;
+
+	for (; x + 4 <= NumPixels; x += 4) {
+		__m128i Pixels = _mm_loadu_si128((CONST __m128i*)&pSrc[x]);
+		Pixels = _mm_shuffle_epi32(Pixels, _MM_SHUFFLE(0, 1, 2, 3));
+		if (bSwap) {
+			Pixels = SwapRedBlue4(Pixels);
+		}
+		_mm_storeu_si128((__m128i*)(pDst - x - 3), Pixels);
+	}
+	for (; x < NumPixels; x++) {
+		*(pDst - x) = bSwap ? SwapRedBlue(pSrc[x]) : pSrc[x];
+	}
+}
+
+// 90 and 270 degree blits walk one side of the copy across rows, a block
+// at a time keeps the lines it touches cached
+static VOID CopyRectTiled32(
+	BYTE* pDstRow,
+	LONG DstPixelPitch,
+	LONG DstRowPitch,
+	CONST BYTE* pSrcRow,
+	LONG SrcPixelPitch,
+	LONG SrcRowPitch,
+	UINT NumPixels,
+	UINT NumRows,
+	BOOLEAN bSwap)
+{
+	for (UINT ty = 0; ty < NumRows; ty += BLT_TILE_SIZE) {
+		UINT TileRows = min(NumRows - ty, (UINT)BLT_TILE_SIZE);
+
+		for (UINT tx = 0; tx < NumPixels; tx += BLT_TILE_SIZE) {
+			UINT TilePixels = min(NumPixels - tx, (UINT)BLT_TILE_SIZE);
+
+			for (UINT y = ty; y < ty + TileRows; y++) {
+				BYTE* pDstPixel = pDstRow + (LONG_PTR)y * DstRowPitch + (LONG_PTR)tx * DstPixelPitch;
+				CONST BYTE* pSrcPixel = pSrcRow + (LONG_PTR)y * SrcRowPitch + (LONG_PTR)tx * SrcPixelPitch;
+
+				for (UINT x = 0; x < TilePixels; x++) {
+					UINT32 Pixel = *(CONST UINT32*)pSrcPixel;
+					*(UINT32*)pDstPixel = bSwap ? SwapRedBlue(Pixel) : Pixel;
+					pDstPixel += DstPixelPitch;
+					pSrcPixel += SrcPixelPitch;
+				}
+			}
+		}
+	}
+}
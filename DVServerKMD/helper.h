@@ -74,8 +74,11 @@ extern "C" {
 	#include "kdebugprint.h"
 	#include "viogpu_pci.h"
 	#include "viogpu.h"
+	#include "viogpu_stats.h"
 	#include "viogpu_queue.h"
 	#include "viogpu_idr.h"
+	#include "viogpu_damage.h"
+	#include "viogpu_framepool.h"
 
 	#include <evntrace.h>
 }
@@ -91,6 +94,12 @@ extern "C" {
 #define NOM_WIDTH_SIZE             1024
 #define NOM_HEIGHT_SIZE            768
 #define VGPU_BPP                   32
+#define SET_MODE_FENCE_TIMEOUT_MS  100
+
+// Values read from the service Parameters key
+#define REG_FRAMEBUFFER_COUNT      L"FrameBufferCount"
+#define REG_PACKED_RING            L"PackedRing"
+#define REG_IRQ_COALESCING         L"InterruptCoalescing"
 
 #define VIOGPUTAG                  'OIVg'
 
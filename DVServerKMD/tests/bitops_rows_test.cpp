@@ -0,0 +1,191 @@
+/*
+ * Copyright (C) 2021 Intel Corporation
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+// Host checks of the blit kernels in bitops_rows.h against plain per pixel
+// copies, for every row length around the SSE2 width and every alignment
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "win_types.h"
+#include "bitops_rows.h"
+
+#define MAX_PIXELS  80
+#define GUARD       8
+#define GUARD_VALUE 0xDEADBEEF
+
+static int failures;
+
+// The byte swap the pre-SSE2 CopyBits32_32 did for ARGB to ABGR
+static UINT32 ReferenceSwap(UINT32 Pixel)
+{
+	BYTE* p = (BYTE*)&Pixel;
+	BYTE b = p[0];
+
+	p[0] = p[2];
+	p[2] = b;
+	return Pixel;
+}
+
+static void FillRandom(UINT32* p, UINT count)
+{
+	for (UINT i = 0; i < count; i++) {
+		p[i] = ((UINT32)rand() << 16) ^ (UINT32)rand();
+	}
+}
+
+static void TestSwap(void)
+{
+	CHECK(SwapRedBlue(0x11223344) == 0x11443322);
+	CHECK(SwapRedBlue(0xFF0000FF) == 0xFFFF0000);
+	for (UINT i = 0; i < 100000; i++) {
+		UINT32 Pixel = ((UINT32)rand() << 16) ^ (UINT32)rand();
+		CHECK(SwapRedBlue(Pixel) == ReferenceSwap(Pixel));
+	}
+}
+
+static void TestCopyRow(void)
+{
+	UINT32 src[MAX_PIXELS + 4];
+	UINT32 dst[MAX_PIXELS + 4 + 2 * GUARD];
+
+	for (UINT n = 0; n <= MAX_PIXELS; n++) {
+		for (UINT align = 0; align < 4; align++) {
+			for (BOOLEAN bSwap = 0; bSwap <= 1; bSwap++) {
+				FillRandom(src, MAX_PIXELS + 4);
+				for (UINT i = 0; i < MAX_PIXELS + 4 + 2 * GUARD; i++) {
+					dst[i] = GUARD_VALUE;
+				}
+
+				CopyRow32(&dst[GUARD + align], &src[align], n, bSwap);
+
+				for (UINT i = 0; i < MAX_PIXELS + 4 + 2 * GUARD; i++) {
+					UINT32 expected = GUARD_VALUE;
+					if (i >= GUARD + align && i < GUARD + align + n) {
+						UINT32 Pixel = src[i - GUARD];
+						expected = bSwap ? ReferenceSwap(Pixel) : Pixel;
+					}
+					if (dst[i] != expected) {
+						printf("CopyRow32 n=%u align=%u swap=%u: pixel %u is %08x, expected %08x\n",
+							n, align, bSwap, i, dst[i], expected);
+						failures++;
+						break;
+					}
+				}
+			}
+		}
+	}
+}
+
+static void TestCopyRowReversed(void)
+{
+	UINT32 src[MAX_PIXELS + 4];
+	UINT32 dst[MAX_PIXELS + 4 + 2 * GUARD];
+
+	for (UINT n = 0; n <= MAX_PIXELS; n++) {
+		for (UINT align = 0; align < 4; align++) {
+			for (BOOLEAN bSwap = 0; bSwap <= 1; bSwap++) {
+				// The first source pixel lands on last, the rest before it
+				UINT last = GUARD + align + (n ? n - 1 : 0);
+
+				FillRandom(src, MAX_PIXELS + 4);
+				for (UINT i = 0; i < MAX_PIXELS + 4 + 2 * GUARD; i++) {
+					dst[i] = GUARD_VALUE;
+				}
+
+				CopyRowReversed32(&dst[last], &src[align], n, bSwap);
+
+				for (UINT i = 0; i < MAX_PIXELS + 4 + 2 * GUARD; i++) {
+					UINT32 expected = GUARD_VALUE;
+					if (n && i >= GUARD + align && i <= last) {
+						UINT32 Pixel = src[align + (last - i)];
+						expected = bSwap ? ReferenceSwap(Pixel) : Pixel;
+					}
+					if (dst[i] != expected) {
+						printf("CopyRowReversed32 n=%u align=%u swap=%u: pixel %u is %08x, expected %08x\n",
+							n, align, bSwap, i, dst[i], expected);
+						failures++;
+						break;
+					}
+				}
+			}
+		}
+	}
+}
+
+// 90 and 270 degree copies of a Width x Height source, destination pixel
+// (x, y) for source pixel (x, y) worked out independently of the kernel
+static void TestCopyRectTiled(void)
+{
+	const UINT sizes[] = { 1, 2, 3, 15, 16, 17, 31, 33, 40 };
+	const UINT count = sizeof(sizes) / sizeof(sizes[0]);
+	static UINT32 src[40 * 40];
+	static UINT32 dst[40 * 40];
+
+	for (UINT iw = 0; iw < count; iw++) {
+		for (UINT ih = 0; ih < count; ih++) {
+			for (UINT rot = 0; rot < 2; rot++) {
+				for (BOOLEAN bSwap = 0; bSwap <= 1; bSwap++) {
+					UINT Width = sizes[iw], Height = sizes[ih];
+					// Rotated, the destination is Height pixels wide
+					LONG DstPitch = (LONG)Height * 4;
+					LONG DstPixelPitch, DstRowPitch;
+					BYTE* pDstRow;
+
+					if (rot == 0) {
+						// 90: source row y becomes destination column Height - 1 - y
+						DstPixelPitch = DstPitch;
+						DstRowPitch = -4;
+						pDstRow = (BYTE*)dst + (Height - 1) * 4;
+					}
+					else {
+						// 270: source row y becomes destination column y, bottom up
+						DstPixelPitch = -DstPitch;
+						DstRowPitch = 4;
+						pDstRow = (BYTE*)dst + (LONG_PTR)(Width - 1) * DstPitch;
+					}
+
+					FillRandom(src, Width * Height);
+					for (UINT i = 0; i < 40 * 40; i++) {
+						dst[i] = GUARD_VALUE;
+					}
+
+					CopyRectTiled32(pDstRow, DstPixelPitch, DstRowPitch,
+						(CONST BYTE*)src, 4, (LONG)Width * 4, Width, Height, bSwap);
+
+					for (UINT y = 0; y < Height; y++) {
+						for (UINT x = 0; x < Width; x++) {
+							UINT dx = (rot == 0) ? Height - 1 - y : y;
+							UINT dy = (rot == 0) ? x : Width - 1 - x;
+							UINT32 Pixel = src[y * Width + x];
+							UINT32 expected = bSwap ? ReferenceSwap(Pixel) : Pixel;
+							if (dst[dy * Height + dx] != expected) {
+								printf("CopyRectTiled32 %ux%u rot=%u swap=%u: source (%u, %u) wrong\n",
+									Width, Height, rot ? 270 : 90, bSwap, x, y);
+								failures++;
+								y = Height;
+								break;
+							}
+						}
+					}
+					for (UINT i = Width * Height; i < 40 * 40; i++) {
+						CHECK(dst[i] == GUARD_VALUE);
+					}
+				}
+			}
+		}
+	}
+}
+
+int main(void)
+{
+	srand(1);
+	TestSwap();
+	TestCopyRow();
+	TestCopyRowReversed();
+	TestCopyRectTiled();
+
+	printf("bitops_rows_test: %s\n", failures ? "FAILED" : "passed");
+	return failures ? 1 : 0;
+}
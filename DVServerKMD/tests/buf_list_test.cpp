@@ -0,0 +1,173 @@
+/*
+ * Copyright (C) 2021 Intel Corporation
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+// Host checks of the vbuf free list in viogpu_buf_list.h: every buffer of
+// the allocation is handed out once, chains of them go back in one push,
+// and buffers taken and returned from several threads never get shared
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <atomic>
+#include <set>
+#include <thread>
+#include <vector>
+#include "win_types.h"
+#include "viogpu_buf_list.h"
+
+static int failures;
+
+// Like GPU_VBUFFER, the list entry comes first
+typedef struct _TEST_VBUFFER
+{
+	SLIST_ENTRY free_entry;
+	std::atomic<int> owners;
+	UINT index;
+} TEST_VBUFFER;
+
+#define NUM_BUFS 64
+
+static PBYTE AllocBufs(UINT stride, UINT count)
+{
+	PBYTE pBase = (PBYTE)aligned_alloc(MEMORY_ALLOCATION_ALIGNMENT, (SIZE_T)stride * count);
+
+	RtlZeroMemory(pBase, (SIZE_T)stride * count);
+	for (UINT i = 0; i < count; i++) {
+		((TEST_VBUFFER*)VBufAt(pBase, stride, i))->index = i;
+	}
+	return pBase;
+}
+
+static void TestStride(void)
+{
+	CHECK(VBufStride(1) == MEMORY_ALLOCATION_ALIGNMENT);
+	CHECK(VBufStride(MEMORY_ALLOCATION_ALIGNMENT) == MEMORY_ALLOCATION_ALIGNMENT);
+	CHECK(VBufStride(MEMORY_ALLOCATION_ALIGNMENT + 1) == 2 * MEMORY_ALLOCATION_ALIGNMENT);
+	CHECK(VBufStride(sizeof(TEST_VBUFFER)) >= sizeof(TEST_VBUFFER));
+}
+
+static void TestFillAndDrain(void)
+{
+	UINT stride = VBufStride(sizeof(TEST_VBUFFER) + 3);
+	PBYTE pBase = AllocBufs(stride, NUM_BUFS);
+	SLIST_HEADER head;
+	std::set<UINT> seen;
+	PSLIST_ENTRY pEntry;
+
+	InitializeSListHead(&head);
+	VBufListFill(&head, pBase, stride, NUM_BUFS);
+	CHECK(QueryDepthSList(&head) == NUM_BUFS);
+
+	while ((pEntry = InterlockedPopEntrySList(&head)) != NULL) {
+		TEST_VBUFFER* pBuf = (TEST_VBUFFER*)pEntry;
+		SIZE_T offset = (PBYTE)pBuf - pBase;
+
+		CHECK(offset % stride == 0);
+		CHECK(offset / stride == pBuf->index);
+		CHECK(((ULONG_PTR)pBuf % MEMORY_ALLOCATION_ALIGNMENT) == 0);
+		CHECK(seen.insert(pBuf->index).second);
+	}
+	CHECK(seen.size() == NUM_BUFS);
+	CHECK(QueryDepthSList(&head) == 0);
+	free(pBase);
+}
+
+// Batches of random size go back with one push each and come out again in
+// the order they were chained
+static void TestPushChain(void)
+{
+	UINT stride = VBufStride(sizeof(TEST_VBUFFER));
+	PBYTE pBase = AllocBufs(stride, NUM_BUFS);
+	SLIST_HEADER head;
+
+	InitializeSListHead(&head);
+	VBufListFill(&head, pBase, stride, NUM_BUFS);
+
+	for (int round = 0; round < 1000; round++) {
+		UINT count = (UINT)(rand() % NUM_BUFS);
+		std::vector<PVOID> bufs;
+
+		for (UINT i = 0; i < count; i++) {
+			bufs.push_back(InterlockedPopEntrySList(&head));
+		}
+		CHECK(QueryDepthSList(&head) == NUM_BUFS - count);
+
+		VBufListPushChain(&head, bufs.data(), count);
+		CHECK(QueryDepthSList(&head) == NUM_BUFS);
+		for (UINT i = 0; i < count; i++) {
+			CHECK(InterlockedPopEntrySList(&head) == bufs[i]);
+		}
+		VBufListPushChain(&head, bufs.data(), count);
+	}
+
+	// An empty chain leaves the list alone
+	VBufListPushChain(&head, NULL, 0);
+	CHECK(QueryDepthSList(&head) == NUM_BUFS);
+	free(pBase);
+}
+
+// Threads take up to a batch of buffers, check no one else holds them, and
+// return them one by one or as a chain
+static void TestConcurrent(void)
+{
+	UINT stride = VBufStride(sizeof(TEST_VBUFFER));
+	PBYTE pBase = AllocBufs(stride, NUM_BUFS);
+	SLIST_HEADER head;
+	std::atomic<int> shared(0);
+	std::vector<std::thread> threads;
+
+	InitializeSListHead(&head);
+	VBufListFill(&head, pBase, stride, NUM_BUFS);
+
+	for (int t = 0; t < 4; t++) {
+		threads.emplace_back([&head, &shared, t]() {
+			unsigned int seed = (unsigned int)t + 1;
+
+			for (int round = 0; round < 20000; round++) {
+				PVOID bufs[8];
+				UINT count = 0;
+				UINT want = (UINT)(rand_r(&seed) % 8) + 1;
+				PSLIST_ENTRY pEntry;
+
+				while (count < want && (pEntry = InterlockedPopEntrySList(&head)) != NULL) {
+					if (((TEST_VBUFFER*)pEntry)->owners.fetch_add(1) != 0)
+						shared++;
+					bufs[count++] = pEntry;
+				}
+				for (UINT i = 0; i < count; i++) {
+					((TEST_VBUFFER*)bufs[i])->owners.fetch_sub(1);
+				}
+				if (count == 1 || (round & 1)) {
+					for (UINT i = 0; i < count; i++) {
+						InterlockedPushEntrySList(&head, (PSLIST_ENTRY)bufs[i]);
+					}
+				}
+				else {
+					VBufListPushChain(&head, bufs, count);
+				}
+			}
+		});
+	}
+	for (auto& thread : threads) {
+		thread.join();
+	}
+
+	CHECK(shared == 0);
+	CHECK(QueryDepthSList(&head) == NUM_BUFS);
+	CHECK(InterlockedFlushSList(&head) != NULL);
+	CHECK(InterlockedPopEntrySList(&head) == NULL);
+	free(pBase);
+}
+
+int main(void)
+{
+	srand(1);
+	TestStride();
+	TestFillAndDrain();
+	TestPushChain();
+	TestConcurrent();
+
+	printf("buf_list_test: %s\n", failures ? "FAILED" : "passed");
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,188 @@
+/*
+ * Copyright (C) 2021 Intel Corporation
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+// Host checks of the damage rect merging in viogpu_damage_merge.h
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "win_types.h"
+#include "viogpu_damage_merge.h"
+
+static int failures;
+
+static RECT Rect(LONG left, LONG top, LONG right, LONG bottom)
+{
+	RECT rect = { left, top, right, bottom };
+	return rect;
+}
+
+static bool SameRect(const RECT& a, const RECT& b)
+{
+	return a.left == b.left && a.top == b.top && a.right == b.right && a.bottom == b.bottom;
+}
+
+static BOOLEAN Merge(RECT a, RECT b, PRECT pMerged)
+{
+	return ShouldMerge(&a, &b, pMerged);
+}
+
+static BOOLEAN Add(PDAMAGE_REGION pRegion, RECT rect)
+{
+	return AddDamageRect(pRegion, &rect);
+}
+
+static void TestClip(void)
+{
+	RECT rect = Rect(-10, -10, 50, 50);
+	CHECK(ClipRect(&rect, 40, 30));
+	CHECK(SameRect(rect, Rect(0, 0, 40, 30)));
+
+	rect = Rect(40, 0, 60, 10);
+	CHECK(!ClipRect(&rect, 40, 30));
+
+	rect = Rect(5, 5, 5, 10);
+	CHECK(!ClipRect(&rect, 40, 30));
+}
+
+static void TestShouldMerge(void)
+{
+	RECT merged;
+
+	// Touching rects waste nothing
+	CHECK(Merge(Rect(0, 0, 10, 10), Rect(10, 0, 20, 10), &merged));
+	CHECK(SameRect(merged, Rect(0, 0, 20, 10)));
+
+	// Small rects may pull in up to DAMAGE_MERGE_SLACK_PIXELS: 900 wasted
+	CHECK(Merge(Rect(0, 0, 10, 10), Rect(100, 0, 110, 10), &merged));
+	CHECK(SameRect(merged, Rect(0, 0, 110, 10)));
+
+	// 10x10 at opposite corners of a 510x510 box
+	CHECK(!Merge(Rect(0, 0, 10, 10), Rect(500, 500, 510, 510), &merged));
+
+	// Large rects may waste a quarter of the box: 20000 of 100000 merges,
+	// 40000 of 120000 does not
+	CHECK(Merge(Rect(0, 0, 200, 200), Rect(300, 0, 500, 200), &merged));
+	CHECK(SameRect(merged, Rect(0, 0, 500, 200)));
+	CHECK(!Merge(Rect(0, 0, 200, 200), Rect(400, 0, 600, 200), &merged));
+
+	// Exactly a quarter still merges, one more column of waste does not
+	CHECK(Merge(Rect(0, 0, 400, 100), Rect(0, 100, 200, 200), &merged));
+	CHECK(SameRect(merged, Rect(0, 0, 400, 200)));
+	CHECK(!Merge(Rect(0, 0, 400, 100), Rect(0, 100, 199, 200), &merged));
+
+	// Overlap is only counted once
+	CHECK(Merge(Rect(0, 0, 200, 200), Rect(100, 100, 300, 300), &merged));
+	CHECK(!Merge(Rect(0, 0, 200, 200), Rect(150, 150, 400, 400), &merged));
+}
+
+static void TestAddCascade(void)
+{
+	DAMAGE_REGION region = {};
+
+	CHECK(Add(&region, Rect(0, 0, 100, 100)));
+	CHECK(Add(&region, Rect(300, 0, 400, 100)));
+	CHECK(region.NumRects == 2);
+
+	// Bridges the two: merges with the first, then the grown rect with the
+	// second
+	CHECK(Add(&region, Rect(100, 0, 300, 100)));
+	CHECK(region.NumRects == 1);
+	CHECK(SameRect(region.Rects[0], Rect(0, 0, 400, 100)));
+}
+
+static void TestAddOverflow(void)
+{
+	DAMAGE_REGION region = {};
+
+	for (LONG i = 0; i < MAX_DAMAGE_REGION_RECTS; i++) {
+		LONG x = (i % 4) * 1000;
+		LONG y = (i / 4) * 1000;
+		CHECK(Add(&region, Rect(x, y, x + 10, y + 10)));
+	}
+	CHECK(region.NumRects == MAX_DAMAGE_REGION_RECTS);
+	CHECK(!Add(&region, Rect(5000, 5000, 5010, 5010)));
+	CHECK(region.NumRects == MAX_DAMAGE_REGION_RECTS);
+
+	// A rect that merges still fits
+	CHECK(Add(&region, Rect(10, 0, 20, 10)));
+	CHECK(region.NumRects == MAX_DAMAGE_REGION_RECTS);
+}
+
+static void TestMostlyDamaged(void)
+{
+	DAMAGE_REGION region = {};
+
+	CHECK(!IsMostlyDamaged(&region, 1920, 1080));
+
+	// 1440 of 1920 columns is exactly 75 percent
+	region.NumRects = 1;
+	region.Rects[0] = Rect(0, 0, 1439, 1080);
+	CHECK(!IsMostlyDamaged(&region, 1920, 1080));
+	region.Rects[0] = Rect(0, 0, 1440, 1080);
+	CHECK(IsMostlyDamaged(&region, 1920, 1080));
+}
+
+// Whatever the merging does, every damaged pixel stays covered, nothing
+// leaves the screen and the rect count stays bounded
+static void TestRandomCoverage(void)
+{
+	const UINT Width = 256, Height = 192;
+	static bool damaged[192][256], covered[192][256];
+
+	srand(1);
+	for (int iter = 0; iter < 2000; iter++) {
+		DAMAGE_REGION region = {};
+		int count = 1 + rand() % 24;
+		bool fits = true;
+
+		memset(damaged, 0, sizeof(damaged));
+		memset(covered, 0, sizeof(covered));
+		for (int i = 0; i < count && fits; i++) {
+			LONG left = rand() % (Width + 40) - 20;
+			LONG top = rand() % (Height + 40) - 20;
+			RECT rect = Rect(left, top, left + 1 + rand() % 64, top + 1 + rand() % 64);
+
+			if (!ClipRect(&rect, Width, Height))
+				continue;
+			for (LONG y = rect.top; y < rect.bottom; y++)
+				for (LONG x = rect.left; x < rect.right; x++)
+					damaged[y][x] = true;
+			fits = AddDamageRect(&region, &rect);
+		}
+		if (!fits)
+			continue;
+
+		CHECK(region.NumRects <= MAX_DAMAGE_REGION_RECTS);
+		for (ULONG i = 0; i < region.NumRects; i++) {
+			const RECT* pRect = &region.Rects[i];
+			CHECK(pRect->left >= 0 && pRect->top >= 0);
+			CHECK(pRect->right <= (LONG)Width && pRect->bottom <= (LONG)Height);
+			CHECK(pRect->left < pRect->right && pRect->top < pRect->bottom);
+			for (LONG y = pRect->top; y < pRect->bottom; y++)
+				for (LONG x = pRect->left; x < pRect->right; x++)
+					covered[y][x] = true;
+		}
+		for (UINT y = 0; y < Height; y++)
+			for (UINT x = 0; x < Width; x++)
+				if (damaged[y][x] && !covered[y][x]) {
+					CHECK(!"damaged pixel left out");
+					y = Height;
+					break;
+				}
+	}
+}
+
+int main(void)
+{
+	TestClip();
+	TestShouldMerge();
+	TestAddCascade();
+	TestAddOverflow();
+	TestMostlyDamaged();
+	TestRandomCoverage();
+
+	printf("damage_merge_test: %s\n", failures ? "FAILED" : "passed");
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,166 @@
+/*
+ * Copyright (C) 2021 Intel Corporation
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+// Host checks of the framebuffer slot ring in viogpu_fb_slots.h: a new
+// frame fills a free slot and becomes the front once queued, the old front
+// retires only after the flush of its replacement, and a full ring drops
+// frames until a slot is reaped
+
+#include <stdio.h>
+#include "win_types.h"
+#include "viogpu_fb_slots.h"
+
+static int failures;
+
+// Stands in for the VioGpuObj the driver creates per slot
+static VioGpuObj* const OBJ = reinterpret_cast<VioGpuObj*>(0x1000);
+
+typedef struct _RING
+{
+	FRAMEBUFFER_SLOT Slots[4];
+	UINT Count;
+	UINT Front;
+	ULONGLONG Retired;
+} RING;
+
+static void InitRing(RING* pRing, UINT count)
+{
+	RtlZeroMemory(pRing, sizeof(*pRing));
+	pRing->Count = count;
+}
+
+static void Reap(RING* pRing)
+{
+	FrameBufUpdateFront(&pRing->Slots[pRing->Front], pRing->Retired);
+	for (UINT i = 0; i < pRing->Count; i++) {
+		if (FrameBufCanReap(&pRing->Slots[i], pRing->Retired)) {
+			pRing->Slots[i].pObj = NULL;
+			pRing->Slots[i].State = FrameBufState::Free;
+		}
+	}
+}
+
+// What SetCurrentModeExt does for a new frame, FALSE when it was dropped
+static BOOLEAN Present(RING* pRing, ULONGLONG fence_id)
+{
+	UINT back;
+
+	Reap(pRing);
+	back = FrameBufBackIndex(pRing->Slots, pRing->Count, pRing->Front);
+	if (back >= pRing->Count)
+		return FALSE;
+
+	pRing->Slots[back].pObj = OBJ;
+	FrameBufQueue(&pRing->Slots[back], fence_id);
+	pRing->Front = FrameBufSwap(pRing->Slots, pRing->Count, pRing->Front, back);
+	return TRUE;
+}
+
+static UINT CountState(const RING* pRing, FrameBufState state)
+{
+	UINT n = 0;
+
+	for (UINT i = 0; i < pRing->Count; i++) {
+		if (pRing->Slots[i].State == state)
+			n++;
+	}
+	return n;
+}
+
+static void TestFirstFrame(void)
+{
+	RING ring;
+
+	InitRing(&ring, 2);
+	CHECK(Present(&ring, 1));
+	CHECK(ring.Front == 1);
+	CHECK(ring.Slots[1].State == FrameBufState::Queued);
+	// The empty slot it replaced is free again right away
+	CHECK(ring.Slots[0].State == FrameBufState::Free);
+
+	ring.Retired = 1;
+	Reap(&ring);
+	CHECK(ring.Slots[1].State == FrameBufState::ScanningOut);
+}
+
+// The queued back slot is no longer Free, so the swap has to be told which
+// slot was filled rather than look it up again
+static void TestSwapTakesFilledSlot(void)
+{
+	RING ring;
+
+	InitRing(&ring, 2);
+	CHECK(Present(&ring, 1));
+	ring.Retired = 1;
+	CHECK(Present(&ring, 2));
+	CHECK(ring.Front == 0);
+	CHECK(ring.Slots[0].State == FrameBufState::Queued);
+	CHECK(ring.Slots[1].State == FrameBufState::Retiring);
+	CHECK(ring.Slots[1].Fence == 2);
+}
+
+static void TestRetiringWaitsForReplacement(void)
+{
+	RING ring;
+
+	InitRing(&ring, 2);
+	CHECK(Present(&ring, 1));
+	CHECK(Present(&ring, 2));
+
+	// Both slots busy until fence 2 retires
+	CHECK(!Present(&ring, 3));
+	ring.Retired = 1;
+	CHECK(!Present(&ring, 3));
+	CHECK(ring.Slots[1].State == FrameBufState::Retiring);
+
+	ring.Retired = 2;
+	CHECK(Present(&ring, 3));
+	CHECK(ring.Front == 1);
+	CHECK(ring.Slots[0].State == FrameBufState::Retiring);
+}
+
+// Deeper rings keep presenting while the host lags a frame behind
+static void TestDeepRing(void)
+{
+	RING ring;
+	UINT dropped = 0;
+
+	InitRing(&ring, 3);
+	for (ULONGLONG fence = 1; fence <= 100; fence++) {
+		ring.Retired = (fence > 2) ? fence - 2 : 0;
+		if (!Present(&ring, fence))
+			dropped++;
+
+		CHECK(ring.Slots[ring.Front].pObj == OBJ);
+		CHECK(CountState(&ring, FrameBufState::Queued) + CountState(&ring, FrameBufState::ScanningOut) == 1);
+		for (UINT i = 0; i < ring.Count; i++) {
+			CHECK(ring.Slots[i].State == FrameBufState::Free || ring.Slots[i].pObj == OBJ);
+		}
+	}
+	CHECK(dropped == 0);
+}
+
+static void TestBadBack(void)
+{
+	RING ring;
+
+	InitRing(&ring, 2);
+	CHECK(Present(&ring, 1));
+	CHECK(FrameBufSwap(ring.Slots, ring.Count, ring.Front, ring.Count) == ring.Front);
+	CHECK(FrameBufSwap(ring.Slots, ring.Count, ring.Front, ring.Front) == ring.Front);
+	CHECK(ring.Slots[ring.Front].State == FrameBufState::Queued);
+}
+
+int main(void)
+{
+	TestFirstFrame();
+	TestSwapTakesFilledSlot();
+	TestRetiringWaitsForReplacement();
+	TestDeepRing();
+	TestBadBack();
+
+	printf("fb_slots_test: %s\n", failures ? "FAILED" : "passed");
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,207 @@
+/*
+ * Copyright (C) 2021 Intel Corporation
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+// Host checks of the fence retirement in viogpu_fence_tracker.h: a fence
+// never counts as retired while a present reserved at or below it is
+// pending, whatever retires above it, and everything retires once settled
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <iterator>
+#include <set>
+#include <vector>
+#include "win_types.h"
+#include "viogpu_fence_tracker.h"
+
+static int failures;
+
+// The worker runs 10 while 11 was replaced by 12 in the mailbox. Retiring
+// orphan 11 must not make 10 look retired before its flush did.
+static void TestOrphanBehindRunning(void)
+{
+	FENCE_TRACKER t;
+
+	FenceTrackerInit(&t);
+	CHECK(FenceTrackerReserve(&t, 10));
+	CHECK(FenceTrackerReserve(&t, 11));
+	CHECK(FenceTrackerReserve(&t, 12));
+	FenceTrackerRelease(&t, 11, 0);
+	CHECK(t.Retired == 9);
+
+	FenceTrackerMarkFlushed(&t, 10);
+	FenceTrackerRetire(&t, 10, 0);
+	CHECK(t.Retired == 11);
+
+	FenceTrackerMarkFlushed(&t, 12);
+	FenceTrackerRetire(&t, 12, 0);
+	CHECK(t.Retired == 12);
+	CHECK(t.NumReserved == 0);
+}
+
+// The running present drops its frame instead
+static void TestOrphanBehindDropped(void)
+{
+	FENCE_TRACKER t;
+
+	FenceTrackerInit(&t);
+	CHECK(FenceTrackerReserve(&t, 10));
+	CHECK(FenceTrackerReserve(&t, 11));
+	FenceTrackerRelease(&t, 11, 0);
+	CHECK(t.Retired == 9);
+	FenceTrackerRelease(&t, 10, 0);
+	CHECK(t.Retired == 11);
+}
+
+// A mode set flush takes 6 while the present holding 5 waits in the
+// mailbox, and the host completes 6 first
+static void TestFreshFlushOvertakes(void)
+{
+	FENCE_TRACKER t;
+
+	FenceTrackerInit(&t);
+	CHECK(FenceTrackerReserve(&t, 5));
+	FenceTrackerRetire(&t, 6, 0);
+	CHECK(t.Retired == 4);
+	CHECK(t.Held == 6);
+
+	FenceTrackerMarkFlushed(&t, 5);
+	FenceTrackerRetire(&t, 5, 0);
+	CHECK(t.Retired == 6);
+	CHECK(t.Held == 0);
+}
+
+// A released fence waits for the flushes queued before it
+static void TestOrphanWaitsForFlushes(void)
+{
+	FENCE_TRACKER t;
+
+	FenceTrackerInit(&t);
+	FenceTrackerRelease(&t, 7, 1);
+	CHECK(t.Retired == 0);
+	FenceTrackerRetire(&t, 6, 0);
+	CHECK(t.Retired == 7);
+	CHECK(t.Orphan == 0);
+}
+
+// A reset loses the flushes in flight but not the presents still queued
+static void TestRetireAll(void)
+{
+	FENCE_TRACKER t;
+
+	FenceTrackerInit(&t);
+	CHECK(FenceTrackerReserve(&t, 3));
+	CHECK(FenceTrackerReserve(&t, 4));
+	FenceTrackerMarkFlushed(&t, 3);
+	FenceTrackerRetireAll(&t, 3);
+	CHECK(t.Retired == 3);
+	CHECK(t.NumReserved == 1);
+
+	FenceTrackerRelease(&t, 4, 0);
+	CHECK(t.Retired == 4);
+}
+
+static void TestFull(void)
+{
+	FENCE_TRACKER t;
+
+	FenceTrackerInit(&t);
+	for (ULONGLONG f = 1; f <= MAX_RESERVED_FENCES; f++) {
+		CHECK(FenceTrackerReserve(&t, f));
+	}
+	CHECK(!FenceTrackerReserve(&t, MAX_RESERVED_FENCES + 1));
+	FenceTrackerRelease(&t, 1, 0);
+	CHECK(FenceTrackerReserve(&t, MAX_RESERVED_FENCES + 1));
+}
+
+/*
+ * Random mix of presents reserving fences, flushes with fresh fences, and
+ * the host completing flushes in the order they were queued. Checks after
+ * every step that no pending reserved fence or flush in flight counts as
+ * retired and that Retired never goes back, and at the end that everything retired.
+ */
+static void TestRandom(void)
+{
+	for (int round = 0; round < 2000; round++) {
+		FENCE_TRACKER t;
+		ULONGLONG next = 1;
+		ULONGLONG last = 0;
+		std::set<ULONGLONG> pending;        // reserved, not flushed or released
+		std::vector<ULONGLONG> in_flight;   // flushes in queue order
+
+		FenceTrackerInit(&t);
+		for (int step = 0; step < 200; step++) {
+			int op = rand() % 5;
+
+			if (op == 0 && t.NumReserved < MAX_RESERVED_FENCES) {
+				CHECK(FenceTrackerReserve(&t, next));
+				pending.insert(next++);
+			}
+			else if (op == 1 && !pending.empty()) {
+				// The oldest pending present runs and flushes
+				ULONGLONG f = *pending.begin();
+				pending.erase(pending.begin());
+				FenceTrackerMarkFlushed(&t, f);
+				in_flight.push_back(f);
+			}
+			else if (op == 2 && !pending.empty()) {
+				// A pending present is replaced or dropped
+				auto it = pending.begin();
+				std::advance(it, rand() % pending.size());
+				ULONGLONG f = *it;
+				pending.erase(it);
+				FenceTrackerRelease(&t, f, (LONG)in_flight.size());
+			}
+			else if (op == 3) {
+				// A flush outside of a present
+				in_flight.push_back(next++);
+			}
+			else if (!in_flight.empty()) {
+				ULONGLONG f = in_flight.front();
+				in_flight.erase(in_flight.begin());
+				FenceTrackerRetire(&t, f, (LONG)in_flight.size());
+			}
+
+			CHECK(t.Retired >= last);
+			last = t.Retired;
+			for (ULONGLONG f : pending) {
+				CHECK(t.Retired < f);
+			}
+			for (ULONGLONG f : in_flight) {
+				CHECK(t.Retired < f);
+			}
+		}
+
+		while (!pending.empty()) {
+			ULONGLONG f = *pending.begin();
+			pending.erase(pending.begin());
+			FenceTrackerRelease(&t, f, (LONG)in_flight.size());
+		}
+		while (!in_flight.empty()) {
+			ULONGLONG f = in_flight.front();
+			in_flight.erase(in_flight.begin());
+			FenceTrackerRetire(&t, f, (LONG)in_flight.size());
+		}
+		CHECK(t.NumReserved == 0);
+		CHECK(next == 1 || t.Retired == next - 1);
+		if (failures) {
+			break;
+		}
+	}
+}
+
+int main(void)
+{
+	srand(1);
+	TestOrphanBehindRunning();
+	TestOrphanBehindDropped();
+	TestFreshFlushOvertakes();
+	TestOrphanWaitsForFlushes();
+	TestRetireAll();
+	TestFull();
+	TestRandom();
+
+	printf("fence_tracker_test: %s\n", failures ? "FAILED" : "passed");
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,123 @@
+/*
+ * Copyright (C) 2021 Intel Corporation
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+// Host checks of the VioGpuIdr bitmap in viogpu_idr_bitmap.h: next-fit
+// order, wrap round, exhaustion, and that threads racing to claim and free
+// indices never get the same one at once
+
+#include <stdio.h>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include "win_types.h"
+#include "viogpu_idr_bitmap.h"
+
+#define WORDS           4
+#define THREADS         4
+#define HELD            24
+#define ROUNDS          200000
+
+static int failures;
+
+static void TestOrder(void)
+{
+	volatile LONG words[2] = {};
+	ULONG index;
+
+	for (ULONG i = 0; i < 2 * IDR_BITS_PER_WORD; i++) {
+		CHECK(IdrClaimIndex(words, 2, 0, &index));
+		CHECK(index == i);
+	}
+	CHECK(!IdrClaimIndex(words, 2, 0, &index));
+	CHECK(!IdrClaimIndex(words, 2, 1, &index));
+
+	// A freed index comes back, wherever the search starts
+	CHECK(IdrReleaseIndex(words, 5));
+	CHECK(!IdrReleaseIndex(words, 5));
+	CHECK(IdrClaimIndex(words, 2, 1, &index));
+	CHECK(index == 5);
+}
+
+static void TestNextFit(void)
+{
+	volatile LONG words[3] = {};
+	ULONG index;
+
+	CHECK(IdrClaimIndex(words, 3, 1, &index));
+	CHECK(index == IDR_BITS_PER_WORD);
+	CHECK(IdrClaimIndex(words, 3, 4, &index));
+	CHECK(index == IDR_BITS_PER_WORD + 1);
+
+	// A full last word sends the search round to the first one
+	words[2] = (LONG)-1;
+	CHECK(IdrClaimIndex(words, 3, 2, &index));
+	CHECK(index == 0);
+
+	CHECK(!IdrSetIndex(words, 7));
+	CHECK(IdrSetIndex(words, 7));
+	CHECK(IdrReleaseIndex(words, 7));
+}
+
+static volatile LONG race_words[WORDS];
+static std::atomic<int> owners[WORDS * IDR_BITS_PER_WORD];
+static std::atomic<ULONG> cursor;
+static std::atomic<int> double_claims;
+static std::atomic<int> bad_releases;
+
+static void Racer(void)
+{
+	ULONG held[HELD];
+	ULONG count = 0;
+
+	for (ULONG r = 0; r < ROUNDS; r++) {
+		ULONG index;
+
+		if (count < HELD && IdrClaimIndex(race_words, WORDS, cursor++ % WORDS, &index)) {
+			if (owners[index].fetch_add(1) != 0)
+				double_claims++;
+			held[count++] = index;
+		}
+		if (count == HELD || (r & 1)) {
+			if (count == 0)
+				continue;
+			index = held[--count];
+			owners[index].fetch_sub(1);
+			if (!IdrReleaseIndex(race_words, index))
+				bad_releases++;
+		}
+	}
+	while (count) {
+		ULONG index = held[--count];
+		owners[index].fetch_sub(1);
+		if (!IdrReleaseIndex(race_words, index))
+			bad_releases++;
+	}
+}
+
+static void TestRace(void)
+{
+	std::vector<std::thread> threads;
+
+	for (int t = 0; t < THREADS; t++)
+		threads.emplace_back(Racer);
+	for (auto& t : threads)
+		t.join();
+
+	CHECK(double_claims == 0);
+	CHECK(bad_releases == 0);
+	for (ULONG w = 0; w < WORDS; w++) {
+		CHECK(race_words[w] == 0);
+	}
+}
+
+int main(void)
+{
+	TestOrder();
+	TestNextFit();
+	TestRace();
+
+	printf("idr_bitmap_test: %s\n", failures ? "FAILED" : "passed");
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,118 @@
+/*
+ * Copyright (C) 2021 Intel Corporation
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+// Host checks of the present mailbox in viogpu_present_mailbox.h: the
+// latest present wins, the one it replaces is handed back with its damage
+// carried over, and a present is only taken by its owner or the worker
+
+#include <stdio.h>
+#include "win_types.h"
+#include "viogpu_present_mailbox.h"
+
+static int failures;
+
+static PRESENT_WORK MakeWork(PresentKind Kind, ULONGLONG Fence, ULONG NumRects)
+{
+	PRESENT_WORK work;
+
+	RtlZeroMemory(&work, sizeof(work));
+	work.Kind = Kind;
+	work.Owner = (PVOID)0x1000;
+	work.Width = 640;
+	work.Height = 480;
+	work.Fence = Fence;
+	work.NumRects = NumRects;
+	for (ULONG i = 0; i < NumRects; i++) {
+		work.Rects[i] = { (LONG)(Fence * 10 + i), 0, (LONG)(Fence * 10 + i + 1), 1 };
+	}
+	return work;
+}
+
+static void TestLatestWins(void)
+{
+	PRESENT_MAILBOX box;
+	PRESENT_WORK a = MakeWork(PresentKind::Buffer, 1, 2);
+	PRESENT_WORK b = MakeWork(PresentKind::Buffer, 2, 3);
+	PRESENT_WORK old, taken;
+
+	PresentMailboxInit(&box);
+	CHECK(!PresentMailboxTake(&box, &taken, NULL));
+	CHECK(!PresentMailboxPost(&box, &a, &old));
+	CHECK(PresentMailboxPost(&box, &b, &old));
+	CHECK(old.Fence == 1);
+
+	// b carries its own rects first, then the ones of a
+	CHECK(PresentMailboxTake(&box, &taken, NULL));
+	CHECK(taken.Fence == 2);
+	CHECK(taken.NumRects == 5);
+	CHECK(taken.Rects[0].left == 20);
+	CHECK(taken.Rects[3].left == 10);
+	CHECK(taken.Rects[4].left == 11);
+	CHECK(!PresentMailboxTake(&box, &taken, NULL));
+}
+
+// Any mismatch turns the replacing present into a full frame update
+static void TestMergeFallsBackToFull(void)
+{
+	PRESENT_WORK full = MakeWork(PresentKind::Buffer, 1, 0);
+	PRESENT_WORK pool = MakeWork(PresentKind::Pool, 1, 2);
+	PRESENT_WORK resized = MakeWork(PresentKind::Buffer, 1, 2);
+	PRESENT_WORK many = MakeWork(PresentKind::Buffer, 1, MAX_DAMAGE_REGION_RECTS);
+	PRESENT_WORK work;
+
+	resized.Width = 800;
+
+	work = MakeWork(PresentKind::Buffer, 2, 2);
+	MergePresentDamage(&full, &work);
+	CHECK(work.NumRects == 0);
+
+	work = MakeWork(PresentKind::Buffer, 2, 2);
+	MergePresentDamage(&pool, &work);
+	CHECK(work.NumRects == 0);
+
+	work = MakeWork(PresentKind::Buffer, 2, 2);
+	MergePresentDamage(&resized, &work);
+	CHECK(work.NumRects == 0);
+
+	work = MakeWork(PresentKind::Buffer, 2, 1);
+	MergePresentDamage(&many, &work);
+	CHECK(work.NumRects == 0);
+
+	// A full update stays one whatever it replaces
+	work = MakeWork(PresentKind::Buffer, 2, 0);
+	MergePresentDamage(&pool, &work);
+	CHECK(work.NumRects == 0);
+
+	// Exactly filling the rect array still merges
+	work = MakeWork(PresentKind::Buffer, 2, 1);
+	many.NumRects = MAX_DAMAGE_REGION_RECTS - 1;
+	MergePresentDamage(&many, &work);
+	CHECK(work.NumRects == MAX_DAMAGE_REGION_RECTS);
+}
+
+static void TestOwner(void)
+{
+	PRESENT_MAILBOX box;
+	PRESENT_WORK a = MakeWork(PresentKind::Pool, 1, 1);
+	PRESENT_WORK old, taken;
+
+	PresentMailboxInit(&box);
+	PresentMailboxPost(&box, &a, &old);
+	CHECK(!PresentMailboxTake(&box, &taken, (PVOID)0x2000));
+	CHECK(box.bPending);
+	CHECK(PresentMailboxTake(&box, &taken, (PVOID)0x1000));
+	CHECK(taken.Fence == 1);
+	CHECK(!box.bPending);
+}
+
+int main(void)
+{
+	TestLatestWins();
+	TestMergeFallsBackToFull();
+	TestOwner();
+
+	printf("present_mailbox_test: %s\n", failures ? "FAILED" : "passed");
+	return failures ? 1 : 0;
+}
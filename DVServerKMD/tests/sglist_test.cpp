@@ -0,0 +1,128 @@
+/*
+ * Copyright (C) 2021 Intel Corporation
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+// Host checks of the SG list merging in viogpu_sglist.h: adjacent pages
+// share an element, anything else starts a new one, and no element length
+// wraps round
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "win_types.h"
+#include "viogpu_sglist.h"
+
+#define PAGE        0x1000
+#define MAX_PAGES   64
+
+static int failures;
+
+// Room for one element per page, as VioGpuMemSegment allocates it
+static PSCATTER_GATHER_LIST NewList(void)
+{
+	return (PSCATTER_GATHER_LIST)calloc(1, sizeof(SCATTER_GATHER_LIST) + MAX_PAGES * sizeof(SCATTER_GATHER_ELEMENT));
+}
+
+static void Append(PSCATTER_GATHER_LIST pSG, LONGLONG addr, ULONG length)
+{
+	PHYSICAL_ADDRESS pa;
+
+	pa.QuadPart = addr;
+	AppendSGElement(pSG, pa, length);
+}
+
+static void TestMerge(void)
+{
+	PSCATTER_GATHER_LIST sg = NewList();
+
+	for (LONGLONG i = 1; i <= 4; i++) {
+		Append(sg, i * PAGE, PAGE);
+	}
+	CHECK(sg->NumberOfElements == 1);
+	CHECK(sg->Elements[0].Address.QuadPart == PAGE);
+	CHECK(sg->Elements[0].Length == 4 * PAGE);
+	free(sg);
+}
+
+static void TestSplit(void)
+{
+	PSCATTER_GATHER_LIST sg = NewList();
+
+	// A gap, a page just below the last one, and one adjacent to an
+	// element other than the last all start a new element
+	Append(sg, 0x10000, PAGE);
+	Append(sg, 0x12000, PAGE);
+	Append(sg, 0x11000, PAGE);
+	Append(sg, 0x11000 + PAGE + PAGE, PAGE);
+	Append(sg, 0x13000 + PAGE, PAGE);
+	CHECK(sg->NumberOfElements == 4);
+	CHECK(sg->Elements[0].Address.QuadPart == 0x10000);
+	CHECK(sg->Elements[1].Address.QuadPart == 0x12000);
+	CHECK(sg->Elements[2].Address.QuadPart == 0x11000);
+	CHECK(sg->Elements[3].Address.QuadPart == 0x13000);
+	CHECK(sg->Elements[3].Length == 2 * PAGE);
+	free(sg);
+}
+
+static void TestOverflow(void)
+{
+	PSCATTER_GATHER_LIST sg = NewList();
+
+	Append(sg, 0, MAXULONG - 2 * PAGE + 1);
+	Append(sg, MAXULONG - 2 * PAGE + 1, PAGE);
+	CHECK(sg->NumberOfElements == 1);
+	CHECK(sg->Elements[0].Length == MAXULONG - PAGE + 1);
+
+	// One more page would wrap the length
+	Append(sg, MAXULONG - PAGE + 1, PAGE);
+	CHECK(sg->NumberOfElements == 2);
+	CHECK(sg->Elements[0].Length == MAXULONG - PAGE + 1);
+	CHECK(sg->Elements[1].Address.QuadPart == MAXULONG - PAGE + 1);
+	CHECK(sg->Elements[1].Length == PAGE);
+	free(sg);
+}
+
+// Random runs of pages, as FillSGList sees them from a scattered pool
+// allocation: one element per run and every page covered exactly once
+static void TestRandomRuns(void)
+{
+	for (int round = 0; round < 1000; round++) {
+		PSCATTER_GATHER_LIST sg = NewList();
+		LONGLONG pages[MAX_PAGES];
+		ULONG runs = 0;
+		UINT count = 1 + rand() % MAX_PAGES;
+
+		for (UINT i = 0; i < count; i++) {
+			if (i > 0 && rand() % 3) {
+				pages[i] = pages[i - 1] + PAGE;
+			}
+			else {
+				pages[i] = (LONGLONG)(rand() % 4096) * PAGE;
+			}
+			if (i == 0 || pages[i] != pages[i - 1] + PAGE)
+				runs++;
+			Append(sg, pages[i], PAGE);
+		}
+
+		CHECK(sg->NumberOfElements == runs);
+		UINT page = 0;
+		for (ULONG e = 0; e < sg->NumberOfElements && page < count; e++) {
+			CHECK(sg->Elements[e].Address.QuadPart == pages[page]);
+			page += sg->Elements[e].Length / PAGE;
+		}
+		CHECK(page == count);
+		free(sg);
+	}
+}
+
+int main(void)
+{
+	srand(1);
+	TestMerge();
+	TestSplit();
+	TestOverflow();
+	TestRandomRuns();
+
+	printf("sglist_test: %s\n", failures ? "FAILED" : "passed");
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,80 @@
+/*
+ * Copyright (C) 2021 Intel Corporation
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+// Host checks of the WaitForCompletion spin budget in viogpu_spin_budget.h:
+// it follows twice the wait latency, backs off to the minimum on a slow
+// host and stays within its bounds whatever the samples
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "win_types.h"
+#include "viogpu_spin_budget.h"
+
+#define MAXULONGLONG    (~(ULONGLONG)0)
+
+static int failures;
+
+static LONG Settle(LONG budget, ULONGLONG latency_us)
+{
+	for (int i = 0; i < 64; i++) {
+		budget = TuneSpinBudget(budget, latency_us);
+	}
+	return budget;
+}
+
+static void TestFollowsLatency(void)
+{
+	LONG budget;
+
+	// Integer steps of a quarter stop up to 3us short of the target
+	budget = Settle(WAIT_SPIN_DEFAULT_US, 30);
+	CHECK(budget >= 57 && budget <= 60);
+	budget = Settle(budget, 5);
+	CHECK(budget >= 10 && budget <= 13);
+
+	// A quarter of the way per wait, not all at once
+	budget = TuneSpinBudget(WAIT_SPIN_DEFAULT_US, 40);
+	CHECK(budget == WAIT_SPIN_DEFAULT_US + (80 - WAIT_SPIN_DEFAULT_US) / 4);
+}
+
+static void TestSlowHost(void)
+{
+	LONG budget;
+
+	// Just short enough to be covered by the largest budget
+	budget = Settle(WAIT_SPIN_DEFAULT_US, WAIT_SPIN_MAX_US / 2);
+	CHECK(budget >= WAIT_SPIN_MAX_US - 3 && budget <= WAIT_SPIN_MAX_US);
+
+	// Anything longer, timeouts included, backs off
+	budget = Settle(WAIT_SPIN_MAX_US, WAIT_SPIN_MAX_US / 2 + 1);
+	CHECK(budget <= WAIT_SPIN_MIN_US + 3);
+	budget = Settle(WAIT_SPIN_MAX_US, MAXULONGLONG);
+	CHECK(budget <= WAIT_SPIN_MIN_US + 3);
+	CHECK(budget >= WAIT_SPIN_MIN_US);
+}
+
+static void TestBounds(void)
+{
+	LONG budget = WAIT_SPIN_DEFAULT_US;
+
+	CHECK(TuneSpinBudget(WAIT_SPIN_MIN_US, 0) == WAIT_SPIN_MIN_US);
+	for (int i = 0; i < 100000; i++) {
+		ULONGLONG latency = (rand() % 4) ? (ULONGLONG)(rand() % 200) : MAXULONGLONG;
+
+		budget = TuneSpinBudget(budget, latency);
+		CHECK(budget >= WAIT_SPIN_MIN_US && budget <= WAIT_SPIN_MAX_US);
+	}
+}
+
+int main(void)
+{
+	srand(1);
+	TestFollowsLatency();
+	TestSlowHost();
+	TestBounds();
+
+	printf("spin_budget_test: %s\n", failures ? "FAILED" : "passed");
+	return failures ? 1 : 0;
+}
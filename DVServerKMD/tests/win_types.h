@@ -0,0 +1,196 @@
+/*
+ * Copyright (C) 2021 Intel Corporation
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#pragma once
+
+// The Windows base types the WDK-free driver headers expect, with the
+// widths they have on x64 Windows (LONG and ULONG stay 32 bit)
+#include <limits.h>
+#include <stdint.h>
+#include <string.h>
+
+typedef void VOID;
+typedef unsigned char BYTE;
+typedef unsigned char BOOLEAN;
+typedef unsigned char UCHAR;
+typedef unsigned int UINT;
+typedef uint32_t UINT32;
+typedef int32_t LONG;
+typedef uint32_t ULONG;
+typedef int64_t LONGLONG;
+typedef uint64_t ULONGLONG;
+typedef intptr_t LONG_PTR;
+typedef uintptr_t ULONG_PTR;
+typedef size_t SIZE_T;
+typedef void* PVOID;
+typedef BYTE* PBYTE;
+
+// Only ever handled as an opaque pointer
+typedef struct _KPROCESS* PEPROCESS;
+
+typedef struct _RECT
+{
+	LONG left;
+	LONG top;
+	LONG right;
+	LONG bottom;
+} RECT, * PRECT;
+
+typedef union _LARGE_INTEGER
+{
+	LONGLONG QuadPart;
+} LARGE_INTEGER, PHYSICAL_ADDRESS;
+
+// The WDK declares Elements as a one element array; here it is a flexible
+// one so the tests can index past the first element they make room for
+typedef struct _SCATTER_GATHER_ELEMENT
+{
+	PHYSICAL_ADDRESS Address;
+	ULONG Length;
+	ULONG_PTR Reserved;
+} SCATTER_GATHER_ELEMENT, * PSCATTER_GATHER_ELEMENT;
+
+typedef struct _SCATTER_GATHER_LIST
+{
+	ULONG NumberOfElements;
+	ULONG_PTR Reserved;
+	SCATTER_GATHER_ELEMENT Elements[];
+} SCATTER_GATHER_LIST, * PSCATTER_GATHER_LIST;
+
+#define TRUE 1
+#define FALSE 0
+#define CONST const
+#define MAXULONG 0xffffffffUL
+
+#define _In_
+#define _Out_
+#define _Inout_
+#define _In_reads_(size)
+
+#ifndef min
+#define min(a, b) (((a) < (b)) ? (a) : (b))
+#endif
+#ifndef max
+#define max(a, b) (((a) > (b)) ? (a) : (b))
+#endif
+
+#define RtlCopyMemory(Destination, Source, Length) memcpy((Destination), (Source), (Length))
+#define RtlZeroMemory(Destination, Length) memset((Destination), 0, (Length))
+
+#ifndef _MSC_VER
+#define __forceinline inline __attribute__((always_inline))
+
+// The interlocked intrinsics are full barriers, as they are on Windows
+static inline BOOLEAN InterlockedBitTestAndSet(volatile LONG* Base, LONG Offset)
+{
+	LONG mask = (LONG)(1U << Offset);
+	return (__atomic_fetch_or(Base, mask, __ATOMIC_SEQ_CST) & mask) != 0;
+}
+
+static inline BOOLEAN InterlockedBitTestAndReset(volatile LONG* Base, LONG Offset)
+{
+	LONG mask = (LONG)(1U << Offset);
+	return (__atomic_fetch_and(Base, ~mask, __ATOMIC_SEQ_CST) & mask) != 0;
+}
+
+// A stand-in for the SList calls that serializes them on a spin flag. It
+// keeps the LIFO order and the depth the driver relies on, not the
+// lock-free implementation of Windows.
+#define MEMORY_ALLOCATION_ALIGNMENT 16
+
+typedef struct _SLIST_ENTRY
+{
+	struct _SLIST_ENTRY* Next;
+} __attribute__((aligned(MEMORY_ALLOCATION_ALIGNMENT))) SLIST_ENTRY, * PSLIST_ENTRY;
+
+typedef struct _SLIST_HEADER
+{
+	PSLIST_ENTRY Next;
+	ULONG Depth;
+	volatile LONG Lock;
+} SLIST_HEADER, * PSLIST_HEADER;
+
+static inline void SListLock(PSLIST_HEADER ListHead)
+{
+	while (__atomic_exchange_n(&ListHead->Lock, 1, __ATOMIC_ACQUIRE))
+		;
+}
+
+static inline void SListUnlock(PSLIST_HEADER ListHead)
+{
+	__atomic_store_n(&ListHead->Lock, 0, __ATOMIC_RELEASE);
+}
+
+static inline void InitializeSListHead(PSLIST_HEADER ListHead)
+{
+	ListHead->Next = NULL;
+	ListHead->Depth = 0;
+	ListHead->Lock = 0;
+}
+
+static inline PSLIST_ENTRY InterlockedPushListSListEx(PSLIST_HEADER ListHead, PSLIST_ENTRY List, PSLIST_ENTRY ListEnd, ULONG Count)
+{
+	PSLIST_ENTRY first;
+
+	SListLock(ListHead);
+	first = ListHead->Next;
+	ListEnd->Next = first;
+	ListHead->Next = List;
+	ListHead->Depth += Count;
+	SListUnlock(ListHead);
+	return first;
+}
+
+static inline PSLIST_ENTRY InterlockedPushEntrySList(PSLIST_HEADER ListHead, PSLIST_ENTRY ListEntry)
+{
+	return InterlockedPushListSListEx(ListHead, ListEntry, ListEntry, 1);
+}
+
+static inline PSLIST_ENTRY InterlockedPopEntrySList(PSLIST_HEADER ListHead)
+{
+	PSLIST_ENTRY first;
+
+	SListLock(ListHead);
+	first = ListHead->Next;
+	if (first) {
+		ListHead->Next = first->Next;
+		ListHead->Depth--;
+	}
+	SListUnlock(ListHead);
+	return first;
+}
+
+static inline PSLIST_ENTRY InterlockedFlushSList(PSLIST_HEADER ListHead)
+{
+	PSLIST_ENTRY first;
+
+	SListLock(ListHead);
+	first = ListHead->Next;
+	ListHead->Next = NULL;
+	ListHead->Depth = 0;
+	SListUnlock(ListHead);
+	return first;
+}
+
+static inline ULONG QueryDepthSList(PSLIST_HEADER ListHead)
+{
+	return ListHead->Depth;
+}
+
+static inline BOOLEAN _BitScanForward(ULONG* Index, ULONG Mask)
+{
+	if (Mask == 0)
+		return FALSE;
+	*Index = (ULONG)__builtin_ctz(Mask);
+	return TRUE;
+}
+#endif
+
+#define CHECK(cond) \
+	do { \
+		if (!(cond)) { \
+			printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+			failures++; \
+		} \
+	} while (0)
@@ -0,0 +1,43 @@
+/*
+ * Copyright (C) 2021 Intel Corporation
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#pragma once
+
+// The free list behind VioGpuBuf. It uses no more than the Windows base
+// types and the SList calls, so the host tests in tests\ build it without
+// the WDK.
+//
+// The buffers sit stride bytes apart in one allocation and start with the
+// SLIST_ENTRY that links them, so handing one out or taking it back is a
+// single interlocked operation and a chain of them goes back with one.
+
+static inline UINT VBufStride(_In_ UINT size)
+{
+	return (size + MEMORY_ALLOCATION_ALIGNMENT - 1) & ~(UINT)(MEMORY_ALLOCATION_ALIGNMENT - 1);
+}
+
+static inline PVOID VBufAt(_In_ PBYTE pBase, _In_ UINT stride, _In_ UINT idx)
+{
+	return pBase + (SIZE_T)idx * stride;
+}
+
+static inline void VBufListFill(_Inout_ PSLIST_HEADER pHead, _In_ PBYTE pBase, _In_ UINT stride, _In_ UINT count)
+{
+	for (UINT i = 0; i < count; i++) {
+		InterlockedPushEntrySList(pHead, (PSLIST_ENTRY)VBufAt(pBase, stride, i));
+	}
+}
+
+// Links the buffers in order and returns them with one interlocked
+// operation
+static inline void VBufListPushChain(_Inout_ PSLIST_HEADER pHead, _In_reads_(count) PVOID const* ppBufs, _In_ UINT count)
+{
+	if (count == 0)
+		return;
+
+	for (UINT i = 0; i < count; i++) {
+		((PSLIST_ENTRY)ppBufs[i])->Next = (i + 1 < count) ? (PSLIST_ENTRY)ppBufs[i + 1] : NULL;
+	}
+	InterlockedPushListSListEx(pHead, (PSLIST_ENTRY)ppBufs[0], (PSLIST_ENTRY)ppBufs[count - 1], count);
+}
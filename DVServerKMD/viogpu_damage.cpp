@@ -0,0 +1,163 @@
+/*
+ * Copyright (C) 2021 Intel Corporation
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include "helper.h"
+#include "viogpu_damage.h"
+#include "Trace.h"
+#include <viogpu_damage.tmh>
+#if !DBG
+#include "viogpu_damage.tmh"
+#endif
+
+PAGED_CODE_SEG_BEGIN
+
+BOOLEAN FindUpdateRect(
+	_In_ ULONG             NumMoves,
+	_In_ D3DKMT_MOVE_RECT* pMoves,
+	_In_ ULONG             NumDirtyRects,
+	_In_ PRECT             pDirtyRect,
+	_In_ D3DKMDT_VIDPN_PRESENT_PATH_ROTATION Rotation,
+	_Out_ PRECT pUpdateRect)
+{
+	PAGED_CODE();
+	TRACING_HOT();
+	UNREFERENCED_PARAMETER(Rotation);
+	BOOLEAN updated = FALSE;
+	for (ULONG i = 0; i < NumMoves; i++)
+	{
+		PRECT  pRect = &pMoves[i].DestRect;
+		if (!updated)
+		{
+			*pUpdateRect = *pRect;
+			updated = TRUE;
+		}
+		else
+		{
+			pUpdateRect->bottom = max(pRect->bottom, pUpdateRect->bottom);
+			pUpdateRect->left = min(pRect->left, pUpdateRect->left);
+			pUpdateRect->right = max(pRect->right, pUpdateRect->right);
+			pUpdateRect->top = min(pRect->top, pUpdateRect->top);
+		}
+	}
+	for (ULONG i = 0; i < NumDirtyRects; i++)
+	{
+		PRECT  pRect = &pDirtyRect[i];
+		if (!updated)
+		{
+			*pUpdateRect = *pRect;
+			updated = TRUE;
+		}
+		else
+		{
+			pUpdateRect->bottom = max(pRect->bottom, pUpdateRect->bottom);
+			pUpdateRect->left = min(pRect->left, pUpdateRect->left);
+			pUpdateRect->right = max(pRect->right, pUpdateRect->right);
+			pUpdateRect->top = min(pRect->top, pUpdateRect->top);
+		}
+	}
+	if (Rotation == D3DKMDT_VPPR_ROTATE90 || Rotation == D3DKMDT_VPPR_ROTATE270)
+	{
+	}
+	return updated;
+}
+
+/*
+ * Clips the move destinations and dirty rects of a present to the screen
+ * and merges them into at most MAX_DAMAGE_REGION_RECTS rects. Falls back to
+ * the bounding box from FindUpdateRect when they don't fit, and to the full
+ * screen once most of it is damaged anyway. Returns FALSE when nothing
+ * inside the screen is damaged.
+ */
+BOOLEAN BuildDamageRegion(
+	_In_ ULONG             NumMoves,
+	_In_opt_ D3DKMT_MOVE_RECT* pMoves,
+	_In_ ULONG             NumDirtyRects,
+	_In_opt_ PRECT         pDirtyRect,
+	_In_ UINT              Width,
+	_In_ UINT              Height,
+	_Out_ PDAMAGE_REGION   pRegion)
+{
+	PAGED_CODE();
+	TRACING_HOT();
+
+	BOOLEAN fits = TRUE;
+	RECT rect;
+
+	pRegion->NumRects = 0;
+
+	if (!pMoves)
+		NumMoves = 0;
+	if (!pDirtyRect)
+		NumDirtyRects = 0;
+
+	for (ULONG i = 0; i < NumMoves && fits; i++) {
+		rect = pMoves[i].DestRect;
+		if (ClipRect(&rect, Width, Height))
+			fits = AddDamageRect(pRegion, &rect);
+	}
+
+	for (ULONG i = 0; i < NumDirtyRects && fits; i++) {
+		rect = pDirtyRect[i];
+		if (ClipRect(&rect, Width, Height))
+			fits = AddDamageRect(pRegion, &rect);
+	}
+
+	if (!fits) {
+		DBGPRINT("%d moves + %d dirty rects don't fit, using the bounding box\n", NumMoves, NumDirtyRects);
+		pRegion->NumRects = 0;
+		if (FindUpdateRect(NumMoves, pMoves, NumDirtyRects, pDirtyRect, D3DKMDT_VPPR_IDENTITY, &rect) &&
+			ClipRect(&rect, Width, Height)) {
+			pRegion->Rects[pRegion->NumRects++] = rect;
+		}
+	}
+
+	if (IsMostlyDamaged(pRegion, Width, Height)) {
+		SetFullDamageRegion(Width, Height, pRegion);
+	}
+
+	return (pRegion->NumRects != 0);
+}
+
+VOID SetFullDamageRegion(
+	_In_ UINT              Width,
+	_In_ UINT              Height,
+	_Out_ PDAMAGE_REGION   pRegion)
+{
+	PAGED_CODE();
+
+	pRegion->Rects[0].left = 0;
+	pRegion->Rects[0].top = 0;
+	pRegion->Rects[0].right = (LONG)Width;
+	pRegion->Rects[0].bottom = (LONG)Height;
+	pRegion->NumRects = 1;
+}
+
+/*
+ * Adds the rects of pSrc to pDst with the same merging as BuildDamageRegion.
+ * A NULL or empty pSrc stands for the full screen, as does pDst once the
+ * rects no longer fit.
+ */
+VOID AccumulateDamageRegion(
+	_In_opt_ const DAMAGE_REGION* pSrc,
+	_In_ UINT              Width,
+	_In_ UINT              Height,
+	_Inout_ PDAMAGE_REGION pDst)
+{
+	PAGED_CODE();
+
+	if (pSrc == NULL || pSrc->NumRects == 0) {
+		SetFullDamageRegion(Width, Height, pDst);
+		return;
+	}
+
+	for (ULONG i = 0; i < pSrc->NumRects; i++) {
+		if (!AddDamageRect(pDst, &pSrc->Rects[i])) {
+			SetFullDamageRegion(Width, Height, pDst);
+			return;
+		}
+	}
+}
+
+PAGED_CODE_SEG_END
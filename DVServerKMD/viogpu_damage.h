@@ -0,0 +1,35 @@
+/*
+ * Copyright (C) 2021 Intel Corporation
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#pragma once
+#include "helper.h"
+#include "viogpu_damage_merge.h"
+
+BOOLEAN FindUpdateRect(
+	_In_ ULONG             NumMoves,
+	_In_ D3DKMT_MOVE_RECT* pMoves,
+	_In_ ULONG             NumDirtyRects,
+	_In_ PRECT             pDirtyRect,
+	_In_ D3DKMDT_VIDPN_PRESENT_PATH_ROTATION Rotation,
+	_Out_ PRECT pUpdateRect);
+
+BOOLEAN BuildDamageRegion(
+	_In_ ULONG             NumMoves,
+	_In_opt_ D3DKMT_MOVE_RECT* pMoves,
+	_In_ ULONG             NumDirtyRects,
+	_In_opt_ PRECT         pDirtyRect,
+	_In_ UINT              Width,
+	_In_ UINT              Height,
+	_Out_ PDAMAGE_REGION   pRegion);
+
+VOID SetFullDamageRegion(
+	_In_ UINT              Width,
+	_In_ UINT              Height,
+	_Out_ PDAMAGE_REGION   pRegion);
+
+VOID AccumulateDamageRegion(
+	_In_opt_ const DAMAGE_REGION* pSrc,
+	_In_ UINT              Width,
+	_In_ UINT              Height,
+	_Inout_ PDAMAGE_REGION pDst);
@@ -0,0 +1,106 @@
+/*
+ * Copyright (C) 2021 Intel Corporation
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#pragma once
+
+// Rect merging behind BuildDamageRegion and AccumulateDamageRegion. It uses
+// no more than the Windows base types, so the host tests in tests\ build it
+// without the WDK.
+
+#define MAX_DAMAGE_REGION_RECTS    16
+// Extra pixels two rects may pull in when merged; a 64x64 tile is cheaper
+// to copy than a separate transfer/flush pair
+#define DAMAGE_MERGE_SLACK_PIXELS  (64 * 64)
+// Once this share (in percent) of the screen is damaged a single full
+// surface update is cheaper than a list of rects
+#define DAMAGE_FULL_THRESHOLD      75
+
+typedef struct _DAMAGE_REGION
+{
+	ULONG NumRects;
+	RECT Rects[MAX_DAMAGE_REGION_RECTS];
+} DAMAGE_REGION, * PDAMAGE_REGION;
+
+static inline LONG RectArea(_In_ const RECT* pRect)
+{
+	return (pRect->right - pRect->left) * (pRect->bottom - pRect->top);
+}
+
+static inline BOOLEAN ClipRect(_Inout_ PRECT pRect, _In_ UINT Width, _In_ UINT Height)
+{
+	pRect->left = max(pRect->left, 0L);
+	pRect->top = max(pRect->top, 0L);
+	pRect->right = min(pRect->right, (LONG)Width);
+	pRect->bottom = min(pRect->bottom, (LONG)Height);
+
+	return (pRect->left < pRect->right && pRect->top < pRect->bottom);
+}
+
+static inline VOID UnionRect(_In_ const RECT* pA, _In_ const RECT* pB, _Out_ PRECT pUnion)
+{
+	pUnion->left = min(pA->left, pB->left);
+	pUnion->top = min(pA->top, pB->top);
+	pUnion->right = max(pA->right, pB->right);
+	pUnion->bottom = max(pA->bottom, pB->bottom);
+}
+
+static inline LONG IntersectArea(_In_ const RECT* pA, _In_ const RECT* pB)
+{
+	LONG w = min(pA->right, pB->right) - max(pA->left, pB->left);
+	LONG h = min(pA->bottom, pB->bottom) - max(pA->top, pB->top);
+
+	return (w > 0 && h > 0) ? w * h : 0;
+}
+
+// Two rects are merged when their bounding box wastes no more than a
+// quarter of itself (or DAMAGE_MERGE_SLACK_PIXELS for small rects) on
+// pixels neither of them covers
+static inline BOOLEAN ShouldMerge(_In_ const RECT* pA, _In_ const RECT* pB, _Out_ PRECT pUnion)
+{
+	LONG covered, waste;
+
+	UnionRect(pA, pB, pUnion);
+	covered = RectArea(pA) + RectArea(pB) - IntersectArea(pA, pB);
+	waste = RectArea(pUnion) - covered;
+
+	return (waste <= max(RectArea(pUnion) / 4, (LONG)DAMAGE_MERGE_SLACK_PIXELS));
+}
+
+static inline BOOLEAN AddDamageRect(_Inout_ PDAMAGE_REGION pRegion, _In_ const RECT* pRect)
+{
+	RECT rect = *pRect;
+	RECT merged;
+	ULONG i = 0;
+
+	// Merging may make the grown rect overlap ones already checked, so
+	// start over after every merge
+	while (i < pRegion->NumRects) {
+		if (ShouldMerge(&pRegion->Rects[i], &rect, &merged)) {
+			rect = merged;
+			pRegion->Rects[i] = pRegion->Rects[--pRegion->NumRects];
+			i = 0;
+			continue;
+		}
+		i++;
+	}
+
+	if (pRegion->NumRects == MAX_DAMAGE_REGION_RECTS) {
+		return FALSE;
+	}
+
+	pRegion->Rects[pRegion->NumRects++] = rect;
+	return TRUE;
+}
+
+// Past DAMAGE_FULL_THRESHOLD of the screen one full update is cheaper
+static inline BOOLEAN IsMostlyDamaged(_In_ const DAMAGE_REGION* pRegion, _In_ UINT Width, _In_ UINT Height)
+{
+	LONG area = 0;
+
+	for (ULONG i = 0; i < pRegion->NumRects; i++) {
+		area += RectArea(&pRegion->Rects[i]);
+	}
+
+	return (area > 0 && (LONGLONG)area * 100 >= (LONGLONG)Width * Height * DAMAGE_FULL_THRESHOLD);
+}
@@ -0,0 +1,84 @@
+/*
+ * Copyright (C) 2021 Intel Corporation
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#pragma once
+
+// The framebuffer slot ring of a screen, behind the ScreenInfo framebuffer
+// methods. The caller holds the screen lock. It uses no more than the
+// Windows base types, so the host tests in tests\ build it without the WDK.
+//
+// A new frame fills the first Free slot after the front one and becomes
+// the front once queued. The old front is Retiring until the flush of the
+// new one retires, only then can the host stop reading it.
+
+class VioGpuObj;
+
+enum class FrameBufSlot : UINT {
+    Front = 0,
+    Back = 1,
+};
+
+enum class FrameBufState : UINT {
+	Free = 0,       // no resource, the next present may fill it
+	Queued,         // resource flushed, fence still pending
+	ScanningOut,    // fence retired, the host shows this slot
+	Retiring,       // replaced by a newer slot, destroyed once that one is on screen
+};
+
+typedef struct _FRAMEBUFFER_SLOT
+{
+	VioGpuObj* pObj;
+	FrameBufState State;
+	// Last flush of the slot, or for a Retiring slot the flush of the slot
+	// that replaced it
+	ULONGLONG Fence;
+} FRAMEBUFFER_SLOT;
+
+// First free slot after the front one, count when every slot is in use
+static inline UINT FrameBufBackIndex(_In_ const FRAMEBUFFER_SLOT* pSlots, _In_ UINT count, _In_ UINT front)
+{
+	for (UINT i = 1; i < count; i++) {
+		UINT index = (front + i) % count;
+		if (pSlots[index].State == FrameBufState::Free)
+			return index;
+	}
+	return count;
+}
+
+static inline void FrameBufQueue(_Inout_ FRAMEBUFFER_SLOT* pSlot, _In_ ULONGLONG fence_id)
+{
+	pSlot->State = FrameBufState::Queued;
+	pSlot->Fence = fence_id;
+}
+
+// Makes back, filled and queued, the front slot and returns its index. The
+// old front keeps its resource until the flush of back retires.
+static inline UINT FrameBufSwap(_Inout_ FRAMEBUFFER_SLOT* pSlots, _In_ UINT count, _In_ UINT front, _In_ UINT back)
+{
+	FRAMEBUFFER_SLOT* pFront = &pSlots[front];
+
+	if (back >= count || back == front)
+		return front;
+
+	if (pFront->pObj) {
+		pFront->State = FrameBufState::Retiring;
+		pFront->Fence = pSlots[back].Fence;
+	}
+	else {
+		pFront->State = FrameBufState::Free;
+	}
+	return back;
+}
+
+static inline void FrameBufUpdateFront(_Inout_ FRAMEBUFFER_SLOT* pFront, _In_ ULONGLONG retired)
+{
+	if (pFront->State == FrameBufState::Queued && pFront->Fence <= retired)
+		pFront->State = FrameBufState::ScanningOut;
+}
+
+// A Retiring slot whose replacement reached the host may be destroyed
+static inline BOOLEAN FrameBufCanReap(_In_ const FRAMEBUFFER_SLOT* pSlot, _In_ ULONGLONG retired)
+{
+	return pSlot->State == FrameBufState::Retiring && pSlot->Fence <= retired;
+}
@@ -0,0 +1,136 @@
+/*
+ * Copyright (C) 2021 Intel Corporation
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#pragma once
+
+// Flush fence retirement of a screen, behind ScreenInfo::RetireFence and
+// ReleaseFence. The caller serializes the calls. It uses no more than the
+// Windows base types, so the host tests in tests\ build it without the WDK.
+//
+// A present gets its fence when it is queued, so flushes issued while it
+// waits carry higher ids and may reach the host first. Retired says every
+// fence up to it is done, so it never moves past a reserved fence that is
+// still pending; a fence retiring above one is held until it settles.
+
+#define MAX_RESERVED_FENCES    16
+
+typedef struct _RESERVED_FENCE
+{
+	ULONGLONG Fence;
+	// Carried by a flush in flight, which a device reset loses
+	BOOLEAN Flushed;
+} RESERVED_FENCE;
+
+typedef struct _FENCE_TRACKER
+{
+	ULONGLONG Retired;
+	// Highest fence that retired above a pending reserved fence
+	ULONGLONG Held;
+	// Highest released fence, done once the flushes in flight are
+	ULONGLONG Orphan;
+	UINT NumReserved;
+	RESERVED_FENCE Reserved[MAX_RESERVED_FENCES];
+} FENCE_TRACKER, * PFENCE_TRACKER;
+
+static inline void FenceTrackerInit(_Out_ PFENCE_TRACKER pTracker)
+{
+	pTracker->Retired = 0;
+	pTracker->Held = 0;
+	pTracker->Orphan = 0;
+	pTracker->NumReserved = 0;
+}
+
+static inline void FenceTrackerAdvance(_Inout_ PFENCE_TRACKER pTracker, _In_ ULONGLONG fence_id)
+{
+	ULONGLONG limit;
+
+	fence_id = max(fence_id, pTracker->Held);
+	limit = fence_id;
+	for (UINT i = 0; i < pTracker->NumReserved; i++) {
+		if (pTracker->Reserved[i].Fence <= limit) {
+			limit = pTracker->Reserved[i].Fence - 1;
+		}
+	}
+	pTracker->Held = (limit < fence_id) ? fence_id : 0;
+	if (limit > pTracker->Retired) {
+		pTracker->Retired = limit;
+	}
+}
+
+static inline BOOLEAN FenceTrackerForget(_Inout_ PFENCE_TRACKER pTracker, _In_ ULONGLONG fence_id)
+{
+	for (UINT i = 0; i < pTracker->NumReserved; i++) {
+		if (pTracker->Reserved[i].Fence == fence_id) {
+			pTracker->Reserved[i] = pTracker->Reserved[--pTracker->NumReserved];
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+// Returns FALSE when too many presents are pending already
+static inline BOOLEAN FenceTrackerReserve(_Inout_ PFENCE_TRACKER pTracker, _In_ ULONGLONG fence_id)
+{
+	if (pTracker->NumReserved == MAX_RESERVED_FENCES) {
+		return FALSE;
+	}
+	pTracker->Reserved[pTracker->NumReserved].Fence = fence_id;
+	pTracker->Reserved[pTracker->NumReserved].Flushed = FALSE;
+	pTracker->NumReserved++;
+	return TRUE;
+}
+
+static inline void FenceTrackerMarkFlushed(_Inout_ PFENCE_TRACKER pTracker, _In_ ULONGLONG fence_id)
+{
+	for (UINT i = 0; i < pTracker->NumReserved; i++) {
+		if (pTracker->Reserved[i].Fence == fence_id) {
+			pTracker->Reserved[i].Flushed = TRUE;
+		}
+	}
+}
+
+// The flush carrying fence_id completed, in_flight flushes are left
+static inline void FenceTrackerRetire(_Inout_ PFENCE_TRACKER pTracker, _In_ ULONGLONG fence_id, _In_ LONG in_flight)
+{
+	FenceTrackerForget(pTracker, fence_id);
+	if (in_flight <= 0) {
+		fence_id = max(fence_id, pTracker->Orphan);
+		pTracker->Orphan = 0;
+	}
+	FenceTrackerAdvance(pTracker, fence_id);
+}
+
+// No flush is going to carry fence_id, its present was dropped or replaced.
+// Whoever waits on it only needs the flushes queued before it.
+static inline void FenceTrackerRelease(_Inout_ PFENCE_TRACKER pTracker, _In_ ULONGLONG fence_id, _In_ LONG in_flight)
+{
+	FenceTrackerForget(pTracker, fence_id);
+	pTracker->Orphan = max(pTracker->Orphan, fence_id);
+	if (in_flight <= 0) {
+		fence_id = pTracker->Orphan;
+		pTracker->Orphan = 0;
+		FenceTrackerAdvance(pTracker, fence_id);
+	}
+	else {
+		// Dropping a reserved fence may still free a held one
+		FenceTrackerAdvance(pTracker, 0);
+	}
+}
+
+// After a device reset nothing in flight is going to complete. Presents
+// not flushed yet keep their fences.
+static inline void FenceTrackerRetireAll(_Inout_ PFENCE_TRACKER pTracker, _In_ ULONGLONG last_submitted)
+{
+	for (UINT i = 0; i < pTracker->NumReserved;) {
+		if (pTracker->Reserved[i].Flushed) {
+			pTracker->Reserved[i] = pTracker->Reserved[--pTracker->NumReserved];
+		}
+		else {
+			i++;
+		}
+	}
+	last_submitted = max(last_submitted, pTracker->Orphan);
+	pTracker->Orphan = 0;
+	FenceTrackerAdvance(pTracker, last_submitted);
+}
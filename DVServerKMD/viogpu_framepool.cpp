@@ -0,0 +1,125 @@
+/*
+ * Copyright (C) 2021 Intel Corporation
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include "helper.h"
+#include "viogpu_framepool.h"
+#include "Trace.h"
+#include <viogpu_framepool.tmh>
+#if !DBG
+#include "viogpu_framepool.tmh"
+#endif
+
+PAGED_CODE_SEG_BEGIN
+
+VioGpuFramePool::VioGpuFramePool(void)
+{
+	PAGED_CODE();
+	TRACING();
+
+	for (UINT i = 0; i < MAX_FRAME_POOL_SLOTS; i++) {
+		m_Slots[i].pObj = NULL;
+		m_Slots[i].Fence = 0;
+		m_Slots[i].PendingDamage.NumRects = 0;
+	}
+	m_NumSlots = 0;
+	m_PoolId = 0;
+	m_Owner = NULL;
+	m_Width = 0;
+	m_Height = 0;
+	m_Pitch = 0;
+	m_Stride = 0;
+	m_Format = 0;
+	m_ScanoutSlot = FRAME_POOL_NO_SCANOUT;
+}
+
+VioGpuFramePool::~VioGpuFramePool(void)
+{
+	PAGED_CODE();
+	TRACING();
+
+	Close();
+}
+
+BOOLEAN VioGpuFramePool::Init(
+	_In_ ULONG PoolId,
+	_In_ PVOID Owner,
+	_In_ UINT NumSlots,
+	_In_reads_(NumSlots) PVOID* pSlotAddrs,
+	_In_ UINT Width,
+	_In_ UINT Height,
+	_In_ UINT Pitch,
+	_In_ UINT Stride,
+	_In_ UINT Format)
+{
+	PAGED_CODE();
+	TRACING();
+
+	UINT size = Pitch * Height;
+
+	ASSERT(!IsRegistered());
+	if (NumSlots == 0 || NumSlots > MAX_FRAME_POOL_SLOTS) {
+		ERR("Invalid number of slots %d\n", NumSlots);
+		return FALSE;
+	}
+
+	for (m_NumSlots = 0; m_NumSlots < NumSlots; m_NumSlots++) {
+		PFRAME_POOL_SLOT pSlot = &m_Slots[m_NumSlots];
+
+		if (!pSlot->Segment.InitExt(size, pSlotAddrs[m_NumSlots])) {
+			ERR("Failed to pin slot %d at %p\n", m_NumSlots, pSlotAddrs[m_NumSlots]);
+			Close();
+			return FALSE;
+		}
+
+		pSlot->Fence = 0;
+		// The host resource is created on first use and starts out empty
+		SetFullDamageRegion(Width, Height, &pSlot->PendingDamage);
+	}
+
+	m_PoolId = PoolId;
+	m_Owner = Owner;
+	m_Width = Width;
+	m_Height = Height;
+	m_Pitch = Pitch;
+	m_Stride = Stride;
+	m_Format = Format;
+	m_ScanoutSlot = FRAME_POOL_NO_SCANOUT;
+
+	DBGPRINT("Pool %d: %d slots of %dx%d, pitch = %d\n", PoolId, NumSlots, Width, Height, Pitch);
+	return TRUE;
+}
+
+// The host resources of the slots must be gone before the pages are unpinned
+void VioGpuFramePool::Close(void)
+{
+	PAGED_CODE();
+	TRACING();
+
+	for (UINT i = 0; i < m_NumSlots; i++) {
+		PFRAME_POOL_SLOT pSlot = &m_Slots[i];
+
+		ASSERT(pSlot->pObj == NULL);
+		pSlot->Fence = 0;
+		pSlot->PendingDamage.NumRects = 0;
+		pSlot->Segment.Close();
+	}
+
+	m_NumSlots = 0;
+	m_PoolId = 0;
+	m_Owner = NULL;
+	m_ScanoutSlot = FRAME_POOL_NO_SCANOUT;
+}
+
+// Every slot has to catch up on what changed, not just the one presented
+void VioGpuFramePool::AddDamage(_In_opt_ const DAMAGE_REGION* pDamage)
+{
+	PAGED_CODE();
+
+	for (UINT i = 0; i < m_NumSlots; i++) {
+		AccumulateDamageRegion(pDamage, m_Width, m_Height, &m_Slots[i].PendingDamage);
+	}
+}
+
+PAGED_CODE_SEG_END
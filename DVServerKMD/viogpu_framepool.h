@@ -0,0 +1,66 @@
+/*
+ * Copyright (C) 2021 Intel Corporation
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#pragma once
+#include "helper.h"
+
+// Same value as in Public.h, the UMD sizes its requests with it
+#define MAX_FRAME_POOL_SLOTS       4
+#define FRAME_POOL_NO_SCANOUT      ((UINT)-1)
+
+typedef struct _FRAME_POOL_SLOT
+{
+	// Its entries are built once at registration, so creating the host
+	// resource again (first present, device reset) needs no page table walk
+	VioGpuMemSegment Segment;
+	VioGpuObj* pObj;
+	ULONGLONG Fence;
+	// Everything that changed since the host copy of this slot was updated
+	DAMAGE_REGION PendingDamage;
+} FRAME_POOL_SLOT, * PFRAME_POOL_SLOT;
+
+/*
+ * A set of UMD staging buffers registered once per mode. The buffers stay
+ * pinned until the pool is closed, and presents refer to them by slot index.
+ */
+class VioGpuFramePool
+{
+public:
+	VioGpuFramePool(void);
+	~VioGpuFramePool(void);
+	BOOLEAN Init(_In_ ULONG PoolId,
+		_In_ PVOID Owner,
+		_In_ UINT NumSlots,
+		_In_reads_(NumSlots) PVOID* pSlotAddrs,
+		_In_ UINT Width,
+		_In_ UINT Height,
+		_In_ UINT Pitch,
+		_In_ UINT Stride,
+		_In_ UINT Format);
+	void Close(void);
+	BOOLEAN IsRegistered(void) { return (m_PoolId != 0); }
+	BOOLEAN IsPool(ULONG PoolId) { return (PoolId != 0 && PoolId == m_PoolId); }
+	PVOID GetOwner(void) { return m_Owner; }
+	UINT GetSlotCount(void) { return m_NumSlots; }
+	PFRAME_POOL_SLOT GetSlot(UINT idx) { return &m_Slots[idx]; }
+	UINT GetWidth(void) { return m_Width; }
+	UINT GetHeight(void) { return m_Height; }
+	UINT GetPitch(void) { return m_Pitch; }
+	UINT GetStride(void) { return m_Stride; }
+	UINT GetFormat(void) { return m_Format; }
+	UINT GetScanoutSlot(void) { return m_ScanoutSlot; }
+	void SetScanoutSlot(UINT idx) { m_ScanoutSlot = idx; }
+	void AddDamage(_In_opt_ const DAMAGE_REGION* pDamage);
+private:
+	FRAME_POOL_SLOT m_Slots[MAX_FRAME_POOL_SLOTS];
+	UINT m_NumSlots;
+	ULONG m_PoolId;
+	PVOID m_Owner;
+	UINT m_Width;
+	UINT m_Height;
+	UINT m_Pitch;
+	UINT m_Stride;
+	UINT m_Format;
+	UINT m_ScanoutSlot;
+};
@@ -38,8 +38,10 @@
 VioGpuIdr::VioGpuIdr()
 {
 	m_uStartIndex = 0;
-	m_IdBitMap.SizeOfBitMap = 0;
-	m_IdBitMap.Buffer = NULL;
+	m_pWords = NULL;
+	m_uWords = 0;
+	m_Cursor = 0;
+	m_pGenerations = NULL;
 }
 
 VioGpuIdr::~VioGpuIdr()
@@ -50,81 +52,91 @@ VioGpuIdr::~VioGpuIdr()
 BOOLEAN VioGpuIdr::Init(
 	_In_ ULONG start)
 {
-	PUCHAR buf = NULL;
-	BOOLEAN ret = FALSE;
+	VIOGPU_ASSERT(m_pWords == NULL);
+	VIOGPU_ASSERT(start < IDR_INDEX_COUNT);
+
 	m_uStartIndex = start;
-	ExInitializeFastMutex(&m_IdBitMapMutex);
-
-	VIOGPU_ASSERT(m_IdBitMap.Buffer == NULL);
-	Lock();
-	buf = new (NonPagedPoolNx) UCHAR[PAGE_SIZE];
-	if (buf) {
-		RtlInitializeBitMap(&m_IdBitMap,
-			(PULONG)buf,
-			CHAR_BIT * PAGE_SIZE);
-		RtlClearAllBits(&m_IdBitMap);
-		RtlSetBits(&m_IdBitMap, 0, m_uStartIndex);
-		ret = TRUE;
+	m_uWords = IDR_INDEX_COUNT / IDR_BITS_PER_WORD;
+	m_Cursor = 0;
+	m_pWords = new (NonPagedPoolNx) LONG[m_uWords];
+	m_pGenerations = new (NonPagedPoolNx) UCHAR[IDR_INDEX_COUNT];
+	if (!m_pWords || !m_pGenerations) {
+		ERR("Failed to allocate the id bitmap\n");
+		Close();
+		return FALSE;
 	}
-	Unlock();
-	return ret;
-}
-
-#pragma warning( disable: 28167 )
-//_IRQL_raises_(APC_LEVEL)
-//_IRQL_saves_global_(OldIrql, m_IdBitMapMutex)
-VOID VioGpuIdr::Lock(VOID)
-{
-	ExAcquireFastMutex(&m_IdBitMapMutex);
-}
 
-#pragma warning( disable: 28167 )
-//_IRQL_requires_(APC_LEVEL)
-//_IRQL_restores_global_(OldIrql, m_IdBitMapMutex)
-VOID VioGpuIdr::Unlock(VOID)
-{
-	ExReleaseFastMutex(&m_IdBitMapMutex);
+	RtlZeroMemory((PVOID)m_pWords, m_uWords * sizeof(LONG));
+	RtlZeroMemory(m_pGenerations, IDR_INDEX_COUNT);
+	for (ULONG i = 0; i < m_uStartIndex; i++) {
+		IdrSetIndex(m_pWords, i);
+	}
+	return TRUE;
 }
 
+/*
+ * Every call starts at the word after the one the previous call started
+ * at, so a freed index is only handed out again once the search went round
+ * the whole bitmap. Claiming a bit is a single interlocked operation, while
+ * the bitmap is sparse the first word tried nearly always has one clear.
+ */
 ULONG VioGpuIdr::GetId(VOID)
 {
 	ULONG id = 0;
-	Lock();
-	if (m_IdBitMap.Buffer != NULL)
-	{
-		id = RtlFindClearBitsAndSet(&m_IdBitMap, 1, 0);
+	ULONG index;
+
+	if (m_pWords == NULL)
+		return 0;
+
+	ULONG first = (ULONG)InterlockedIncrement(&m_Cursor) % m_uWords;
+
+	if (IdrClaimIndex(m_pWords, m_uWords, first, &index)) {
+		id = ((ULONG)m_pGenerations[index] << IDR_INDEX_BITS) | index;
+	}
+
+	if (id == 0) {
+		ERR("Out of resource ids\n");
 	}
-	Unlock();
 	DBGPRINT("id = %d\n", id);
-	ASSERT(id < USHORT_MAX);
 	return id;
 }
 
 VOID VioGpuIdr::PutId(ULONG id)
 {
-	ASSERT(id >= m_uStartIndex);
-	ASSERT(id <= (CHAR_BIT * PAGE_SIZE));
-	DBGPRINT("bit %d\n", id);
-	Lock();
-	if (m_IdBitMap.Buffer != NULL)
+	ULONG index = id & IDR_INDEX_MASK;
+	ULONG gen = id >> IDR_INDEX_BITS;
+
+	DBGPRINT("id %d\n", id);
+
+	if (m_pWords == NULL)
+		return;
+
+	if (index < m_uStartIndex || gen != m_pGenerations[index]) {
+		ERR("id %d is stale or was never handed out\n", id);
+		return;
+	}
+
+	// The new generation must be in place before the index can be claimed
+	// again, InterlockedBitTestAndReset orders the two
+	m_pGenerations[index] = (UCHAR)((gen + 1) & IDR_GENERATION_MASK);
+	if (!IdrReleaseIndex(m_pWords, index))
 	{
-		if (!RtlAreBitsSet(&m_IdBitMap, id, 1))
-		{
-			ERR("bit %d is not set\n", id - m_uStartIndex);
-		}
-		RtlClearBits(&m_IdBitMap, id, 1);
+		ERR("index %d is not set\n", index);
 	}
-	Unlock();
 }
 
 VOID VioGpuIdr::Close(VOID)
 {
-	Lock();
-	if (m_IdBitMap.Buffer != NULL)
+	if (m_pWords != NULL)
+	{
+		delete[] (LONG*)m_pWords;
+		m_pWords = NULL;
+	}
+	if (m_pGenerations != NULL)
 	{
-		delete[] m_IdBitMap.Buffer;
-		m_IdBitMap.Buffer = NULL;
+		delete[] m_pGenerations;
+		m_pGenerations = NULL;
 	}
+	m_uWords = 0;
 	m_uStartIndex = 0;
-	Unlock();
 }
@@ -28,6 +28,7 @@
  */
 #pragma once
 #include "helper.h"
+#include "viogpu_idr_bitmap.h"
 
 class VioGpuIdr
 {
@@ -39,10 +40,12 @@ public:
 	VOID PutId(_In_ ULONG id);
 private:
 	VOID Close(VOID);
-	VOID Lock(VOID);
-	VOID Unlock(VOID);
 private:
 	ULONG m_uStartIndex;
-	RTL_BITMAP m_IdBitMap;
-	FAST_MUTEX m_IdBitMapMutex;
+	// One bit per index, set while the index is in use
+	volatile LONG* m_pWords;
+	ULONG m_uWords;
+	// Word GetId starts searching at, advanced by every call
+	volatile LONG m_Cursor;
+	PUCHAR m_pGenerations;
 };
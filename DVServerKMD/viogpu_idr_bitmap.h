@@ -0,0 +1,55 @@
+/*
+ * Copyright (C) 2021 Intel Corporation
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#pragma once
+
+// The lock-free bitmap behind VioGpuIdr. It uses no more than the Windows
+// base types and interlocked intrinsics, so the host tests in tests\ build
+// it without the WDK.
+
+// An id is a bitmap index tagged with a generation in the bits above it.
+// The generation moves on each time the index is freed, so an id the host
+// still knows by is never handed out again as is. 0 disables the tags.
+#define IDR_INDEX_BITS         15
+#define IDR_INDEX_COUNT        (1UL << IDR_INDEX_BITS)
+#define IDR_INDEX_MASK         (IDR_INDEX_COUNT - 1)
+#define IDR_GENERATION_BITS    8
+#define IDR_GENERATION_MASK    ((1UL << IDR_GENERATION_BITS) - 1)
+#define IDR_BITS_PER_WORD      ((ULONG)(sizeof(LONG) * CHAR_BIT))
+
+// Claims the first clear bit, searching the words from first on and
+// wrapping round. Returns FALSE when every bit is set.
+static inline BOOLEAN IdrClaimIndex(
+	_Inout_ volatile LONG* pWords,
+	_In_ ULONG uWords,
+	_In_ ULONG first,
+	_Out_ ULONG* pIndex)
+{
+	for (ULONG n = 0; n < uWords; n++) {
+		ULONG w = (first + n) % uWords;
+		LONG word;
+
+		while ((word = pWords[w]) != (LONG)-1) {
+			ULONG bit;
+			_BitScanForward(&bit, ~(ULONG)word);
+			if (!InterlockedBitTestAndSet(&pWords[w], (LONG)bit)) {
+				*pIndex = w * IDR_BITS_PER_WORD + bit;
+				return TRUE;
+			}
+		}
+	}
+	return FALSE;
+}
+
+// Marks index as in use, returns whether it already was
+static inline BOOLEAN IdrSetIndex(_Inout_ volatile LONG* pWords, _In_ ULONG index)
+{
+	return InterlockedBitTestAndSet(&pWords[index / IDR_BITS_PER_WORD], (LONG)(index % IDR_BITS_PER_WORD));
+}
+
+// Frees index, returns whether it was in use
+static inline BOOLEAN IdrReleaseIndex(_Inout_ volatile LONG* pWords, _In_ ULONG index)
+{
+	return InterlockedBitTestAndReset(&pWords[index / IDR_BITS_PER_WORD], (LONG)(index % IDR_BITS_PER_WORD));
+}
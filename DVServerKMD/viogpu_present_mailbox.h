@@ -0,0 +1,101 @@
+/*
+ * Copyright (C) 2021 Intel Corporation
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#pragma once
+
+// The present mailbox of a screen, behind ScreenInfo::PostPresent and
+// TakePresent. The caller holds the lock. It uses no more than the Windows
+// base types, so the host tests in tests\ build it without the WDK.
+
+#include "viogpu_damage_merge.h"
+
+enum class PresentKind : UINT {
+	Buffer = 0,     // zero-copy present of a UMD buffer
+	Pool,           // present of a registered frame pool slot
+};
+
+// A present waiting for the worker thread of its screen. The mailbox keeps
+// only the latest one, a newer present takes over the damage of the one it
+// replaces
+typedef struct _PRESENT_WORK
+{
+	PresentKind Kind;
+	PVOID Owner;            // file object the present came through
+	PEPROCESS Process;      // referenced, the address space Addr lives in
+	PVOID Addr;
+	UINT BytesPerPixel;
+	LONG Pitch;
+	UINT Width;
+	UINT Height;
+	UINT Stride;
+	ULONG PoolId;
+	UINT Slot;
+	// No rects means the whole frame changed
+	ULONG NumRects;
+	RECT Rects[MAX_DAMAGE_REGION_RECTS];
+	// Reserved when queued and carried by the fenced flush of the present
+	ULONGLONG Fence;
+	// VioGpuStats::NowUs() when the present IOCTL came in
+	ULONGLONG EntryUs;
+} PRESENT_WORK;
+
+typedef struct _PRESENT_MAILBOX
+{
+	PRESENT_WORK Pending;
+	BOOLEAN bPending;
+} PRESENT_MAILBOX, * PPRESENT_MAILBOX;
+
+static inline void PresentMailboxInit(_Out_ PPRESENT_MAILBOX pBox)
+{
+	RtlZeroMemory(&pBox->Pending, sizeof(PRESENT_WORK));
+	pBox->bPending = FALSE;
+}
+
+// The replaced present never reaches the host, so its damage moves to the
+// one that replaces it
+static inline void MergePresentDamage(_In_ const PRESENT_WORK* pOld, _Inout_ PRESENT_WORK* pNew)
+{
+	if (pNew->NumRects == 0)
+		return;
+
+	if (pOld->NumRects == 0 ||
+		pOld->Kind != pNew->Kind ||
+		pOld->PoolId != pNew->PoolId ||
+		pOld->Width != pNew->Width ||
+		pOld->Height != pNew->Height ||
+		pOld->NumRects + pNew->NumRects > MAX_DAMAGE_REGION_RECTS) {
+		pNew->NumRects = 0;
+		return;
+	}
+
+	RtlCopyMemory(&pNew->Rects[pNew->NumRects], pOld->Rects, pOld->NumRects * sizeof(RECT));
+	pNew->NumRects += pOld->NumRects;
+}
+
+// Returns TRUE when pWork replaced a present the worker had not picked up
+// yet, that one is handed back in pOld
+static inline BOOLEAN PresentMailboxPost(_Inout_ PPRESENT_MAILBOX pBox, _Inout_ PRESENT_WORK* pWork, _Out_ PRESENT_WORK* pOld)
+{
+	BOOLEAN bReplaced = pBox->bPending;
+
+	if (bReplaced) {
+		RtlCopyMemory(pOld, &pBox->Pending, sizeof(PRESENT_WORK));
+		MergePresentDamage(pOld, pWork);
+	}
+	RtlCopyMemory(&pBox->Pending, pWork, sizeof(PRESENT_WORK));
+	pBox->bPending = TRUE;
+	return bReplaced;
+}
+
+// A NULL Owner takes the pending present whoever queued it
+static inline BOOLEAN PresentMailboxTake(_Inout_ PPRESENT_MAILBOX pBox, _Out_ PRESENT_WORK* pWork, _In_ PVOID Owner)
+{
+	BOOLEAN bTaken = pBox->bPending && (Owner == NULL || pBox->Pending.Owner == Owner);
+
+	if (bTaken) {
+		RtlCopyMemory(pWork, &pBox->Pending, sizeof(PRESENT_WORK));
+		pBox->bPending = FALSE;
+	}
+	return bTaken;
+}
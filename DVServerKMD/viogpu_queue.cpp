@@ -30,6 +30,7 @@
 
 #include "helper.h"
 #include "baseobj.h"
+#include "viogpu_sglist.h"
 #include "Trace.h"
 #include "viogpu_queue.tmh"
 
@@ -45,13 +46,42 @@ static BOOLEAN BuildSGElement(VirtIOBufferDescriptor* sg, PVOID buf, ULONG size)
 	return FALSE;
 }
 
+static VOID ReferenceMemEntries(PGPU_MEM_ENTRIES pEnts)
+{
+	InterlockedIncrement(&pEnts->RefCount);
+}
+
+// The last reference goes either with the segment or with the completion
+// of the last command sent with the entries
+static VOID ReleaseMemEntries(PGPU_MEM_ENTRIES pEnts)
+{
+	if (InterlockedDecrement(&pEnts->RefCount) == 0) {
+		delete[] reinterpret_cast<PBYTE>(pEnts);
+	}
+}
+
+// Hands the entries to the host without a copy
+static VOID SetDataEntries(PGPU_VBUFFER vbuf, PGPU_MEM_ENTRIES pEnts)
+{
+	ReferenceMemEntries(pEnts);
+	vbuf->data_ents = pEnts;
+	vbuf->data_buf = pEnts->Entries;
+	vbuf->data_size = sizeof(GPU_MEM_ENTRY) * pEnts->NumEntries;
+}
+
 VioGpuQueue::VioGpuQueue()
 {
 	m_pBuf = NULL;
 	m_Index = (UINT)-1;
 	m_pVIODevice = NULL;
 	m_pVirtQueue = NULL;
+	m_bIndirect = FALSE;
 	KeInitializeSpinLock(&m_SpinLock);
+	m_pfnPoll = NULL;
+	m_PollContext = NULL;
+	m_SpinBudgetUs = WAIT_SPIN_DEFAULT_US;
+	m_WaitSpinHits = 0;
+	m_WaitSleeps = 0;
 }
 
 VioGpuQueue::~VioGpuQueue()
@@ -77,10 +107,45 @@ BOOLEAN  VioGpuQueue::Init(
 	m_pVIODevice = pVIODevice;
 	m_pVirtQueue = pVirtQueue;
 	m_Index = index;
+	if (!m_Stats.Init(virtio_get_queue_size(pVirtQueue))) {
+		WARNING("Queue %d runs without counters\n", index);
+	}
 	EnableInterrupt();
 	return TRUE;
 }
 
+static UINT GetCmdType(PGPU_VBUFFER buf)
+{
+	return reinterpret_cast<PGPU_CTRL_HDR>(buf->buf)->type;
+}
+
+int VioGpuQueue::AddBuf(
+	_In_ struct VirtIOBufferDescriptor sg[],
+	_In_ UINT out_num,
+	_In_ UINT in_num,
+	_In_ PGPU_VBUFFER buf,
+	_In_ void* va_indirect,
+	_In_ ULONGLONG phys_indirect)
+{
+	int ret;
+
+	buf->queue_us = VioGpuStats::NowUs();
+	ret = virtqueue_add_buf(m_pVirtQueue, sg, out_num, in_num, buf,
+		va_indirect, phys_indirect);
+	m_Stats.RecordAdd(GetCmdType(buf), ret == 0);
+	return ret;
+}
+
+PGPU_VBUFFER VioGpuQueue::GetBuf(_Out_ UINT* len)
+{
+	PGPU_VBUFFER buf = reinterpret_cast<PGPU_VBUFFER>(virtqueue_get_buf(m_pVirtQueue, len));
+
+	if (buf) {
+		m_Stats.RecordComplete(GetCmdType(buf), VioGpuStats::ElapsedUs(buf->queue_us));
+	}
+	return buf;
+}
+
 _IRQL_requires_max_(DISPATCH_LEVEL)
 _IRQL_saves_global_(OldIrql, Irql)
 _IRQL_raises_(DISPATCH_LEVEL)
@@ -110,6 +175,17 @@ void VioGpuQueue::Unlock(KIRQL SavedIrql)
 	}
 }
 
+// The counters are only changed under the queue lock, so a command
+// counted while they are cleared cannot leave half of itself behind
+void VioGpuQueue::ResetStats(void)
+{
+	KIRQL SavedIrql;
+
+	Lock(&SavedIrql);
+	m_Stats.Reset();
+	Unlock(SavedIrql);
+}
+
 PAGED_CODE_SEG_BEGIN
 
 UINT VioGpuQueue::QueryAllocation()
@@ -140,7 +216,7 @@ PAGED_CODE_SEG_BEGIN
 PVOID CtrlQueue::AllocCmd(PGPU_VBUFFER* buf, int sz)
 {
 	PAGED_CODE();
-	TRACING();
+	TRACING_HOT();
 
 	PGPU_VBUFFER vbuf;
 	vbuf = m_pBuf->GetBuf(sz, sizeof(GPU_CTRL_HDR), NULL);
@@ -154,7 +230,7 @@ PVOID CtrlQueue::AllocCmd(PGPU_VBUFFER* buf, int sz)
 PVOID CtrlQueue::AllocCmdResp(PGPU_VBUFFER* buf, int cmd_sz, PVOID resp_buf, int resp_sz)
 {
 	PAGED_CODE();
-	TRACING();
+	TRACING_HOT();
 
 	PGPU_VBUFFER vbuf;
 	vbuf = m_pBuf->GetBuf(cmd_sz, resp_sz, resp_buf);
@@ -202,8 +278,7 @@ BOOLEAN CtrlQueue::AskDisplayInfo(PGPU_VBUFFER* buf, KEVENT* event)
 	PGPU_RESP_DISP_INFO resp_buf;
 	NTSTATUS status;
 
-	resp_buf = reinterpret_cast<PGPU_RESP_DISP_INFO>
-		(new (NonPagedPoolNx) BYTE[sizeof(GPU_RESP_DISP_INFO)]);
+	resp_buf = reinterpret_cast<PGPU_RESP_DISP_INFO>(m_pBuf->AllocResp(sizeof(GPU_RESP_DISP_INFO)));
 
 	if (!resp_buf)
 	{
@@ -214,6 +289,7 @@ BOOLEAN CtrlQueue::AskDisplayInfo(PGPU_VBUFFER* buf, KEVENT* event)
 	cmd = (PGPU_CTRL_HDR)AllocCmdResp(&vbuf, sizeof(GPU_CTRL_HDR), resp_buf, sizeof(GPU_RESP_DISP_INFO));
 	if (!cmd) {
 		ERR("Couldn't allocate %ld bytes of memory\n", sizeof(*cmd));
+		m_pBuf->FreeResp(resp_buf);
 		return FALSE;
 	}
 	RtlZeroMemory(cmd, sizeof(GPU_CTRL_HDR));
@@ -227,12 +303,12 @@ BOOLEAN CtrlQueue::AskDisplayInfo(PGPU_VBUFFER* buf, KEVENT* event)
 	timeout.QuadPart = Int32x32To64(1000, -10000);
 
 	DBGPRINT("QueueBuffer, type = %d\n", cmd->type);
-	QueueBuffer(vbuf);
-	status = KeWaitForSingleObject(event,
-		Executive,
-		KernelMode,
-		FALSE,
-		&timeout);
+	if (QueueBuffer(vbuf) != 0) {
+		ERR("Failed to queue display info request\n");
+		ReleaseBuffer(vbuf);
+		return FALSE;
+	}
+	status = WaitForCompletion(event, &timeout);
 
 	if (status == STATUS_TIMEOUT) {
 		DBGPRINT("Failed to ask display info due to timeout\n");
@@ -254,8 +330,7 @@ BOOLEAN CtrlQueue::AskEdidInfo(PGPU_VBUFFER* buf, UINT id, KEVENT* event)
 	PGPU_RESP_EDID resp_buf;
 	NTSTATUS status;
 
-	resp_buf = reinterpret_cast<PGPU_RESP_EDID>
-		(new (NonPagedPoolNx) BYTE[sizeof(GPU_RESP_EDID)]);
+	resp_buf = reinterpret_cast<PGPU_RESP_EDID>(m_pBuf->AllocResp(sizeof(GPU_RESP_EDID)));
 
 	if (!resp_buf)
 	{
@@ -265,6 +340,7 @@ BOOLEAN CtrlQueue::AskEdidInfo(PGPU_VBUFFER* buf, UINT id, KEVENT* event)
 	cmd = (PGPU_CMD_GET_EDID)AllocCmdResp(&vbuf, sizeof(GPU_CMD_GET_EDID), resp_buf, sizeof(GPU_RESP_EDID));
 	if (!cmd) {
 		ERR("Couldn't allocate %ld bytes of memory\n", sizeof(*cmd));
+		m_pBuf->FreeResp(resp_buf);
 		return FALSE;
 	}
 	RtlZeroMemory(cmd, sizeof(GPU_CMD_GET_EDID));
@@ -279,14 +355,13 @@ BOOLEAN CtrlQueue::AskEdidInfo(PGPU_VBUFFER* buf, UINT id, KEVENT* event)
 	timeout.QuadPart = Int32x32To64(1000, -10000);
 
 	DBGPRINT("QueueBuffer, type = %d, screen = %d\n", cmd->hdr.type, cmd->scanout);
-	QueueBuffer(vbuf);
+	if (QueueBuffer(vbuf) != 0) {
+		ERR("Failed to queue edid request for screen %d\n", id);
+		ReleaseBuffer(vbuf);
+		return FALSE;
+	}
 
-	status = KeWaitForSingleObject(event,
-		Executive,
-		KernelMode,
-		FALSE,
-		&timeout
-	);
+	status = WaitForCompletion(event, &timeout);
 
 	if (status == STATUS_TIMEOUT) {
 		DBGPRINT("Failed to get edid info due to timeout\n");
@@ -298,6 +373,59 @@ BOOLEAN CtrlQueue::AskEdidInfo(PGPU_VBUFFER* buf, UINT id, KEVENT* event)
 	return TRUE;
 }
 
+/*
+ * Waits for event, which DpcRoutine sets on a completion. A local host
+ * often answers within microseconds, well below the interrupt, DPC and
+ * scheduler round trip, so the waiter first spins for a budget and runs
+ * the poll routine itself whenever the device returned buffers. Only then
+ * does it sleep on the event.
+ */
+NTSTATUS VioGpuQueue::WaitForCompletion(_In_ PKEVENT event, _In_opt_ PLARGE_INTEGER timeout)
+{
+	PAGED_CODE();
+	TRACING_HOT();
+
+	NTSTATUS status;
+	LARGE_INTEGER freq;
+	LARGE_INTEGER start;
+	LONGLONG budget;
+	LONGLONG elapsed;
+
+	// A completion that came in before the wait says nothing about how
+	// long the host takes, so it is neither a spin hit nor a sample
+	if (KeReadStateEvent(event)) {
+		return STATUS_SUCCESS;
+	}
+
+	start = KeQueryPerformanceCounter(&freq);
+	budget = (LONGLONG)m_SpinBudgetUs * freq.QuadPart / 1000000;
+	do {
+		if (m_pfnPoll && m_pVirtQueue && virtqueue_has_buf(m_pVirtQueue)) {
+			m_pfnPoll(m_PollContext);
+		}
+		else {
+			YieldProcessor();
+		}
+		elapsed = KeQueryPerformanceCounter(NULL).QuadPart - start.QuadPart;
+		if (KeReadStateEvent(event)) {
+			InterlockedIncrement64(&m_WaitSpinHits);
+			UpdateSpinBudget((ULONGLONG)(elapsed * 1000000 / freq.QuadPart));
+			return STATUS_SUCCESS;
+		}
+	} while (elapsed < budget);
+
+	InterlockedIncrement64(&m_WaitSleeps);
+	status = KeWaitForSingleObject(event,
+		Executive,
+		KernelMode,
+		FALSE,
+		timeout);
+
+	elapsed = KeQueryPerformanceCounter(NULL).QuadPart - start.QuadPart;
+	UpdateSpinBudget((status == STATUS_TIMEOUT) ? MAXULONGLONG : (ULONGLONG)(elapsed * 1000000 / freq.QuadPart));
+	return status;
+}
+
 BOOLEAN CtrlQueue::GetEdidInfo(PGPU_VBUFFER buf, UINT id, PBYTE edid)
 {
 	PAGED_CODE();
@@ -322,10 +450,10 @@ BOOLEAN CtrlQueue::GetEdidInfo(PGPU_VBUFFER buf, UINT id, PBYTE edid)
 	return TRUE;
 }
 
-void CtrlQueue::CreateResource(UINT res_id, UINT format, UINT width, UINT height)
+void CtrlQueue::CreateResource(UINT res_id, UINT format, UINT width, UINT height, PGPU_BATCH batch)
 {
 	PAGED_CODE();
-	TRACING();
+	TRACING_HOT();
 
 	PGPU_RES_CREATE_2D cmd;
 	PGPU_VBUFFER vbuf;
@@ -344,14 +472,14 @@ void CtrlQueue::CreateResource(UINT res_id, UINT format, UINT width, UINT height
 
 	//FIXME!!! if 
 	DBGPRINT("QueueBuffer, type = %d\n", cmd->hdr.type);
-	QueueBuffer(vbuf);
+	Submit(vbuf, batch);
 }
 
-void CtrlQueue::CreateResourceBlob(UINT res_id, PGPU_MEM_ENTRY ents, UINT nents, ULONGLONG width, ULONGLONG height, ULONGLONG stride)
+void CtrlQueue::CreateResourceBlob(UINT res_id, PGPU_MEM_ENTRIES ents, ULONGLONG width, ULONGLONG height, ULONGLONG stride, PGPU_BATCH batch)
 {
 	PAGED_CODE();
 	UNREFERENCED_PARAMETER(width);
-	TRACING();
+	TRACING_HOT();
 
 	PGPU_RES_CREATE_BLOB cmd;
 	PGPU_VBUFFER vbuf;
@@ -367,23 +495,22 @@ void CtrlQueue::CreateResourceBlob(UINT res_id, PGPU_MEM_ENTRY ents, UINT nents,
 	cmd->blob_mem = VIRTIO_GPU_BLOB_MEM_GUEST;
 	cmd->blob_flags = VIRTIO_GPU_BLOB_FLAG_USE_SHAREABLE;
 	cmd->blob_id = 0;
-	cmd->nr_entries = nents;
+	cmd->nr_entries = ents->NumEntries;
 	/* TODO: Check if ROUND_TO_PAGES (round up) should be used or PAGE_ALIGN (round down) */
 	cmd->size = ROUND_TO_PAGES(stride * height * 4);
 
-	vbuf->data_buf = ents;
-	vbuf->data_size = sizeof(*ents) * nents;
+	SetDataEntries(vbuf, ents);
 
 	//FIXME!!! if
 	DBGPRINT("QueueBuffer, type = %d\n", cmd->hdr.type);
-	QueueBuffer(vbuf);
+	Submit(vbuf, batch);
 }
 
 
-void CtrlQueue::UnrefResource(UINT res_id)
+void CtrlQueue::UnrefResource(UINT res_id, PGPU_BATCH batch)
 {
 	PAGED_CODE();
-	TRACING();
+	TRACING_HOT();
 
 	PGPU_RES_UNREF cmd;
 	PGPU_VBUFFER vbuf;
@@ -399,13 +526,13 @@ void CtrlQueue::UnrefResource(UINT res_id)
 	cmd->resource_id = res_id;
 
 	DBGPRINT("QueueBuffer, type = %d\n", cmd->hdr.type);
-	QueueBuffer(vbuf);
+	Submit(vbuf, batch);
 }
 
-void CtrlQueue::InvalBacking(UINT res_id)
+void CtrlQueue::InvalBacking(UINT res_id, PGPU_BATCH batch)
 {
 	PAGED_CODE();
-	TRACING();
+	TRACING_HOT();
 
 	PGPU_RES_DETACH_BACKING cmd;
 	PGPU_VBUFFER vbuf;
@@ -420,13 +547,13 @@ void CtrlQueue::InvalBacking(UINT res_id)
 	cmd->resource_id = res_id;
 
 	DBGPRINT("QueueBuffer, type = %d\n", cmd->hdr.type);
-	QueueBuffer(vbuf);
+	Submit(vbuf, batch);
 }
 
-void CtrlQueue::SetScanout(UINT scan_id, UINT res_id, UINT width, UINT height, UINT x, UINT y)
+void CtrlQueue::SetScanout(UINT scan_id, UINT res_id, UINT width, UINT height, UINT x, UINT y, PGPU_BATCH batch)
 {
 	PAGED_CODE();
-	TRACING();
+	TRACING_HOT();
 
 	PGPU_SET_SCANOUT cmd;
 	PGPU_VBUFFER vbuf;
@@ -447,13 +574,13 @@ void CtrlQueue::SetScanout(UINT scan_id, UINT res_id, UINT width, UINT height, U
 
 	//FIXME if 
 	DBGPRINT("QueueBuffer, type = %d, screen = %d\n", cmd->hdr.type, scan_id);
-	QueueBuffer(vbuf);
+	Submit(vbuf, batch);
 }
 
-void CtrlQueue::SetScanoutBlob(UINT scan_id, UINT res_id, UINT width, UINT height, UINT format, UINT x, UINT y, UINT stride)
+void CtrlQueue::SetScanoutBlob(UINT scan_id, UINT res_id, UINT width, UINT height, UINT format, UINT x, UINT y, UINT stride, PGPU_BATCH batch)
 {
 	PAGED_CODE();
-	TRACING();
+	TRACING_HOT();
 
 	PGPU_SET_SCANOUT_BLOB cmd;
 	PGPU_VBUFFER vbuf;
@@ -484,65 +611,59 @@ void CtrlQueue::SetScanoutBlob(UINT scan_id, UINT res_id, UINT width, UINT heigh
 
 	//FIXME if
 	DBGPRINT("QueueBuffer, type = %d, screen = %d\n", cmd->hdr.type, scan_id);
-	QueueBuffer(vbuf);
+	Submit(vbuf, batch);
 }
 
-void CtrlQueue::ResFlush(UINT res_id, UINT width, UINT height, UINT x, UINT y, UINT screen_num, KEVENT* event)
+BOOLEAN CtrlQueue::ResFlush(UINT res_id, UINT width, UINT height, UINT x, UINT y, UINT screen_num, PULONGLONG fence_id, PGPU_BATCH batch)
 {
-	NTSTATUS status;
-
 	PAGED_CODE();
-	TRACING();
+	TRACING_HOT();
 
 	PGPU_RES_FLUSH cmd;
 	PGPU_VBUFFER vbuf;
 	cmd = (PGPU_RES_FLUSH)AllocCmd(&vbuf, sizeof(*cmd));
 	if (!cmd) {
 		ERR("Couldn't allocate %ld bytes of memory\n", sizeof(*cmd));
-		return;
+		return FALSE;
 	}
 	RtlZeroMemory(cmd, sizeof(*cmd));
 
 	cmd->hdr.type = VIRTIO_GPU_CMD_RESOURCE_FLUSH;
-	cmd->hdr.fence_id = screen_num;
 	cmd->resource_id = res_id;
 	cmd->r.width = width;
 	cmd->r.height = height;
 	cmd->r.x = x;
 	cmd->r.y = y;
 
-	if (vbuf == NULL) {
-		return;
+	// Fence ids are unique across scanouts; the scanout travels with the
+	// vbuf for DpcRoutine. A non-zero *fence_id was reserved when the
+	// present was queued, so flushes queued meanwhile carry higher ids and
+	// the host may see and complete fences out of order. ScreenInfo does
+	// not count a fence as retired while a lower reserved one is pending,
+	// see viogpu_fence_tracker.h.
+	if (fence_id) {
+		if (*fence_id == 0) {
+			*fence_id = ReserveFenceId();
+		}
+		cmd->hdr.flags |= VIRTIO_GPU_FLAG_FENCE;
+		cmd->hdr.fence_id = *fence_id;
+		vbuf->submit_us = VioGpuStats::NowUs();
 	}
+	vbuf->screen_num = screen_num;
 
-	KeInitializeEvent(event, NotificationEvent, FALSE);
-	vbuf->event = event;
-
-	DBGPRINT("QueueBuffer, type = %d, screen = %d\n", cmd->hdr.type, screen_num);
-	QueueBuffer(vbuf);
-
-	LARGE_INTEGER timeout = { 0 };
-	timeout.QuadPart = Int32x32To64(1000, -1000);
-
-	status = KeWaitForSingleObject(event,
-		Executive,
-		KernelMode,
-		FALSE,
-		&timeout);
-
-	if (status == STATUS_TIMEOUT) {
-		ERR("---> Timeout waiting for Resrouce Flush\n");
-		VioGpuDbgBreak();
-		//        return FALSE;
+	DBGPRINT("QueueBuffer, type = %d, screen = %d, fence = %llu\n", cmd->hdr.type, screen_num, cmd->hdr.fence_id);
+	if (Submit(vbuf, batch) != 0) {
+		ERR("Failed to queue resource flush for screen %d\n", screen_num);
+		return FALSE;
 	}
 
-	ReleaseBuffer(vbuf);
+	return TRUE;
 }
 
-void CtrlQueue::TransferToHost2D(UINT res_id, ULONG offset, UINT width, UINT height, UINT x, UINT y, PUINT fence_id)
+void CtrlQueue::TransferToHost2D(UINT res_id, ULONG offset, UINT width, UINT height, UINT x, UINT y, PUINT fence_id, PGPU_BATCH batch)
 {
 	PAGED_CODE();
-	TRACING();
+	TRACING_HOT();
 	PGPU_RES_TRANSF_TO_HOST_2D cmd;
 	PGPU_VBUFFER vbuf;
 	cmd = (PGPU_RES_TRANSF_TO_HOST_2D)AllocCmd(&vbuf, sizeof(*cmd));
@@ -566,13 +687,13 @@ void CtrlQueue::TransferToHost2D(UINT res_id, ULONG offset, UINT width, UINT hei
 	}
 
 	DBGPRINT("QueueBuffer, type = %d\n", cmd->hdr.type);
-	QueueBuffer(vbuf);
+	Submit(vbuf, batch);
 }
 
-void CtrlQueue::AttachBacking(UINT res_id, PGPU_MEM_ENTRY ents, UINT nents)
+void CtrlQueue::AttachBacking(UINT res_id, PGPU_MEM_ENTRIES ents, PGPU_BATCH batch)
 {
 	PAGED_CODE();
-	TRACING();
+	TRACING_HOT();
 
 	PGPU_RES_ATTACH_BACKING cmd;
 	PGPU_VBUFFER vbuf;
@@ -585,32 +706,26 @@ void CtrlQueue::AttachBacking(UINT res_id, PGPU_MEM_ENTRY ents, UINT nents)
 
 	cmd->hdr.type = VIRTIO_GPU_CMD_RESOURCE_ATTACH_BACKING;
 	cmd->resource_id = res_id;
-	cmd->nr_entries = nents;
+	cmd->nr_entries = ents->NumEntries;
 
-	vbuf->data_buf = ents;
-	vbuf->data_size = sizeof(*ents) * nents;
+	SetDataEntries(vbuf, ents);
 
 	DBGPRINT("QueueBuffer, type = %d\n", cmd->hdr.type);
-	QueueBuffer(vbuf);
+	Submit(vbuf, batch);
 }
 
 PAGED_CODE_SEG_END
 
-#define SGLIST_SIZE 64
-UINT CtrlQueue::QueueBuffer(PGPU_VBUFFER buf)
+BOOLEAN CtrlQueue::BuildSGList(PGPU_VBUFFER buf, VirtIOBufferDescriptor* sg, PUINT pOutCnt, PUINT pInCnt)
 {
-	//    PAGED_CODE();
-	TRACING();
+	TRACING_HOT();
 
-	VirtIOBufferDescriptor  sg[SGLIST_SIZE];
 	UINT sgleft = SGLIST_SIZE;
 	UINT outcnt = 0, incnt = 0;
-	UINT ret = 0;
-	KIRQL SavedIrql;
 
 	if (buf->size > PAGE_SIZE) {
 		ERR("Size is too big %d\n", buf->size);
-		return 0;
+		return FALSE;
 	}
 
 	if (BuildSGElement(&sg[outcnt + incnt], (PVOID)buf->buf, buf->size))
@@ -625,23 +740,27 @@ UINT CtrlQueue::QueueBuffer(PGPU_VBUFFER buf)
 		PVOID data_buf = (PVOID)buf->data_buf;
 		while (data_size)
 		{
-			if (BuildSGElement(&sg[outcnt + incnt], data_buf, data_size))
-			{
-				data_buf = (PVOID)((LONG_PTR)(data_buf)+PAGE_SIZE);
-				data_size -= min(data_size, PAGE_SIZE);
-				outcnt++;
-				sgleft--;
-				if (sgleft == 0) {
-					ERR("No more sgelenamt spots left %d\n", outcnt);
-					return 0;
-				}
+			// An element must not cross a page, the entries of a segment
+			// start after the header of GPU_MEM_ENTRIES and not on a page
+			ULONG length = min(data_size, PAGE_SIZE - BYTE_OFFSET(data_buf));
+			if (!BuildSGElement(&sg[outcnt + incnt], data_buf, length)) {
+				ERR("Invalid data buffer %p\n", data_buf);
+				return FALSE;
+			}
+			data_buf = (PVOID)((LONG_PTR)(data_buf)+length);
+			data_size -= length;
+			outcnt++;
+			sgleft--;
+			if (sgleft == 0) {
+				ERR("No more sgelenamt spots left %d\n", outcnt);
+				return FALSE;
 			}
 		}
 	}
 
 	if (buf->resp_size > PAGE_SIZE) {
 		ERR("resp_size is too big %d\n", buf->resp_size);
-		return 0;
+		return FALSE;
 	}
 
 	if (buf->resp_size && (sgleft > 0))
@@ -654,133 +773,378 @@ UINT CtrlQueue::QueueBuffer(PGPU_VBUFFER buf)
 	}
 
 	DBGPRINT("sgleft %d\n", sgleft);
+	*pOutCnt = outcnt;
+	*pInCnt = incnt;
+	return TRUE;
+}
+
+// With indirect descriptors a command takes a single ring slot however
+// many pages its payload spans, so a full ring no longer fails large
+// ATTACH_BACKING and CREATE_BLOB commands. Called under the queue lock.
+int CtrlQueue::AddCmd(PGPU_VBUFFER buf, VirtIOBufferDescriptor* sg, UINT outcnt, UINT incnt)
+{
+	if (m_bIndirect && buf->indirect_va) {
+		return AddBuf(sg, outcnt, incnt, buf, buf->indirect_va, buf->indirect_pa);
+	}
+	return AddBuf(sg, outcnt, incnt, buf, NULL, 0);
+}
+
+UINT CtrlQueue::QueueBuffer(PGPU_VBUFFER buf)
+{
+	//    PAGED_CODE();
+	TRACING_HOT();
+
+	VirtIOBufferDescriptor  sg[SGLIST_SIZE];
+	UINT outcnt = 0, incnt = 0;
+	UINT ret = 0;
+	BOOLEAN notify = FALSE;
+	KIRQL SavedIrql;
+
+	// A payload that does not fit in the descriptors must fail like a full
+	// ring, the caller still owns the buffer and whatever it reserved
+	if (!BuildSGList(buf, sg, &outcnt, &incnt)) {
+		return (UINT)-ENOSPC;
+	}
 
 	Lock(&SavedIrql);
-	ret = AddBuf(&sg[0], outcnt, incnt, buf, NULL, 0);
+	ret = AddCmd(buf, &sg[0], outcnt, incnt);
+	if (ret == 0) {
+		notify = KickPrepare();
+	}
 	Unlock(SavedIrql);
 
-	Kick();
+	if (notify) {
+		Notify();
+	}
 	DBGPRINT("ret = %d\n", ret);
 	return ret;
 }
 
-PGPU_VBUFFER CtrlQueue::DequeueBuffer(_Out_ UINT* len)
+// Without a batch the command goes out right away, and is released when
+// it could not be queued. A full batch is committed early rather than
+// failing the append.
+UINT CtrlQueue::Submit(PGPU_VBUFFER buf, PGPU_BATCH batch)
 {
-	TRACING();
+	if (batch == NULL) {
+		UINT ret = QueueBuffer(buf);
+		if (ret != 0) {
+			ERR("Failed to queue command %d, ret = %d\n", GetCmdType(buf), (int)ret);
+			ReleaseBuffer(buf);
+		}
+		return ret;
+	}
 
-	PGPU_VBUFFER buf = NULL;
+	if (batch->Count == MAX_BATCH_CMDS) {
+		WARNING("Batch is full, committing %d commands early\n", batch->Count);
+		CommitBatch(batch);
+	}
+	batch->Bufs[batch->Count++] = buf;
+	return 0;
+}
+
+// Queues the commands of the batch in order under a single lock and
+// notifies the host once. Commands depend on the ones before them, so
+// everything after the first one that does not fit in the ring is dropped.
+BOOLEAN CtrlQueue::CommitBatch(PGPU_BATCH batch)
+{
+	TRACING_HOT();
+
+	VirtIOBufferDescriptor  sg[SGLIST_SIZE];
+	UINT outcnt = 0, incnt = 0;
+	UINT queued = 0;
+	BOOLEAN ret;
+	BOOLEAN notify = FALSE;
 	KIRQL SavedIrql;
+
+	if (batch->Count == 0) {
+		return TRUE;
+	}
+
 	Lock(&SavedIrql);
-	buf = (PGPU_VBUFFER)GetBuf(len);
+	for (; queued < batch->Count; queued++) {
+		PGPU_VBUFFER buf = batch->Bufs[queued];
+		if (!BuildSGList(buf, sg, &outcnt, &incnt) ||
+			AddCmd(buf, &sg[0], outcnt, incnt) != 0) {
+			break;
+		}
+	}
+	if (queued) {
+		notify = KickPrepare();
+	}
 	Unlock(SavedIrql);
-	if (buf == NULL)
-	{
-		*len = 0;
+
+	if (notify) {
+		Notify();
 	}
-	return buf;
+
+	for (UINT i = queued; i < batch->Count; i++) {
+		ERR("Failed to queue command %d of %d\n", i + 1, batch->Count);
+		ReleaseBuffer(batch->Bufs[i]);
+	}
+
+	DBGPRINT("%d of %d commands queued, notify = %d\n", queued, batch->Count, notify);
+	ret = (queued == batch->Count);
+	batch->Count = 0;
+	return ret;
 }
 
 
 void VioGpuQueue::ReleaseBuffer(PGPU_VBUFFER buf)
 {
-	TRACING();
+	TRACING_HOT();
 	m_pBuf->FreeBuf(buf);
 }
 
+void VioGpuQueue::ReleaseBuffers(PGPU_VBUFFER* bufs, UINT count)
+{
+	TRACING_HOT();
+	if (count) {
+		m_pBuf->FreeBufs(bufs, count);
+	}
+}
 
-BOOLEAN VioGpuBuf::Init(_In_ UINT cnt)
+/*
+ * Re-arming sets used_event from last_used, which GetBuf moves on. Waiters
+ * spinning in WaitForCompletion harvest while the DPC re-arms, so without
+ * the lock used_event could be left behind what they consumed and, with
+ * VIRTIO_RING_F_EVENT_IDX, the device would not interrupt again.
+ */
+BOOLEAN VioGpuQueue::EnableInterrupt(void)
 {
-	KIRQL                   OldIrql;
-	TRACING();
+	KIRQL SavedIrql;
+	BOOLEAN bEmpty;
 
-	InitializeListHead(&m_FreeBufs);
-	InitializeListHead(&m_InUseBufs);
-	KeInitializeSpinLock(&m_SpinLock);
+	Lock(&SavedIrql);
+	bEmpty = (virtqueue_enable_cb(m_pVirtQueue) ? TRUE : FALSE);
+	Unlock(SavedIrql);
+	return bEmpty;
+}
 
-	for (UINT i = 0; i < cnt; ++i) {
-		PGPU_VBUFFER pvbuf = reinterpret_cast<PGPU_VBUFFER>
-			(new (NonPagedPoolNx) BYTE[VBUFFER_SIZE]);
-		if (!pvbuf) {
-			ERR("Failed to allocate %d bytes\n", VBUFFER_SIZE);
+BOOLEAN VioGpuQueue::EnableInterruptDelayed(void)
+{
+	KIRQL SavedIrql;
+	BOOLEAN bEmpty;
+
+	Lock(&SavedIrql);
+	bEmpty = (virtqueue_enable_cb_delayed(m_pVirtQueue) ? TRUE : FALSE);
+	Unlock(SavedIrql);
+	return bEmpty;
+}
+
+// Takes up to max completed buffers under a single acquisition of the
+// queue lock, the caller handles them after it was dropped
+UINT VioGpuQueue::DequeueBuffers(PGPU_VBUFFER* bufs, UINT* lens, UINT max)
+{
+	TRACING_HOT();
+
+	UINT count = 0;
+	KIRQL SavedIrql;
+	Lock(&SavedIrql);
+	while (count < max) {
+		bufs[count] = GetBuf(&lens[count]);
+		if (bufs[count] == NULL) {
 			break;
 		}
-		//FIXME
-		RtlZeroMemory(pvbuf, VBUFFER_SIZE);
-		if (pvbuf)
-		{
-			KeAcquireSpinLock(&m_SpinLock, &OldIrql);
-			InsertTailList(&m_FreeBufs, &pvbuf->list_entry);
-			++m_uCount;
-			KeReleaseSpinLock(&m_SpinLock, OldIrql);
-		}
+		count++;
 	}
-	if (m_uCount != cnt) {
-		/*Before assert, Free the allocated system memory as the requested quantity is not satisfied in entirety */
-		KeAcquireSpinLock(&m_SpinLock, &OldIrql);
-		while (!IsListEmpty(&m_FreeBufs))
-		{
-			LIST_ENTRY* pListItem = RemoveHeadList(&m_FreeBufs);
-			if (pListItem) {
-				PGPU_VBUFFER pvbuf = CONTAINING_RECORD(pListItem, GPU_VBUFFER, list_entry);
-				delete[] reinterpret_cast<PBYTE>(pvbuf);
-			}
-		}
-		KeReleaseSpinLock(&m_SpinLock, OldIrql);
-		ASSERT(m_uCount == cnt);
+	Unlock(SavedIrql);
+
+	DBGPRINT("%d buffers dequeued\n", count);
+	return count;
+}
+
+
+C_ASSERT(FIELD_OFFSET(GPU_VBUFFER, free_entry) == 0);
+
+// All buffers come from one allocation, see viogpu_buf_list.h
+BOOLEAN VioGpuBuf::Init(_In_ UINT cnt, _In_ BOOLEAN bIndirect)
+{
+	TRACING();
+
+	if (m_pBufs) {
+		Close();
+	}
+
+	InitializeSListHead(&m_FreeBufs);
+	m_uStride = VBufStride(VBUFFER_SIZE);
+	m_pBufs = new (NonPagedPoolNx) BYTE[m_uStride * cnt];
+	if (!m_pBufs) {
+		ERR("Failed to allocate %d bytes\n", m_uStride * cnt);
+		return FALSE;
+	}
+	ASSERT(((ULONG_PTR)m_pBufs & (MEMORY_ALLOCATION_ALIGNMENT - 1)) == 0);
+	RtlZeroMemory(m_pBufs, m_uStride * cnt);
+
+	m_uCount = cnt;
+	VBufListFill(&m_FreeBufs, m_pBufs, m_uStride, cnt);
+
+	// AllocResp falls back to the pool when the slabs are missing
+	if (!InitRespPool()) {
+		WARNING("Response buffers are not preallocated\n");
+	}
+	// Without the tables commands go out as plain descriptor chains
+	if (bIndirect && !InitIndirect()) {
+		WARNING("Indirect descriptor tables are not preallocated\n");
 	}
 	return (m_uCount > 0);
 }
 
-void VioGpuBuf::Close(void)
+C_ASSERT(PAGE_SIZE % INDIRECT_TABLE_SIZE == 0);
+
+// One table per buffer, carved out of a single allocation. The allocation
+// is page aligned and a table divides a page, so every table is physically
+// contiguous and its address is looked up once here. Pool allocations are
+// only page aligned from a page up, so the size is rounded to whole pages.
+BOOLEAN VioGpuBuf::InitIndirect(void)
 {
-	KIRQL                   OldIrql;
+	TRACING();
 
+	SIZE_T size = ROUND_TO_PAGES((SIZE_T)INDIRECT_TABLE_SIZE * m_uCount);
+	m_pIndirect = new (NonPagedPoolNx) BYTE[size];
+	if (!m_pIndirect) {
+		ERR("Failed to allocate %d indirect tables\n", m_uCount);
+		return FALSE;
+	}
+	// A table crossing a page would not be physically contiguous
+	if (((ULONG_PTR)m_pIndirect & (PAGE_SIZE - 1)) != 0) {
+		WARNING("Indirect tables at %p are not page aligned\n", m_pIndirect);
+		delete[] m_pIndirect;
+		m_pIndirect = NULL;
+		return FALSE;
+	}
+
+	for (UINT i = 0; i < m_uCount; i++) {
+		PGPU_VBUFFER pbuf = GetBufAt(i);
+
+		pbuf->indirect_va = m_pIndirect + i * INDIRECT_TABLE_SIZE;
+		pbuf->indirect_pa = (ULONGLONG)MmGetPhysicalAddress(pbuf->indirect_va).QuadPart;
+	}
+	DBGPRINT("%d indirect tables of %d bytes\n", m_uCount, INDIRECT_TABLE_SIZE);
+	return TRUE;
+}
+
+// Each class is a power of two no bigger than a page, carved from a slab of
+// at least a page, so no response crosses a page boundary. The virtqueue
+// describes a response with a single physical range.
+BOOLEAN VioGpuBuf::InitRespPool(void)
+{
 	TRACING();
 
-	KeAcquireSpinLock(&m_SpinLock, &OldIrql);
-	while (!IsListEmpty(&m_InUseBufs))
-	{
-		LIST_ENTRY* pListItem = RemoveHeadList(&m_InUseBufs);
-		if (pListItem)
-		{
-			PGPU_VBUFFER pvbuf = CONTAINING_RECORD(pListItem, GPU_VBUFFER, list_entry);
-			ASSERT(pvbuf);
-			ASSERT(pvbuf->resp_size <= MAX_INLINE_RESP_SIZE);
+	UINT sizes[RESP_POOL_CLASSES] = { sizeof(GPU_RESP_DISP_INFO), sizeof(GPU_RESP_EDID) };
+	BOOLEAN ret = TRUE;
+
+	for (UINT i = 0; i < RESP_POOL_CLASSES; i++) {
+		PRESP_POOL_CLASS pClass = &m_RespPool[i];
+		UINT size = MEMORY_ALLOCATION_ALIGNMENT;
 
-			delete[] reinterpret_cast<PBYTE>(pvbuf);
-			--m_uCount;
+		while (size < sizes[i]) {
+			size <<= 1;
 		}
+		ASSERT(size <= PAGE_SIZE);
+
+		InitializeSListHead(&pClass->FreeList);
+		pClass->Size = size;
+		pClass->Count = max(MAX_SCAN_OUT, PAGE_SIZE / size);
+		pClass->pBase = new (NonPagedPoolNx) BYTE[pClass->Size * pClass->Count];
+		if (!pClass->pBase) {
+			ERR("Failed to allocate %d responses of %d bytes\n", pClass->Count, pClass->Size);
+			pClass->Count = 0;
+			ret = FALSE;
+			continue;
+		}
+		ASSERT(((ULONG_PTR)pClass->pBase & (PAGE_SIZE - 1)) == 0);
+
+		for (UINT j = 0; j < pClass->Count; j++) {
+			InterlockedPushEntrySList(&pClass->FreeList, (PSLIST_ENTRY)(pClass->pBase + j * pClass->Size));
+		}
+		DBGPRINT("%d responses of %d bytes\n", pClass->Count, pClass->Size);
 	}
+	return ret;
+}
 
-	while (!IsListEmpty(&m_FreeBufs))
-	{
-		LIST_ENTRY* pListItem = RemoveHeadList(&m_FreeBufs);
-		if (pListItem)
-		{
-			PGPU_VBUFFER pbuf = CONTAINING_RECORD(pListItem, GPU_VBUFFER, list_entry);
-			ASSERT(pbuf);
+void VioGpuBuf::CloseRespPool(void)
+{
+	TRACING();
 
-			if (pbuf->resp_buf && pbuf->resp_size > MAX_INLINE_RESP_SIZE)
-			{
-				delete[] reinterpret_cast<PBYTE>(pbuf->resp_buf);
-				pbuf->resp_buf = NULL;
-				pbuf->resp_size = 0;
-			}
+	for (UINT i = 0; i < RESP_POOL_CLASSES; i++) {
+		PRESP_POOL_CLASS pClass = &m_RespPool[i];
 
-			if (pbuf->data_buf && pbuf->data_size)
-			{
-				delete[] reinterpret_cast<PBYTE>(pbuf->data_buf);
-				pbuf->data_buf = NULL;
-				pbuf->data_size = 0;
-			}
+		InterlockedFlushSList(&pClass->FreeList);
+		if (pClass->pBase) {
+			delete[] pClass->pBase;
+			pClass->pBase = NULL;
+		}
+		pClass->Count = 0;
+	}
+}
 
-			delete[] reinterpret_cast<PBYTE>(pbuf);
-			--m_uCount;
+PVOID VioGpuBuf::AllocResp(_In_ UINT size)
+{
+	TRACING_HOT();
+
+	PVOID resp = NULL;
+
+	for (UINT i = 0; i < RESP_POOL_CLASSES; i++) {
+		if (size <= m_RespPool[i].Size && m_RespPool[i].Count) {
+			resp = InterlockedPopEntrySList(&m_RespPool[i].FreeList);
+			break;
 		}
 	}
-	KeReleaseSpinLock(&m_SpinLock, OldIrql);
 
-	ASSERT(m_uCount == 0);
+	if (resp) {
+		InterlockedIncrement64(&m_RespHits);
+	}
+	else {
+		InterlockedIncrement64(&m_RespMisses);
+		resp = new (NonPagedPoolNx) BYTE[size];
+	}
+	DBGPRINT("resp = %p, size = %d, hits = %lld, misses = %lld\n", resp, size, m_RespHits, m_RespMisses);
+	return resp;
+}
+
+void VioGpuBuf::FreeResp(_In_ PVOID resp)
+{
+	TRACING_HOT();
+
+	PBYTE p = reinterpret_cast<PBYTE>(resp);
+
+	for (UINT i = 0; i < RESP_POOL_CLASSES; i++) {
+		PRESP_POOL_CLASS pClass = &m_RespPool[i];
+
+		if (p >= pClass->pBase && p < pClass->pBase + pClass->Size * pClass->Count) {
+			InterlockedPushEntrySList(&pClass->FreeList, (PSLIST_ENTRY)p);
+			return;
+		}
+	}
+	delete[] p;
+}
+
+void VioGpuBuf::Close(void)
+{
+	TRACING();
+
+	if (!m_pBufs) {
+		return;
+	}
+
+	InterlockedFlushSList(&m_FreeBufs);
+	for (UINT i = 0; i < m_uCount; i++) {
+		PGPU_VBUFFER pbuf = GetBufAt(i);
+
+		if (pbuf->in_use) {
+			ReleaseData(pbuf);
+		}
+	}
+	CloseRespPool();
+
+	if (m_pIndirect) {
+		delete[] m_pIndirect;
+		m_pIndirect = NULL;
+	}
+
+	delete[] m_pBufs;
+	m_pBufs = NULL;
+	m_uCount = 0;
 }
 
 PGPU_VBUFFER VioGpuBuf::GetBuf(
@@ -789,41 +1153,43 @@ PGPU_VBUFFER VioGpuBuf::GetBuf(
 	_In_ void* resp_buf)
 {
 
-	TRACING();
+	TRACING_HOT();
 
 	PGPU_VBUFFER pbuf = NULL;
-	PLIST_ENTRY pListItem = NULL;
-	KIRQL                   OldIrql;
-
-	KeAcquireSpinLock(&m_SpinLock, &OldIrql);
+	PSLIST_ENTRY pEntry = InterlockedPopEntrySList(&m_FreeBufs);
 
-	if (!IsListEmpty(&m_FreeBufs))
+	if (pEntry)
 	{
-		pListItem = RemoveHeadList(&m_FreeBufs);
-		pbuf = CONTAINING_RECORD(pListItem, GPU_VBUFFER, list_entry);
+		pbuf = CONTAINING_RECORD(pEntry, GPU_VBUFFER, free_entry);
 
-		memset(pbuf, 0, VBUFFER_SIZE);
+		// Commands zero their own structure, only the header and an inline
+		// response are cleared here
 		pbuf->buf = (char*)((ULONG_PTR)pbuf + sizeof(*pbuf));
 		pbuf->size = size;
+		pbuf->data_buf = NULL;
+		pbuf->data_size = 0;
+		pbuf->data_ents = NULL;
+		pbuf->submit_us = 0;
+		pbuf->event = NULL;
+		pbuf->screen_num = 0;
 
 		pbuf->resp_size = resp_size;
 		if (resp_size <= MAX_INLINE_RESP_SIZE)
 		{
 			pbuf->resp_buf = (char*)((ULONG_PTR)pbuf->buf + size);
+			RtlZeroMemory(pbuf->resp_buf, resp_size);
 		}
 		else
 		{
 			pbuf->resp_buf = (char*)resp_buf;
 		}
-
-		InsertTailList(&m_InUseBufs, &pbuf->list_entry);
+		pbuf->in_use = TRUE;
 	}
 	else
 	{
 		ERR("Cannot allocate buffer\n");
 		VioGpuDbgBreak();
 	}
-	KeReleaseSpinLock(&m_SpinLock, OldIrql);
 
 	DBGPRINT("buf = %p\n", pbuf);
 	return pbuf;
@@ -832,46 +1198,54 @@ PGPU_VBUFFER VioGpuBuf::GetBuf(
 void VioGpuBuf::FreeBuf(
 	_In_ PGPU_VBUFFER pbuf)
 {
-	KIRQL                   OldIrql;
-	TRACING();
+	TRACING_HOT();
 	DBGPRINT("buf = %p\n", pbuf);
-	KeAcquireSpinLock(&m_SpinLock, &OldIrql);
 
-	if (!IsListEmpty(&m_InUseBufs))
-	{
-		PLIST_ENTRY leCurrent = m_InUseBufs.Flink;
-		PGPU_VBUFFER pvbuf = CONTAINING_RECORD(leCurrent, GPU_VBUFFER, list_entry);
-		while (leCurrent && pvbuf)
-		{
-			if (pvbuf == pbuf)
-			{
-				RemoveEntryList(leCurrent);
-				pvbuf = NULL;
-				break;
-			}
+	ASSERT(pbuf->in_use);
+	ReleaseData(pbuf);
+	pbuf->in_use = FALSE;
+	InterlockedPushEntrySList(&m_FreeBufs, &pbuf->free_entry);
+}
 
-			leCurrent = leCurrent->Flink;
-			if (leCurrent) {
-				pvbuf = CONTAINING_RECORD(leCurrent, GPU_VBUFFER, list_entry);
-			}
-		}
+void VioGpuBuf::FreeBufs(
+	_In_reads_(count) PGPU_VBUFFER* bufs,
+	_In_ UINT count)
+{
+	TRACING_HOT();
+
+	for (UINT i = 0; i < count; i++) {
+		ASSERT(bufs[i]->in_use);
+		ReleaseData(bufs[i]);
+		bufs[i]->in_use = FALSE;
 	}
+	VBufListPushChain(&m_FreeBufs, reinterpret_cast<PVOID const*>(bufs), count);
+	DBGPRINT("%d buffers freed\n", count);
+}
+
+// Response and data buffers too big to be inline are owned by the vbuf
+void VioGpuBuf::ReleaseData(
+	_In_ PGPU_VBUFFER pbuf)
+{
 	if (pbuf->resp_buf && pbuf->resp_size > MAX_INLINE_RESP_SIZE)
 	{
-		delete[] reinterpret_cast<PBYTE>(pbuf->resp_buf);
+		FreeResp(pbuf->resp_buf);
 		pbuf->resp_buf = NULL;
 		pbuf->resp_size = 0;
 	}
 
-	if (pbuf->data_buf && pbuf->data_size)
+	if (pbuf->data_ents)
+	{
+		ReleaseMemEntries(pbuf->data_ents);
+		pbuf->data_ents = NULL;
+		pbuf->data_buf = NULL;
+		pbuf->data_size = 0;
+	}
+	else if (pbuf->data_buf && pbuf->data_size)
 	{
 		delete[] reinterpret_cast<PBYTE>(pbuf->data_buf);
 		pbuf->data_buf = NULL;
 		pbuf->data_size = 0;
 	}
-
-	InsertTailList(&m_FreeBufs, &pbuf->list_entry);
-	KeReleaseSpinLock(&m_SpinLock, OldIrql);
 }
 
 PAGED_CODE_SEG_BEGIN
@@ -880,7 +1254,13 @@ VioGpuBuf::VioGpuBuf()
 	PAGED_CODE();
 	TRACING();
 
+	m_pBufs = NULL;
+	m_pIndirect = NULL;
+	m_uStride = 0;
 	m_uCount = 0;
+	m_RespHits = 0;
+	m_RespMisses = 0;
+	RtlZeroMemory(m_RespPool, sizeof(m_RespPool));
 }
 
 VioGpuBuf::~VioGpuBuf()
@@ -899,12 +1279,15 @@ VioGpuMemSegment::VioGpuMemSegment(void)
 	TRACING();
 
 	m_pSGList = NULL;
+	m_pEnts = NULL;
 	m_pVAddr = NULL;
 	m_pMdl = NULL;
 	m_bSystemMemory = FALSE;
 	m_bUserMemory = FALSE;
 	m_bMapped = FALSE;
 	m_Size = 0;
+	m_uPages = 0;
+	m_SysAlloc = SegmentAlloc::None;
 }
 
 VioGpuMemSegment::~VioGpuMemSegment(void)
@@ -921,16 +1304,12 @@ BOOLEAN VioGpuMemSegment::Init(_In_ UINT size, _In_ PPHYSICAL_ADDRESS pPAddr)
 	TRACING();
 
 	ASSERT(size);
-	PVOID buf = NULL;
 	UINT pages = BYTES_TO_PAGES(size);
 	UINT sglsize = sizeof(SCATTER_GATHER_LIST) + (sizeof(SCATTER_GATHER_ELEMENT) * pages);
 	size = pages * PAGE_SIZE;
 
 	if (pPAddr == NULL) {
-		m_pVAddr = new (NonPagedPoolNx) BYTE[size];
-		RtlZeroMemory(m_pVAddr, size);
-
-		if (!m_pVAddr)
+		if (!AllocSystemMemory(size))
 		{
 			ERR("Insufficient resources to allocate %x bytes\n", size);
 			return FALSE;
@@ -950,23 +1329,27 @@ BOOLEAN VioGpuMemSegment::Init(_In_ UINT size, _In_ PPHYSICAL_ADDRESS pPAddr)
 		return FALSE;
 	}
 
-	m_pMdl = IoAllocateMdl(m_pVAddr, size, FALSE, FALSE, NULL);
-	if (!m_pMdl)
-	{
-		ERR("Insufficient resources to allocate MDLs\n");
-		return FALSE;
-	}
-	if (m_bSystemMemory == TRUE) {
-		__try
+	// Pages allocated for an MDL come locked with it
+	if (m_pMdl == NULL) {
+		m_pMdl = IoAllocateMdl(m_pVAddr, size, FALSE, FALSE, NULL);
+		if (!m_pMdl)
 		{
-			MmProbeAndLockPages(m_pMdl, KernelMode, IoWriteAccess);
+			ERR("Insufficient resources to allocate MDLs\n");
+			return FALSE;
 		}
+		if (m_bSystemMemory == TRUE) {
+			__try
+			{
+				MmProbeAndLockPages(m_pMdl, KernelMode, IoWriteAccess);
+			}
 #pragma prefast(suppress: __WARNING_EXCEPTIONEXECUTEHANDLER, "try/except is only able to protect against user-mode errors and these are the only errors we try to catch here");
-		__except (EXCEPTION_EXECUTE_HANDLER)
-		{
-			ERR("Failed to lock pages with error %x\n", GetExceptionCode());
-			IoFreeMdl(m_pMdl);
-			return FALSE;
+			__except (EXCEPTION_EXECUTE_HANDLER)
+			{
+				ERR("Failed to lock pages with error %x\n", GetExceptionCode());
+				IoFreeMdl(m_pMdl);
+				m_pMdl = NULL;
+				return FALSE;
+			}
 		}
 	}
 	m_pSGList = reinterpret_cast<PSCATTER_GATHER_LIST>(new (NonPagedPoolNx) BYTE[sglsize]);
@@ -976,24 +1359,12 @@ BOOLEAN VioGpuMemSegment::Init(_In_ UINT size, _In_ PPHYSICAL_ADDRESS pPAddr)
 	//    (MmGetSystemAddressForMdlSafe(m_pMdl, NormalPagePriority | MdlMappingNoExecute));
 
 	RtlZeroMemory(m_pSGList, sglsize);
-	buf = PAGE_ALIGN(m_pVAddr);
-
-	for (UINT i = 0; i < pages; ++i)
-	{
-		PHYSICAL_ADDRESS pa = { 0 };
-		ASSERT(MmIsAddressValid(buf));
-		pa = MmGetPhysicalAddress(buf);
-		if (pa.QuadPart == 0LL)
-		{
-			ERR("Invalid PA buf = %p element %d\n", buf, i);
-			break;
-		}
-		m_pSGList->Elements[i].Address = pa;
-		m_pSGList->Elements[i].Length = PAGE_SIZE;
-		buf = (PVOID)((LONG_PTR)(buf)+PAGE_SIZE);
-		m_pSGList->NumberOfElements++;
-	}
+	FillSGList(pages);
 	m_Size = size;
+	if (!BuildMemEntries()) {
+		Close();
+		return FALSE;
+	}
 	return TRUE;
 }
 
@@ -1003,11 +1374,16 @@ BOOLEAN VioGpuMemSegment::InitExt(_In_ UINT size, _In_ PVOID pUserAddr)
 	TRACING();
 
 	ASSERT(size);
-	PVOID buf = NULL;
 	UINT pages = BYTES_TO_PAGES(size);
 	UINT sglsize = sizeof(SCATTER_GATHER_LIST) + (sizeof(SCATTER_GATHER_ELEMENT) * pages);
 	size = pages * PAGE_SIZE;
 
+	// Kernel backing left in the segment would be freed as user memory
+	ASSERT(m_pMdl == NULL && m_pVAddr == NULL);
+	m_bSystemMemory = FALSE;
+	m_bMapped = FALSE;
+	m_SysAlloc = SegmentAlloc::None;
+
 	if (size > 0 && pUserAddr != NULL) {
 		m_pVAddr = pUserAddr;
 		m_bUserMemory = TRUE;
@@ -1024,6 +1400,8 @@ BOOLEAN VioGpuMemSegment::InitExt(_In_ UINT size, _In_ PVOID pUserAddr)
 			{
 				ERR("Failed to lock pages with error %x\n", GetExceptionCode());
 				IoFreeMdl(m_pMdl);
+				m_pMdl = NULL;
+				m_pVAddr = NULL;
 				return FALSE;
 			}
 
@@ -1031,25 +1409,13 @@ BOOLEAN VioGpuMemSegment::InitExt(_In_ UINT size, _In_ PVOID pUserAddr)
 			m_pSGList->NumberOfElements = 0;
 			m_pSGList->Reserved = 0;
 			RtlZeroMemory(m_pSGList, sglsize);
-			buf = PAGE_ALIGN(m_pVAddr);
-
-			for (UINT i = 0; i < pages; ++i)
-			{
-				PHYSICAL_ADDRESS pa = { 0 };
-				ASSERT(MmIsAddressValid(buf));
-				pa = MmGetPhysicalAddress(buf);
-				if (pa.QuadPart == 0LL)
-				{
-					ERR("Invalid PA buf = %p element %d\n", buf, i);
-					break;
-				}
-				m_pSGList->Elements[i].Address = pa;
-				m_pSGList->Elements[i].Length = PAGE_SIZE;
-				buf = (PVOID)((LONG_PTR)(buf)+PAGE_SIZE);
-				m_pSGList->NumberOfElements++;
-			}
+			FillSGList(pages);
 
 			m_Size = size;
+			if (!BuildMemEntries()) {
+				Close();
+				return FALSE;
+			}
 			return TRUE;
 		}
 		else {
@@ -1063,6 +1429,108 @@ BOOLEAN VioGpuMemSegment::InitExt(_In_ UINT size, _In_ PVOID pUserAddr)
 	}
 }
 
+// Prefers backing the host can map with few entries: a single physically
+// contiguous run (the primitive mem_alloc_contiguous_pages uses), then pages
+// allocated in contiguous chunks, then plain nonpaged pool
+BOOLEAN VioGpuMemSegment::AllocSystemMemory(_In_ UINT size)
+{
+	PAGED_CODE();
+	TRACING();
+
+	PHYSICAL_ADDRESS low = { 0 };
+	PHYSICAL_ADDRESS high = { 0 };
+	PHYSICAL_ADDRESS skip = { 0 };
+
+	high.QuadPart = 0xFFFFFFFFFF;
+
+	m_pVAddr = MmAllocateContiguousMemory(size, high);
+	if (m_pVAddr) {
+		m_SysAlloc = SegmentAlloc::Contiguous;
+		RtlZeroMemory(m_pVAddr, size);
+		DBGPRINT("%x bytes of contiguous memory\n", size);
+		return TRUE;
+	}
+
+	m_pMdl = MmAllocatePagesForMdlEx(low, high, skip, size, MmCached,
+		MM_ALLOCATE_FULLY_REQUIRED | MM_ALLOCATE_PREFER_CONTIGUOUS);
+	if (m_pMdl) {
+		m_pVAddr = MmMapLockedPagesSpecifyCache(m_pMdl, KernelMode, MmCached, NULL, FALSE,
+			NormalPagePriority | MdlMappingNoExecute);
+		if (m_pVAddr) {
+			m_SysAlloc = SegmentAlloc::PageChunks;
+			RtlZeroMemory(m_pVAddr, size);
+			DBGPRINT("%x bytes in contiguous chunks\n", size);
+			return TRUE;
+		}
+		MmFreePagesFromMdl(m_pMdl);
+		ExFreePool(m_pMdl);
+		m_pMdl = NULL;
+	}
+
+	WARNING("No contiguous memory for %x bytes, using scattered pages\n", size);
+	m_pVAddr = new (NonPagedPoolNx) BYTE[size];
+	if (m_pVAddr) {
+		m_SysAlloc = SegmentAlloc::Pool;
+		RtlZeroMemory(m_pVAddr, size);
+		return TRUE;
+	}
+	return FALSE;
+}
+
+// Walks the pages of the segment and merges physically adjacent ones into
+// a single element, so the host gets one entry per contiguous run
+void VioGpuMemSegment::FillSGList(_In_ UINT pages)
+{
+	PAGED_CODE();
+	TRACING();
+
+	PVOID buf = PAGE_ALIGN(m_pVAddr);
+
+	m_uPages = 0;
+	for (UINT i = 0; i < pages; ++i)
+	{
+		PHYSICAL_ADDRESS pa = { 0 };
+		ASSERT(MmIsAddressValid(buf));
+		pa = MmGetPhysicalAddress(buf);
+		if (pa.QuadPart == 0LL)
+		{
+			ERR("Invalid PA buf = %p element %d\n", buf, i);
+			break;
+		}
+		AppendSGElement(m_pSGList, pa, PAGE_SIZE);
+		buf = (PVOID)((LONG_PTR)(buf)+PAGE_SIZE);
+		m_uPages++;
+	}
+
+	DBGPRINT("%d pages in %d elements\n", m_uPages, m_pSGList->NumberOfElements);
+}
+
+// Every resource created on the segment attaches the same entries, so
+// they are converted from the SG list once
+BOOLEAN VioGpuMemSegment::BuildMemEntries(void)
+{
+	PAGED_CODE();
+	TRACING();
+
+	UINT count = m_pSGList->NumberOfElements;
+	UINT size = FIELD_OFFSET(GPU_MEM_ENTRIES, Entries) + sizeof(GPU_MEM_ENTRY) * count;
+
+	m_pEnts = reinterpret_cast<PGPU_MEM_ENTRIES>(new (NonPagedPoolNx) BYTE[size]);
+	if (!m_pEnts) {
+		ERR("Cannot allocate %d entries\n", count);
+		return FALSE;
+	}
+
+	m_pEnts->RefCount = 1;
+	m_pEnts->NumEntries = count;
+	for (UINT i = 0; i < count; i++) {
+		m_pEnts->Entries[i].addr = m_pSGList->Elements[i].Address.QuadPart;
+		m_pEnts->Entries[i].length = m_pSGList->Elements[i].Length;
+		m_pEnts->Entries[i].padding = 0;
+	}
+	return TRUE;
+}
+
 PHYSICAL_ADDRESS VioGpuMemSegment::GetPhysicalAddress(void)
 {
 	PAGED_CODE();
@@ -1083,16 +1551,28 @@ void VioGpuMemSegment::Close(void)
 
 	if (m_pMdl)
 	{
-		if (m_bSystemMemory || m_bUserMemory) {
-			MmUnlockPages(m_pMdl);
+		if (m_bSystemMemory && m_SysAlloc == SegmentAlloc::PageChunks) {
+			MmUnmapLockedPages(m_pVAddr, m_pMdl);
+			MmFreePagesFromMdl(m_pMdl);
+			ExFreePool(m_pMdl);
+		}
+		else {
+			if (m_bSystemMemory || m_bUserMemory) {
+				MmUnlockPages(m_pMdl);
+			}
+			IoFreeMdl(m_pMdl);
 		}
-		IoFreeMdl(m_pMdl);
 		m_pMdl = NULL;
 	}
 
 	if (!m_bUserMemory) {
 		if (m_bSystemMemory) {
-			delete[] static_cast<BYTE*>(m_pVAddr);
+			if (m_SysAlloc == SegmentAlloc::Contiguous) {
+				MmFreeContiguousMemory(m_pVAddr);
+			}
+			else if (m_SysAlloc == SegmentAlloc::Pool) {
+				delete[] static_cast<BYTE*>(m_pVAddr);
+			}
 		}
 		else if (m_pVAddr) {
 			UnmapFrameBuffer(m_pVAddr, (ULONG)m_Size);
@@ -1100,12 +1580,21 @@ void VioGpuMemSegment::Close(void)
 		}
 	}
 
+	// The segment may be set up again with different backing
 	m_pVAddr = NULL;
+	m_bSystemMemory = FALSE;
+	m_bUserMemory = FALSE;
+	m_SysAlloc = SegmentAlloc::None;
 
 	if (m_pSGList) {
 		delete[] reinterpret_cast<PBYTE>(m_pSGList);
 		m_pSGList = NULL;
 	}
+
+	if (m_pEnts) {
+		ReleaseMemEntries(m_pEnts);
+		m_pEnts = NULL;
+	}
 }
 
 
@@ -1149,7 +1638,7 @@ BOOLEAN VioGpuObj::Init(_In_ UINT size, VioGpuMemSegment* pSegment)
 PVOID CrsrQueue::AllocCursor(PGPU_VBUFFER* buf)
 {
 	PAGED_CODE();
-	TRACING();
+	TRACING_HOT();
 
 	PGPU_VBUFFER vbuf;
 	vbuf = m_pBuf->GetBuf(sizeof(GPU_UPDATE_CURSOR), 0, NULL);
@@ -1165,7 +1654,7 @@ PAGED_CODE_SEG_END
 UINT CrsrQueue::QueueCursor(PGPU_VBUFFER buf)
 {
 	//    PAGED_CODE();
-	TRACING();
+	TRACING_HOT();
 
 	UINT res = 0;
 	KIRQL SavedIrql;
@@ -1173,6 +1662,7 @@ UINT CrsrQueue::QueueCursor(PGPU_VBUFFER buf)
 	VirtIOBufferDescriptor  sg[1];
 	int outcnt = 0;
 	UINT ret = 0;
+	BOOLEAN notify = FALSE;
 
 	ASSERT(buf->size <= PAGE_SIZE);
 	if (BuildSGElement(&sg[outcnt], (PVOID)buf->buf, buf->size))
@@ -1183,26 +1673,14 @@ UINT CrsrQueue::QueueCursor(PGPU_VBUFFER buf)
 	ASSERT(outcnt);
 	Lock(&SavedIrql);
 	ret = AddBuf(&sg[0], outcnt, 0, buf, NULL, 0);
+	if (ret == 0) {
+		notify = KickPrepare();
+	}
 	Unlock(SavedIrql);
-	Kick();
+	if (notify) {
+		Notify();
+	}
 
 	DBGPRINT("vbuf = %p outcnt = %d, ret = %d\n", buf, outcnt, ret);
 	return res;
 }
-
-PGPU_VBUFFER CrsrQueue::DequeueCursor(_Out_ UINT* len)
-{
-	TRACING();
-
-	PGPU_VBUFFER buf = NULL;
-	KIRQL SavedIrql;
-	Lock(&SavedIrql);
-	buf = (PGPU_VBUFFER)GetBuf(len);
-	Unlock(SavedIrql);
-	if (buf == NULL)
-	{
-		*len = 0;
-	}
-	DBGPRINT("buf %p len = %u\n", buf, *len);
-	return buf;
-}
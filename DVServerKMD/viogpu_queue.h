@@ -30,6 +30,9 @@
 
 #pragma once
 #include "helper.h"
+#include "viogpu_spin_budget.h"
+#include "viogpu_damage_merge.h"
+#include "viogpu_buf_list.h"
 
 #pragma pack(1)
 typedef struct virtio_gpu_config {
@@ -40,18 +43,42 @@ typedef struct virtio_gpu_config {
 }GPU_CONFIG, * PGPU_CONFIG;
 #pragma pack()
 
+// Backing of a memory segment in the form the host takes it, built once
+// when the segment is set up. Commands in flight hold a reference, so the
+// array outlives a segment closed before the host answered.
+typedef struct _GPU_MEM_ENTRIES {
+	volatile LONG RefCount;
+	UINT NumEntries;
+	GPU_MEM_ENTRY Entries[ANYSIZE_ARRAY];
+} GPU_MEM_ENTRIES, * PGPU_MEM_ENTRIES;
+
 //#pragma pack(1)
 typedef struct virtio_gpu_vbuffer {
+	// Links the buffer into the free list of VioGpuBuf, SLIST_ENTRY makes
+	// the structure 16 byte aligned. Has to stay first, see
+	// viogpu_buf_list.h
+	SLIST_ENTRY free_entry;
 	char* buf;
 	int size;
 
 	void* data_buf;
 	u32 data_size;
+	// Owner of data_buf when it is a shared entry array
+	PGPU_MEM_ENTRIES data_ents;
 
 	char* resp_buf;
 	int resp_size;
+	// Descriptor table the command goes out with when the ring takes
+	// indirect descriptors, set up once by VioGpuBuf::Init
+	PVOID indirect_va;
+	ULONGLONG indirect_pa;
+	// VioGpuStats::NowUs() when a fenced flush was queued, 0 otherwise
+	ULONGLONG submit_us;
+	// VioGpuStats::NowUs() when the command was added to the ring
+	ULONGLONG queue_us;
 	PKEVENT event;
-	LIST_ENTRY list_entry;
+	UINT screen_num;
+	BOOLEAN in_use;
 }GPU_VBUFFER, * PGPU_VBUFFER;
 //#pragma pack()
 
@@ -61,6 +88,39 @@ typedef struct virtio_gpu_vbuffer {
                                + MAX_INLINE_CMD_SIZE \
                                + MAX_INLINE_RESP_SIZE)
 
+// Descriptors a command is split into at most, and the size of its
+// indirect table. Split and packed descriptors are both 16 bytes, so a
+// table never crosses a page.
+#define SGLIST_SIZE           64
+#define INDIRECT_DESC_SIZE    16
+#define INDIRECT_TABLE_SIZE   (SGLIST_SIZE * INDIRECT_DESC_SIZE)
+
+// Enough for the longest sequence the driver sends at once, a scanout
+// change followed by a transfer and a flush per damage rect of a frame
+#define MAX_BATCH_CMDS        (2 * MAX_DAMAGE_REGION_RECTS + 2)
+
+typedef struct _GPU_BATCH {
+	PGPU_VBUFFER Bufs[MAX_BATCH_CMDS];
+	UINT Count;
+} GPU_BATCH, * PGPU_BATCH;
+
+// Completions DpcRoutine takes off a queue per acquisition of its lock
+#define DPC_HARVEST_BATCH     16
+
+// Processes the completions of a queue outside of the DPC
+typedef VOID(*PQUEUE_POLL_ROUTINE)(_In_ PVOID Context);
+
+// Responses too big to be inline that the driver asks for on every config
+// change, GET_DISPLAY_INFO and GET_EDID
+#define RESP_POOL_CLASSES     2
+
+typedef struct _RESP_POOL_CLASS {
+	SLIST_HEADER FreeList;
+	PBYTE pBase;
+	UINT Size;
+	UINT Count;
+} RESP_POOL_CLASS, * PRESP_POOL_CLASS;
+
 class VioGpuBuf
 {
 public:
@@ -72,14 +132,41 @@ public:
 		_In_ void* resp_buf);
 	void FreeBuf(
 		_In_ PGPU_VBUFFER pbuf);
-	BOOLEAN Init(_In_ UINT cnt);
+	void FreeBufs(
+		_In_reads_(count) PGPU_VBUFFER* bufs,
+		_In_ UINT count);
+	BOOLEAN Init(_In_ UINT cnt, _In_ BOOLEAN bIndirect);
+	PVOID AllocResp(_In_ UINT size);
+	void FreeResp(_In_ PVOID resp);
+	ULONGLONG GetRespHits(void) { return (ULONGLONG)m_RespHits; }
+	ULONGLONG GetRespMisses(void) { return (ULONGLONG)m_RespMisses; }
 private:
 	void Close(void);
+	BOOLEAN InitRespPool(void);
+	void CloseRespPool(void);
+	BOOLEAN InitIndirect(void);
+	void ReleaseData(_In_ PGPU_VBUFFER pbuf);
+	PGPU_VBUFFER GetBufAt(UINT idx) { return reinterpret_cast<PGPU_VBUFFER>(VBufAt(m_pBufs, m_uStride, idx)); }
 private:
-	LIST_ENTRY   m_FreeBufs;
-	LIST_ENTRY   m_InUseBufs;
-	KSPIN_LOCK   m_SpinLock;
+	SLIST_HEADER m_FreeBufs;
+	PBYTE        m_pBufs;
+	PBYTE        m_pIndirect;
+	UINT         m_uStride;
 	UINT         m_uCount;
+	RESP_POOL_CLASS m_RespPool[RESP_POOL_CLASSES];
+	volatile LONG64 m_RespHits;
+	volatile LONG64 m_RespMisses;
+};
+
+// How the memory of a VioGpuMemSegment is backed, the values are reported
+// as is through IOCTL_DVSERVER_GET_DIAG
+enum class SegmentAlloc : UINT {
+	None = 0,
+	Contiguous,     // a single physically contiguous run
+	PageChunks,     // pages allocated in contiguous chunks where possible
+	Pool,           // nonpaged pool, scattered pages
+	Mapped,         // PCI BAR
+	User,           // locked UMD buffer
 };
 
 class VioGpuMemSegment
@@ -91,19 +178,32 @@ public:
 	PVOID GetVirtualAddress(void) { return m_pVAddr; }
 	PHYSICAL_ADDRESS GetPhysicalAddress(void);
 	PSCATTER_GATHER_LIST GetSGList(void) { return m_pSGList; }
+	PGPU_MEM_ENTRIES GetMemEntries(void) { return m_pEnts; }
 	BOOLEAN Init(_In_ UINT size, _In_ PPHYSICAL_ADDRESS pPAddr);
 	BOOLEAN InitExt(_In_ UINT size, _In_ PVOID pUserAddr);
 	BOOLEAN IsSystemMemory(void) { return m_bSystemMemory; }
+	BOOLEAN IsUserMemory(void) { return m_bUserMemory; }
 	void Close(void);
 	PVOID GetFbVAddr() { return m_pVAddr; }
+	// Pages behind the SG list, NumberOfElements of it is smaller once
+	// adjacent pages were merged
+	UINT GetPageCount(void) { return m_uPages; }
+	SegmentAlloc GetAllocType(void) { return m_bUserMemory ? SegmentAlloc::User : (m_bMapped ? SegmentAlloc::Mapped : m_SysAlloc); }
+private:
+	BOOLEAN AllocSystemMemory(_In_ UINT size);
+	void FillSGList(_In_ UINT pages);
+	BOOLEAN BuildMemEntries(void);
 private:
 	BOOLEAN m_bSystemMemory;
 	BOOLEAN m_bUserMemory;
 	BOOLEAN m_bMapped;
 	PSCATTER_GATHER_LIST m_pSGList;
+	PGPU_MEM_ENTRIES m_pEnts;
 	PVOID m_pVAddr;
 	PMDL    m_pMdl;
 	SIZE_T m_Size;
+	UINT m_uPages;
+	SegmentAlloc m_SysAlloc;
 };
 
 class VioGpuObj
@@ -116,8 +216,11 @@ public:
 	BOOLEAN Init(_In_ UINT size, VioGpuMemSegment* pSegment);
 	SIZE_T GetSize(void) { return m_Size; }
 	PSCATTER_GATHER_LIST GetSGList(void) { return m_pSegment ? m_pSegment->GetSGList() : NULL; }
+	PGPU_MEM_ENTRIES GetMemEntries(void) { return m_pSegment ? m_pSegment->GetMemEntries() : NULL; }
 	PHYSICAL_ADDRESS GetPhysicalAddress(void) { PHYSICAL_ADDRESS pa = { 0 }; return m_pSegment ? m_pSegment->GetPhysicalAddress() : pa; }
 	PVOID GetVirtualAddress(void) { return m_pSegment ? m_pSegment->GetVirtualAddress() : NULL; }
+	UINT GetPageCount(void) { return m_pSegment ? m_pSegment->GetPageCount() : 0; }
+	VioGpuMemSegment* GetSegment(void) { return m_pSegment; }
 private:
 	UINT m_uiHwRes;
 	SIZE_T m_Size;
@@ -134,30 +237,49 @@ public:
 		_In_ struct virtqueue* pVirtQueue,
 		_In_ UINT index);
 	void Close(void);
+	// AddBuf, GetBuf and KickPrepare are called under the queue lock
 	int AddBuf(_In_ struct VirtIOBufferDescriptor sg[],
 		_In_ UINT out_num,
 		_In_ UINT in_num,
-		_In_ void* data,
+		_In_ PGPU_VBUFFER buf,
 		_In_ void* va_indirect,
-		_In_ ULONGLONG phys_indirect)
+		_In_ ULONGLONG phys_indirect);
+	PGPU_VBUFFER GetBuf(_Out_ UINT* len);
+	// Must be called right after adding buffers. With
+	// VIRTIO_RING_F_EVENT_IDX the device is only notified when it asked to
+	// be, the notify itself is left for after the lock is dropped.
+	BOOLEAN KickPrepare()
 	{
-		return virtqueue_add_buf(m_pVirtQueue, sg, out_num, in_num, data,
-			va_indirect, phys_indirect);
-	}
-	void* GetBuf(_Out_ UINT* len)
-	{
-		return virtqueue_get_buf(m_pVirtQueue, len);
+		BOOLEAN notify = (virtqueue_kick_prepare(m_pVirtQueue) ? TRUE : FALSE);
+
+		m_Stats.RecordKick(notify);
+		return notify;
 	}
-	void Kick()
+	void Notify()
 	{
-		virtqueue_kick_always(m_pVirtQueue);
+		virtqueue_notify(m_pVirtQueue);
 	}
-	BOOLEAN EnableInterrupt(void) { return (virtqueue_enable_cb(m_pVirtQueue) ? TRUE : FALSE); }
+	// Taken under the queue lock, see EnableInterrupt
+	BOOLEAN EnableInterrupt(void);
+	BOOLEAN EnableInterruptDelayed(void);
+	// Also called from EvtInterruptDisable at DIRQL, so without the lock
 	VOID DisableInterrupt(void) { virtqueue_disable_cb(m_pVirtQueue); }
 	BOOLEAN InterruptEnabled(void) { return virtqueue_is_interrupt_enabled(m_pVirtQueue); }
 	UINT QueryAllocation();
 	void SetGpuBuf(_In_ VioGpuBuf* pbuf) { m_pBuf = pbuf; }
+	// VIRTIO_RING_F_INDIRECT_DESC was negotiated
+	void SetIndirect(_In_ BOOLEAN bIndirect) { m_bIndirect = bIndirect; }
+	BOOLEAN IsIndirect(void) { return m_bIndirect; }
 	void ReleaseBuffer(PGPU_VBUFFER buf);
+	void ReleaseBuffers(PGPU_VBUFFER* bufs, UINT count);
+	UINT DequeueBuffers(_Out_writes_to_(max, return) PGPU_VBUFFER* bufs, _Out_writes_to_(max, return) UINT* lens, _In_ UINT max);
+	void SetPollRoutine(_In_ PQUEUE_POLL_ROUTINE pfnPoll, _In_ PVOID Context) { m_pfnPoll = pfnPoll; m_PollContext = Context; }
+	NTSTATUS WaitForCompletion(_In_ PKEVENT event, _In_opt_ PLARGE_INTEGER timeout);
+	ULONGLONG GetWaitSpinHits(void) { return (ULONGLONG)m_WaitSpinHits; }
+	ULONGLONG GetWaitSleeps(void) { return (ULONGLONG)m_WaitSleeps; }
+	ULONG GetSpinBudget(void) { return (ULONG)m_SpinBudgetUs; }
+	VioGpuQueueStats* GetStats(void) { return &m_Stats; }
+	void ResetStats(void);
 protected:
 	_IRQL_requires_max_(DISPATCH_LEVEL)
 		_IRQL_saves_global_(OldIrql, Irql)
@@ -167,36 +289,59 @@ protected:
 		_IRQL_restores_global_(OldIrql, Irql)
 		void Unlock(KIRQL Irql);
 private:
+	void UpdateSpinBudget(ULONGLONG latency_us) { m_SpinBudgetUs = TuneSpinBudget(m_SpinBudgetUs, latency_us); }
 	struct virtqueue* m_pVirtQueue;
 	VirtIODevice* m_pVIODevice;
 	UINT m_Index;
 	KSPIN_LOCK m_SpinLock;
+	PQUEUE_POLL_ROUTINE m_pfnPoll;
+	PVOID m_PollContext;
+	// Waits the spin satisfied and waits that had to sleep on the event
+	volatile LONG m_SpinBudgetUs;
+	volatile LONG64 m_WaitSpinHits;
+	volatile LONG64 m_WaitSleeps;
+	VioGpuQueueStats m_Stats;
 protected:
 	VioGpuBuf* m_pBuf;
+	BOOLEAN m_bIndirect;
 };
 
 class CtrlQueue : public VioGpuQueue
 {
 public:
+	CtrlQueue() : m_FenceId(0) {}
 	PVOID AllocCmd(PGPU_VBUFFER* buf, int sz);
 	PVOID AllocCmdResp(PGPU_VBUFFER* buf, int cmd_sz, PVOID resp_buf, int resp_sz);
 
 	UINT QueueBuffer(PGPU_VBUFFER buf);
-	PGPU_VBUFFER DequeueBuffer(_Out_ UINT* len);
-
-	void CreateResource(UINT res_id, UINT format, UINT width, UINT height);
-	void CreateResourceBlob(UINT res_id, PGPU_MEM_ENTRY ents, UINT nents, ULONGLONG width, ULONGLONG height, ULONGLONG stride);
-	void UnrefResource(UINT id);
-	void InvalBacking(UINT id);
-	void SetScanout(UINT scan_id, UINT res_id, UINT width, UINT height, UINT x, UINT y);
-	void SetScanoutBlob(UINT scan_id, UINT res_id, UINT width, UINT height, UINT format, UINT x, UINT y, UINT stride);
-	void ResFlush(UINT res_id, UINT width, UINT height, UINT x, UINT y, UINT screen_num, KEVENT* event);
-	void TransferToHost2D(UINT res_id, ULONG offset, UINT width, UINT height, UINT x, UINT y, PUINT fence_id);
-	void AttachBacking(UINT res_id, PGPU_MEM_ENTRY ents, UINT nents);
+
+	// Commands given a batch are only queued by CommitBatch
+	void BeginBatch(PGPU_BATCH batch) { batch->Count = 0; }
+	BOOLEAN CommitBatch(PGPU_BATCH batch);
+
+	void CreateResource(UINT res_id, UINT format, UINT width, UINT height, PGPU_BATCH batch = NULL);
+	void CreateResourceBlob(UINT res_id, PGPU_MEM_ENTRIES ents, ULONGLONG width, ULONGLONG height, ULONGLONG stride, PGPU_BATCH batch = NULL);
+	void UnrefResource(UINT id, PGPU_BATCH batch = NULL);
+	void InvalBacking(UINT id, PGPU_BATCH batch = NULL);
+	void SetScanout(UINT scan_id, UINT res_id, UINT width, UINT height, UINT x, UINT y, PGPU_BATCH batch = NULL);
+	void SetScanoutBlob(UINT scan_id, UINT res_id, UINT width, UINT height, UINT format, UINT x, UINT y, UINT stride, PGPU_BATCH batch = NULL);
+	BOOLEAN ResFlush(UINT res_id, UINT width, UINT height, UINT x, UINT y, UINT screen_num, PULONGLONG fence_id, PGPU_BATCH batch = NULL);
+	void TransferToHost2D(UINT res_id, ULONG offset, UINT width, UINT height, UINT x, UINT y, PUINT fence_id, PGPU_BATCH batch = NULL);
+	void AttachBacking(UINT res_id, PGPU_MEM_ENTRIES ents, PGPU_BATCH batch = NULL);
 	BOOLEAN GetDisplayInfo(PGPU_VBUFFER buf, UINT id, PULONG xres, PULONG yres);
 	BOOLEAN AskDisplayInfo(PGPU_VBUFFER* buf, KEVENT* event);
 	BOOLEAN AskEdidInfo(PGPU_VBUFFER* buf, UINT id, KEVENT* event);
 	BOOLEAN GetEdidInfo(PGPU_VBUFFER buf, UINT id, PBYTE edid);
+	ULONGLONG GetLastFenceId(void) { return (ULONGLONG)m_FenceId; }
+	// Takes a fence id for a flush that is going to be queued later, see
+	// ResFlush
+	ULONGLONG ReserveFenceId(void) { return (ULONGLONG)InterlockedIncrement64(&m_FenceId); }
+private:
+	BOOLEAN BuildSGList(PGPU_VBUFFER buf, VirtIOBufferDescriptor* sg, PUINT pOutCnt, PUINT pInCnt);
+	int AddCmd(PGPU_VBUFFER buf, VirtIOBufferDescriptor* sg, UINT outcnt, UINT incnt);
+	UINT Submit(PGPU_VBUFFER buf, PGPU_BATCH batch);
+private:
+	volatile LONG64 m_FenceId;
 };
 
 class CrsrQueue : public VioGpuQueue
@@ -204,6 +349,5 @@ class CrsrQueue : public VioGpuQueue
 public:
 	PVOID AllocCursor(PGPU_VBUFFER* buf);
 	UINT QueueCursor(PGPU_VBUFFER buf);
-	PGPU_VBUFFER DequeueCursor(_Out_ UINT* len);
 };
 
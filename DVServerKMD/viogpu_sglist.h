@@ -0,0 +1,29 @@
+/*
+ * Copyright (C) 2021 Intel Corporation
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#pragma once
+
+// Scatter/gather list building behind VioGpuMemSegment::FillSGList. It
+// uses no more than the Windows base types, so the host tests in tests\ build
+// it without the WDK.
+
+// Adds a range to the list, growing the last element instead when the
+// range starts right where it ends. The list must have room for one more.
+static inline VOID AppendSGElement(_Inout_ PSCATTER_GATHER_LIST pSGList, _In_ PHYSICAL_ADDRESS pa, _In_ ULONG length)
+{
+	if (pSGList->NumberOfElements != 0)
+	{
+		PSCATTER_GATHER_ELEMENT last = &pSGList->Elements[pSGList->NumberOfElements - 1];
+		if (last->Address.QuadPart + last->Length == pa.QuadPart &&
+			last->Length <= MAXULONG - length)
+		{
+			last->Length += length;
+			return;
+		}
+	}
+
+	pSGList->Elements[pSGList->NumberOfElements].Address = pa;
+	pSGList->Elements[pSGList->NumberOfElements].Length = length;
+	pSGList->NumberOfElements++;
+}
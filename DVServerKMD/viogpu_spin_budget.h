@@ -0,0 +1,25 @@
+/*
+ * Copyright (C) 2021 Intel Corporation
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#pragma once
+
+// The spin budget of VioGpuQueue::WaitForCompletion. It uses no more than
+// the Windows base types, so the host tests in tests\ build it without the
+// WDK.
+
+// Bounds and start value of the budget, in microseconds
+#define WAIT_SPIN_MIN_US      2
+#define WAIT_SPIN_MAX_US      100
+#define WAIT_SPIN_DEFAULT_US  20
+
+// Moves the budget a quarter of the way towards twice the latency of the
+// last wait. A wait too long for any spin to cover pulls it towards the
+// minimum, so a slow host soon stops costing spin time.
+static inline LONG TuneSpinBudget(_In_ LONG budget, _In_ ULONGLONG latency_us)
+{
+	LONG target = (latency_us <= WAIT_SPIN_MAX_US / 2) ? (LONG)(latency_us * 2) : WAIT_SPIN_MIN_US;
+
+	budget += (target - budget) / 4;
+	return max(WAIT_SPIN_MIN_US, min(WAIT_SPIN_MAX_US, budget));
+}
@@ -0,0 +1,229 @@
+/*
+ * Copyright (C) 2021 Intel Corporation
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include "helper.h"
+#include "viogpu_stats.h"
+#include "Trace.h"
+#include <viogpu_stats.tmh>
+#if !DBG
+#include "viogpu_stats.tmh"
+#endif
+
+// Bucket 0 holds values under 1, bucket n [2^(n-1), 2^n) and the last one
+// everything bigger
+static UINT Log2Bucket(ULONGLONG value, UINT count)
+{
+	ULONG msb;
+
+	if (!BitScanReverse64(&msb, value)) {
+		return 0;
+	}
+	return min(msb + 1, count - 1);
+}
+
+VioGpuStats::VioGpuStats(void)
+{
+	Reset();
+}
+
+// The counter is split into whole seconds and the rest, so the conversion
+// cannot overflow however long the machine has been up
+ULONGLONG VioGpuStats::NowUs(void)
+{
+	LARGE_INTEGER freq;
+	LARGE_INTEGER now = KeQueryPerformanceCounter(&freq);
+
+	return (ULONGLONG)(now.QuadPart / freq.QuadPart) * 1000000 +
+		(ULONGLONG)(now.QuadPart % freq.QuadPart) * 1000000 / freq.QuadPart;
+}
+
+ULONGLONG VioGpuStats::ElapsedUs(_In_ ULONGLONG start_us)
+{
+	ULONGLONG now = NowUs();
+
+	return (now > start_us) ? now - start_us : 0;
+}
+
+void VioGpuStats::Record(_In_ UINT stage, _In_ ULONGLONG us)
+{
+	UINT bucket = Log2Bucket(us, STATS_BUCKETS);
+
+	ASSERT(stage < STATS_STAGE_COUNT);
+	InterlockedIncrement64(&m_Buckets[stage][bucket]);
+	InterlockedExchangeAdd64(&m_SumUs[stage], (LONG64)us);
+}
+
+// Samples recorded while the histograms are copied may be missing from
+// the sums or the buckets, which is fine for percentiles
+void VioGpuStats::Fill(_Out_ struct stats_info* info)
+{
+	for (UINT i = 0; i < STATS_STAGE_COUNT; i++) {
+		for (UINT j = 0; j < STATS_BUCKETS; j++) {
+			info->buckets[i][j] = (UINT64)m_Buckets[i][j];
+		}
+		info->sum_us[i] = (UINT64)m_SumUs[i];
+	}
+}
+
+void VioGpuStats::Reset(void)
+{
+	for (UINT i = 0; i < STATS_STAGE_COUNT; i++) {
+		for (UINT j = 0; j < STATS_BUCKETS; j++) {
+			InterlockedExchange64(&m_Buckets[i][j], 0);
+		}
+		InterlockedExchange64(&m_SumUs[i], 0);
+	}
+}
+
+VioGpuQueueStats::VioGpuQueueStats(void)
+{
+	m_pCpu = NULL;
+	m_uCpuCount = 0;
+	m_uRingSize = 0;
+	m_InFlight = 0;
+	m_MaxInFlight = 0;
+}
+
+VioGpuQueueStats::~VioGpuQueueStats(void)
+{
+	if (m_pCpu) {
+		ExFreePoolWithTag(m_pCpu, VIOGPUTAG);
+		m_pCpu = NULL;
+	}
+}
+
+// The slots stay allocated until the queue object goes away, a restart of
+// the device only clears them. Without them the queue runs uncounted.
+// Array new only promises 16 byte alignment, so the slots come straight
+// from the pool with the cache alignment DECLSPEC_CACHEALIGN asks for.
+BOOLEAN VioGpuQueueStats::Init(_In_ UINT ring_size)
+{
+	TRACING();
+
+	if (!m_pCpu) {
+		m_uCpuCount = KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+		m_pCpu = (PQUEUE_CPU_STATS)ExAllocatePool2(POOL_FLAG_NON_PAGED | POOL_FLAG_CACHE_ALIGNED,
+			sizeof(QUEUE_CPU_STATS) * m_uCpuCount, VIOGPUTAG);
+		if (!m_pCpu) {
+			ERR("Failed to allocate counters for %d processors\n", m_uCpuCount);
+			m_uCpuCount = 0;
+			return FALSE;
+		}
+		ASSERT(((ULONG_PTR)m_pCpu & (SYSTEM_CACHE_ALIGNMENT_SIZE - 1)) == 0);
+	}
+	m_uRingSize = ring_size;
+	m_InFlight = 0;
+	m_MaxInFlight = 0;
+	Reset();
+	return TRUE;
+}
+
+// Processors added later than Init share the last slot, which is still
+// safe as the callers hold the queue lock
+PQUEUE_CPU_STATS VioGpuQueueStats::GetCpuStats(void)
+{
+	ULONG cpu = KeGetCurrentProcessorNumberEx(NULL);
+
+	return &m_pCpu[min(cpu, m_uCpuCount - 1)];
+}
+
+static UINT CmdIndex(UINT type)
+{
+	return min(type & 0xFF, QSTATS_CMD_TYPES - 1);
+}
+
+void VioGpuQueueStats::RecordAdd(_In_ UINT type, _In_ BOOLEAN bAdded)
+{
+	if (!m_pCpu) {
+		return;
+	}
+
+	PQUEUE_CPU_STATS pCpu = GetCpuStats();
+	if (!bAdded) {
+		pCpu->AddFailures++;
+		return;
+	}
+	pCpu->Occupancy[Log2Bucket((ULONGLONG)m_InFlight, QSTATS_OCC_BUCKETS)]++;
+	pCpu->Submitted[CmdIndex(type)]++;
+	m_InFlight++;
+	if (m_InFlight > m_MaxInFlight) {
+		m_MaxInFlight = m_InFlight;
+	}
+}
+
+void VioGpuQueueStats::RecordComplete(_In_ UINT type, _In_ ULONGLONG us)
+{
+	if (!m_pCpu) {
+		return;
+	}
+
+	PQUEUE_CPU_STATS pCpu = GetCpuStats();
+	UINT idx = CmdIndex(type);
+	pCpu->Completed[idx]++;
+	pCpu->SumUs[idx] += us;
+	pCpu->Buckets[idx][Log2Bucket(us, STATS_BUCKETS)]++;
+	if (m_InFlight > 0) {
+		m_InFlight--;
+	}
+}
+
+void VioGpuQueueStats::RecordKick(_In_ BOOLEAN bNotify)
+{
+	if (!m_pCpu) {
+		return;
+	}
+
+	PQUEUE_CPU_STATS pCpu = GetCpuStats();
+	if (bNotify) {
+		pCpu->Notifies++;
+	}
+	else {
+		pCpu->NotifiesSuppressed++;
+	}
+}
+
+// The sums may miss the commands counted while they are taken, which is
+// fine for rates and percentiles
+void VioGpuQueueStats::Fill(_Inout_ struct queue_stats_info* info)
+{
+	info->ring_size = m_uRingSize;
+	info->in_flight = (unsigned int)m_InFlight;
+	info->max_in_flight = (unsigned int)m_MaxInFlight;
+	info->add_failures = 0;
+	info->notifies = 0;
+	info->notifies_suppressed = 0;
+	RtlZeroMemory(info->occupancy, sizeof(info->occupancy));
+	RtlZeroMemory(info->submitted, sizeof(info->submitted));
+	RtlZeroMemory(info->completed, sizeof(info->completed));
+	RtlZeroMemory(info->sum_us, sizeof(info->sum_us));
+	RtlZeroMemory(info->buckets, sizeof(info->buckets));
+
+	for (ULONG cpu = 0; cpu < m_uCpuCount; cpu++) {
+		PQUEUE_CPU_STATS pCpu = &m_pCpu[cpu];
+
+		info->add_failures += pCpu->AddFailures;
+		info->notifies += pCpu->Notifies;
+		info->notifies_suppressed += pCpu->NotifiesSuppressed;
+		for (UINT i = 0; i < QSTATS_OCC_BUCKETS; i++) {
+			info->occupancy[i] += pCpu->Occupancy[i];
+		}
+		for (UINT i = 0; i < QSTATS_CMD_TYPES; i++) {
+			info->submitted[i] += pCpu->Submitted[i];
+			info->completed[i] += pCpu->Completed[i];
+			info->sum_us[i] += pCpu->SumUs[i];
+			for (UINT j = 0; j < STATS_BUCKETS; j++) {
+				info->buckets[i][j] += pCpu->Buckets[i][j];
+			}
+		}
+	}
+}
+
+void VioGpuQueueStats::Reset(void)
+{
+	if (m_pCpu) {
+		RtlZeroMemory(m_pCpu, sizeof(QUEUE_CPU_STATS) * m_uCpuCount);
+	}
+	m_MaxInFlight = m_InFlight;
+}
@@ -0,0 +1,69 @@
+/*
+ * Copyright (C) 2021 Intel Corporation
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#pragma once
+#include "helper.h"
+#include "Public.h"
+
+/*
+ * Latency histograms of the present stages of a screen, read out through
+ * IOCTL_DVSERVER_GET_STATS. Recording a sample is two interlocked adds, so
+ * it runs on the present path and in the DPC without a lock.
+ */
+class VioGpuStats
+{
+public:
+	VioGpuStats(void);
+	static ULONGLONG NowUs(void);
+	static ULONGLONG ElapsedUs(_In_ ULONGLONG start_us);
+	void Record(_In_ UINT stage, _In_ ULONGLONG us);
+	void Fill(_Inout_ struct stats_info* info);
+	void Reset(void);
+private:
+	volatile LONG64 m_Buckets[STATS_STAGE_COUNT][STATS_BUCKETS];
+	volatile LONG64 m_SumUs[STATS_STAGE_COUNT];
+};
+
+// Counters of a queue as one processor saw them. VioGpuQueueStats::Init
+// allocates the slots cache aligned, so a slot never shares a cache line
+// with the slot of another processor
+typedef struct DECLSPEC_CACHEALIGN _QUEUE_CPU_STATS {
+	ULONGLONG Submitted[QSTATS_CMD_TYPES];
+	ULONGLONG Completed[QSTATS_CMD_TYPES];
+	ULONGLONG SumUs[QSTATS_CMD_TYPES];
+	ULONGLONG Buckets[QSTATS_CMD_TYPES][STATS_BUCKETS];
+	ULONGLONG Occupancy[QSTATS_OCC_BUCKETS];
+	ULONGLONG AddFailures;
+	ULONGLONG Notifies;
+	ULONGLONG NotifiesSuppressed;
+} QUEUE_CPU_STATS, * PQUEUE_CPU_STATS;
+
+/*
+ * Per command type counters of a virtqueue, read out through
+ * IOCTL_DVSERVER_GET_QUEUE_STATS. The Record calls come from under the
+ * queue lock at DISPATCH_LEVEL, so each processor bumps its own slot with
+ * plain adds. Fill sums the slots without the lock.
+ */
+class VioGpuQueueStats
+{
+public:
+	VioGpuQueueStats(void);
+	~VioGpuQueueStats(void);
+	BOOLEAN Init(_In_ UINT ring_size);
+	void RecordAdd(_In_ UINT type, _In_ BOOLEAN bAdded);
+	void RecordComplete(_In_ UINT type, _In_ ULONGLONG us);
+	void RecordKick(_In_ BOOLEAN bNotify);
+	void Fill(_Inout_ struct queue_stats_info* info);
+	// Must be called under the queue lock, see VioGpuQueue::ResetStats
+	void Reset(void);
+private:
+	PQUEUE_CPU_STATS GetCpuStats(void);
+private:
+	PQUEUE_CPU_STATS m_pCpu;
+	ULONG m_uCpuCount;
+	UINT m_uRingSize;
+	// Commands added and not taken back yet, changed under the queue lock
+	volatile LONG m_InFlight;
+	volatile LONG m_MaxInFlight;
+};
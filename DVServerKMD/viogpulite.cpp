@@ -54,6 +54,8 @@ extern "C" int _fltused = 0;
 
 static UINT g_InstanceId = 0;
 
+UINT ColorFormat(UINT format);
+
 PAGED_CODE_SEG_BEGIN
 
 ScreenInfo::ScreenInfo()
@@ -66,18 +68,52 @@ ScreenInfo::ScreenInfo()
 	m_ModeNumbers = NULL;
 	m_CurrentMode = 0;
 	m_CustomMode = 0;
-	for (size_t i = 0; i < FRAMEBUFFER_COUNT; i++) {
-		m_pFrameBuf[i] = NULL;
-	}
+	for (UINT i = 0; i < MAX_FRAMEBUFFER_COUNT; i++) {
+		m_FrameBuf[i].pObj = NULL;
+		m_FrameBuf[i].State = FrameBufState::Free;
+		m_FrameBuf[i].Fence = 0;
+	}
+	m_FrameBufferCount = MIN_FRAMEBUFFER_COUNT;
+	m_FramesPresented = 0;
+	m_FramesDropped = 0;
+	m_FramesReplaced = 0;
+	m_FbAlloc = SegmentAlloc::None;
+	m_FbAllocPages = 0;
+	m_FbAllocEntries = 0;
 	m_FrontBufferIndex = 0;
 	m_pCursorBuf = NULL;
 	m_FlushCount = 0;
 	enabled = FALSE;
+	InvalidateFrameBufferCache();
+	for (UINT i = 0; i < MAX_PINNED_SEGMENTS; i++) {
+		m_Pinned[i].Process = NULL;
+		m_Pinned[i].Owner = NULL;
+		m_Pinned[i].LastUse = 0;
+	}
+	m_PinClock = 0;
+	m_PresentOwner = NULL;
+	m_PresentEntryUs = 0;
+	m_bFullDamagePending = FALSE;
+	m_LastSubmittedFence = 0;
+	m_LastRetiredFence = 0;
+	m_RetiredFenceHead = 0;
+	RtlZeroMemory(m_RetiredFences, sizeof(m_RetiredFences));
 	RtlZeroMemory(&mode_list, sizeof(output_modelist));
 	RtlZeroMemory(&gpu_disp_mode_ext, sizeof(GPU_DISP_MODE_EXT) * MAX_MODELIST_SIZE);
 	RtlZeroMemory(&m_DisplayInfoEvent.Header, sizeof(m_DisplayInfoEvent.Header));
 	RtlZeroMemory(&m_EdidEvent.Header, sizeof(m_EdidEvent.Header));
-	RtlZeroMemory(&m_FlushEvent.Header, sizeof(m_FlushEvent.Header));
+	KeInitializeSpinLock(&m_FenceLock);
+	FenceTrackerInit(&m_Fences);
+	InitializeListHead(&m_FenceWaiters);
+	ExInitializeResourceLite(&m_Lock);
+	KeInitializeSpinLock(&m_PresentLock);
+	PresentMailboxInit(&m_Mailbox);
+	KeInitializeEvent(&m_PresentEvent, SynchronizationEvent, FALSE);
+	m_pPresentThread = NULL;
+	m_bStopPresentThread = FALSE;
+	m_pAdapter = NULL;
+	m_ScreenNum = 0;
+	m_ReservedFence = 0;
 }
 
 ScreenInfo::~ScreenInfo()
@@ -87,6 +123,7 @@ ScreenInfo::~ScreenInfo()
 	m_CurrentMode = 0;
 	m_CustomMode = 0;
 	m_ModeCount = 0;
+	ExDeleteResourceLite(&m_Lock);
 }
 
 void ScreenInfo::Reset()
@@ -105,23 +142,168 @@ void ScreenInfo::Reset()
 	RtlZeroMemory(&gpu_disp_mode_ext, sizeof(GPU_DISP_MODE_EXT) * MAX_MODELIST_SIZE);
 }
 
-void ScreenInfo::SwapFramebuffer() {
-	m_FrontBufferIndex = (m_FrontBufferIndex + 1) % FRAMEBUFFER_COUNT;
+// back is the slot CreateFrameBufferObj filled, which is no longer Free
+// once queued. See VioGpuAdapterLite::ReapFrameBufferSlots for the old one
+void ScreenInfo::SwapFramebuffer(UINT back) {
+	m_FrontBufferIndex = FrameBufSwap(m_FrameBuf, m_FrameBufferCount, m_FrontBufferIndex, back);
+}
+
+void ScreenInfo::RecordFrameSegmentAlloc(void) {
+	PSCATTER_GATHER_LIST sgl = m_FrameSegment.GetSGList();
+
+	m_FbAlloc = m_FrameSegment.GetAllocType();
+	m_FbAllocPages = m_FrameSegment.GetPageCount();
+	m_FbAllocEntries = sgl ? sgl->NumberOfElements : 0;
+	DBGPRINT("FB segment backing %d, %d pages in %d entries\n",
+		(UINT)m_FbAlloc, m_FbAllocPages, m_FbAllocEntries);
 }
 
 UINT ScreenInfo::GetFrameBufferIndex(FrameBufSlot bufSlot) {
-	return (m_FrontBufferIndex + (UINT) bufSlot) % FRAMEBUFFER_COUNT;
+	if (bufSlot == FrameBufSlot::Front)
+		return m_FrontBufferIndex;
+
+	return FrameBufBackIndex(m_FrameBuf, m_FrameBufferCount, m_FrontBufferIndex);
 }
 
 VioGpuObj* ScreenInfo::GetFrameBufferObj(FrameBufSlot bufSlot) {
-	return m_pFrameBuf[GetFrameBufferIndex(bufSlot)];
+	UINT index = GetFrameBufferIndex(bufSlot);
+	return (index < m_FrameBufferCount) ? m_FrameBuf[index].pObj : NULL;
 }
 
 void ScreenInfo::SetFrameBufferObj(VioGpuObj* buf, FrameBufSlot bufSlot) {
+	UINT index = GetFrameBufferIndex(bufSlot);
 	ASSERT(buf != NULL);
-	m_pFrameBuf[GetFrameBufferIndex(bufSlot)] = buf;
+	ASSERT(index < m_FrameBufferCount);
+	m_FrameBuf[index].pObj = buf;
 };
 
+void ScreenInfo::SetFrameBufferCount(UINT count) {
+	ASSERT(m_FrameBuf[m_FrontBufferIndex].pObj == NULL);
+	m_FrameBufferCount = max(MIN_FRAMEBUFFER_COUNT, min(count, MAX_FRAMEBUFFER_COUNT));
+	m_FrontBufferIndex = 0;
+}
+
+void ScreenInfo::QueueFrameBuffer(FrameBufSlot bufSlot, ULONGLONG fence_id) {
+	UINT index = GetFrameBufferIndex(bufSlot);
+	ASSERT(index < m_FrameBufferCount);
+	FrameBufQueue(&m_FrameBuf[index], fence_id);
+}
+
+void ScreenInfo::UpdateFrameBufferStates(void) {
+	FrameBufUpdateFront(&m_FrameBuf[m_FrontBufferIndex], (ULONGLONG)m_LastRetiredFence);
+}
+
+// The front object can only be flushed again as is while the user pages it
+// was created on are still locked
+BOOLEAN ScreenInfo::IsFrameBufferCached(const FRAMEBUFFER_CACHE_KEY* pKey) {
+	VioGpuObj* pObj = GetFrameBufferObj(FrameBufSlot::Front);
+	VioGpuMemSegment* pSegment = pObj ? pObj->GetSegment() : NULL;
+
+	if (!m_bFbCacheValid || pSegment == NULL)
+		return FALSE;
+
+	if (!pSegment->IsUserMemory() || pSegment->GetFbVAddr() != pKey->UserAddr)
+		return FALSE;
+
+	return (RtlCompareMemory(&m_FbCacheKey, pKey, sizeof(FRAMEBUFFER_CACHE_KEY)) == sizeof(FRAMEBUFFER_CACHE_KEY));
+}
+
+void ScreenInfo::SetFrameBufferCache(const FRAMEBUFFER_CACHE_KEY* pKey) {
+	RtlCopyMemory(&m_FbCacheKey, pKey, sizeof(FRAMEBUFFER_CACHE_KEY));
+	m_bFbCacheValid = TRUE;
+}
+
+void ScreenInfo::InvalidateFrameBufferCache() {
+	RtlZeroMemory(&m_FbCacheKey, sizeof(FRAMEBUFFER_CACHE_KEY));
+	m_bFbCacheValid = FALSE;
+}
+
+// The UMD rotates through a few staging buffers, so the pages a present
+// locked can back a later one as long as neither the range nor the process
+// changed. A new buffer takes the least recently used entry no framebuffer
+// object references any more
+VioGpuMemSegment* ScreenInfo::PinFrameSegment(PVOID pUserAddr, UINT size) {
+	PINNED_SEGMENT* pVictim = NULL;
+	ULONGLONG start_us;
+
+	m_PinClock++;
+	for (UINT i = 0; i < MAX_PINNED_SEGMENTS; i++) {
+		PINNED_SEGMENT* pPinned = &m_Pinned[i];
+		if (pPinned->Segment.IsUserMemory() &&
+			pPinned->Segment.GetFbVAddr() == pUserAddr &&
+			pPinned->Segment.GetSize() == ROUND_TO_PAGES(size) &&
+			pPinned->Process == PsGetCurrentProcess()) {
+			pPinned->LastUse = m_PinClock;
+			return &pPinned->Segment;
+		}
+		if (!IsFrameSegmentInUse(&pPinned->Segment) &&
+			(pVictim == NULL || pPinned->LastUse < pVictim->LastUse)) {
+			pVictim = pPinned;
+		}
+	}
+
+	if (pVictim == NULL) {
+		ERR("No free entry to lock the buffer %p into\n", pUserAddr);
+		return NULL;
+	}
+
+	UnpinFrameSegment(pVictim);
+	start_us = VioGpuStats::NowUs();
+	if (!pVictim->Segment.InitExt(size, pUserAddr)) {
+		pVictim->Segment.Close();
+		m_Stats.Record(STATS_STAGE_LOCK, VioGpuStats::ElapsedUs(start_us));
+		return NULL;
+	}
+	m_Stats.Record(STATS_STAGE_LOCK, VioGpuStats::ElapsedUs(start_us));
+	pVictim->Process = PsGetCurrentProcess();
+	pVictim->Owner = m_PresentOwner;
+	pVictim->LastUse = m_PinClock;
+	return &pVictim->Segment;
+}
+
+// The host may still read the pages of any object left in a slot
+BOOLEAN ScreenInfo::IsFrameSegmentInUse(VioGpuMemSegment* pSegment) {
+	for (UINT i = 0; i < MAX_FRAMEBUFFER_COUNT; i++) {
+		if (m_FrameBuf[i].pObj && m_FrameBuf[i].pObj->GetSegment() == pSegment)
+			return TRUE;
+	}
+	return FALSE;
+}
+
+void ScreenInfo::UnpinFrameSegment(PINNED_SEGMENT* pPinned) {
+	if (pPinned->Segment.IsUserMemory()) {
+		pPinned->Segment.Close();
+	}
+	pPinned->Process = NULL;
+	pPinned->Owner = NULL;
+	pPinned->LastUse = 0;
+}
+
+BOOLEAN ScreenInfo::IsPinnedSegment(VioGpuMemSegment* pSegment, PVOID Owner) {
+	for (UINT i = 0; i < MAX_PINNED_SEGMENTS; i++) {
+		if (&m_Pinned[i].Segment == pSegment)
+			return pSegment->IsUserMemory() && (Owner == NULL || m_Pinned[i].Owner == Owner);
+	}
+	return FALSE;
+}
+
+// Unpins the buffers of Owner, or all of them for NULL. Objects created on
+// the unlocked pages must not be flushed again as is. A buffer an object in
+// a slot still references stays locked, see DetachPinnedObjs
+void ScreenInfo::UnpinFrameSegments(PVOID Owner) {
+	for (UINT i = 0; i < MAX_PINNED_SEGMENTS; i++) {
+		if (!m_Pinned[i].Segment.IsUserMemory() || (Owner != NULL && m_Pinned[i].Owner != Owner))
+			continue;
+		InvalidateFrameBufferCache();
+		if (IsFrameSegmentInUse(&m_Pinned[i].Segment)) {
+			WARNING("Buffer %p of screen %d is still in use, left locked\n",
+				m_Pinned[i].Segment.GetFbVAddr(), m_ScreenNum);
+			continue;
+		}
+		UnpinFrameSegment(&m_Pinned[i]);
+	}
+}
+
 VioGpuAdapterLite::VioGpuAdapterLite(_In_ PVOID pvDeviceContext) : IVioGpuAdapterLite(pvDeviceContext)
 {
 	PAGED_CODE();
@@ -135,7 +317,12 @@ VioGpuAdapterLite::VioGpuAdapterLite(_In_ PVOID pvDeviceContext) : IVioGpuAdapte
 	m_bStopWorkThread = FALSE;
 	m_pWorkThread = NULL;
 	m_bBlobSupported = FALSE;
+	m_bPackedRing = FALSE;
+	m_bIrqCoalescing = FALSE;
 	hpd_event = NULL;
+	m_NextFramePoolId = 0;
+	m_SgPagesSent = 0;
+	m_SgEntriesSent = 0;
 	m_u64HostFeatures = 0;
 	m_u64GuestFeatures = 0;
 	m_u32NumScanouts = 0;
@@ -143,6 +330,11 @@ VioGpuAdapterLite::VioGpuAdapterLite(_In_ PVOID pvDeviceContext) : IVioGpuAdapte
 	RtlZeroMemory(&m_Flags, sizeof(DEVICE_STATUS_FLAG));
 	RtlZeroMemory(&m_VioDev, sizeof(VirtIODevice));
 	RtlZeroMemory(&m_CurrentModeInfo, sizeof(CURRENT_MODE));
+	ExInitializeResourceLite(&m_screen_lock);
+	for (UINT32 i = 0; i < MAX_SCAN_OUT; i++) {
+		m_screen[i].m_pAdapter = this;
+		m_screen[i].m_ScreenNum = i;
+	}
 }
 
 VioGpuAdapterLite::~VioGpuAdapterLite(void)
@@ -151,13 +343,14 @@ VioGpuAdapterLite::~VioGpuAdapterLite(void)
 	TRACING();
 	VioGpuAdapterLiteClose();
 	HWClose();
+	ExDeleteResourceLite(&m_screen_lock);
 	m_Id = 0;
 	g_InstanceId--;
 }
 
 static BOOLEAN IsSameMode(PVIDEO_MODE_INFORMATION pModeInfo, CURRENT_MODE* pCurrentMode)
 {
-	TRACING();
+	TRACING_SAMPLED(TRACE_SAMPLE_RATE);
 	BOOLEAN result = FALSE;
 
 	if (!pModeInfo || !pCurrentMode)
@@ -170,21 +363,19 @@ static BOOLEAN IsSameMode(PVIDEO_MODE_INFORMATION pModeInfo, CURRENT_MODE* pCurr
 	return result;
 }
 
-NTSTATUS VioGpuAdapterLite::SetCurrentModeExt(CURRENT_MODE* pCurrentMode)
+NTSTATUS VioGpuAdapterLite::SetCurrentModeExt(CURRENT_MODE* pCurrentMode, const DAMAGE_REGION* pDamage)
 {
 	NTSTATUS status = STATUS_UNSUCCESSFUL;
 
 	PAGED_CODE();
-	TRACING();
+	TRACING_SAMPLED(TRACE_SAMPLE_RATE);
 
 	if (!pCurrentMode) {
 		ERR("Mode pointer is NULL\n");
 		return status;
 	}
 
-	// Adding a lock here to prevent potential memory dereferencing issues,
-	//as m_screen is utilized across multiple threads
-	KeWaitForMutexObject(&m_screen_mutex, Executive, KernelMode, FALSE, NULL);
+	LockScreen(pCurrentMode->DispInfo.TargetId, TRUE);
 	DBGPRINT("ScreenNum = %d, Mode = %dx%d\n", pCurrentMode->DispInfo.TargetId, pCurrentMode->DispInfo.Width, pCurrentMode->DispInfo.Height);
 
 	for (ULONG idx = 0; idx < m_screen[pCurrentMode->DispInfo.TargetId].GetModeCount(); idx++)
@@ -196,22 +387,68 @@ NTSTATUS VioGpuAdapterLite::SetCurrentModeExt(CURRENT_MODE* pCurrentMode)
 
 		RtlCopyMemory(&m_CurrentModeInfo, pCurrentMode, sizeof(CURRENT_MODE));
 
-		if (!m_screen[pCurrentMode->DispInfo.TargetId].m_FlushCount) {
-			CreateFrameBufferObj(&m_screen[pCurrentMode->DispInfo.TargetId].m_ModeInfo[idx], FrameBufSlot::Back, pCurrentMode);
-			m_screen[pCurrentMode->DispInfo.TargetId].SwapFramebuffer();
-			DestroyFrameBufferSlotObj(pCurrentMode->DispInfo.TargetId, FrameBufSlot::Back, FALSE);
+		ReapFrameBufferSlots(pCurrentMode->DispInfo.TargetId);
+
+		if (m_screen[pCurrentMode->DispInfo.TargetId].CanQueueFrame()) {
+			PVIDEO_MODE_INFORMATION pModeInfo = &m_screen[pCurrentMode->DispInfo.TargetId].m_ModeInfo[idx];
+			FRAMEBUFFER_CACHE_KEY key = { 0 };
+			key.UserAddr = pCurrentMode->FrameBuffer.Ptr;
+			key.Size = pCurrentMode->DispInfo.Pitch * pModeInfo->VisScreenHeight;
+			key.Width = pModeInfo->VisScreenWidth;
+			key.Height = pModeInfo->VisScreenHeight;
+			key.Stride = pCurrentMode->Stride;
+			key.Format = ColorFormat(pCurrentMode->DispInfo.ColorFormat);
+
+			// The front buffer object still references the same user pages,
+			// so only the host copy needs refreshing
+			if (key.UserAddr && m_screen[pCurrentMode->DispInfo.TargetId].IsFrameBufferCached(&key)) {
+				FlushFrameBufferObj(pModeInfo, pCurrentMode, pDamage);
+				InterlockedIncrement(&m_screen[pCurrentMode->DispInfo.TargetId].m_FramesPresented);
+				break;
+			}
+
+			if (!m_screen[pCurrentMode->DispInfo.TargetId].HasFreeFrameBuffer()) {
+				m_screen[pCurrentMode->DispInfo.TargetId].m_bFullDamagePending = TRUE;
+				InterlockedIncrement(&m_screen[pCurrentMode->DispInfo.TargetId].m_FramesDropped);
+				DBGPRINT("For screen %d all %d framebuffers are busy, dropped %d frames so far\n",
+					pCurrentMode->DispInfo.TargetId, m_screen[pCurrentMode->DispInfo.TargetId].m_FrameBufferCount,
+					m_screen[pCurrentMode->DispInfo.TargetId].m_FramesDropped);
+				break;
+			}
+
+			UINT back = m_screen[pCurrentMode->DispInfo.TargetId].GetFrameBufferIndex(FrameBufSlot::Back);
+			m_screen[pCurrentMode->DispInfo.TargetId].InvalidateFrameBufferCache();
+			// Without a back buffer object the front one stays on screen
+			if (!CreateFrameBufferObj(pModeInfo, FrameBufSlot::Back, pCurrentMode)) {
+				m_screen[pCurrentMode->DispInfo.TargetId].m_bFullDamagePending = TRUE;
+				InterlockedIncrement(&m_screen[pCurrentMode->DispInfo.TargetId].m_FramesDropped);
+				ERR("For screen %d the framebuffer could not be created, dropped %d frames so far\n",
+					pCurrentMode->DispInfo.TargetId, m_screen[pCurrentMode->DispInfo.TargetId].m_FramesDropped);
+				status = STATUS_INSUFFICIENT_RESOURCES;
+				break;
+			}
+			m_screen[pCurrentMode->DispInfo.TargetId].SwapFramebuffer(back);
+			InterlockedIncrement(&m_screen[pCurrentMode->DispInfo.TargetId].m_FramesPresented);
+			if (key.UserAddr && m_screen[pCurrentMode->DispInfo.TargetId].GetFrameBufferObj(FrameBufSlot::Front)) {
+				m_screen[pCurrentMode->DispInfo.TargetId].SetFrameBufferCache(&key);
+			}
 			DBGPRINT("screen %d: setting current mode (%d x %d)\n",
-				pCurrentMode->DispInfo.TargetId, m_screen[pCurrentMode->DispInfo.TargetId].m_ModeInfo[idx].VisScreenWidth,
-				m_screen[pCurrentMode->DispInfo.TargetId].m_ModeInfo[idx].VisScreenHeight);
+				pCurrentMode->DispInfo.TargetId, pModeInfo->VisScreenWidth, pModeInfo->VisScreenHeight);
 		}
 		else {
-			DBGPRINT("For screen %d Pending flush (%d) with Qemu so not sending another request\n",
-				pCurrentMode->DispInfo.TargetId, m_screen[pCurrentMode->DispInfo.TargetId].m_FlushCount);
+			// The damage of a skipped frame is lost, so the next flush has
+			// to cover the whole surface. Presents from the worker wait in
+			// the mailbox instead, only a mode set can still end up here
+			m_screen[pCurrentMode->DispInfo.TargetId].m_bFullDamagePending = TRUE;
+			InterlockedIncrement(&m_screen[pCurrentMode->DispInfo.TargetId].m_FramesDropped);
+			DBGPRINT("For screen %d Pending flush (%d) with Qemu so not sending another request, dropped %d frames so far\n",
+				pCurrentMode->DispInfo.TargetId, m_screen[pCurrentMode->DispInfo.TargetId].m_FlushCount,
+				m_screen[pCurrentMode->DispInfo.TargetId].m_FramesDropped);
 		}
 		break;
 	}
 
-	KeReleaseMutex(&m_screen_mutex, FALSE);
+	UnlockScreen(pCurrentMode->DispInfo.TargetId);
 	return status;
 }
 
@@ -228,7 +465,7 @@ NTSTATUS VioGpuAdapterLite::VioGpuAdapterLiteInit()
 		return status;
 	}
 
-	KeInitializeMutex(&m_screen_mutex, 0);
+	ReadRegistryParameters();
 
 	status = VirtIoDeviceInit();
 	if (!NT_SUCCESS(status)) {
@@ -250,6 +487,17 @@ NTSTATUS VioGpuAdapterLite::VioGpuAdapterLiteInit()
 #if (NTDDI_VERSION >= NTDDI_WIN10)
 		AckFeature(VIRTIO_F_ACCESS_PLATFORM);
 #endif
+		// Lets the rings skip notifies and interrupts the other side does
+		// not need, see VioGpuQueue::KickPrepare and DpcRoutine
+		AckFeature(VIRTIO_RING_F_EVENT_IDX);
+		// The ring layout is hidden behind the virtqueue ops, so the queue
+		// code is the same for both
+		if (m_bPackedRing) {
+			AckFeature(VIRTIO_F_RING_PACKED);
+		}
+		// Lets a control command take a single ring slot, see
+		// CtrlQueue::AddCmd
+		AckFeature(VIRTIO_RING_F_INDIRECT_DESC);
 		status = virtio_set_features(&m_VioDev, m_u64GuestFeatures);
 		if (!NT_SUCCESS(status))
 		{
@@ -257,6 +505,9 @@ NTSTATUS VioGpuAdapterLite::VioGpuAdapterLiteInit()
 			VioGpuDbgBreak();
 			break;
 		}
+		DBGPRINT("Features = %llx, packed ring = %d, event idx = %d, indirect = %d\n", m_u64GuestFeatures,
+			m_VioDev.packed_ring, m_VioDev.event_suppression_enabled,
+			virtio_is_feature_enabled(m_u64GuestFeatures, VIRTIO_RING_F_INDIRECT_DESC));
 
 		status = virtio_find_queues(
 			&m_VioDev,
@@ -275,6 +526,7 @@ NTSTATUS VioGpuAdapterLite::VioGpuAdapterLiteInit()
 			VioGpuDbgBreak();
 			break;
 		}
+		m_CtrlQueue.SetIndirect(virtio_is_feature_enabled(m_u64GuestFeatures, VIRTIO_RING_F_INDIRECT_DESC));
 
 		// In HPD thread we are handling the display arrival and departure in runtime,
 		// So setting m_u32NumScanouts as 4 always.
@@ -322,6 +574,11 @@ void VioGpuAdapterLite::VioGpuAdapterLiteClose()
 		SetHardwareInit(FALSE);
 
 		virtio_device_reset(&m_VioDev);
+		// Nothing queued before the reset is going to complete, release
+		// anybody waiting on those flushes
+		for (UINT32 i = 0; i < MAX_SCAN_OUT; i++) {
+			m_screen[i].RetireAllFences();
+		}
 		virtio_delete_queues(&m_VioDev);
 		m_CtrlQueue.Close();
 		m_CursorQueue.Close();
@@ -346,6 +603,8 @@ NTSTATUS VioGpuAdapterLite::SetPowerState(DEVICE_POWER_STATE DevicePowerState)
 	case PowerDeviceUnspecified:
 	case PowerDeviceD0: {
 		VioGpuAdapterLiteInit();
+		// HWClose stopped the present threads on the way down
+		StartPresentThreads();
 		KeSetEvent(&m_ConfigUpdateEvent, IO_NO_INCREMENT, FALSE);
 	} break;
 	case PowerDeviceD1:
@@ -409,18 +668,184 @@ NTSTATUS VioGpuAdapterLite::VirtIoDeviceInit()
 		m_PciResources.IsMSIEnabled());
 }
 
+static ULONG ReadDriverParameter(PCWSTR Name, ULONG Default, ULONG Min, ULONG Max)
+{
+	PAGED_CODE();
+	TRACING();
+
+	NTSTATUS status;
+	WDFKEY hKey = NULL;
+	UNICODE_STRING valueName;
+	ULONG value = Default;
+
+	status = WdfDriverOpenParametersRegistryKey(WdfGetDriver(), KEY_READ, WDF_NO_OBJECT_ATTRIBUTES, &hKey);
+	if (!NT_SUCCESS(status)) {
+		return Default;
+	}
+
+	RtlInitUnicodeString(&valueName, Name);
+	status = WdfRegistryQueryULong(hKey, &valueName, &value);
+	WdfRegistryClose(hKey);
+
+	if (!NT_SUCCESS(status)) {
+		return Default;
+	}
+
+	if (value < Min || value > Max) {
+		WARNING("%ws = %d is out of range [%d, %d], using %d\n", Name, value, Min, Max, Default);
+		return Default;
+	}
+
+	DBGPRINT("%ws = %d\n", Name, value);
+	return value;
+}
+
+void VioGpuAdapterLite::ReadRegistryParameters(void)
+{
+	PAGED_CODE();
+	TRACING();
+
+	ULONG count = ReadDriverParameter(REG_FRAMEBUFFER_COUNT, ScreenInfo::MIN_FRAMEBUFFER_COUNT,
+		ScreenInfo::MIN_FRAMEBUFFER_COUNT, ScreenInfo::MAX_FRAMEBUFFER_COUNT);
+
+	for (UINT32 i = 0; i < MAX_SCAN_OUT; i++) {
+		m_screen[i].SetFrameBufferCount(count);
+	}
+
+	m_bPackedRing = (ReadDriverParameter(REG_PACKED_RING, 0, 0, 1) != 0);
+	m_bIrqCoalescing = (ReadDriverParameter(REG_IRQ_COALESCING, 0, 0, 1) != 0);
+}
+
+VOID VioGpuAdapterLite::UnpinFrameSegments(UINT32 screen_num)
+{
+	PAGED_CODE();
+	TRACING();
+
+	LockScreen(screen_num, TRUE);
+	DetachPinnedObjs(screen_num, NULL);
+	m_screen[screen_num].UnpinFrameSegments(NULL);
+	UnlockScreen(screen_num);
+}
+
+// Pages locked for a process have to be unlocked before it exits. The
+// present worker takes and runs a present under the screen lock, so no
+// present of the closing file can lock them again once this returned
+VOID VioGpuAdapterLite::ReleaseFrameSegments(PVOID Owner)
+{
+	PAGED_CODE();
+	TRACING();
+
+	LockAllScreens();
+	for (UINT32 i = 0; i < MAX_SCAN_OUT; i++) {
+		DetachPinnedObjs(i, Owner);
+		m_screen[i].UnpinFrameSegments(Owner);
+	}
+	UnlockAllScreens();
+}
+
+// Destroys the slot objects created on the buffers of Owner, or on any
+// locked buffer for NULL, so that their pages can be unlocked. The host may
+// still be reading them through the last flush, so when that does not
+// retire in time they are left alone. Called with the screen lock held.
+VOID VioGpuAdapterLite::DetachPinnedObjs(UINT32 screen_num, PVOID Owner)
+{
+	PAGED_CODE();
+	TRACING();
+
+	ScreenInfo* pScreen = &m_screen[screen_num];
+	BOOLEAN bWaited = FALSE;
+
+	for (UINT i = 0; i < pScreen->m_FrameBufferCount; i++) {
+		FRAMEBUFFER_SLOT* pSlot = &pScreen->m_FrameBuf[i];
+
+		if (pSlot->pObj == NULL || !pScreen->IsPinnedSegment(pSlot->pObj->GetSegment(), Owner))
+			continue;
+
+		if (!bWaited) {
+			if (WaitForFence(screen_num, GetLastSubmittedFence(screen_num), SET_MODE_FENCE_TIMEOUT_MS, NULL) != STATUS_SUCCESS) {
+				ERR("Flushes of screen %d still pending, buffers stay locked\n", screen_num);
+				return;
+			}
+			bWaited = TRUE;
+		}
+		if (i == pScreen->GetFrameBufferIndex(FrameBufSlot::Front)) {
+			m_CtrlQueue.SetScanout(screen_num, 0, 0, 0, 0, 0);
+		}
+		DestroyFrameBufferObj(&pSlot->pObj, FALSE);
+		pSlot->State = FrameBufState::Free;
+	}
+}
+
+// Work on a single screen holds the adapter lock shared and the lock of
+// that screen, so screens never wait on each other. Work spanning all
+// screens holds the adapter lock exclusive. Both are recursive for the
+// owning thread, but a shared owner must not ask for exclusive access.
+VOID VioGpuAdapterLite::LockScreen(UINT32 screen_num, BOOLEAN bExclusive)
+{
+	PAGED_CODE();
+
+	KeEnterCriticalRegion();
+	ExAcquireResourceSharedLite(&m_screen_lock, TRUE);
+	if (bExclusive) {
+		ExAcquireResourceExclusiveLite(&m_screen[screen_num].m_Lock, TRUE);
+	}
+	else {
+		ExAcquireResourceSharedLite(&m_screen[screen_num].m_Lock, TRUE);
+	}
+}
+
+VOID VioGpuAdapterLite::UnlockScreen(UINT32 screen_num)
+{
+	PAGED_CODE();
+
+	ExReleaseResourceLite(&m_screen[screen_num].m_Lock);
+	ExReleaseResourceLite(&m_screen_lock);
+	KeLeaveCriticalRegion();
+}
+
+VOID VioGpuAdapterLite::LockAllScreens(void)
+{
+	PAGED_CODE();
+
+	KeEnterCriticalRegion();
+	ExAcquireResourceExclusiveLite(&m_screen_lock, TRUE);
+}
+
+VOID VioGpuAdapterLite::UnlockAllScreens(void)
+{
+	PAGED_CODE();
+
+	ExReleaseResourceLite(&m_screen_lock);
+	KeLeaveCriticalRegion();
+}
+
+VOID VioGpuAdapterLite::FillEdidInfo(UINT32 screen_num, struct edid_info* edata)
+{
+	PAGED_CODE();
+	TRACING();
+
+	LockScreen(screen_num, FALSE);
+	if (GetModeListSize(screen_num) != 0) {
+		edata->mode_size = GetModeListSize(screen_num);
+	}
+	else {
+		edata->mode_size = QEMU_MODELIST_SIZE;
+	}
+	RtlCopyMemory(edata->edid_data, GetEdidData(screen_num), EDID_V1_BLOCK_SIZE);
+	CopyResolution(screen_num, edata);
+	UnlockScreen(screen_num);
+}
+
 PBYTE VioGpuAdapterLite::GetEdidData(UINT Id)
 {
 	PAGED_CODE();
 	TRACING();
 	PBYTE ret;
 
+	// The pointer is only stable while the caller holds the lock of the
+	// screen, FillEdidInfo is the reader path for everybody else
 	if (m_bEDID) {
-		// Adding a lock here to prevent potential memory dereferencing issues,
-		//as m_screen is utilized across multiple threads
-		KeWaitForMutexObject(&m_screen_mutex, Executive, KernelMode, FALSE, NULL);
 		ret = m_screen[Id].m_EDIDs;
-		KeReleaseMutex(&m_screen_mutex, FALSE);
 	}
 	else {
 		ret = (PBYTE)(&g_gpu_edid);
@@ -464,13 +889,14 @@ NTSTATUS VioGpuAdapterLite::HWInit(WDFCMRESLIST pResList, DXGK_DISPLAY_INFORMATI
 		DBGPRINT("size %d\n", size);
 		ASSERT(size);
 
-		if (!m_GpuBuf.Init(size)) {
+		if (!m_GpuBuf.Init(size, m_CtrlQueue.IsIndirect())) {
 			ERR("Failed to initialize buffers\n");
 			VioGpuDbgBreak();
 			break;
 		}
 
 		m_CtrlQueue.SetGpuBuf(&m_GpuBuf);
+		m_CtrlQueue.SetPollRoutine(VioGpuAdapterLite::CtrlQueuePoll, this);
 		m_CursorQueue.SetGpuBuf(&m_GpuBuf);
 
 		if (!m_Idr.Init(1)) {
@@ -505,6 +931,12 @@ NTSTATUS VioGpuAdapterLite::HWInit(WDFCMRESLIST pResList, DXGK_DISPLAY_INFORMATI
 
 	ZwClose(threadHandle);
 
+	status = StartPresentThreads();
+	if (!NT_SUCCESS(status))
+	{
+		return status;
+	}
+
 	status = GetModeList(pDispInfo);
 	if (!NT_SUCCESS(status))
 	{
@@ -531,6 +963,7 @@ NTSTATUS VioGpuAdapterLite::HWInit(WDFCMRESLIST pResList, DXGK_DISPLAY_INFORMATI
 			VioGpuDbgBreak();
 			return status;
 		}
+		m_screen[i].RecordFrameSegmentAlloc();
 	}
 
 	for (UINT32 i = 0; i < m_u32NumScanouts; i++) {		
@@ -571,7 +1004,9 @@ NTSTATUS VioGpuAdapterLite::HWClose(void)
 		ObDereferenceObject(m_pWorkThread);
 		m_pWorkThread = NULL;
 	}
+	StopPresentThreads();
 	for (UINT32 i = 0; i < m_u32NumScanouts; i++) {
+		m_screen[i].UnpinFrameSegments(NULL);
 		if (m_screen[i].m_FrameSegment.GetFbVAddr()) {
 			m_screen[i].m_FrameSegment.Close();
 		}
@@ -582,56 +1017,6 @@ NTSTATUS VioGpuAdapterLite::HWClose(void)
 	return STATUS_SUCCESS;
 }
 
-BOOLEAN FindUpdateRect(
-	_In_ ULONG             NumMoves,
-	_In_ D3DKMT_MOVE_RECT* pMoves,
-	_In_ ULONG             NumDirtyRects,
-	_In_ PRECT             pDirtyRect,
-	_In_ D3DKMDT_VIDPN_PRESENT_PATH_ROTATION Rotation,
-	_Out_ PRECT pUpdateRect)
-{
-	PAGED_CODE();
-	TRACING();
-	UNREFERENCED_PARAMETER(Rotation);
-	BOOLEAN updated = FALSE;
-	for (ULONG i = 0; i < NumMoves; i++)
-	{
-		PRECT  pRect = &pMoves[i].DestRect;
-		if (!updated)
-		{
-			*pUpdateRect = *pRect;
-			updated = TRUE;
-		}
-		else
-		{
-			pUpdateRect->bottom = max(pRect->bottom, pUpdateRect->bottom);
-			pUpdateRect->left = min(pRect->left, pUpdateRect->left);
-			pUpdateRect->right = max(pRect->right, pUpdateRect->right);
-			pUpdateRect->top = min(pRect->top, pUpdateRect->top);
-		}
-	}
-	for (ULONG i = 0; i < NumDirtyRects; i++)
-	{
-		PRECT  pRect = &pDirtyRect[i];
-		if (!updated)
-		{
-			*pUpdateRect = *pRect;
-			updated = TRUE;
-		}
-		else
-		{
-			pUpdateRect->bottom = max(pRect->bottom, pUpdateRect->bottom);
-			pUpdateRect->left = min(pRect->left, pUpdateRect->left);
-			pUpdateRect->right = max(pRect->right, pUpdateRect->right);
-			pUpdateRect->top = min(pRect->top, pUpdateRect->top);
-		}
-	}
-	if (Rotation == D3DKMDT_VPPR_ROTATE90 || Rotation == D3DKMDT_VPPR_ROTATE270)
-	{
-	}
-	return updated;
-}
-
 NTSTATUS VioGpuAdapterLite::ExecutePresentDisplayZeroCopy(
 	_In_ BYTE* SrcAddr,
 	_In_ UINT               SrcBytesPerPixel,
@@ -639,10 +1024,12 @@ NTSTATUS VioGpuAdapterLite::ExecutePresentDisplayZeroCopy(
 	_In_ UINT               SrcWidth,
 	_In_ UINT               SrcHeight,
 	_In_ UINT               ScreenNum,
-	_In_ UINT               Stride)
+	_In_ UINT               Stride,
+	_In_opt_ const DAMAGE_REGION* pDamage,
+	_Out_opt_ PULONGLONG    FenceId)
 {
 	PAGED_CODE();
-	TRACING();
+	TRACING_SAMPLED(TRACE_SAMPLE_RATE);
 
 	BLT_INFO SrcBltInfo = { 0 };
 	BLT_INFO DstBltInfo = { 0 };
@@ -660,7 +1047,10 @@ NTSTATUS VioGpuAdapterLite::ExecutePresentDisplayZeroCopy(
 	tempCurrentMode.FrameBuffer.Ptr = SrcAddr;
 	tempCurrentMode.Stride = Stride;
 
-	status = SetCurrentModeExt(&tempCurrentMode);
+	status = SetCurrentModeExt(&tempCurrentMode, pDamage);
+	if (FenceId) {
+		*FenceId = GetLastSubmittedFence(ScreenNum);
+	}
 
 	DBGPRINT("offset = (XxYxWxH) (%dx%dx%dx%d) vs (%dx%dx%dx%d)\n",
 		rect.left,
@@ -672,8 +1062,6 @@ NTSTATUS VioGpuAdapterLite::ExecutePresentDisplayZeroCopy(
 		SrcWidth,
 		SrcHeight);
 
-	Close(ScreenNum);
-
 	return status;
 }
 
@@ -688,6 +1076,8 @@ VOID VioGpuAdapterLite::BlackOutScreen(CURRENT_MODE* pCurrentMod)
 		BYTE* pDst = (BYTE*)pCurrentMod->FrameBuffer.Ptr;
 
 		UINT resid = 0;
+		ULONGLONG fence_id;
+		GPU_BATCH batch;
 
 		if (pDst)
 		{
@@ -695,15 +1085,19 @@ VOID VioGpuAdapterLite::BlackOutScreen(CURRENT_MODE* pCurrentMod)
 		}
 
 		//FIXME!!! rotation
-		KeWaitForMutexObject(&m_screen_mutex, Executive, KernelMode, FALSE, NULL);
+		LockScreen(pCurrentMod->DispInfo.TargetId, TRUE);
 
 		resid = m_screen[pCurrentMod->DispInfo.TargetId].GetFrameBufferObj(FrameBufSlot::Front)->GetId();
 
-		m_CtrlQueue.TransferToHost2D(resid, 0UL, pCurrentMod->DispInfo.Width, pCurrentMod->DispInfo.Height, 0, 0, NULL);
-		m_screen[pCurrentMod->DispInfo.TargetId].m_FlushCount++;
-		m_CtrlQueue.ResFlush(resid, pCurrentMod->DispInfo.Width, pCurrentMod->DispInfo.Height, 0, 0, pCurrentMod->DispInfo.TargetId,
-			&m_screen[pCurrentMod->DispInfo.TargetId].m_FlushEvent);
-		KeReleaseMutex(&m_screen_mutex, FALSE);
+		m_CtrlQueue.BeginBatch(&batch);
+		// Blob resources scan out of the guest pages directly
+		if (!m_bBlobSupported) {
+			m_CtrlQueue.TransferToHost2D(resid, 0UL, pCurrentMod->DispInfo.Width, pCurrentMod->DispInfo.Height, 0, 0, NULL, &batch);
+		}
+		fence_id = QueueResFlush(pCurrentMod->DispInfo.TargetId, resid, pCurrentMod->DispInfo.Width, pCurrentMod->DispInfo.Height, 0, 0, TRUE, &batch);
+		fence_id = CommitCtrlBatch(&batch, pCurrentMod->DispInfo.TargetId, fence_id);
+		m_screen[pCurrentMod->DispInfo.TargetId].QueueFrameBuffer(FrameBufSlot::Front, fence_id);
+		UnlockScreen(pCurrentMod->DispInfo.TargetId);
 	}
 }
 
@@ -715,7 +1109,7 @@ NTSTATUS VioGpuAdapterLite::SetPointerShape(_In_ CONST POINTER_SHAPE* pSetPointe
 	UNREFERENCED_PARAMETER(cf);
 	UNREFERENCED_PARAMETER(cursor_visible);
 
-	TRACING();
+	TRACING_SAMPLED(TRACE_SAMPLE_RATE);
 
 	DestroyCursor(pSetPointerShape->pointer.VidPnSourceId);
 	if (CreateCursor(pSetPointerShape, cf))
@@ -747,7 +1141,7 @@ NTSTATUS VioGpuAdapterLite::SetPointerShape(_In_ CONST POINTER_SHAPE* pSetPointe
 NTSTATUS VioGpuAdapterLite::SetPointerPosition(_In_ CONST DXGKARG_SETPOINTERPOSITION* pSetPointerPosition)
 {
 	PAGED_CODE();
-	TRACING();
+	TRACING_SAMPLED(TRACE_SAMPLE_RATE);
 	
 	if (m_screen[pSetPointerPosition->VidPnSourceId].m_pCursorBuf != NULL)
 	{
@@ -814,14 +1208,12 @@ BOOLEAN VioGpuAdapterLite::GetEdids(UINT32 screen_num)
 
 	PGPU_VBUFFER vbuf = NULL;
 
-	// Adding a lock here to prevent potential memory dereferencing issues,
-	//as m_screen is utilized across multiple threads
-	KeWaitForMutexObject(&m_screen_mutex, Executive, KernelMode, FALSE, NULL);
+	LockScreen(screen_num, TRUE);
 	if (m_CtrlQueue.AskEdidInfo(&vbuf, screen_num, &m_screen[screen_num].m_EdidEvent) &&
 		m_CtrlQueue.GetEdidInfo(vbuf, screen_num, m_screen[screen_num].m_EDIDs)) {
 		m_bEDID = TRUE;
 	}
-	KeReleaseMutex(&m_screen_mutex, FALSE);
+	UnlockScreen(screen_num);
 	m_CtrlQueue.ReleaseBuffer(vbuf);
 
 	return TRUE;
@@ -912,9 +1304,8 @@ NTSTATUS VioGpuAdapterLite::GetModeList(DXGK_DISPLAY_INFORMATION* pDispInfo)
 
 	TRACING();
 
-	// Adding a lock here to prevent potential memory dereferencing issues,
-	//as m_screen is utilized across multiple threads
-	KeWaitForMutexObject(&m_screen_mutex, Executive, KernelMode, FALSE, NULL);
+	// Rebuilds the mode lists of all screens at once
+	LockAllScreens();
 	for (UINT32 i = 0; i < m_u32NumScanouts; i++) {
 
 		UINT ModeCount = 0;
@@ -930,7 +1321,7 @@ NTSTATUS VioGpuAdapterLite::GetModeList(DXGK_DISPLAY_INFORMATION* pDispInfo)
 		{
 			Status = STATUS_NO_MEMORY;
 			ERR("VioGpuAdapterLite::GetModeList failed to allocate m_ModeInfo memory\n");
-			return Status;
+			break;
 		}
 		RtlZeroMemory(m_screen[i].m_ModeInfo, sizeof(VIDEO_MODE_INFORMATION) * ModeCount);
 
@@ -939,7 +1330,7 @@ NTSTATUS VioGpuAdapterLite::GetModeList(DXGK_DISPLAY_INFORMATION* pDispInfo)
 		{
 			Status = STATUS_NO_MEMORY;
 			ERR("VioGpuAdapterLite::GetModeList failed to allocate m_ModeNumbers memory\n");
-			return Status;
+			break;
 		}
 		RtlZeroMemory(m_screen[i].m_ModeNumbers, sizeof(USHORT) * ModeCount);
 		m_screen[i].m_CurrentMode = 0;
@@ -1005,14 +1396,163 @@ NTSTATUS VioGpuAdapterLite::GetModeList(DXGK_DISPLAY_INFORMATION* pDispInfo)
 				m_screen[i].m_ModeInfo[idx].VisScreenHeight);
 		}
 	}
-	KeReleaseMutex(&m_screen_mutex, FALSE);
+	UnlockAllScreens();
 	return Status;
 }
 PAGED_CODE_SEG_END
 
+// Makes what the tracker retired visible and wakes the waiters it covers.
+// Called with m_FenceLock held.
+void ScreenInfo::PublishRetiredFence(void)
+{
+	if ((ULONGLONG)m_LastRetiredFence < m_Fences.Retired) {
+		InterlockedExchange64(&m_LastRetiredFence, (LONG64)m_Fences.Retired);
+	}
+	for (PLIST_ENTRY pEntry = m_FenceWaiters.Flink; pEntry != &m_FenceWaiters; pEntry = pEntry->Flink) {
+		PFENCE_WAITER pWaiter = CONTAINING_RECORD(pEntry, FENCE_WAITER, Entry);
+		if (IsFenceRetired(pWaiter->Fence)) {
+			KeSetEvent(&pWaiter->Event, IO_NO_INCREMENT, FALSE);
+		}
+	}
+}
+
+// The fence stays pending until its present's flush retires or the fence
+// is released, see viogpu_fence_tracker.h
+BOOLEAN ScreenInfo::ReserveFence(CtrlQueue* pCtrlQueue, PULONGLONG pFence)
+{
+	KIRQL oldIrql;
+	BOOLEAN bReserved;
+
+	// Reserved under the lock, so no flush with a later id can retire
+	// before the tracker knows about this one
+	KeAcquireSpinLock(&m_FenceLock, &oldIrql);
+	*pFence = pCtrlQueue->ReserveFenceId();
+	bReserved = FenceTrackerReserve(&m_Fences, *pFence);
+	KeReleaseSpinLock(&m_FenceLock, oldIrql);
+
+	if (!bReserved) {
+		ERR("Too many presents pending, fence %llu not reserved\n", *pFence);
+		*pFence = 0;
+	}
+	return bReserved;
+}
+
+void ScreenInfo::MarkFenceFlushed(ULONGLONG fence_id)
+{
+	KIRQL oldIrql;
+
+	KeAcquireSpinLock(&m_FenceLock, &oldIrql);
+	FenceTrackerMarkFlushed(&m_Fences, fence_id);
+	KeReleaseSpinLock(&m_FenceLock, oldIrql);
+}
+
+void ScreenInfo::RetireFence(ULONGLONG fence_id)
+{
+	KIRQL oldIrql;
+	LONG count;
+	LONG head = InterlockedIncrement(&m_RetiredFenceHead) - 1;
+
+	m_RetiredFences[(ULONG)head % FENCE_RING_SIZE] = fence_id;
+
+	count = InterlockedDecrement(&m_FlushCount);
+	if (count < 0) {
+		ERR("Flush count underflow on fence %llu\n", fence_id);
+		InterlockedExchange(&m_FlushCount, 0);
+	}
+
+	KeAcquireSpinLock(&m_FenceLock, &oldIrql);
+	FenceTrackerRetire(&m_Fences, fence_id, count);
+	PublishRetiredFence();
+	KeReleaseSpinLock(&m_FenceLock, oldIrql);
+
+	DBGPRINT("fence = %llu, m_FlushCount = %d, retired = %llu\n", fence_id, m_FlushCount, (ULONGLONG)m_LastRetiredFence);
+	WakePresentThread();
+}
+
+void ScreenInfo::RetireAllFences()
+{
+	KIRQL oldIrql;
+
+	InterlockedExchange(&m_FlushCount, 0);
+	KeAcquireSpinLock(&m_FenceLock, &oldIrql);
+	FenceTrackerRetireAll(&m_Fences, (ULONGLONG)m_LastSubmittedFence);
+	PublishRetiredFence();
+	KeReleaseSpinLock(&m_FenceLock, oldIrql);
+	WakePresentThread();
+}
+
+// A present parked behind a full flush queue may run now
+void ScreenInfo::WakePresentThread(void)
+{
+	if (m_Mailbox.bPending) {
+		KeSetEvent(&m_PresentEvent, IO_NO_INCREMENT, FALSE);
+	}
+}
+
+/*
+ * Called for a reserved fence that no flush is going to carry, because its
+ * present was dropped or replaced. It retires once the flushes in flight
+ * did and no present reserved before it is pending.
+ */
+void ScreenInfo::ReleaseFence(ULONGLONG fence_id)
+{
+	KIRQL oldIrql;
+
+	KeAcquireSpinLock(&m_FenceLock, &oldIrql);
+	FenceTrackerRelease(&m_Fences, fence_id, m_FlushCount);
+	PublishRetiredFence();
+	KeReleaseSpinLock(&m_FenceLock, oldIrql);
+	DBGPRINT("orphan fence = %llu, retired = %llu\n", fence_id, (ULONGLONG)m_LastRetiredFence);
+}
+
+// The waiter is added before its fence is sampled, so a retire racing
+// with the check still sets its event
+void ScreenInfo::AddFenceWaiter(PFENCE_WAITER pWaiter)
+{
+	KIRQL oldIrql;
+
+	KeInitializeEvent(&pWaiter->Event, NotificationEvent, FALSE);
+	KeAcquireSpinLock(&m_FenceLock, &oldIrql);
+	InsertTailList(&m_FenceWaiters, &pWaiter->Entry);
+	KeReleaseSpinLock(&m_FenceLock, oldIrql);
+}
+
+void ScreenInfo::RemoveFenceWaiter(PFENCE_WAITER pWaiter)
+{
+	KIRQL oldIrql;
+
+	KeAcquireSpinLock(&m_FenceLock, &oldIrql);
+	RemoveEntryList(&pWaiter->Entry);
+	KeReleaseSpinLock(&m_FenceLock, oldIrql);
+}
+
+BOOLEAN ScreenInfo::PostPresent(PRESENT_WORK* pWork, PRESENT_WORK* pOld)
+{
+	KIRQL oldIrql;
+	BOOLEAN bReplaced;
+
+	KeAcquireSpinLock(&m_PresentLock, &oldIrql);
+	bReplaced = PresentMailboxPost(&m_Mailbox, pWork, pOld);
+	KeReleaseSpinLock(&m_PresentLock, oldIrql);
+
+	return bReplaced;
+}
+
+BOOLEAN ScreenInfo::TakePresent(PRESENT_WORK* pWork, PVOID Owner)
+{
+	KIRQL oldIrql;
+	BOOLEAN bTaken;
+
+	KeAcquireSpinLock(&m_PresentLock, &oldIrql);
+	bTaken = PresentMailboxTake(&m_Mailbox, pWork, Owner);
+	KeReleaseSpinLock(&m_PresentLock, oldIrql);
+
+	return bTaken;
+}
+
 BOOLEAN VioGpuAdapterLite::InterruptRoutine(_In_  ULONG MessageNumber)
 {
-	TRACING();
+	TRACING_HOT();
 	DBGPRINT("MessageNumber = %d\n", MessageNumber);
 	BOOLEAN serviced = TRUE;
 	ULONG intReason = 0;
@@ -1092,17 +1632,67 @@ void VioGpuAdapterLite::ThreadWorkRoutine(void)
 	}
 }
 
-void VioGpuAdapterLite::ConfigChanged(void)
+void VioGpuAdapterLite::PresentThreadWork(_In_ PVOID Context)
+{
+	TRACING_SAMPLED(TRACE_SAMPLE_RATE);
+	ScreenInfo* pScreen = reinterpret_cast<ScreenInfo*>(Context);
+	VioGpuAdapterLite* pdev = reinterpret_cast<VioGpuAdapterLite*>(pScreen->m_pAdapter);
+	pdev->PresentThreadRoutine(pScreen->m_ScreenNum);
+}
+
+void VioGpuAdapterLite::PresentThreadRoutine(UINT32 screen_num)
 {
 	TRACING();
 	NTSTATUS status = STATUS_SUCCESS;
-	UINT32 events_read, events_clear = 0;
-	virtio_get_config(&m_VioDev, FIELD_OFFSET(GPU_CONFIG, events_read),
-		&events_read, sizeof(m_u32NumScanouts));
-	if (events_read & VIRTIO_GPU_EVENT_DISPLAY) {
-		status = GetModeList(&DisplayInfo);
+	ScreenInfo* pScreen = &m_screen[screen_num];
+	PRESENT_WORK work;
+	BOOLEAN bTaken;
+
+	KeSetPriorityThread(KeGetCurrentThread(), LOW_REALTIME_PRIORITY);
+
+	for (;;)
+	{
+		status = KeWaitForSingleObject(&pScreen->m_PresentEvent,
+			Executive,
+			KernelMode,
+			FALSE,
+			NULL);
 		if (!NT_SUCCESS(status)) {
-			ERR("GetModeList failed with %x\n", status);
+			ERR("Present thread has not completed the wait successfully\n");
+		}
+		if (pScreen->m_bStopPresentThread) {
+			PsTerminateSystemThread(STATUS_SUCCESS);
+		}
+		// While the flushes in flight leave no room for another frame the
+		// present stays in the mailbox, where a newer one may still replace
+		// it. The retire of one of those flushes wakes the thread again, so
+		// the last frame always reaches the host. The screen lock is held
+		// from taking a present to running it, see ReleaseFrameSegments.
+		while (pScreen->CanQueueFrame()) {
+			LockScreen(screen_num, TRUE);
+			bTaken = pScreen->TakePresent(&work, NULL);
+			if (bTaken) {
+				RunPresent(screen_num, &work);
+			}
+			UnlockScreen(screen_num);
+			if (!bTaken) {
+				break;
+			}
+		}
+	}
+}
+
+void VioGpuAdapterLite::ConfigChanged(void)
+{
+	TRACING();
+	NTSTATUS status = STATUS_SUCCESS;
+	UINT32 events_read, events_clear = 0;
+	virtio_get_config(&m_VioDev, FIELD_OFFSET(GPU_CONFIG, events_read),
+		&events_read, sizeof(m_u32NumScanouts));
+	if (events_read & VIRTIO_GPU_EVENT_DISPLAY) {
+		status = GetModeList(&DisplayInfo);
+		if (!NT_SUCCESS(status)) {
+			ERR("GetModeList failed with %x\n", status);
 			VioGpuDbgBreak();
 		}
 		if (hpd_event) {
@@ -1115,61 +1705,100 @@ void VioGpuAdapterLite::ConfigChanged(void)
 	}
 }
 
-VOID VioGpuAdapterLite::DpcRoutine(void)
+// Runs from DpcRoutine and from waiters spinning in WaitForCompletion,
+// DequeueBuffers hands every completion to only one of them
+void VioGpuAdapterLite::HarvestCtrlQueue(void)
 {
-	TRACING();
-	PGPU_VBUFFER pvbuf = NULL;
-	UINT len = 0;
-	ULONG reason;
-	while ((reason = InterlockedExchange((PLONG)&m_PendingWorks, 0)) != 0)
+	TRACING_HOT();
+	PGPU_VBUFFER bufs[DPC_HARVEST_BATCH];
+	UINT lens[DPC_HARVEST_BATCH];
+	UINT count, released;
+
+	while ((count = m_CtrlQueue.DequeueBuffers(bufs, lens, DPC_HARVEST_BATCH)) != 0)
 	{
-		if ((reason & ISR_REASON_DISPLAY)) {
-			while ((pvbuf = m_CtrlQueue.DequeueBuffer(&len)) != NULL)
+		released = 0;
+		for (UINT i = 0; i < count; i++)
+		{
+			PGPU_VBUFFER pvbuf = bufs[i];
+			DBGPRINT("m_CtrlQueue pvbuf = %p len = %d\n", pvbuf, lens[i]);
+			PGPU_CTRL_HDR pcmd = (PGPU_CTRL_HDR)pvbuf->buf;
+			PGPU_CTRL_HDR resp = (PGPU_CTRL_HDR)pvbuf->resp_buf;
+			PKEVENT evnt = pvbuf->event;
+			if (evnt == NULL)
 			{
-				DBGPRINT("m_CtrlQueue pvbuf = %p len = %d\n", pvbuf, len);
-				PGPU_CTRL_HDR pcmd = (PGPU_CTRL_HDR)pvbuf->buf;
-				PGPU_CTRL_HDR resp = (PGPU_CTRL_HDR)pvbuf->resp_buf;
-				PKEVENT evnt = pvbuf->event;
-				if (evnt == NULL)
+				if (resp->type != VIRTIO_GPU_RESP_OK_NODATA)
 				{
-					if (resp->type != VIRTIO_GPU_RESP_OK_NODATA)
-					{
-						DBGPRINT("type = %xlu flags = %lu fence_id = %llu ctx_id = %lu cmd_type = %lu\n",
-							resp->type, resp->flags, resp->fence_id, resp->ctx_id, pcmd->type);
-					}
-					m_CtrlQueue.ReleaseBuffer(pvbuf);
-					continue;
+					DBGPRINT("type = %xlu flags = %lu fence_id = %llu ctx_id = %lu cmd_type = %lu\n",
+						resp->type, resp->flags, resp->fence_id, resp->ctx_id, pcmd->type);
 				}
-				switch (pcmd->type)
-				{
-				case VIRTIO_GPU_CMD_RESOURCE_FLUSH:
-					if (m_screen[pcmd->fence_id].m_FlushCount > 0) {
-						m_screen[pcmd->fence_id].m_FlushCount--;
-						DBGPRINT("Screen id = %lld, m_FlushCount = %d\n", pcmd->fence_id, m_screen[pcmd->fence_id].m_FlushCount);
+				// Retire even if the host failed the flush so that nobody
+				// waits on this fence forever
+				if (pcmd->type == VIRTIO_GPU_CMD_RESOURCE_FLUSH &&
+					(pcmd->flags & VIRTIO_GPU_FLAG_FENCE) &&
+					pvbuf->screen_num < MAX_SCAN_OUT) {
+					m_screen[pvbuf->screen_num].RetireFence(pcmd->fence_id);
+					if (pvbuf->submit_us) {
+						m_screen[pvbuf->screen_num].m_Stats.Record(STATS_STAGE_COMPLETE, VioGpuStats::ElapsedUs(pvbuf->submit_us));
 					}
-					else {
-						ERR("Screen is %d, Flush Count is %d\n", (int)pcmd->fence_id,
-							m_screen[pcmd->fence_id].m_FlushCount);
-					}
-				case VIRTIO_GPU_CMD_GET_DISPLAY_INFO:
-				case VIRTIO_GPU_CMD_GET_EDID:
-				{
-					ASSERT(evnt);
-					KeSetEvent(evnt, IO_NO_INCREMENT, FALSE);
 				}
+				bufs[released++] = pvbuf;
+				continue;
+			}
+			// The waiter owns the buffer from here on
+			switch (pcmd->type)
+			{
+			case VIRTIO_GPU_CMD_GET_DISPLAY_INFO:
+			case VIRTIO_GPU_CMD_GET_EDID:
+			{
+				ASSERT(evnt);
+				KeSetEvent(evnt, IO_NO_INCREMENT, FALSE);
+			}
+			break;
+			default:
+				ERR("Unknown cmd type 0x%x\n", resp->type);
 				break;
-				default:
-					ERR("Unknown cmd type 0x%x\n", resp->type);
-					break;
-				}
 			}
 		}
+		m_CtrlQueue.ReleaseBuffers(bufs, released);
+	}
+}
+
+void VioGpuAdapterLite::CtrlQueuePoll(_In_ PVOID Context)
+{
+	VioGpuAdapterLite* pdev = reinterpret_cast<VioGpuAdapterLite*>(Context);
+	pdev->HarvestCtrlQueue();
+}
+
+VOID VioGpuAdapterLite::DpcRoutine(void)
+{
+	TRACING_HOT();
+	PGPU_VBUFFER bufs[DPC_HARVEST_BATCH];
+	UINT lens[DPC_HARVEST_BATCH];
+	UINT count;
+	ULONG reason;
+	while ((reason = InterlockedExchange((PLONG)&m_PendingWorks, 0)) != 0)
+	{
+		if ((reason & ISR_REASON_DISPLAY)) {
+			// Completions are taken in batches with the interrupt off, the
+			// buffers nobody waits on go back to the pool together. With
+			// coalescing the device interrupts again only once most of the
+			// outstanding commands completed, which delays fences.
+			do {
+				m_CtrlQueue.DisableInterrupt();
+				HarvestCtrlQueue();
+			} while (!(m_bIrqCoalescing ? m_CtrlQueue.EnableInterruptDelayed() : m_CtrlQueue.EnableInterrupt()));
+		}
 		if ((reason & ISR_REASON_CURSOR)) {
-			while ((pvbuf = m_CursorQueue.DequeueCursor(&len)) != NULL)
-			{
-				DBGPRINT("m_CursorQueue pvbuf = %p len = %u\n", pvbuf, len);
-				m_CursorQueue.ReleaseBuffer(pvbuf);
-			};
+			// Nobody waits on cursor updates, so the device only has to
+			// interrupt once most of the outstanding ones were consumed.
+			do {
+				m_CursorQueue.DisableInterrupt();
+				while ((count = m_CursorQueue.DequeueBuffers(bufs, lens, DPC_HARVEST_BATCH)) != 0)
+				{
+					DBGPRINT("m_CursorQueue %d buffers\n", count);
+					m_CursorQueue.ReleaseBuffers(bufs, count);
+				};
+			} while (!m_CursorQueue.EnableInterruptDelayed());
 		}
 		if (reason & ISR_REASON_CHANGE) {
 			DBGPRINT("ConfigChanged\n");
@@ -1185,7 +1814,7 @@ VOID VioGpuAdapterLite::ResetDevice(VOID)
 
 UINT ColorFormat(UINT format)
 {
-	TRACING();
+	TRACING_HOT();
 	switch (format)
 	{
 	case D3DDDIFMT_A8R8G8B8:
@@ -1201,17 +1830,26 @@ UINT ColorFormat(UINT format)
 	return VIRTIO_GPU_FORMAT_B8G8R8A8_UNORM;
 }
 
-void VioGpuAdapterLite::DestroyFrameBufferSlotObj(UINT32 screen_num, FrameBufSlot bufSlot, BOOLEAN bReset)
+void VioGpuAdapterLite::ReapFrameBufferSlots(UINT32 screen_num)
 {
-    TRACING();
-	UINT index = m_screen[screen_num].GetFrameBufferIndex(bufSlot);
-    DestroyFrameBufferObj(&m_screen[screen_num].m_pFrameBuf[index], bReset);
+	TRACING_HOT();
+	ScreenInfo* pScreen = &m_screen[screen_num];
+
+	pScreen->UpdateFrameBufferStates();
+	for (UINT i = 0; i < pScreen->m_FrameBufferCount; i++) {
+		FRAMEBUFFER_SLOT* pSlot = &pScreen->m_FrameBuf[i];
+		if (FrameBufCanReap(pSlot, (ULONGLONG)pScreen->m_LastRetiredFence)) {
+			DestroyFrameBufferObj(&pSlot->pObj, FALSE);
+			pSlot->State = FrameBufState::Free;
+		}
+	}
 }
 
 void VioGpuAdapterLite::DestroyFrameBufferObj(VioGpuObj** ppFbuf, BOOLEAN bReset)
 {
-	TRACING();
+	TRACING_SAMPLED(TRACE_SAMPLE_RATE);
 	UINT resid = 0;
+	GPU_BATCH batch;
 
 	VioGpuObj* fbuf = (VioGpuObj*)InterlockedExchangePointer((PVOID volatile *)ppFbuf, NULL);
 	if (fbuf == NULL) return;
@@ -1222,11 +1860,13 @@ void VioGpuAdapterLite::DestroyFrameBufferObj(VioGpuObj** ppFbuf, BOOLEAN bReset
 	//    m_CtrlQueue.ResFlush(resid, 1024, 768, 0, 0);
 	//}
 	//m_CtrlQueue.SetScanout(0/*FIXME m_Id*/, resid, 1024, 768, 0, 0);
-	m_CtrlQueue.InvalBacking(resid);
-	m_CtrlQueue.UnrefResource(resid);
+	m_CtrlQueue.BeginBatch(&batch);
+	m_CtrlQueue.InvalBacking(resid, &batch);
+	m_CtrlQueue.UnrefResource(resid, &batch);
 	if (bReset == TRUE) {
-		m_CtrlQueue.SetScanout(0/*FIXME m_Id*/, 0, 0, 0, 0, 0);
+		m_CtrlQueue.SetScanout(0/*FIXME m_Id*/, 0, 0, 0, 0, 0, &batch);
 	}
+	m_CtrlQueue.CommitBatch(&batch);
 	delete fbuf;
 	m_Idr.PutId(resid);
 }
@@ -1240,8 +1880,12 @@ void VioGpuAdapterLite::DestroyCursor(UINT32 screen_num)
     if (cursor != NULL)
     {
         UINT id = (UINT)cursor->GetId();
-        m_CtrlQueue.InvalBacking(id);
-        m_CtrlQueue.UnrefResource(id);
+        GPU_BATCH batch;
+
+        m_CtrlQueue.BeginBatch(&batch);
+        m_CtrlQueue.InvalBacking(id, &batch);
+        m_CtrlQueue.UnrefResource(id, &batch);
+        m_CtrlQueue.CommitBatch(&batch);
         delete cursor;
         m_Idr.PutId(id);
     }
@@ -1252,20 +1896,40 @@ void VioGpuAdapterLite::DestroyFrameBufferCursorObjExt()
 	TRACING();
 
 	for (UINT32 i = 0; i < m_u32NumScanouts; i++) {
-		for (UINT32 j = 0; j <  m_screen[i].FRAMEBUFFER_COUNT; j++) {
-			DestroyFrameBufferObj(&m_screen[i].m_pFrameBuf[j], TRUE);
+		m_screen[i].InvalidateFrameBufferCache();
+		for (UINT32 j = 0; j < m_screen[i].MAX_FRAMEBUFFER_COUNT; j++) {
+			DestroyFrameBufferObj(&m_screen[i].m_FrameBuf[j].pObj, TRUE);
+			m_screen[i].m_FrameBuf[j].State = FrameBufState::Free;
 		}
+		DestroyFramePoolObjs(i);
 		DestroyCursor(i);
 	}
 }
 
+// The slots stay pinned, their host resources are created again on the
+// next present from the entries built at registration
+void VioGpuAdapterLite::DestroyFramePoolObjs(UINT32 screen_num)
+{
+	TRACING();
+
+	VioGpuFramePool* pPool = &m_screen[screen_num].m_FramePool;
+
+	for (UINT i = 0; i < pPool->GetSlotCount(); i++) {
+		DestroyFrameBufferObj(&pPool->GetSlot(i)->pObj, FALSE);
+	}
+	pPool->SetScanoutSlot(FRAME_POOL_NO_SCANOUT);
+}
+
 PAGED_CODE_SEG_BEGIN
-void VioGpuAdapterLite::CreateFrameBufferObj(PVIDEO_MODE_INFORMATION pModeInfo, FrameBufSlot bufSlot, CURRENT_MODE* pCurrentMode)
+BOOLEAN VioGpuAdapterLite::CreateFrameBufferObj(PVIDEO_MODE_INFORMATION pModeInfo, FrameBufSlot bufSlot, CURRENT_MODE* pCurrentMode)
 {
 	UINT resid, format, size;
+	ULONGLONG fence_id, start_us;
 	VioGpuObj* obj;
+	VioGpuMemSegment* pSegment;
+	GPU_BATCH batch;
 	PAGED_CODE();
-	TRACING();
+	TRACING_SAMPLED(TRACE_SAMPLE_RATE);
 	DBGPRINT("%d: %d, (%d x %d)\n", m_Id, pCurrentMode->DispInfo.TargetId,
 		pModeInfo->VisScreenWidth, pModeInfo->VisScreenHeight);
 	ASSERT(m_screen[pCurrentMode->DispInfo.TargetId].GetFrameBufferObj(bufSlot) == NULL);
@@ -1273,47 +1937,647 @@ void VioGpuAdapterLite::CreateFrameBufferObj(PVIDEO_MODE_INFORMATION pModeInfo,
 	format = ColorFormat(pCurrentMode->DispInfo.ColorFormat);
 	DBGPRINT("(%d -> %d)\n", pCurrentMode->DispInfo.ColorFormat, format);
 	resid = m_Idr.GetId();
-
-	if (!m_bBlobSupported) {
-		m_CtrlQueue.CreateResource(resid, format, pModeInfo->VisScreenWidth, pModeInfo->VisScreenHeight);
+	if (resid == 0) {
+		return FALSE;
 	}
 
-	// Update the frame segment based on the current mode
+	// Update the frame segment based on the current mode. A UMD buffer
+	// still locked from an earlier frame is used as is
 	if (pCurrentMode->FrameBuffer.Ptr) {
-		m_screen[pCurrentMode->DispInfo.TargetId].m_FrameSegment.InitExt(size, pCurrentMode->FrameBuffer.Ptr);
+		pSegment = m_screen[pCurrentMode->DispInfo.TargetId].PinFrameSegment(pCurrentMode->FrameBuffer.Ptr, size);
 	}
-	else if (m_screen[pCurrentMode->DispInfo.TargetId].m_FrameSegment.GetFbVAddr() && size > m_screen[pCurrentMode->DispInfo.TargetId].m_FrameSegment.GetSize()) {
-		m_screen[pCurrentMode->DispInfo.TargetId].m_FrameSegment.Close();
-		m_screen[pCurrentMode->DispInfo.TargetId].m_FrameSegment.Init(size, NULL);
+	else {
+		m_screen[pCurrentMode->DispInfo.TargetId].UnpinFrameSegments(NULL);
+		pSegment = &m_screen[pCurrentMode->DispInfo.TargetId].m_FrameSegment;
+		if (m_screen[pCurrentMode->DispInfo.TargetId].m_FrameSegment.GetFbVAddr() && size > m_screen[pCurrentMode->DispInfo.TargetId].m_FrameSegment.GetSize()) {
+			m_screen[pCurrentMode->DispInfo.TargetId].m_FrameSegment.Close();
+			m_screen[pCurrentMode->DispInfo.TargetId].m_FrameSegment.Init(size, NULL);
+			m_screen[pCurrentMode->DispInfo.TargetId].RecordFrameSegmentAlloc();
+		}
+	}
+
+	// Everything up to the first flush reaches the host with one notify
+	start_us = VioGpuStats::NowUs();
+	m_CtrlQueue.BeginBatch(&batch);
+	if (!m_bBlobSupported) {
+		m_CtrlQueue.CreateResource(resid, format, pModeInfo->VisScreenWidth, pModeInfo->VisScreenHeight, &batch);
 	}
 
 	obj = new(NonPagedPoolNx) VioGpuObj();
-	if (!obj->Init(size, &m_screen[pCurrentMode->DispInfo.TargetId].m_FrameSegment))
+	if (pSegment == NULL || !obj || !obj->Init(size, pSegment))
 	{
 		ERR("Failed to init obj size = %d\n", size);
+		if (!m_bBlobSupported) {
+			m_CtrlQueue.UnrefResource(resid, &batch);
+		}
+		m_CtrlQueue.CommitBatch(&batch);
+		m_Idr.PutId(resid);
 		delete obj;
-		return;
+		return FALSE;
 	}
 
-	GpuObjectAttach(resid, obj, pModeInfo->VisScreenWidth, pModeInfo->VisScreenHeight,pCurrentMode->Stride);
+	GpuObjectAttach(resid, obj, pModeInfo->VisScreenWidth, pModeInfo->VisScreenHeight,pCurrentMode->Stride, &batch);
+	m_screen[pCurrentMode->DispInfo.TargetId].m_Stats.Record(STATS_STAGE_CREATE, VioGpuStats::ElapsedUs(start_us));
 
+	start_us = VioGpuStats::NowUs();
 	if (m_bBlobSupported)
 	{
-		m_CtrlQueue.SetScanoutBlob(pCurrentMode->DispInfo.TargetId, resid, pModeInfo->VisScreenWidth, pModeInfo->VisScreenHeight, format, 0, 0, pCurrentMode->Stride);
+		m_CtrlQueue.SetScanoutBlob(pCurrentMode->DispInfo.TargetId, resid, pModeInfo->VisScreenWidth, pModeInfo->VisScreenHeight, format, 0, 0, pCurrentMode->Stride, &batch);
 	}
 	else
 	{
-		m_CtrlQueue.SetScanout(pCurrentMode->DispInfo.TargetId, resid, pModeInfo->VisScreenWidth, pModeInfo->VisScreenHeight, 0, 0);
+		m_CtrlQueue.SetScanout(pCurrentMode->DispInfo.TargetId, resid, pModeInfo->VisScreenWidth, pModeInfo->VisScreenHeight, 0, 0, &batch);
 		// only required for non-blob
-		m_CtrlQueue.TransferToHost2D(resid, 0, pModeInfo->VisScreenWidth, pModeInfo->VisScreenHeight, 0, 0, NULL);
+		m_CtrlQueue.TransferToHost2D(resid, 0, pModeInfo->VisScreenWidth, pModeInfo->VisScreenHeight, 0, 0, NULL, &batch);
 	}
-	m_screen[pCurrentMode->DispInfo.TargetId].m_FlushCount++;
-	DBGPRINT("Screen num = %d, flushcount = %d\n", pCurrentMode->DispInfo.TargetId, m_screen[pCurrentMode->DispInfo.TargetId].m_FlushCount);
-	m_CtrlQueue.ResFlush(resid, pModeInfo->VisScreenWidth, pModeInfo->VisScreenHeight, 0, 0, pCurrentMode->DispInfo.TargetId,
-		&m_screen[pCurrentMode->DispInfo.TargetId].m_FlushEvent);
+	m_screen[pCurrentMode->DispInfo.TargetId].m_Stats.Record(STATS_STAGE_SCANOUT, VioGpuStats::ElapsedUs(start_us));
+	fence_id = QueueResFlush(pCurrentMode->DispInfo.TargetId, resid, pModeInfo->VisScreenWidth, pModeInfo->VisScreenHeight, 0, 0, TRUE, &batch);
+	fence_id = CommitCtrlBatch(&batch, pCurrentMode->DispInfo.TargetId, fence_id);
+	m_screen[pCurrentMode->DispInfo.TargetId].m_bFullDamagePending = FALSE;
+	m_screen[pCurrentMode->DispInfo.TargetId].m_FramePool.SetScanoutSlot(FRAME_POOL_NO_SCANOUT);
 	m_screen[pCurrentMode->DispInfo.TargetId].SetFrameBufferObj(obj, bufSlot);
+	m_screen[pCurrentMode->DispInfo.TargetId].QueueFrameBuffer(bufSlot, fence_id);
 	pCurrentMode->FrameBuffer.Ptr = obj->GetVirtualAddress();
 	pCurrentMode->Flags.FrameBufferIsActive = TRUE;
+	return TRUE;
+}
+
+void VioGpuAdapterLite::FlushFrameBufferObj(PVIDEO_MODE_INFORMATION pModeInfo, CURRENT_MODE* pCurrentMode, const DAMAGE_REGION* pDamage)
+{
+	UINT resid;
+	ULONGLONG fence_id = 0;
+	GPU_BATCH batch;
+	PAGED_CODE();
+	TRACING_SAMPLED(TRACE_SAMPLE_RATE);
+
+	ScreenInfo* pScreen = &m_screen[pCurrentMode->DispInfo.TargetId];
+	VioGpuObj* obj = pScreen->GetFrameBufferObj(FrameBufSlot::Front);
+	ASSERT(obj != NULL);
+	resid = obj->GetId();
+
+	// The whole frame reaches the host with one notify
+	m_CtrlQueue.BeginBatch(&batch);
+	if (pDamage == NULL || pDamage->NumRects == 0 || pScreen->m_bFullDamagePending)
+	{
+		if (!m_bBlobSupported)
+		{
+			// only required for non-blob
+			m_CtrlQueue.TransferToHost2D(resid, 0, pModeInfo->VisScreenWidth, pModeInfo->VisScreenHeight, 0, 0, NULL, &batch);
+		}
+		DBGPRINT("Screen num = %d, resid = %d\n", pCurrentMode->DispInfo.TargetId, resid);
+		fence_id = QueueResFlush(pCurrentMode->DispInfo.TargetId, resid, pModeInfo->VisScreenWidth, pModeInfo->VisScreenHeight, 0, 0, TRUE, &batch);
+		fence_id = CommitCtrlBatch(&batch, pCurrentMode->DispInfo.TargetId, fence_id);
+		pScreen->QueueFrameBuffer(FrameBufSlot::Front, fence_id);
+		pScreen->m_bFullDamagePending = FALSE;
+		pCurrentMode->Flags.FrameBufferIsActive = TRUE;
+		return;
+	}
+
+	fence_id = FlushDamageRects(pCurrentMode->DispInfo.TargetId, resid, pCurrentMode->DispInfo.Pitch, pDamage, &batch);
+	fence_id = CommitCtrlBatch(&batch, pCurrentMode->DispInfo.TargetId, fence_id);
+	pScreen->QueueFrameBuffer(FrameBufSlot::Front, fence_id);
+	pCurrentMode->Flags.FrameBufferIsActive = TRUE;
+}
+
+// Appends the transfers and flushes of the frame to batch, the caller
+// commits it
+ULONGLONG VioGpuAdapterLite::FlushDamageRects(UINT32 screen_num, UINT res_id, UINT Pitch, const DAMAGE_REGION* pDamage, PGPU_BATCH batch)
+{
+	ULONGLONG fence_id = 0;
+	PAGED_CODE();
+	TRACING_HOT();
+
+	for (ULONG i = 0; i < pDamage->NumRects; i++)
+	{
+		const RECT* pRect = &pDamage->Rects[i];
+		UINT width = (UINT)(pRect->right - pRect->left);
+		UINT height = (UINT)(pRect->bottom - pRect->top);
+
+		if (!m_bBlobSupported)
+		{
+			// offset is where the rect starts inside the backing pages
+			ULONG offset = (ULONG)pRect->top * Pitch + (ULONG)pRect->left * (VGPU_BPP / BITS_PER_BYTE);
+			m_CtrlQueue.TransferToHost2D(res_id, offset, width, height, pRect->left, pRect->top, NULL, batch);
+		}
+		// Only the last flush of the frame is fenced, so m_FlushCount
+		// keeps counting frames rather than rects
+		fence_id = QueueResFlush(screen_num, res_id, width, height, pRect->left, pRect->top,
+			(i + 1 == pDamage->NumRects), batch);
+	}
+	DBGPRINT("Screen num = %d, resid = %d, damage rects = %d\n", screen_num, res_id, pDamage->NumRects);
+	return fence_id;
+}
+
+NTSTATUS VioGpuAdapterLite::RegisterFramePool(UINT32 screen_num, PVOID Owner, UINT NumSlots, PVOID* pSlotAddrs,
+	UINT Width, UINT Height, UINT Pitch, UINT Stride, PULONG pPoolId)
+{
+	PAGED_CODE();
+	TRACING();
+
+	NTSTATUS status = STATUS_SUCCESS;
+	ULONG pool_id = 0;
+
+	LockScreen(screen_num, TRUE);
+
+	// A new registration replaces the previous pool of the screen
+	DestroyFramePool(screen_num);
+
+	if (NumSlots != 0) {
+		pool_id = (ULONG)InterlockedIncrement(&m_NextFramePoolId);
+		if (!m_screen[screen_num].m_FramePool.Init(pool_id, Owner, NumSlots, pSlotAddrs,
+			Width, Height, Pitch, Stride, ColorFormat(D3DDDIFMT_X8R8G8B8))) {
+			pool_id = 0;
+			status = STATUS_INSUFFICIENT_RESOURCES;
+		}
+	}
+
+	UnlockScreen(screen_num);
+	*pPoolId = pool_id;
+	return status;
+}
+
+VOID VioGpuAdapterLite::UnregisterFramePool(UINT32 screen_num)
+{
+	PAGED_CODE();
+	TRACING();
+
+	LockScreen(screen_num, TRUE);
+	DestroyFramePool(screen_num);
+	UnlockScreen(screen_num);
+}
+
+// Called when a file object goes away, its pools must not keep the pages
+// of the closing process pinned
+VOID VioGpuAdapterLite::ReleaseFramePools(PVOID Owner)
+{
+	PAGED_CODE();
+	TRACING();
+
+	LockAllScreens();
+	for (UINT32 i = 0; i < MAX_SCAN_OUT; i++) {
+		if (m_screen[i].m_FramePool.IsRegistered() && m_screen[i].m_FramePool.GetOwner() == Owner) {
+			DestroyFramePool(i);
+		}
+	}
+	UnlockAllScreens();
+}
+
+// Caller holds the lock of the screen
+void VioGpuAdapterLite::DestroyFramePool(UINT32 screen_num)
+{
+	PAGED_CODE();
+	TRACING();
+
+	VioGpuFramePool* pPool = &m_screen[screen_num].m_FramePool;
+
+	if (!pPool->IsRegistered())
+		return;
+
+	// The host may still be reading a slot through the last flush
+	WaitForFence(screen_num, GetLastSubmittedFence(screen_num), SET_MODE_FENCE_TIMEOUT_MS, NULL);
+
+	if (pPool->GetScanoutSlot() != FRAME_POOL_NO_SCANOUT) {
+		m_CtrlQueue.SetScanout(screen_num, 0, 0, 0, 0, 0);
+	}
+	DestroyFramePoolObjs(screen_num);
+	pPool->Close();
+}
+
+BOOLEAN VioGpuAdapterLite::CreateFramePoolObj(UINT32 screen_num, UINT Slot)
+{
+	PAGED_CODE();
+	TRACING_SAMPLED(TRACE_SAMPLE_RATE);
+
+	VioGpuFramePool* pPool = &m_screen[screen_num].m_FramePool;
+	PFRAME_POOL_SLOT pSlot = pPool->GetSlot(Slot);
+	PGPU_MEM_ENTRIES ents = pSlot->Segment.GetMemEntries();
+	ULONGLONG start_us = VioGpuStats::NowUs();
+	VioGpuObj* obj;
+	UINT resid;
+
+	ASSERT(pSlot->pObj == NULL);
+	obj = new(NonPagedPoolNx) VioGpuObj();
+	if (!obj || !obj->Init(pPool->GetPitch() * pPool->GetHeight(), &pSlot->Segment)) {
+		ERR("Failed to init obj for slot %d\n", Slot);
+		delete obj;
+		return FALSE;
+	}
+
+	resid = m_Idr.GetId();
+	if (resid == 0) {
+		delete obj;
+		return FALSE;
+	}
+	if (m_bBlobSupported) {
+		m_CtrlQueue.CreateResourceBlob(resid, ents, pPool->GetWidth(), pPool->GetHeight(), pPool->GetStride());
+	}
+	else {
+		m_CtrlQueue.CreateResource(resid, pPool->GetFormat(), pPool->GetWidth(), pPool->GetHeight());
+		m_CtrlQueue.AttachBacking(resid, ents);
+	}
+	CountSgEntries(pSlot->Segment.GetPageCount(), ents->NumEntries);
+	obj->SetId(resid);
+	pSlot->pObj = obj;
+	m_screen[screen_num].m_Stats.Record(STATS_STAGE_CREATE, VioGpuStats::ElapsedUs(start_us));
+
+	// A fresh host resource holds nothing of the slot yet
+	SetFullDamageRegion(pPool->GetWidth(), pPool->GetHeight(), &pSlot->PendingDamage);
+	return TRUE;
+}
+
+/*
+ * Presents a slot of the registered pool. The damage is added to every
+ * slot, each one then uploads only what changed since its host copy was
+ * last updated, which for a slot presented every N frames is the damage of
+ * those N frames.
+ */
+NTSTATUS VioGpuAdapterLite::PresentFramePool(UINT32 screen_num, ULONG PoolId, UINT Slot, ULONG NumRects, PRECT pRects, PULONGLONG FenceId)
+{
+	PAGED_CODE();
+	TRACING_SAMPLED(TRACE_SAMPLE_RATE);
+
+	NTSTATUS status = STATUS_SUCCESS;
+	ScreenInfo* pScreen = &m_screen[screen_num];
+	VioGpuFramePool* pPool = &pScreen->m_FramePool;
+	DAMAGE_REGION damage;
+	const DAMAGE_REGION* pDamage = NULL;
+
+	LockScreen(screen_num, TRUE);
+
+	if (!pPool->IsPool(PoolId) || Slot >= pPool->GetSlotCount()) {
+		ERR("Screen %d has no pool %d with slot %d\n", screen_num, PoolId, Slot);
+		UnlockScreen(screen_num);
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	// No rects means the whole slot changed
+	if (NumRects && BuildDamageRegion(0, NULL, NumRects, pRects, pPool->GetWidth(), pPool->GetHeight(), &damage)) {
+		pDamage = &damage;
+	}
+	pPool->AddDamage(pDamage);
+
+	ReapFrameBufferSlots(screen_num);
+
+	if (!pScreen->CanQueueFrame()) {
+		// The damage stays pending in the slots, so nothing is lost
+		InterlockedIncrement(&pScreen->m_FramesDropped);
+		DBGPRINT("For screen %d Pending flush (%d) with Qemu so not sending another request, dropped %d frames so far\n",
+			screen_num, pScreen->m_FlushCount, pScreen->m_FramesDropped);
+	}
+	else if (pPool->GetSlot(Slot)->pObj == NULL && !CreateFramePoolObj(screen_num, Slot)) {
+		status = STATUS_INSUFFICIENT_RESOURCES;
+	}
+	else {
+		PFRAME_POOL_SLOT pSlot = pPool->GetSlot(Slot);
+		UINT resid = pSlot->pObj->GetId();
+		GPU_BATCH batch;
+
+		// The scanout switch and the frame reach the host with one notify
+		m_CtrlQueue.BeginBatch(&batch);
+		if (pPool->GetScanoutSlot() != Slot) {
+			ULONGLONG start_us = VioGpuStats::NowUs();
+			if (m_bBlobSupported) {
+				m_CtrlQueue.SetScanoutBlob(screen_num, resid, pPool->GetWidth(), pPool->GetHeight(), pPool->GetFormat(), 0, 0, pPool->GetStride(), &batch);
+			}
+			else {
+				m_CtrlQueue.SetScanout(screen_num, resid, pPool->GetWidth(), pPool->GetHeight(), 0, 0, &batch);
+			}
+			pPool->SetScanoutSlot(Slot);
+			// The front framebuffer is no longer what the host shows
+			pScreen->InvalidateFrameBufferCache();
+			pScreen->m_Stats.Record(STATS_STAGE_SCANOUT, VioGpuStats::ElapsedUs(start_us));
+		}
+
+		pSlot->Fence = FlushDamageRects(screen_num, resid, pPool->GetPitch(), &pSlot->PendingDamage, &batch);
+		pSlot->Fence = CommitCtrlBatch(&batch, screen_num, pSlot->Fence);
+		pSlot->PendingDamage.NumRects = 0;
+		InterlockedIncrement(&pScreen->m_FramesPresented);
+	}
+
+	if (FenceId) {
+		*FenceId = GetLastSubmittedFence(screen_num);
+	}
+
+	UnlockScreen(screen_num);
+	return status;
+}
+
+/*
+ * Hands a present to the worker thread of the screen and returns without
+ * waiting on the host. FenceId gets the fence reserved for it, which
+ * retires once the frame reached the host or was superseded.
+ */
+NTSTATUS VioGpuAdapterLite::QueuePresent(UINT32 screen_num, PRESENT_WORK* pWork, PULONGLONG FenceId)
+{
+	PAGED_CODE();
+	TRACING_SAMPLED(TRACE_SAMPLE_RATE);
+
+	ScreenInfo* pScreen = &m_screen[screen_num];
+	PRESENT_WORK old;
+	BOOLEAN bValid = TRUE;
+
+	if (screen_num >= m_u32NumScanouts || pScreen->m_pPresentThread == NULL) {
+		ERR("Screen %d has no present thread\n", screen_num);
+		return STATUS_DEVICE_NOT_READY;
+	}
+
+	if (pWork->Kind == PresentKind::Pool) {
+		LockScreen(screen_num, FALSE);
+		bValid = pScreen->m_FramePool.IsPool(pWork->PoolId) && pWork->Slot < pScreen->m_FramePool.GetSlotCount();
+		UnlockScreen(screen_num);
+		if (!bValid) {
+			ERR("Screen %d has no pool %d with slot %d\n", screen_num, pWork->PoolId, pWork->Slot);
+			return STATUS_INVALID_PARAMETER;
+		}
+	}
+
+	if (!pScreen->ReserveFence(&m_CtrlQueue, &pWork->Fence)) {
+		return STATUS_DEVICE_BUSY;
+	}
+	pWork->Process = NULL;
+	if (pWork->Kind == PresentKind::Buffer) {
+		pWork->Process = PsGetCurrentProcess();
+		ObReferenceObject(pWork->Process);
+	}
+	if (FenceId) {
+		*FenceId = pWork->Fence;
+	}
+
+	if (pScreen->PostPresent(pWork, &old)) {
+		InterlockedIncrement(&pScreen->m_FramesReplaced);
+		ReleasePresent(screen_num, &old);
+	}
+	KeSetEvent(&pScreen->m_PresentEvent, IO_NO_INCREMENT, FALSE);
+
+	return STATUS_SUCCESS;
+}
+
+/*
+ * Runs on the worker thread of the screen. A zero-copy present locks the
+ * UMD buffer, so the worker borrows the address space of the process that
+ * queued it for the duration.
+ */
+void VioGpuAdapterLite::RunPresent(UINT32 screen_num, PRESENT_WORK* pWork)
+{
+	PAGED_CODE();
+	TRACING_SAMPLED(TRACE_SAMPLE_RATE);
+
+	NTSTATUS status;
+	ScreenInfo* pScreen = &m_screen[screen_num];
+	DAMAGE_REGION damage;
+	const DAMAGE_REGION* pDamage = NULL;
+	KAPC_STATE apcState;
+
+	LockScreen(screen_num, TRUE);
+	InterlockedExchange64(&pScreen->m_ReservedFence, (LONG64)pWork->Fence);
+	pScreen->m_Stats.Record(STATS_STAGE_QUEUE, VioGpuStats::ElapsedUs(pWork->EntryUs));
+	pScreen->m_PresentEntryUs = pWork->EntryUs;
+
+	if (pWork->Kind == PresentKind::Pool) {
+		status = PresentFramePool(screen_num, pWork->PoolId, pWork->Slot, pWork->NumRects, pWork->Rects, NULL);
+	}
+	else {
+		if (pWork->NumRects && BuildDamageRegion(0, NULL, pWork->NumRects, pWork->Rects, pWork->Width, pWork->Height, &damage)) {
+			pDamage = &damage;
+		}
+		KeStackAttachProcess(pWork->Process, &apcState);
+		pScreen->m_PresentOwner = pWork->Owner;
+		status = ExecutePresentDisplayZeroCopy((BYTE*)pWork->Addr,
+			pWork->BytesPerPixel,
+			pWork->Pitch,
+			pWork->Width,
+			pWork->Height,
+			screen_num,
+			pWork->Stride,
+			pDamage,
+			NULL);
+		pScreen->m_PresentOwner = NULL;
+		KeUnstackDetachProcess(&apcState);
+	}
+
+	// A fence the flush did not take went with a dropped frame
+	pWork->Fence = (ULONGLONG)InterlockedExchange64(&pScreen->m_ReservedFence, 0);
+	pScreen->m_PresentEntryUs = 0;
+	UnlockScreen(screen_num);
+
+	if (!NT_SUCCESS(status)) {
+		ERR("Present on screen %d failed with status = 0x%x\n", screen_num, status);
+	}
+	ReleasePresent(screen_num, pWork);
+}
+
+// Drops what a present still holds once it ran or was given up
+void VioGpuAdapterLite::ReleasePresent(UINT32 screen_num, PRESENT_WORK* pWork)
+{
+	PAGED_CODE();
+	TRACING_SAMPLED(TRACE_SAMPLE_RATE);
+
+	if (pWork->Fence) {
+		m_screen[screen_num].ReleaseFence(pWork->Fence);
+		pWork->Fence = 0;
+	}
+	if (pWork->Process) {
+		ObDereferenceObject(pWork->Process);
+		pWork->Process = NULL;
+	}
+}
+
+// A NULL Owner drops the pending present whoever queued it
+VOID VioGpuAdapterLite::CancelPresent(UINT32 screen_num, PVOID Owner)
+{
+	PAGED_CODE();
+	TRACING();
+
+	PRESENT_WORK work;
+
+	if (m_screen[screen_num].TakePresent(&work, Owner)) {
+		InterlockedIncrement(&m_screen[screen_num].m_FramesDropped);
+		ReleasePresent(screen_num, &work);
+	}
+}
+
+// The buffers of the closing file are about to go away
+VOID VioGpuAdapterLite::CancelPresents(PVOID Owner)
+{
+	PAGED_CODE();
+	TRACING();
+
+	for (UINT32 i = 0; i < MAX_SCAN_OUT; i++) {
+		CancelPresent(i, Owner);
+	}
+}
+
+// One present worker per scanout, so that a screen waiting on the host
+// does not hold back the others. Screens that have one already are skipped,
+// so it serves both HWInit and the return to D0.
+NTSTATUS VioGpuAdapterLite::StartPresentThreads(void)
+{
+	PAGED_CODE();
+	TRACING();
+
+	NTSTATUS status = STATUS_SUCCESS;
+	HANDLE   threadHandle = 0;
+
+	for (UINT32 i = 0; i < m_u32NumScanouts; i++) {
+		if (m_screen[i].m_pPresentThread != NULL)
+			continue;
+
+		m_screen[i].m_bStopPresentThread = FALSE;
+		status = PsCreateSystemThread(&threadHandle,
+			(ACCESS_MASK)0,
+			NULL,
+			(HANDLE)0,
+			NULL,
+			VioGpuAdapterLite::PresentThreadWork,
+			&m_screen[i]);
+
+		if (!NT_SUCCESS(status))
+		{
+			ERR("Failed to create present thread for screen %d, status %x\n", i, status);
+			VioGpuDbgBreak();
+			return status;
+		}
+		ObReferenceObjectByHandle(threadHandle,
+			THREAD_ALL_ACCESS,
+			NULL,
+			KernelMode,
+			(PVOID*)(&m_screen[i].m_pPresentThread),
+			NULL);
+
+		ZwClose(threadHandle);
+	}
+	return status;
+}
+
+void VioGpuAdapterLite::StopPresentThreads(void)
+{
+	PAGED_CODE();
+	TRACING();
+
+	LARGE_INTEGER timeout = { 0 };
+	timeout.QuadPart = Int32x32To64(1000, -10000);
+
+	for (UINT32 i = 0; i < MAX_SCAN_OUT; i++) {
+		ScreenInfo* pScreen = &m_screen[i];
+		PETHREAD pThread = pScreen->m_pPresentThread;
+
+		if (pThread == NULL)
+			continue;
+
+		// Stops QueuePresent from posting more work first
+		pScreen->m_pPresentThread = NULL;
+		pScreen->m_bStopPresentThread = TRUE;
+		KeSetEvent(&pScreen->m_PresentEvent, IO_NO_INCREMENT, FALSE);
+
+		if (KeWaitForSingleObject(pThread,
+			Executive,
+			KernelMode,
+			FALSE,
+			&timeout) == STATUS_TIMEOUT) {
+			ERR("---> Failed to exit the present thread of screen %d\n", i);
+			VioGpuDbgBreak();
+		}
+
+		ObDereferenceObject(pThread);
+		CancelPresent(i, NULL);
+	}
+}
+
+ULONGLONG VioGpuAdapterLite::QueueResFlush(UINT32 screen_num, UINT res_id, UINT width, UINT height, UINT x, UINT y, BOOLEAN bFence, PGPU_BATCH batch)
+{
+	PAGED_CODE();
+	TRACING_HOT();
+
+	ULONGLONG fence_id = 0;
+
+	if (!bFence) {
+		m_CtrlQueue.ResFlush(res_id, width, height, x, y, screen_num, NULL, batch);
+		return 0;
+	}
+
+	// Count the flush before it is queued, DpcRoutine may retire it
+	// before ResFlush even returns
+	InterlockedIncrement(&m_screen[screen_num].m_FlushCount);
+
+	// The present the worker is running carries the fence reserved for it
+	fence_id = (ULONGLONG)InterlockedExchange64(&m_screen[screen_num].m_ReservedFence, 0);
+	BOOLEAN bReserved = (fence_id != 0);
+
+	if (!m_CtrlQueue.ResFlush(res_id, width, height, x, y, screen_num, &fence_id, batch)) {
+		InterlockedDecrement(&m_screen[screen_num].m_FlushCount);
+		if (bReserved) {
+			m_screen[screen_num].ReleaseFence(fence_id);
+		}
+		return 0;
+	}
+	if (bReserved) {
+		m_screen[screen_num].MarkFenceFlushed(fence_id);
+	}
+
+	InterlockedExchange64(&m_screen[screen_num].m_LastSubmittedFence, (LONG64)fence_id);
+	if (batch == NULL && m_screen[screen_num].m_PresentEntryUs) {
+		m_screen[screen_num].m_Stats.Record(STATS_STAGE_SUBMIT, VioGpuStats::ElapsedUs(m_screen[screen_num].m_PresentEntryUs));
+	}
+	DBGPRINT("Screen num = %d, fence = %llu, flushcount = %d\n", screen_num, fence_id, m_screen[screen_num].m_FlushCount);
+	return fence_id;
+}
+
+// The fenced flush is the last command of the batch, so a batch that did
+// not make it into the ring as a whole never queued it
+ULONGLONG VioGpuAdapterLite::CommitCtrlBatch(PGPU_BATCH batch, UINT32 screen_num, ULONGLONG fence_id)
+{
+	PAGED_CODE();
+	TRACING_HOT();
+
+	if (m_CtrlQueue.CommitBatch(batch)) {
+		if (fence_id && m_screen[screen_num].m_PresentEntryUs) {
+			m_screen[screen_num].m_Stats.Record(STATS_STAGE_SUBMIT, VioGpuStats::ElapsedUs(m_screen[screen_num].m_PresentEntryUs));
+		}
+		return fence_id;
+	}
+
+	if (fence_id) {
+		InterlockedDecrement(&m_screen[screen_num].m_FlushCount);
+		m_screen[screen_num].ReleaseFence(fence_id);
+	}
+	return 0;
+}
+
+NTSTATUS VioGpuAdapterLite::WaitForFence(UINT32 screen_num, ULONGLONG fence_id, ULONG timeout_ms, PULONGLONG last_retired)
+{
+	PAGED_CODE();
+	TRACING_SAMPLED(TRACE_SAMPLE_RATE);
+
+	NTSTATUS status = STATUS_TIMEOUT;
+	ScreenInfo* pScreen = &m_screen[screen_num];
+	FENCE_WAITER waiter;
+
+	if (fence_id > m_CtrlQueue.GetLastFenceId()) {
+		ERR("Fence %llu has not been issued yet\n", fence_id);
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	// The event of the waiter is only set once fence_id retired, so a
+	// completion the wait sees is the one it asked for
+	waiter.Fence = fence_id;
+	pScreen->AddFenceWaiter(&waiter);
+	if (pScreen->IsFenceRetired(fence_id)) {
+		status = STATUS_SUCCESS;
+	}
+	else if (timeout_ms != 0) {
+		LARGE_INTEGER timeout = { 0 };
+		timeout.QuadPart = -(LONGLONG)timeout_ms * 10000;
+		m_CtrlQueue.WaitForCompletion(&waiter.Event, &timeout);
+		if (pScreen->IsFenceRetired(fence_id)) {
+			status = STATUS_SUCCESS;
+		}
+	}
+	pScreen->RemoveFenceWaiter(&waiter);
+
+	if (last_retired) {
+		*last_retired = (ULONGLONG)pScreen->m_LastRetiredFence;
+	}
+	return status;
 }
 
 BOOLEAN VioGpuAdapterLite::CreateCursor(_In_ CONST POINTER_SHAPE* pSetPointerShape, _In_ CONST UINT cf)
@@ -1326,6 +2590,9 @@ BOOLEAN VioGpuAdapterLite::CreateCursor(_In_ CONST POINTER_SHAPE* pSetPointerSha
 	size = POINTER_SIZE * POINTER_SIZE * 4;
 	format = ColorFormat(cf);
 	resid = (UINT)m_Idr.GetId();
+	if (resid == 0) {
+		return FALSE;
+	}
 	
 	if (!m_bBlobSupported) {
 		m_CtrlQueue.CreateResource(resid, format, POINTER_SIZE, POINTER_SIZE);
@@ -1397,46 +2664,44 @@ BOOLEAN VioGpuAdapterLite::CreateCursor(_In_ CONST POINTER_SHAPE* pSetPointerSha
 	return TRUE;
 }
 
-BOOLEAN VioGpuAdapterLite::GpuObjectAttach(UINT res_id, VioGpuObj* obj, ULONGLONG width, ULONGLONG height , ULONGLONG stride)
+BOOLEAN VioGpuAdapterLite::GpuObjectAttach(UINT res_id, VioGpuObj* obj, ULONGLONG width, ULONGLONG height , ULONGLONG stride, PGPU_BATCH batch)
 {
 	PAGED_CODE();
-	TRACING();
-	PGPU_MEM_ENTRY ents = NULL;
-	PSCATTER_GATHER_LIST sgl = NULL;
-	UINT size = 0;
-	sgl = obj->GetSGList();
-	size = sizeof(GPU_MEM_ENTRY) * sgl->NumberOfElements;
-	ents = reinterpret_cast<PGPU_MEM_ENTRY> (new (NonPagedPoolNx)  BYTE[size]);
+	TRACING_HOT();
+	// The entries belong to the segment, the commands take a reference
+	PGPU_MEM_ENTRIES ents = obj->GetMemEntries();
 
 	if (!ents)
 	{
-		ERR("cannot allocate memory %x bytes numberofentries = %d\n", size, sgl->NumberOfElements);
+		ERR("No backing to attach to resource %d\n", res_id);
 		return FALSE;
 	}
-	//FIXME
-	RtlZeroMemory(ents, size);
-
-	for (UINT i = 0; i < sgl->NumberOfElements; i++)
-	{
-		ents[i].addr = sgl->Elements[i].Address.QuadPart;
-		ents[i].length = sgl->Elements[i].Length;
-		ents[i].padding = 0;
-	}
 
 	if (m_bBlobSupported) {
-		m_CtrlQueue.CreateResourceBlob(res_id, ents, sgl->NumberOfElements, width, height, stride);
+		m_CtrlQueue.CreateResourceBlob(res_id, ents, width, height, stride, batch);
 	}
 	else {
-		m_CtrlQueue.AttachBacking(res_id, ents, sgl->NumberOfElements);
+		m_CtrlQueue.AttachBacking(res_id, ents, batch);
 	}
+	CountSgEntries(obj->GetPageCount(), ents->NumEntries);
 
 	obj->SetId(res_id);
 	return TRUE;
 }
 
+void VioGpuAdapterLite::CountSgEntries(UINT Pages, UINT Entries)
+{
+	PAGED_CODE();
+
+	LONG64 pages = InterlockedExchangeAdd64(&m_SgPagesSent, Pages) + Pages;
+	LONG64 entries = InterlockedExchangeAdd64(&m_SgEntriesSent, Entries) + Entries;
+
+	DBGPRINT("%d pages sent as %d entries, %lld:%lld overall\n", Pages, Entries, pages, entries);
+}
+
 VOID VioGpuAdapterLite::SetEvent(HANDLE event)
 {
-	TRACING();
+	TRACING_HOT();
 	NTSTATUS status;
 	/* If the UMD has provided us with an event and we don't have it initialized already */
 	if (event && !hpd_event) {
@@ -1450,12 +2715,84 @@ VOID VioGpuAdapterLite::SetEvent(HANDLE event)
 
 VOID VioGpuAdapterLite::FillPresentStatus(struct hp_info* info)
 {
-	TRACING();
+	TRACING_HOT();
 	for (UINT32 i = 0; i < m_u32NumScanouts; i++) {
 		info->screen_present[i] = m_screen[i].enabled;
 	}
 }
 
+NTSTATUS VioGpuAdapterLite::FillDiagInfo(struct diag_info* info)
+{
+	TRACING();
+
+	if (info->screen_num >= m_u32NumScanouts) {
+		ERR("Screen %d is not present, %d scanouts\n", info->screen_num, m_u32NumScanouts);
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	ScreenInfo* pScreen = &m_screen[info->screen_num];
+
+	LockScreen(info->screen_num, FALSE);
+	info->fb_alloc = (unsigned int)pScreen->m_FbAlloc;
+	info->fb_pages = pScreen->m_FbAllocPages;
+	info->fb_entries = pScreen->m_FbAllocEntries;
+	info->framebuffer_count = pScreen->m_FrameBufferCount;
+	UnlockScreen(info->screen_num);
+
+	info->frames_presented = pScreen->m_FramesPresented;
+	info->frames_dropped = pScreen->m_FramesDropped;
+	info->frames_replaced = pScreen->m_FramesReplaced;
+	info->wait_spin_hits = m_CtrlQueue.GetWaitSpinHits();
+	info->wait_sleeps = m_CtrlQueue.GetWaitSleeps();
+	info->wait_spin_budget_us = m_CtrlQueue.GetSpinBudget();
+	info->sg_pages_sent = m_SgPagesSent;
+	info->sg_entries_sent = m_SgEntriesSent;
+	info->resp_pool_hits = m_GpuBuf.GetRespHits();
+	info->resp_pool_misses = m_GpuBuf.GetRespMisses();
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS VioGpuAdapterLite::FillStatsInfo(struct stats_info* info)
+{
+	TRACING();
+
+	if (info->screen_num >= m_u32NumScanouts) {
+		ERR("Screen %d is not present, %d scanouts\n", info->screen_num, m_u32NumScanouts);
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	m_screen[info->screen_num].m_Stats.Fill(info);
+	if (info->reset) {
+		m_screen[info->screen_num].m_Stats.Reset();
+	}
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS VioGpuAdapterLite::FillQueueStatsInfo(struct queue_stats_info* info)
+{
+	TRACING();
+
+	VioGpuQueue* pQueue;
+
+	switch (info->queue) {
+	case QSTATS_QUEUE_CTRL:
+		pQueue = &m_CtrlQueue;
+		break;
+	case QSTATS_QUEUE_CURSOR:
+		pQueue = &m_CursorQueue;
+		break;
+	default:
+		ERR("Queue %d is not present\n", info->queue);
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	pQueue->GetStats()->Fill(info);
+	if (info->reset) {
+		pQueue->ResetStats();
+	}
+	return STATUS_SUCCESS;
+}
+
 
 void VioGpuAdapterLite::DisableInterruptExt()
 {
@@ -33,6 +33,9 @@
 #include "edid.h"
 #include "viogpu.h"
 #include "helper.h"
+#include "viogpu_fence_tracker.h"
+#include "viogpu_present_mailbox.h"
+#include "viogpu_fb_slots.h"
 
 extern "C" {
 #include "..\EDIDParser\edidshared.h"
@@ -85,14 +88,45 @@ typedef struct _POINTER_SHAPE {
 	DXGKARG_SETPOINTERSHAPE pointer;
 } POINTER_SHAPE;
 
-enum class FrameBufSlot : UINT {
-    Front = 0,
-    Back = 1,
-};
+typedef struct _FRAMEBUFFER_CACHE_KEY
+{
+	PVOID UserAddr;
+	UINT Size;
+	UINT Width;
+	UINT Height;
+	UINT Stride;
+	UINT Format;
+} FRAMEBUFFER_CACHE_KEY;
+
+// UMD buffer locked for presents. The pages stay locked across presents
+// until the buffer, the mode or the owner goes away
+typedef struct _PINNED_SEGMENT
+{
+	VioGpuMemSegment Segment;
+	PEPROCESS Process;
+	PVOID Owner;
+	// ScreenInfo::m_PinClock of the last present using it, 0 when unused
+	ULONGLONG LastUse;
+} PINNED_SEGMENT;
+
+// A thread in WaitForFence. Event is set once Fence retired, so waiters on
+// the same screen never consume each other's wake-ups
+typedef struct _FENCE_WAITER
+{
+	LIST_ENTRY Entry;
+	ULONGLONG Fence;
+	KEVENT Event;
+} FENCE_WAITER, * PFENCE_WAITER;
 
 class ScreenInfo {
 public:
-	static constexpr size_t FRAMEBUFFER_COUNT = 2;
+	static constexpr UINT MIN_FRAMEBUFFER_COUNT = 2;
+	static constexpr UINT MAX_FRAMEBUFFER_COUNT = 4;
+	static constexpr UINT FENCE_RING_SIZE = 16;
+	// One per framebuffer, so the back buffer being created always finds an
+	// entry none of the others references. Covers every staging buffer the
+	// UMD rotates through, up to MAX_FRAME_POOL_SLOTS
+	static constexpr UINT MAX_PINNED_SEGMENTS = MAX_FRAMEBUFFER_COUNT;
 	PVIDEO_MODE_INFORMATION m_ModeInfo;
 	ULONG m_ModeCount;
 	PUSHORT m_ModeNumbers;
@@ -103,14 +137,66 @@ public:
 	output_modelist mode_list;
 	KEVENT m_DisplayInfoEvent;
 	KEVENT m_EdidEvent;
-	KEVENT m_FlushEvent;
+	// Driver allocated backing of the framebuffer, UMD buffers get locked
+	// into m_Pinned instead so this one is never replaced
 	VioGpuMemSegment m_FrameSegment;
 	// important must be alligned to because of InterlockedExchangePointer usage
-	VioGpuObj* m_pFrameBuf[FRAMEBUFFER_COUNT];
+	FRAMEBUFFER_SLOT m_FrameBuf[MAX_FRAMEBUFFER_COUNT];
+	UINT m_FrameBufferCount;
+	volatile LONG m_FramesPresented;
+	volatile LONG m_FramesDropped;
+	// Presents a newer one took over in the mailbox before they ran
+	volatile LONG m_FramesReplaced;
 	VioGpuObj* m_pCursorBuf;
 	VioGpuMemSegment m_CursorSegment;
-	BOOL m_FlushCount;
+	volatile LONG m_FlushCount;
 	BOOL enabled;
+	// Flush fences issued for this screen. Each time DpcRoutine retires one
+	// into m_RetiredFences the waiters whose fence it covers are woken.
+	// m_LastRetiredFence mirrors m_Fences.Retired for lock-free checks,
+	// m_FenceLock guards m_Fences and m_FenceWaiters
+	volatile LONG64 m_LastSubmittedFence;
+	volatile LONG64 m_LastRetiredFence;
+	ULONGLONG m_RetiredFences[FENCE_RING_SIZE];
+	volatile LONG m_RetiredFenceHead;
+	KSPIN_LOCK m_FenceLock;
+	FENCE_TRACKER m_Fences;
+	LIST_ENTRY m_FenceWaiters;
+	// Describes the user buffer backing the front framebuffer object, valid
+	// only while that object can be reused for the next present as is
+	FRAMEBUFFER_CACHE_KEY m_FbCacheKey;
+	BOOLEAN m_bFbCacheValid;
+	// Set when a present was skipped, so its dirty rects never reached the host
+	BOOLEAN m_bFullDamagePending;
+	// Staging buffers the UMD registered for present-by-index
+	VioGpuFramePool m_FramePool;
+	// Serializes work on this screen, see VioGpuAdapterLite::LockScreen
+	ERESOURCE m_Lock;
+	// Backing the driver picked for m_FrameSegment
+	SegmentAlloc m_FbAlloc;
+	UINT m_FbAllocPages;
+	UINT m_FbAllocEntries;
+	// Present mailbox, drained by the worker thread of this screen so that
+	// the present IOCTLs never wait on the host
+	KSPIN_LOCK m_PresentLock;
+	PRESENT_MAILBOX m_Mailbox;
+	KEVENT m_PresentEvent;
+	PETHREAD m_pPresentThread;
+	BOOLEAN m_bStopPresentThread;
+	PVOID m_pAdapter;
+	UINT32 m_ScreenNum;
+	// Fence of the present the worker is running, taken by its fenced flush.
+	// A reserved fence no flush took is released when the present ends
+	volatile LONG64 m_ReservedFence;
+	// UMD buffers locked for presents, and the file of the present the
+	// worker is running (NULL outside of one) that newly locked ones belong to
+	PINNED_SEGMENT m_Pinned[MAX_PINNED_SEGMENTS];
+	ULONGLONG m_PinClock;
+	PVOID m_PresentOwner;
+	// Present stage latencies, and the IOCTL entry of the present the
+	// worker is running (0 outside of one) for the stages measured from it
+	VioGpuStats m_Stats;
+	ULONGLONG m_PresentEntryUs;
 
 public:
 	ScreenInfo();
@@ -122,18 +208,44 @@ public:
 	VioGpuObj* GetFrameBufferObj(FrameBufSlot buf);
 	UINT GetFrameBufferIndex(FrameBufSlot bufSlot);
 	void SetFrameBufferObj(VioGpuObj* buf, FrameBufSlot bufType);
-	void SwapFramebuffer();
+	void SwapFramebuffer(UINT back);
+	void RecordFrameSegmentAlloc(void);
+	void SetFrameBufferCount(UINT count);
+	BOOLEAN HasFreeFrameBuffer(void) { return GetFrameBufferIndex(FrameBufSlot::Back) < m_FrameBufferCount; }
+	BOOLEAN CanQueueFrame(void) { return m_FlushCount < (LONG)(m_FrameBufferCount - 1); }
+	void QueueFrameBuffer(FrameBufSlot bufSlot, ULONGLONG fence_id);
+	void UpdateFrameBufferStates(void);
+	BOOLEAN IsFrameBufferCached(const FRAMEBUFFER_CACHE_KEY* pKey);
+	void SetFrameBufferCache(const FRAMEBUFFER_CACHE_KEY* pKey);
+	void InvalidateFrameBufferCache();
+	VioGpuMemSegment* PinFrameSegment(PVOID pUserAddr, UINT size);
+	BOOLEAN IsFrameSegmentInUse(VioGpuMemSegment* pSegment);
+	BOOLEAN IsPinnedSegment(VioGpuMemSegment* pSegment, PVOID Owner);
+	void UnpinFrameSegment(PINNED_SEGMENT* pPinned);
+	void UnpinFrameSegments(PVOID Owner);
+	BOOLEAN IsFenceRetired(ULONGLONG fence_id) { return (ULONGLONG)m_LastRetiredFence >= fence_id; }
+	void RetireFence(ULONGLONG fence_id);
+	void RetireAllFences();
+	void ReleaseFence(ULONGLONG fence_id);
+	BOOLEAN ReserveFence(CtrlQueue* pCtrlQueue, PULONGLONG pFence);
+	void MarkFenceFlushed(ULONGLONG fence_id);
+	void AddFenceWaiter(PFENCE_WAITER pWaiter);
+	void RemoveFenceWaiter(PFENCE_WAITER pWaiter);
+	void WakePresentThread(void);
+	BOOLEAN PostPresent(PRESENT_WORK* pWork, PRESENT_WORK* pOld);
+	BOOLEAN TakePresent(PRESENT_WORK* pWork, PVOID Owner);
 	void SetCurrentModeIndex(USHORT idx) { m_CurrentMode = idx; }
 	void SetCustomDisplay(_In_ USHORT xres, _In_ USHORT yres);
 	void SetVideoModeInfo(UINT Idx, PGPU_DISP_MODE_EXT pModeInfo);
 	void Reset();
 private:
+	void PublishRetiredFence(void);
 	UINT m_FrontBufferIndex;
 };
 
 class IVioGpuAdapterLite {
 public:
-	IVioGpuAdapterLite(_In_ PVOID pvDevcieContext) { m_pvDeviceContext = pvDevcieContext; m_bEDID = FALSE; m_Id = 0; RtlZeroMemory(&m_screen_mutex, sizeof(m_screen_mutex));
+	IVioGpuAdapterLite(_In_ PVOID pvDevcieContext) { m_pvDeviceContext = pvDevcieContext; m_bEDID = FALSE; m_Id = 0; RtlZeroMemory(&m_screen_lock, sizeof(m_screen_lock));
 	}
 	virtual ~IVioGpuAdapterLite(void) { ; }
 	virtual NTSTATUS SetPowerState(DEVICE_POWER_STATE DevicePowerState) = 0;
@@ -164,7 +276,8 @@ protected:
 	ULONG  m_Id;
 	ScreenInfo m_screen[MAX_SCAN_OUT];
 	BOOLEAN m_bEDID;
-	KMUTEX m_screen_mutex;
+	// Held shared for work on one screen, exclusive for work on all of them
+	ERESOURCE m_screen_lock;
 public:
 	PVOID m_pvDeviceContext;
 };
@@ -175,7 +288,7 @@ class VioGpuAdapterLite :
 public:
 	VioGpuAdapterLite(_In_ PVOID pvDeviceContext);
 	~VioGpuAdapterLite(void);
-	NTSTATUS SetCurrentModeExt(CURRENT_MODE* pCurrentMode);
+	NTSTATUS SetCurrentModeExt(CURRENT_MODE* pCurrentMode, const DAMAGE_REGION* pDamage);
 	NTSTATUS SetPowerState(DEVICE_POWER_STATE DevicePowerState);
 	NTSTATUS HWInit(WDFCMRESLIST pResList, DXGK_DISPLAY_INFORMATION* pDispInfo);
 	NTSTATUS HWClose(void);
@@ -185,10 +298,13 @@ public:
 		_In_ UINT               SrcWidth,
 		_In_ UINT               SrcHeight,
 		_In_ UINT               ScreenNum,
-		_In_ UINT               Stride);
+		_In_ UINT               Stride,
+		_In_opt_ const DAMAGE_REGION* pDamage,
+		_Out_opt_ PULONGLONG    FenceId);
 	VOID BlackOutScreen(CURRENT_MODE* pCurrentMod);
 	BOOLEAN InterruptRoutine(_In_  ULONG MessageNumber);
 	VOID DpcRoutine(void);
+	void HarvestCtrlQueue(void);
 	VOID ResetDevice(VOID);
 	NTSTATUS SetPointerShape(_In_ CONST POINTER_SHAPE* pSetPointerShape, _In_ CONST UINT cf, _In_ CONST UINT cv);
 	NTSTATUS SetPointerPosition(_In_ CONST DXGKARG_SETPOINTERPOSITION* pSetPointerPosition);
@@ -203,10 +319,30 @@ public:
 	UINT32 GetNumScreens() { return m_u32NumScanouts; }
 	UINT32 GetModeListSize(UINT32 screen_num) { return m_screen[screen_num].mode_list.modelist_size; }
 	VOID CopyResolution(UINT32 screen_num, struct edid_info* edata);
+	VOID FillEdidInfo(UINT32 screen_num, struct edid_info* edata);
+	VOID LockScreen(UINT32 screen_num, BOOLEAN bExclusive);
+	VOID UnlockScreen(UINT32 screen_num);
+	VOID LockAllScreens(void);
+	VOID UnlockAllScreens(void);
 	PVOID GetFbVAddr(UINT32 screen_num) { return m_screen[screen_num].m_FrameSegment.GetFbVAddr(); }
-	VOID Close(UINT32 screen_num) { m_screen[screen_num].m_FrameSegment.Close(); }
+	VOID UnpinFrameSegments(UINT32 screen_num);
+	VOID ReleaseFrameSegments(PVOID Owner);
+	VOID DetachPinnedObjs(UINT32 screen_num, PVOID Owner);
+	ULONGLONG GetLastSubmittedFence(UINT32 screen_num) { return (ULONGLONG)m_screen[screen_num].m_LastSubmittedFence; }
+	NTSTATUS WaitForFence(UINT32 screen_num, ULONGLONG fence_id, ULONG timeout_ms, PULONGLONG last_retired);
+	NTSTATUS RegisterFramePool(UINT32 screen_num, PVOID Owner, UINT NumSlots, PVOID* pSlotAddrs,
+		UINT Width, UINT Height, UINT Pitch, UINT Stride, PULONG pPoolId);
+	VOID UnregisterFramePool(UINT32 screen_num);
+	VOID ReleaseFramePools(PVOID Owner);
+	NTSTATUS PresentFramePool(UINT32 screen_num, ULONG PoolId, UINT Slot, ULONG NumRects, PRECT pRects, PULONGLONG FenceId);
+	NTSTATUS QueuePresent(UINT32 screen_num, PRESENT_WORK* pWork, PULONGLONG FenceId);
+	VOID CancelPresent(UINT32 screen_num, PVOID Owner);
+	VOID CancelPresents(PVOID Owner);
 	PBYTE GetEdidData(UINT Idx);
 	VOID FillPresentStatus(struct hp_info* info);
+	NTSTATUS FillDiagInfo(struct diag_info* info);
+	NTSTATUS FillStatsInfo(struct stats_info* info);
+	NTSTATUS FillQueueStatsInfo(struct queue_stats_info* info);
 	VOID SetEvent(HANDLE event);
 	void DestroyFrameBufferCursorObjExt();
 	void DisableInterruptExt();
@@ -225,14 +361,30 @@ private:
 	void ProcessEdid(UINT32 screen_num);
 	BOOLEAN GetEdids(UINT32 screen_num);
 	void AddEdidModes(UINT32 screen_num);
-	void CreateFrameBufferObj(PVIDEO_MODE_INFORMATION pModeInfo, FrameBufSlot bufType, CURRENT_MODE* pCurrentMode);
-	void DestroyFrameBufferSlotObj(UINT32 screen_num, FrameBufSlot bufSlot, BOOLEAN bReset);
+	BOOLEAN CreateFrameBufferObj(PVIDEO_MODE_INFORMATION pModeInfo, FrameBufSlot bufType, CURRENT_MODE* pCurrentMode);
+	void FlushFrameBufferObj(PVIDEO_MODE_INFORMATION pModeInfo, CURRENT_MODE* pCurrentMode, const DAMAGE_REGION* pDamage);
+	ULONGLONG QueueResFlush(UINT32 screen_num, UINT res_id, UINT width, UINT height, UINT x, UINT y, BOOLEAN bFence, PGPU_BATCH batch = NULL);
+	ULONGLONG CommitCtrlBatch(PGPU_BATCH batch, UINT32 screen_num, ULONGLONG fence_id);
+	ULONGLONG FlushDamageRects(UINT32 screen_num, UINT res_id, UINT Pitch, const DAMAGE_REGION* pDamage, PGPU_BATCH batch);
+	BOOLEAN CreateFramePoolObj(UINT32 screen_num, UINT Slot);
+	void DestroyFramePoolObjs(UINT32 screen_num);
+	void DestroyFramePool(UINT32 screen_num);
+	void ReapFrameBufferSlots(UINT32 screen_num);
+	void ReadRegistryParameters(void);
+	void CountSgEntries(UINT Pages, UINT Entries);
 	void DestroyFrameBufferObj(VioGpuObj** ppFbuf, BOOLEAN bReset);
 	BOOLEAN CreateCursor(_In_ CONST POINTER_SHAPE* pSetPointerShape, _In_ CONST UINT cf);
 	void DestroyCursor(UINT32 screen_num);
-	BOOLEAN GpuObjectAttach(UINT res_id, VioGpuObj* obj, ULONGLONG width, ULONGLONG height, ULONGLONG stride);
+	BOOLEAN GpuObjectAttach(UINT res_id, VioGpuObj* obj, ULONGLONG width, ULONGLONG height, ULONGLONG stride, PGPU_BATCH batch = NULL);
+	void static CtrlQueuePoll(_In_ PVOID Context);
 	void static ThreadWork(_In_ PVOID Context);
 	void ThreadWorkRoutine(void);
+	void static PresentThreadWork(_In_ PVOID Context);
+	void PresentThreadRoutine(UINT32 screen_num);
+	void RunPresent(UINT32 screen_num, PRESENT_WORK* pWork);
+	void ReleasePresent(UINT32 screen_num, PRESENT_WORK* pWork);
+	NTSTATUS StartPresentThreads(void);
+	void StopPresentThreads(void);
 	void ConfigChanged(void);
 	NTSTATUS VirtIoDeviceInit(void);
 	DEVICE_STATUS_FLAG m_Flags;
@@ -252,6 +404,15 @@ private:
 	BOOLEAN m_bStopWorkThread;
 	CURRENT_MODE m_CurrentModeInfo;
 	BOOLEAN m_bBlobSupported;
+	// Opt in to VIRTIO_F_RING_PACKED, read from the registry
+	BOOLEAN m_bPackedRing;
+	// Re-arm the control queue interrupt delayed, read from the registry
+	BOOLEAN m_bIrqCoalescing;
 	PKEVENT hpd_event;
+	volatile LONG m_NextFramePoolId;
+	// Pages and memory entries sent with CREATE_BLOB/ATTACH_BACKING, their
+	// ratio is how well adjacent pages get merged
+	volatile LONG64 m_SgPagesSent;
+	volatile LONG64 m_SgEntriesSent;
 };
 
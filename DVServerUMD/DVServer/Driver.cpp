@@ -621,10 +621,7 @@ void SwapChainProcessor::cleanup_resources()
 		CloseHandle(m_GPUResourceMutex);
 	}
 
-	if ((m_destimage != NULL) && (m_Device != NULL)) {
-		m_Device->DeviceContext->Unmap(m_destimage, 0);
-		m_destimage->Release();
-	}
+	release_frame_pool();
 
 	// ****** Cursor Resources ******
 	if (hwcursorsupported == TRUE) {
@@ -677,7 +674,19 @@ void SwapChainProcessor::init()
 	m_ioctlresp_size = 0;
 	m_framedata = NULL;
 	m_ioctlresp_frame = NULL;
+	ZeroMemory(&m_present_resp, sizeof(m_present_resp));
+	ZeroMemory(&m_fence_info, sizeof(m_fence_info));
+	ZeroMemory(&m_damagedata, sizeof(m_damagedata));
 	m_destimage = NULL;
+	ZeroMemory(m_poolimage, sizeof(m_poolimage));
+	ZeroMemory(m_pool_addr, sizeof(m_pool_addr));
+	ZeroMemory(m_pool_fence, sizeof(m_pool_fence));
+	m_pool_slot = 0;
+	m_pool_id = 0;
+	m_pool_supported = TRUE;
+	ZeroMemory(&m_poolinfo, sizeof(m_poolinfo));
+	ZeroMemory(&m_poolresp, sizeof(m_poolresp));
+	ZeroMemory(&m_pooldata, sizeof(m_pooldata));
 	m_IAcquiredDesktopImage = NULL;
 	m_frame_statistics_counter = 1; //init the frame statistics counter
 	m_staging_buffer.pData = NULL;
@@ -834,6 +843,9 @@ void SwapChainProcessor::RunCore()
 					break;
 				}
 
+				//Collect what changed since the previous frame, only valid until the next acquire
+				get_damage_rects(&Buffer);
+
 				//Get Frame	from GPU
 				if (GetFrameData(m_Device, m_IAcquiredDesktopImage) == DVSERVERUMD_FAILURE) {
 					ERR("Failed getting frame from GPU\n");
@@ -943,26 +955,54 @@ int SwapChainProcessor::GetFrameData(std::shared_ptr<Direct3DDevice> dvserver_de
 			return DVSERVERUMD_FAILURE;
 		}
 
-		/* Create Texture2D with the staging descriptor parameters */
-		dvserver_device->Device->CreateTexture2D(&m_staging_desc, NULL, &m_destimage);
-		if (m_destimage == NULL) {
-			ERR("Failed Staging Buffer CreateTexture2D is NULL\n");
+		/* Create the staging buffers the frames rotate through */
+		release_frame_pool();
+		if (create_frame_pool(dvserver_device) != DVSERVERUMD_SUCCESS) {
 			return DVSERVERUMD_FAILURE;
 		}
 	}
 
+	m_destimage = m_poolimage[m_pool_slot];
+
+	// The KMD flushes asynchronously, so the host may still be reading this
+	// staging buffer from the last time it was presented. Wait for that
+	// flush to retire before overwriting it.
+	if (m_pool_fence[m_pool_slot]) {
+		m_fence_info.screen_num = m_screen_num;
+		m_fence_info.timeout_ms = FENCE_WAIT_TIMEOUT_MS;
+		m_fence_info.fence_id = m_pool_fence[m_pool_slot];
+		if (!DeviceIoControl(g_DevInfo->get_Handle(), IOCTL_DVSERVER_WAIT_FENCE, \
+			&m_fence_info, sizeof(struct fence_info), \
+			&m_fence_info, sizeof(struct fence_info), \
+			& m_ioctlresp_size, NULL)) {
+			ERR("IOCTL_DVSERVER_WAIT_FENCE call failed for fence %llu\n", m_pool_fence[m_pool_slot]);
+		}
+		else if (!m_fence_info.signaled) {
+			DBGPRINT("Fence %llu not retired within %d ms, last retired = %llu\n",
+				m_pool_fence[m_pool_slot], FENCE_WAIT_TIMEOUT_MS, m_fence_info.last_retired);
+		}
+		m_pool_fence[m_pool_slot] = 0;
+	}
+
 	WaitForSingleObject(m_GPUResourceMutex, INFINITE);
 	dvserver_device->DeviceContext->CopyResource((ID3D11Resource*)m_destimage, (ID3D11Resource*)desktopimage);
 	desktopimage->Release();
 	status = dvserver_device->DeviceContext->Map((ID3D11Resource*)m_destimage, 0, D3D11_MAP_READ, 0, &m_staging_buffer);
 	if (FAILED(status)) {
 		ERR("Failed to Map the resource dvserver_device->DeviceContext->Map\n");
-		m_destimage->Release();
 		ReleaseMutex(m_GPUResourceMutex);
+		release_frame_pool();
+		m_resolution_changed = TRUE;
 		return DVSERVERUMD_FAILURE;
 	}
 	ReleaseMutex(m_GPUResourceMutex);
 
+	// The KMD pinned the pages it was given at registration
+	if (m_staging_buffer.pData != m_pool_addr[m_pool_slot]) {
+		m_pool_addr[m_pool_slot] = m_staging_buffer.pData;
+		m_pool_id = 0;
+	}
+
 	m_pitch = m_staging_buffer.RowPitch;
 	m_stride = m_staging_buffer.RowPitch / 4;
 	m_framedata->width = m_width;
@@ -997,28 +1037,177 @@ int SwapChainProcessor::GetFrameData(std::shared_ptr<Direct3DDevice> dvserver_de
 			FormatMessageA(FORMAT_MESSAGE_FROM_SYSTEM, NULL, GetLastError(),
 				MAKELANGID(LANG_NEUTRAL, SUBLANG_DEFAULT), err, 255, NULL);
 			ERR("IOCTL_DVSERVER_SET_MODE call failed with error: %s!\n", err);
-			dvserver_device->DeviceContext->Unmap(m_destimage, 0);
-			m_destimage->Release();
+			release_frame_pool();
 			return DVSERVERUMD_FAILURE;
 		}
 		m_resolution_changed = FALSE;
+		// SET_MODE drops the pool of the previous mode
+		m_pool_id = 0;
+		m_pool_supported = TRUE;
+	}
+
+	if (m_pool_id == 0 && m_pool_supported == TRUE)
+		register_frame_pool();
+
+	if (m_pool_id != 0) {
+		m_pooldata.screen_num = m_screen_num;
+		m_pooldata.pool_id = m_pool_id;
+		m_pooldata.slot = m_pool_slot;
+		m_pooldata.num_rects = m_damagedata.num_rects;
+		memcpy(m_pooldata.rects, m_damagedata.rects, sizeof(m_pooldata.rects));
+		if (!DeviceIoControl(g_DevInfo->get_Handle(), IOCTL_DVSERVER_PRESENT_POOL, \
+			&m_pooldata, sizeof(struct pool_present), \
+			&m_present_resp, sizeof(struct present_response), \
+			& m_ioctlresp_size, NULL)) {
+			FormatMessageA(FORMAT_MESSAGE_FROM_SYSTEM, NULL, GetLastError(),
+				MAKELANGID(LANG_NEUTRAL, SUBLANG_DEFAULT), err, 255, NULL);
+			ERR("IOCTL_DVSERVER_PRESENT_POOL call failed with error: %s!\n", err);
+			// Registered again on the next frame, this one goes the old way
+			m_pool_id = 0;
+		}
 	}
 
-	if (!DeviceIoControl(g_DevInfo->get_Handle(), IOCTL_DVSERVER_FRAME_DATA, \
-		m_framedata, sizeof(struct FrameMetaData), \
-		m_ioctlresp_frame, sizeof(struct KMDF_IOCTL_Response), \
-		& m_ioctlresp_size, NULL)) {
-		FormatMessageA(FORMAT_MESSAGE_FROM_SYSTEM, NULL, GetLastError(),
-			MAKELANGID(LANG_NEUTRAL, SUBLANG_DEFAULT), err, 255, NULL);
-		ERR("IOCTL_DVSERVER_FRAME_DATA call failed with error: %s!\n", err);
-		dvserver_device->DeviceContext->Unmap(m_destimage, 0);
-		m_destimage->Release();
-		return DVSERVERUMD_FAILURE;
+	if (m_pool_id == 0) {
+		m_damagedata.frame = *m_framedata;
+		if (!DeviceIoControl(g_DevInfo->get_Handle(), IOCTL_DVSERVER_FRAME_DAMAGE, \
+			&m_damagedata, sizeof(struct FrameDamageData), \
+			&m_present_resp, sizeof(struct present_response), \
+			& m_ioctlresp_size, NULL)) {
+			FormatMessageA(FORMAT_MESSAGE_FROM_SYSTEM, NULL, GetLastError(),
+				MAKELANGID(LANG_NEUTRAL, SUBLANG_DEFAULT), err, 255, NULL);
+			ERR("IOCTL_DVSERVER_FRAME_DAMAGE call failed with error: %s!\n", err);
+			release_frame_pool();
+			m_resolution_changed = TRUE;
+			return DVSERVERUMD_FAILURE;
+		}
+	}
+
+	if (m_ioctlresp_size >= sizeof(struct present_response))
+		m_pool_fence[m_pool_slot] = m_present_resp.fence_id;
+	m_pool_slot = (m_pool_slot + 1) % FRAME_POOL_SIZE;
+
+	return DVSERVERUMD_SUCCESS;
+}
+
+/*******************************************************************************
+*
+* Description
+*
+* create_frame_pool - Creates the staging buffers frames rotate through and
+* maps each of them once, so their addresses can be registered with
+* DVServerKMD
+*
+* Parameters
+* dvserver_device - shared_ptr to  Direct3D Device (Direct3D render device)
+*
+* Return val
+* int - 0 == SUCCESS, -1 = ERROR
+*
+******************************************************************************/
+int SwapChainProcessor::create_frame_pool(std::shared_ptr<Direct3DDevice> dvserver_device)
+{
+	D3D11_MAPPED_SUBRESOURCE mapped;
+
+	for (UINT i = 0; i < FRAME_POOL_SIZE; i++) {
+		dvserver_device->Device->CreateTexture2D(&m_staging_desc, NULL, &m_poolimage[i]);
+		if (m_poolimage[i] == NULL) {
+			ERR("Failed Staging Buffer CreateTexture2D is NULL\n");
+			release_frame_pool();
+			return DVSERVERUMD_FAILURE;
+		}
+
+		WaitForSingleObject(m_GPUResourceMutex, INFINITE);
+		if (FAILED(dvserver_device->DeviceContext->Map((ID3D11Resource*)m_poolimage[i], 0, D3D11_MAP_READ, 0, &mapped))) {
+			ERR("Failed to Map staging buffer %d\n", i);
+			ReleaseMutex(m_GPUResourceMutex);
+			release_frame_pool();
+			return DVSERVERUMD_FAILURE;
+		}
+		ReleaseMutex(m_GPUResourceMutex);
+		m_pool_addr[i] = mapped.pData;
 	}
 
+	m_pool_slot = 0;
 	return DVSERVERUMD_SUCCESS;
 }
 
+/*******************************************************************************
+*
+* Description
+*
+* release_frame_pool - Drops the pool registered with DVServerKMD, then
+* unmaps and releases the staging buffers
+*
+* Parameters
+* Null
+*
+* Return val
+* Null
+*
+******************************************************************************/
+void SwapChainProcessor::release_frame_pool()
+{
+	// DVServerKMD must not keep the pages of released textures pinned
+	if (m_pool_id != 0 && g_DevInfo != nullptr) {
+		ZeroMemory(&m_poolinfo, sizeof(m_poolinfo));
+		m_poolinfo.frame.screen_num = m_screen_num;
+		if (!DeviceIoControl(g_DevInfo->get_Handle(), IOCTL_DVSERVER_REGISTER_FRAME_POOL, \
+			&m_poolinfo, sizeof(struct frame_pool_info), \
+			&m_poolresp, sizeof(struct frame_pool_response), \
+			& m_ioctlresp_size, NULL)) {
+			ERR("Dropping frame pool %d failed, screen = %d\n", m_pool_id, m_screen_num);
+		}
+	}
+
+	for (UINT i = 0; i < FRAME_POOL_SIZE; i++) {
+		if ((m_poolimage[i] != NULL) && (m_Device != NULL)) {
+			m_Device->DeviceContext->Unmap(m_poolimage[i], 0);
+			m_poolimage[i]->Release();
+		}
+		m_poolimage[i] = NULL;
+		m_pool_addr[i] = NULL;
+		m_pool_fence[i] = 0;
+	}
+	m_destimage = NULL;
+	m_pool_id = 0;
+}
+
+/*******************************************************************************
+*
+* Description
+*
+* register_frame_pool - Hands the staging buffers to DVServerKMD, which pins
+* them once so frames can be presented by slot index
+*
+* Parameters
+* Null
+*
+* Return val
+* Null
+*
+******************************************************************************/
+void SwapChainProcessor::register_frame_pool()
+{
+	m_poolinfo.frame = *m_framedata;
+	m_poolinfo.frame.addr = NULL;
+	m_poolinfo.num_slots = FRAME_POOL_SIZE;
+	for (UINT i = 0; i < FRAME_POOL_SIZE; i++)
+		m_poolinfo.slot_addr[i] = m_pool_addr[i];
+
+	if (!DeviceIoControl(g_DevInfo->get_Handle(), IOCTL_DVSERVER_REGISTER_FRAME_POOL, \
+		&m_poolinfo, sizeof(struct frame_pool_info), \
+		&m_poolresp, sizeof(struct frame_pool_response), \
+		& m_ioctlresp_size, NULL)) {
+		ERR("IOCTL_DVSERVER_REGISTER_FRAME_POOL call failed, screen = %d\n", m_screen_num);
+		// Presents keep passing the buffer address until the next mode set
+		m_pool_supported = FALSE;
+		return;
+	}
+
+	m_pool_id = m_poolresp.pool_id;
+	DBGPRINT("Registered frame pool %d with %d slots, screen = %d\n", m_pool_id, FRAME_POOL_SIZE, m_screen_num);
+}
+
 /********************************************************************************
 * Description
 *
@@ -1057,6 +1246,81 @@ void SwapChainProcessor::report_frame_statistics(IDARG_OUT_RELEASEANDACQUIREBUFF
 	IddCxSwapChainReportFrameStatistics(m_hSwapChain, &ReportStatsIn);
 }
 
+/********************************************************************************
+* Description
+*
+* get_damage_rects - This function collects the dirty rects and move
+* destinations of the acquired frame into m_damagedata so that DVServerKMD
+* only transfers and flushes what changed. Leaves num_rects at 0 (whole
+* frame) whenever the damage is unknown
+*
+* Parameters
+* buffer - Access Per-frame metadata and frame information
+*
+* Return val
+* Null
+*
+******************************************************************************/
+void SwapChainProcessor::get_damage_rects(IDARG_OUT_RELEASEANDACQUIREBUFFER* buffer)
+{
+	std::vector<RECT> rects;
+	UINT dirty_count = buffer->MetaData.DirtyRectCount;
+	UINT move_count = buffer->MetaData.MoveRegionCount;
+
+	m_damagedata.num_rects = 0;
+
+	//A new staging buffer has to be filled completely
+	if (m_resolution_changed == TRUE || (dirty_count + move_count) == 0)
+		return;
+
+	if (dirty_count) {
+		std::vector<RECT> dirty(dirty_count);
+		IDARG_IN_GETDIRTYRECTS in_args = {};
+		IDARG_OUT_GETDIRTYRECTS out_args = {};
+		in_args.DirtyRectInCount = dirty_count;
+		in_args.pDirtyRects = dirty.data();
+		if (FAILED(IddCxSwapChainGetDirtyRects(m_hSwapChain, &in_args, &out_args))) {
+			ERR("IddCxSwapChainGetDirtyRects failed, screen = %d\n", m_screen_num);
+			return;
+		}
+		rects.insert(rects.end(), dirty.begin(), dirty.begin() + std::min(out_args.DirtyRectOutCount, dirty_count));
+	}
+
+	if (move_count) {
+		std::vector<IDDCX_MOVEREGION> moves(move_count);
+		IDARG_IN_GETMOVEREGIONS in_args = {};
+		IDARG_OUT_GETMOVEREGIONS out_args = {};
+		in_args.MoveRegionInCount = move_count;
+		in_args.pMoveRegions = moves.data();
+		if (FAILED(IddCxSwapChainGetMoveRegions(m_hSwapChain, &in_args, &out_args))) {
+			ERR("IddCxSwapChainGetMoveRegions failed, screen = %d\n", m_screen_num);
+			return;
+		}
+		for (UINT i = 0; i < std::min(out_args.MoveRegionOutCount, move_count); i++)
+			rects.push_back(moves[i].DestRect);
+	}
+
+	//Too many to send, DVServerKMD gets their bounding box instead
+	if (rects.size() > MAX_DAMAGE_RECTS) {
+		RECT bound = rects[0];
+		for (const RECT& r : rects) {
+			bound.left = std::min(bound.left, r.left);
+			bound.top = std::min(bound.top, r.top);
+			bound.right = std::max(bound.right, r.right);
+			bound.bottom = std::max(bound.bottom, r.bottom);
+		}
+		rects.assign(1, bound);
+	}
+
+	for (const RECT& r : rects) {
+		struct damage_rect* d = &m_damagedata.rects[m_damagedata.num_rects++];
+		d->left = r.left;
+		d->top = r.top;
+		d->right = r.right;
+		d->bottom = r.bottom;
+	}
+}
+
 void SwapChainProcessor::GetCursorData()
 {
 	DWORD WaitResult;
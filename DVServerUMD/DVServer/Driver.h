@@ -14,6 +14,7 @@
 
 #include <memory>
 #include <vector>
+#include <algorithm>
 
 #include <devguid.h>
 #include <string>
@@ -32,6 +33,8 @@ DEFINE_GUID(GUID_DEVINTERFACE_DVSERVERKMD,
 #define DEVINFO_FLAGS					DIGCF_PRESENT | DIGCF_ALLCLASSES | DIGCF_DEVICEINTERFACE
 #define REPORT_FRAME_STATS				60 // we need to report frame stats to OS for every 60 frames
 #define PRINT_FREQ                      3600
+#define FENCE_WAIT_TIMEOUT_MS			100 // upper bound on waiting for the host to release the staging buffer
+#define FRAME_POOL_SIZE					3   // staging buffers rotated per screen, at most MAX_FRAME_POOL_SLOTS
 
 #define WINDOWS11_MAJOR_VERSION			10
 #define WINDOWS11_BUILD_NUMBER			22000 // Windows 11 starts from Build 22000
@@ -119,6 +122,10 @@ namespace Microsoft
 			int	 GetFrameData(std::shared_ptr<Direct3DDevice> idd_device, ID3D11Texture2D* desktopimage);
 			void cleanup_resources();
 			void report_frame_statistics(IDARG_OUT_RELEASEANDACQUIREBUFFER Buffer);
+			void get_damage_rects(IDARG_OUT_RELEASEANDACQUIREBUFFER* Buffer);
+			int create_frame_pool(std::shared_ptr<Direct3DDevice> idd_device);
+			void release_frame_pool();
+			void register_frame_pool();
 			void init();
 
 		private:
@@ -148,6 +155,20 @@ namespace Microsoft
 			ULONG m_ioctlresp_size;
 			struct FrameMetaData* m_framedata;
 			struct KMDF_IOCTL_Response* m_ioctlresp_frame;
+			struct present_response m_present_resp;
+			struct fence_info m_fence_info;
+			struct FrameDamageData m_damagedata;
+
+			//Frame pool related, m_destimage is the slot being filled
+			ID3D11Texture2D* m_poolimage[FRAME_POOL_SIZE];
+			void* m_pool_addr[FRAME_POOL_SIZE];
+			UINT64 m_pool_fence[FRAME_POOL_SIZE];
+			UINT m_pool_slot;
+			unsigned int m_pool_id;
+			BOOL m_pool_supported;
+			struct frame_pool_info m_poolinfo;
+			struct frame_pool_response m_poolresp;
+			struct pool_present m_pooldata;
 
 			//Cursor related
 			struct CursorData* m_cursordata;
@@ -0,0 +1,237 @@
+/*===========================================================================
+; DVStats.cpp
+;----------------------------------------------------------------------------
+; Copyright (C) 2021 Intel Corporation
+; SPDX-License-Identifier: MIT
+;
+; File Description:
+;   Console decoder for the present stage and virtqueue statistics that
+;   DVServerKMD hands out through IOCTL_DVSERVER_GET_STATS and
+;   IOCTL_DVSERVER_GET_QUEUE_STATS
+;--------------------------------------------------------------------------*/
+
+#include <windows.h>
+#include <initguid.h>
+#include <setupapi.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "..\..\DVServerKMD\Public.h"
+
+#define DEVINFO_FLAGS		DIGCF_PRESENT | DIGCF_ALLCLASSES | DIGCF_DEVICEINTERFACE
+
+static const char* stage_names[STATS_STAGE_COUNT] = {
+	"queue", "lock", "create", "scanout", "submit", "complete",
+};
+
+// Indexed by the low byte of the command type, see QSTATS_CMD_TYPES
+static const char* ctrl_cmd_names[QSTATS_CMD_TYPES] = {
+	"get_display_info", "resource_create_2d", "resource_unref", "set_scanout",
+	"resource_flush", "transfer_to_host_2d", "attach_backing", "detach_backing",
+	"get_capset_info", "get_capset", "get_edid", "assign_uuid",
+	"resource_create_blob", "set_scanout_blob", "type 14", "type 15+",
+};
+
+static const char* cursor_cmd_names[QSTATS_CMD_TYPES] = {
+	"update_cursor", "move_cursor", "type 2", "type 3",
+	"type 4", "type 5", "type 6", "type 7",
+	"type 8", "type 9", "type 10", "type 11",
+	"type 12", "type 13", "type 14", "type 15+",
+};
+
+static HANDLE open_dvserver_kmd_device()
+{
+	HANDLE dev = INVALID_HANDLE_VALUE;
+	HDEVINFO devinfo;
+	SP_DEVICE_INTERFACE_DATA iface;
+	PSP_DEVICE_INTERFACE_DETAIL_DATA detail;
+	DWORD size = 0;
+
+	devinfo = SetupDiGetClassDevs(NULL, NULL, NULL, DEVINFO_FLAGS);
+	if (devinfo == INVALID_HANDLE_VALUE) {
+		return dev;
+	}
+
+	iface.cbSize = sizeof(SP_DEVICE_INTERFACE_DATA);
+	if (SetupDiEnumDeviceInterfaces(devinfo, 0, &GUID_DEVINTERFACE_DVServerKMD, 0, &iface)) {
+		SetupDiGetDeviceInterfaceDetail(devinfo, &iface, 0, 0, &size, 0);
+		detail = size ? (PSP_DEVICE_INTERFACE_DETAIL_DATA)malloc(size) : NULL;
+		if (detail) {
+			detail->cbSize = sizeof(SP_DEVICE_INTERFACE_DETAIL_DATA);
+			if (SetupDiGetDeviceInterfaceDetail(devinfo, &iface, detail, size, 0, 0)) {
+				dev = CreateFile(detail->DevicePath, 0, 0, NULL, OPEN_EXISTING, 0, 0);
+			}
+			free(detail);
+		}
+	}
+
+	SetupDiDestroyDeviceInfoList(devinfo);
+	return dev;
+}
+
+// Bucket of the sample at pct percent, STATS_BUCKETS when there are none
+static unsigned int percentile_bucket(const UINT64* buckets, UINT64 count, unsigned int pct)
+{
+	UINT64 rank = (count * pct + 99) / 100;
+	UINT64 seen = 0;
+
+	for (unsigned int i = 0; i < STATS_BUCKETS; i++) {
+		seen += buckets[i];
+		if (seen && seen >= rank) {
+			return i;
+		}
+	}
+	return STATS_BUCKETS;
+}
+
+// Upper bound of a latency bucket in microseconds, the last one has none
+static void format_bucket(char* buf, size_t len, unsigned int bucket)
+{
+	if (bucket >= STATS_BUCKETS) {
+		_snprintf_s(buf, len, _TRUNCATE, "-");
+	}
+	else if (bucket == STATS_BUCKETS - 1) {
+		_snprintf_s(buf, len, _TRUNCATE, ">=%llu", 1ull << (bucket - 1));
+	}
+	else {
+		_snprintf_s(buf, len, _TRUNCATE, "<%llu", 1ull << bucket);
+	}
+}
+
+static void print_latency_header(const char* what)
+{
+	printf("  %-22s %10s %10s %10s %10s %10s\n", what, "count", "mean", "p50", "p90", "p99");
+}
+
+static void print_latency(const char* name, UINT64 sum_us, const UINT64* buckets)
+{
+	UINT64 count = 0;
+	char p50[32], p90[32], p99[32];
+
+	for (unsigned int i = 0; i < STATS_BUCKETS; i++) {
+		count += buckets[i];
+	}
+	if (count == 0) {
+		return;
+	}
+
+	format_bucket(p50, sizeof(p50), percentile_bucket(buckets, count, 50));
+	format_bucket(p90, sizeof(p90), percentile_bucket(buckets, count, 90));
+	format_bucket(p99, sizeof(p99), percentile_bucket(buckets, count, 99));
+	printf("  %-22s %10llu %10.1f %10s %10s %10s\n", name, count,
+		(double)sum_us / (double)count, p50, p90, p99);
+}
+
+static int print_screen_stats(HANDLE dev, unsigned int screen_num, unsigned int reset)
+{
+	struct stats_info info;
+	DWORD bytes = 0;
+
+	ZeroMemory(&info, sizeof(info));
+	info.screen_num = screen_num;
+	info.reset = reset;
+	if (!DeviceIoControl(dev, IOCTL_DVSERVER_GET_STATS, &info, sizeof(info), &info, sizeof(info), &bytes, NULL)) {
+		fprintf(stderr, "IOCTL_DVSERVER_GET_STATS for screen %u failed with error %lu\n", screen_num, GetLastError());
+		return -1;
+	}
+
+	printf("Screen %u present stages, microseconds\n", screen_num);
+	print_latency_header("stage");
+	for (unsigned int i = 0; i < STATS_STAGE_COUNT; i++) {
+		print_latency(stage_names[i], info.sum_us[i], info.buckets[i]);
+	}
+	printf("\n");
+	return 0;
+}
+
+static int print_queue_stats(HANDLE dev, unsigned int queue, unsigned int reset)
+{
+	struct queue_stats_info info;
+	const char** names = (queue == QSTATS_QUEUE_CTRL) ? ctrl_cmd_names : cursor_cmd_names;
+	DWORD bytes = 0;
+
+	ZeroMemory(&info, sizeof(info));
+	info.queue = queue;
+	info.reset = reset;
+	if (!DeviceIoControl(dev, IOCTL_DVSERVER_GET_QUEUE_STATS, &info, sizeof(info), &info, sizeof(info), &bytes, NULL)) {
+		fprintf(stderr, "IOCTL_DVSERVER_GET_QUEUE_STATS for queue %u failed with error %lu\n", queue, GetLastError());
+		return -1;
+	}
+
+	printf("%s queue, ring %u, in flight %u, max in flight %u\n",
+		(queue == QSTATS_QUEUE_CTRL) ? "Control" : "Cursor",
+		info.ring_size, info.in_flight, info.max_in_flight);
+	printf("  add failures %llu, notifies %llu, notifies suppressed %llu\n",
+		info.add_failures, info.notifies, info.notifies_suppressed);
+
+	// Bucket n holds commands added with [2^(n-1), 2^n) already in flight
+	printf("  occupancy");
+	for (unsigned int i = 0; i < QSTATS_OCC_BUCKETS; i++) {
+		if (info.occupancy[i] == 0) {
+			continue;
+		}
+		if (i == 0) {
+			printf(" 0:%llu", info.occupancy[i]);
+		}
+		else if (i == QSTATS_OCC_BUCKETS - 1) {
+			printf(" %u+:%llu", 1u << (i - 1), info.occupancy[i]);
+		}
+		else {
+			printf(" %u-%u:%llu", 1u << (i - 1), (1u << i) - 1, info.occupancy[i]);
+		}
+	}
+	printf("\n");
+
+	print_latency_header("command, microseconds");
+	for (unsigned int i = 0; i < QSTATS_CMD_TYPES; i++) {
+		if (info.submitted[i] != info.completed[i]) {
+			printf("  %-22s %llu submitted, %llu completed\n", names[i], info.submitted[i], info.completed[i]);
+		}
+		print_latency(names[i], info.sum_us[i], info.buckets[i]);
+	}
+	printf("\n");
+	return 0;
+}
+
+int main(int argc, char* argv[])
+{
+	struct screen_info screens;
+	unsigned int reset = 0;
+	DWORD bytes = 0;
+	int ret = 0;
+	HANDLE dev;
+
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-r") == 0) {
+			reset = 1;
+		}
+		else {
+			printf("Usage: %s [-r]\n", argv[0]);
+			printf("  Prints the present and virtqueue statistics of DVServerKMD.\n");
+			printf("  -r  clears them once read\n");
+			return 1;
+		}
+	}
+
+	dev = open_dvserver_kmd_device();
+	if (dev == INVALID_HANDLE_VALUE) {
+		fprintf(stderr, "DVServerKMD device not found\n");
+		return 1;
+	}
+
+	ZeroMemory(&screens, sizeof(screens));
+	if (!DeviceIoControl(dev, IOCTL_DVSERVER_GET_TOTAL_SCREENS, &screens, sizeof(screens), &screens, sizeof(screens), &bytes, NULL)) {
+		fprintf(stderr, "IOCTL_DVSERVER_GET_TOTAL_SCREENS failed with error %lu\n", GetLastError());
+		CloseHandle(dev);
+		return 1;
+	}
+
+	for (unsigned int i = 0; i < screens.total_screens; i++) {
+		ret |= print_screen_stats(dev, i, reset);
+	}
+	ret |= print_queue_stats(dev, QSTATS_QUEUE_CTRL, reset);
+	ret |= print_queue_stats(dev, QSTATS_QUEUE_CURSOR, reset);
+
+	CloseHandle(dev);
+	return ret ? 1 : 0;
+}